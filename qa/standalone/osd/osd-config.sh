@@ -90,6 +90,52 @@ function TEST_default_adjustment() {
     [ "$c" = "true" ] || return 1
 }
 
+function TEST_op_history_sample_rate() {
+    local dir=$1
+    local objects=50
+
+    run_mon $dir a || return 1
+    run_mgr $dir x || return 1
+    run_osd $dir 0 \
+        --osd-op-history-size=1000 \
+        --osd-op-history-slow-op-size=1000 \
+        --osd-op-history-slow-op-threshold=1 \
+        || return 1
+    create_pool foo 1 1 || return 1
+    wait_for_clean || return 1
+
+    echo "data" > $dir/obj
+    for i in $(seq 1 $objects) ; do
+        rados -p foo put a$i $dir/obj || return 1
+    done
+    local all=$(CEPH_ARGS='' ceph --admin-daemon $(get_asok_path osd.0) \
+        dump_historic_ops | jq '.ops | length')
+    test $all -ge $objects || return 1
+
+    # only one in ten fast ops reaches the history
+    ceph tell osd.0 injectargs "--osd-op-history-sample-rate 10" || return 1
+    for i in $(seq 1 $objects) ; do
+        rados -p foo put b$i $dir/obj || return 1
+    done
+    local sampled=$(CEPH_ARGS='' ceph --admin-daemon $(get_asok_path osd.0) \
+        dump_historic_ops | jq '.ops | length')
+    test $sampled -ge $all || return 1
+    test $(($sampled - $all)) -le $(($objects / 10 + 5)) || return 1
+
+    # but every slow op does
+    ceph tell osd.0 injectargs "--osd-debug-inject-dispatch-delay-duration 0.6 \
+        --osd-debug-inject-dispatch-delay-probability 1" || return 1
+    for i in $(seq 1 5) ; do
+        rados -p foo put c$i $dir/obj || return 1
+    done
+    ceph tell osd.0 injectargs "--osd-debug-inject-dispatch-delay-probability 0" || return 1
+    CEPH_ARGS='' ceph --admin-daemon $(get_asok_path osd.0) \
+        dump_historic_slow_ops > $dir/slow_ops || return 1
+    for i in $(seq 1 5) ; do
+        jq '.Ops[].description' $dir/slow_ops | grep -q ":::c$i:head" || return 1
+    done
+}
+
 main osd-config "$@"
 
 # Local Variables:
@@ -230,6 +230,57 @@ function TEST_scrub_extented_sleep() {
     teardown $dir || return 1
 }
 
+function TEST_deep_scrub_window() {
+    local dir=$1
+    local poolname=test
+    local OSDS=3
+    local objects=200
+
+    TESTDATA="testdata.$$"
+
+    setup $dir || return 1
+    run_mon $dir a --osd_pool_default_size=3 || return 1
+    run_mgr $dir x || return 1
+    for osd in $(seq 0 $(expr $OSDS - 1))
+    do
+      run_osd $dir $osd --osd_scrub_chunk_min=5 \
+                        --osd_scrub_chunk_max=5 || return 1
+    done
+
+    # Create a pool with a single pg
+    create_pool $poolname 1 1
+    wait_for_clean || return 1
+    poolid=$(ceph osd dump | grep "^pool.*[']${poolname}[']" | awk '{ print $2 }')
+
+    dd if=/dev/urandom of=$TESTDATA bs=64k count=1
+    for i in `seq 1 $objects`
+    do
+        rados -p $poolname put obj${i} $TESTDATA
+    done
+    rm -f $TESTDATA
+
+    local pgid="${poolid}.0"
+    local primary=$(get_primary $poolname obj1)
+
+    # one chunk at a time, then four in flight
+    local window
+    for window in 1 4
+    do
+        ceph tell osd.* config set osd_scrub_chunk_window $window || return 1
+        local start=$(date +%s.%N)
+        pg_deep_scrub "$pgid" || return 1
+        local end=$(date +%s.%N)
+        echo "deep scrub with osd_scrub_chunk_window=$window took $(echo "$end - $start" | bc)s"
+        test "$(ceph pg $pgid query | jq '.info.stats.stat_sum.num_scrub_errors')" = "0" || return 1
+    done
+
+    local perf="$(CEPH_ARGS='' ceph --admin-daemon $(get_asok_path osd.${primary}) perf dump)"
+    test "$(echo $perf | jq '.osd.scrub_chunks_ahead')" -gt 0 || return 1
+    test "$(echo $perf | jq '.osd.scrub_objects')" -ge $(expr $objects \* 2) || return 1
+
+    teardown $dir || return 1
+}
+
 main osd-scrub-test "$@"
 
 # Local Variables:
@@ -23,6 +23,8 @@ int ceph_arch_intel_ssse3 = 0;
 int ceph_arch_intel_sse3 = 0;
 int ceph_arch_intel_sse2 = 0;
 int ceph_arch_intel_aesni = 0;
+int ceph_arch_intel_avx2 = 0;
+int ceph_arch_intel_avx512f = 0;
 
 #ifdef __x86_64__
 #include <cpuid.h>
@@ -36,6 +38,22 @@ int ceph_arch_intel_aesni = 0;
 #define CPUID_SSE3	(1)
 #define CPUID_SSE2	(1 << 26)
 #define CPUID_AESNI (1 << 25)
+#define CPUID_OSXSAVE	(1 << 27)
+
+/* leaf 7, ebx */
+#define CPUID7_AVX2	(1 << 5)
+#define CPUID7_AVX512F	(1 << 16)
+
+/* XCR0: the OS saves SSE and AVX (and AVX-512) register state */
+#define XCR0_AVX	0x06
+#define XCR0_AVX512	0xe6
+
+static unsigned int xgetbv0(void)
+{
+	unsigned int eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return eax;
+}
 
 int ceph_arch_intel_probe(void)
 {
@@ -65,6 +83,19 @@ int ceph_arch_intel_probe(void)
   if ((ecx & CPUID_AESNI) != 0) {
           ceph_arch_intel_aesni = 1;
   }
+	if ((ecx & CPUID_OSXSAVE) != 0 &&
+	    __get_cpuid_max(0, NULL) >= 7) {
+		unsigned int xcr0 = xgetbv0();
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		if ((ebx & CPUID7_AVX2) != 0 &&
+		    (xcr0 & XCR0_AVX) == XCR0_AVX) {
+			ceph_arch_intel_avx2 = 1;
+		}
+		if ((ebx & CPUID7_AVX512F) != 0 &&
+		    (xcr0 & XCR0_AVX512) == XCR0_AVX512) {
+			ceph_arch_intel_avx512f = 1;
+		}
+	}
 
 	return 0;
 }
@@ -0,0 +1,280 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "include/types.h"
+#include "include/crc32c.h"
+#include "arch/probe.h"
+#include "arch/intel.h"
+#include "common/Checksummer.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Multi-buffer checksums: csum blocks are independent of each other, so
+ * instead of walking one block at a time we run several of them through
+ * the SIMD lanes (xxhash32) or interleave them to hide the latency of the
+ * crc32 instruction (crc32c).  The results are identical to the scalar
+ * implementations.
+ */
+
+typedef void (*blocks_func_t)(uint32_t init_value, const char *data,
+			      size_t block_size, size_t count, uint32_t *out);
+
+static void crc32c_blocks_generic(uint32_t init_value, const char *data,
+				  size_t block_size, size_t count,
+				  uint32_t *out)
+{
+  for (size_t i = 0; i < count; ++i, data += block_size) {
+    out[i] = ceph_crc32c(init_value, (const unsigned char*)data, block_size);
+  }
+}
+
+static void xxhash32_blocks_generic(uint32_t init_value, const char *data,
+				    size_t block_size, size_t count,
+				    uint32_t *out)
+{
+  for (size_t i = 0; i < count; ++i, data += block_size) {
+    out[i] = XXH32(data, block_size, init_value);
+  }
+}
+
+#if defined(__x86_64__)
+
+// four blocks at a time; one crc32 instruction retires per cycle but
+// each has a latency of three, so a single stream leaves it mostly idle
+__attribute__((target("sse4.2")))
+static void crc32c_blocks_sse42(uint32_t init_value, const char *data,
+				size_t block_size, size_t count,
+				uint32_t *out)
+{
+  for (; count >= 4; count -= 4, out += 4, data += 4 * block_size) {
+    const char *p0 = data;
+    const char *p1 = p0 + block_size;
+    const char *p2 = p1 + block_size;
+    const char *p3 = p2 + block_size;
+    uint64_t c0 = init_value, c1 = init_value;
+    uint64_t c2 = init_value, c3 = init_value;
+    size_t i = 0;
+    for (; i + 8 <= block_size; i += 8) {
+      uint64_t w0, w1, w2, w3;
+      memcpy(&w0, p0 + i, 8);
+      memcpy(&w1, p1 + i, 8);
+      memcpy(&w2, p2 + i, 8);
+      memcpy(&w3, p3 + i, 8);
+      c0 = _mm_crc32_u64(c0, w0);
+      c1 = _mm_crc32_u64(c1, w1);
+      c2 = _mm_crc32_u64(c2, w2);
+      c3 = _mm_crc32_u64(c3, w3);
+    }
+    for (; i < block_size; ++i) {
+      c0 = _mm_crc32_u8(c0, p0[i]);
+      c1 = _mm_crc32_u8(c1, p1[i]);
+      c2 = _mm_crc32_u8(c2, p2[i]);
+      c3 = _mm_crc32_u8(c3, p3[i]);
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+  }
+  crc32c_blocks_generic(init_value, data, block_size, count, out);
+}
+
+static const uint32_t XXH_PRIME32_1 = 2654435761U;
+static const uint32_t XXH_PRIME32_2 = 2246822519U;
+static const uint32_t XXH_PRIME32_3 = 3266489917U;
+
+// the lanes gather from block i at i * block_size
+static bool xxhash32_simd_ok(size_t block_size)
+{
+  return block_size >= 16 && block_size % 16 == 0 &&
+    block_size <= (1u << 24);
+}
+
+#define AVX2_ROTL(x, r) \
+  _mm256_or_si256(_mm256_slli_epi32(x, r), _mm256_srli_epi32(x, 32 - (r)))
+
+// eight blocks at a time, one per 32-bit lane
+__attribute__((target("avx2")))
+static void xxhash32_blocks_avx2(uint32_t init_value, const char *data,
+				 size_t block_size, size_t count,
+				 uint32_t *out)
+{
+  const __m256i p1 = _mm256_set1_epi32(XXH_PRIME32_1);
+  const __m256i p2 = _mm256_set1_epi32(XXH_PRIME32_2);
+  const __m256i p3 = _mm256_set1_epi32(XXH_PRIME32_3);
+  for (; count >= 8; count -= 8, out += 8, data += 8 * block_size) {
+    __m256i v[4] = {
+      _mm256_set1_epi32(init_value + XXH_PRIME32_1 + XXH_PRIME32_2),
+      _mm256_set1_epi32(init_value + XXH_PRIME32_2),
+      _mm256_set1_epi32(init_value),
+      _mm256_set1_epi32(init_value - XXH_PRIME32_1)
+    };
+    for (size_t off = 0; off < block_size; off += 16) {
+      // z[i] holds the next 16 bytes of blocks i and i + 4; after the
+      // 4x4 transpose in[k] holds word k of blocks 0..7, in order
+      __m256i z[4], in[4];
+      for (int i = 0; i < 4; ++i) {
+	const char *p = data + i * block_size + off;
+	z[i] = _mm256_inserti128_si256(
+	  _mm256_castsi128_si256(
+	    _mm_loadu_si128(reinterpret_cast<const __m128i*>(p))),
+	  _mm_loadu_si128(
+	    reinterpret_cast<const __m128i*>(p + 4 * block_size)), 1);
+      }
+      __m256i t0 = _mm256_unpacklo_epi32(z[0], z[1]);
+      __m256i t1 = _mm256_unpackhi_epi32(z[0], z[1]);
+      __m256i t2 = _mm256_unpacklo_epi32(z[2], z[3]);
+      __m256i t3 = _mm256_unpackhi_epi32(z[2], z[3]);
+      in[0] = _mm256_unpacklo_epi64(t0, t2);
+      in[1] = _mm256_unpackhi_epi64(t0, t2);
+      in[2] = _mm256_unpacklo_epi64(t1, t3);
+      in[3] = _mm256_unpackhi_epi64(t1, t3);
+      for (int k = 0; k < 4; ++k) {
+	v[k] = _mm256_add_epi32(v[k], _mm256_mullo_epi32(in[k], p2));
+	v[k] = AVX2_ROTL(v[k], 13);
+	v[k] = _mm256_mullo_epi32(v[k], p1);
+      }
+    }
+    __m256i h = _mm256_add_epi32(
+      _mm256_add_epi32(AVX2_ROTL(v[0], 1), AVX2_ROTL(v[1], 7)),
+      _mm256_add_epi32(AVX2_ROTL(v[2], 12), AVX2_ROTL(v[3], 18)));
+    h = _mm256_add_epi32(h, _mm256_set1_epi32(block_size));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+    h = _mm256_mullo_epi32(h, p2);
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+    h = _mm256_mullo_epi32(h, p3);
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), h);
+  }
+  xxhash32_blocks_generic(init_value, data, block_size, count, out);
+}
+
+#undef AVX2_ROTL
+
+// sixteen blocks at a time, with native rotates
+__attribute__((target("avx512f,avx2")))
+static void xxhash32_blocks_avx512(uint32_t init_value, const char *data,
+				   size_t block_size, size_t count,
+				   uint32_t *out)
+{
+  const __m512i p1 = _mm512_set1_epi32(XXH_PRIME32_1);
+  const __m512i p2 = _mm512_set1_epi32(XXH_PRIME32_2);
+  const __m512i p3 = _mm512_set1_epi32(XXH_PRIME32_3);
+  for (; count >= 16; count -= 16, out += 16, data += 16 * block_size) {
+    __m512i v[4] = {
+      _mm512_set1_epi32(init_value + XXH_PRIME32_1 + XXH_PRIME32_2),
+      _mm512_set1_epi32(init_value + XXH_PRIME32_2),
+      _mm512_set1_epi32(init_value),
+      _mm512_set1_epi32(init_value - XXH_PRIME32_1)
+    };
+    for (size_t off = 0; off < block_size; off += 16) {
+      // z[i] holds the next 16 bytes of blocks i, i + 4, i + 8 and
+      // i + 12; same transpose as above
+      __m512i z[4], in[4];
+      for (int i = 0; i < 4; ++i) {
+	const char *p = data + i * block_size + off;
+	z[i] = _mm512_castsi128_si512(
+	  _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+	for (int j = 1; j < 4; ++j) {
+	  z[i] = _mm512_inserti32x4(
+	    z[i], _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+		    p + 4 * j * block_size)), j);
+	}
+      }
+      __m512i t0 = _mm512_unpacklo_epi32(z[0], z[1]);
+      __m512i t1 = _mm512_unpackhi_epi32(z[0], z[1]);
+      __m512i t2 = _mm512_unpacklo_epi32(z[2], z[3]);
+      __m512i t3 = _mm512_unpackhi_epi32(z[2], z[3]);
+      in[0] = _mm512_unpacklo_epi64(t0, t2);
+      in[1] = _mm512_unpackhi_epi64(t0, t2);
+      in[2] = _mm512_unpacklo_epi64(t1, t3);
+      in[3] = _mm512_unpackhi_epi64(t1, t3);
+      for (int k = 0; k < 4; ++k) {
+	v[k] = _mm512_add_epi32(v[k], _mm512_mullo_epi32(in[k], p2));
+	v[k] = _mm512_rol_epi32(v[k], 13);
+	v[k] = _mm512_mullo_epi32(v[k], p1);
+      }
+    }
+    __m512i h = _mm512_add_epi32(
+      _mm512_add_epi32(_mm512_rol_epi32(v[0], 1), _mm512_rol_epi32(v[1], 7)),
+      _mm512_add_epi32(_mm512_rol_epi32(v[2], 12),
+		       _mm512_rol_epi32(v[3], 18)));
+    h = _mm512_add_epi32(h, _mm512_set1_epi32(block_size));
+    h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 15));
+    h = _mm512_mullo_epi32(h, p2);
+    h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 13));
+    h = _mm512_mullo_epi32(h, p3);
+    h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 16));
+    _mm512_storeu_si512(out, h);
+  }
+  xxhash32_blocks_avx2(init_value, data, block_size, count, out);
+}
+
+#endif // __x86_64__
+
+static blocks_func_t choose_crc32c_blocks()
+{
+  ceph_arch_probe();
+#if defined(__x86_64__)
+  if (ceph_arch_intel_sse42) {
+    return crc32c_blocks_sse42;
+  }
+#endif
+  return crc32c_blocks_generic;
+}
+
+static blocks_func_t choose_xxhash32_blocks()
+{
+  ceph_arch_probe();
+#if defined(__x86_64__)
+  if (ceph_arch_intel_avx512f && ceph_arch_intel_avx2) {
+    return xxhash32_blocks_avx512;
+  }
+  if (ceph_arch_intel_avx2) {
+    return xxhash32_blocks_avx2;
+  }
+#endif
+  return xxhash32_blocks_generic;
+}
+
+static blocks_func_t crc32c_blocks_func = choose_crc32c_blocks();
+static blocks_func_t xxhash32_blocks_func = choose_xxhash32_blocks();
+
+void Checksummer::crc32c_blocks(uint32_t init_value, const char *data,
+				size_t block_size, size_t count, uint32_t *out)
+{
+  if (count == 1) {
+    out[0] = ceph_crc32c(init_value, (const unsigned char*)data, block_size);
+    return;
+  }
+  crc32c_blocks_func(init_value, data, block_size, count, out);
+}
+
+void Checksummer::xxhash32_blocks(uint32_t init_value, const char *data,
+				  size_t block_size, size_t count,
+				  uint32_t *out)
+{
+#if defined(__x86_64__)
+  if (count > 1 && xxhash32_simd_ok(block_size)) {
+    xxhash32_blocks_func(init_value, data, block_size, count, out);
+    return;
+  }
+#endif
+  xxhash32_blocks_generic(init_value, data, block_size, count, out);
+}
+
+const char *Checksummer::get_blocks_impl()
+{
+  if (xxhash32_blocks_func == xxhash32_blocks_generic) {
+    return crc32c_blocks_func == crc32c_blocks_generic ? "generic" : "sse4.2";
+  }
+#if defined(__x86_64__)
+  if (xxhash32_blocks_func == xxhash32_blocks_avx512) {
+    return "sse4.2+avx512f";
+  }
+#endif
+  return "sse4.2+avx2";
+}
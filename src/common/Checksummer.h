@@ -4,11 +4,28 @@
 #ifndef CEPH_OS_BLUESTORE_CHECKSUMMER
 #define CEPH_OS_BLUESTORE_CHECKSUMMER
 
+#include <algorithm>
+#include <memory>
+
 #include "xxHash/xxhash.h"
 #include "include/byteorder.h"
 
 class Checksummer {
 public:
+  /// max number of blocks handed to Alg::calc_blocks() at once
+  static constexpr size_t MAX_BATCH = 32;
+
+  /**
+   * checksum @count consecutive blocks of @block_size bytes at @data
+   * into @out, several blocks in parallel if the CPU allows it. the
+   * implementation is picked at startup (see get_blocks_impl()).
+   */
+  static void crc32c_blocks(uint32_t init_value, const char *data,
+			    size_t block_size, size_t count, uint32_t *out);
+  static void xxhash32_blocks(uint32_t init_value, const char *data,
+			      size_t block_size, size_t count, uint32_t *out);
+  static const char *get_blocks_impl();
+
   enum CSumType {
     CSUM_NONE = 1,	//intentionally set to 1 to be aligned with OSDMnitor's pool_opts_t handling - it treats 0 as unset while we need to distinguish none and unset cases
     CSUM_XXHASH32 = 2,
@@ -87,6 +104,16 @@ public:
       ) {
       return p.crc32c(len, init_value);
     }
+    static void calc_blocks(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      size_t count,
+      const char *data,
+      init_value_t *out
+      ) {
+      crc32c_blocks(init_value, data, len, count, out);
+    }
   };
 
   struct crc32c_16 {
@@ -108,6 +135,19 @@ public:
       ) {
       return p.crc32c(len, init_value) & 0xffff;
     }
+    static void calc_blocks(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      size_t count,
+      const char *data,
+      init_value_t *out
+      ) {
+      crc32c_blocks(init_value, data, len, count, out);
+      for (size_t i = 0; i < count; ++i) {
+	out[i] &= 0xffff;
+      }
+    }
   };
 
   struct crc32c_8 {
@@ -129,6 +169,19 @@ public:
       ) {
       return p.crc32c(len, init_value) & 0xff;
     }
+    static void calc_blocks(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      size_t count,
+      const char *data,
+      init_value_t *out
+      ) {
+      crc32c_blocks(init_value, data, len, count, out);
+      for (size_t i = 0; i < count; ++i) {
+	out[i] &= 0xff;
+      }
+    }
   };
 
   struct xxhash32 {
@@ -158,6 +211,16 @@ public:
       }
       return XXH32_digest(state);
     }
+    static void calc_blocks(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      size_t count,
+      const char *data,
+      init_value_t *out
+      ) {
+      xxhash32_blocks(init_value, data, len, count, out);
+    }
   };
 
   struct xxhash64 {
@@ -187,8 +250,69 @@ public:
       }
       return XXH64_digest(state);
     }
+    static void calc_blocks(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      size_t count,
+      const char *data,
+      init_value_t *out
+      ) {
+      for (size_t i = 0; i < count; ++i, data += len) {
+	out[i] = XXH64(data, len, init_value);
+      }
+    }
   };
 
+  /**
+   * feed the next @blocks blocks at @p to @f(values, count) in batches
+   * of up to MAX_BATCH checksums; blocks that are contiguous in memory
+   * go through Alg::calc_blocks(), a block straddling two buffers is
+   * copied out first. stops early if @f returns false.
+   */
+  template<class Alg, class Func>
+  static void for_each_batch(
+    typename Alg::state_t state,
+    typename Alg::init_value_t init_value,
+    size_t csum_block_size,
+    size_t blocks,
+    bufferlist::const_iterator& p,
+    Func&& f) {
+    typename Alg::init_value_t values[MAX_BATCH];
+    std::unique_ptr<char[]> straddle;
+    while (blocks > 0) {
+      const char *data;
+      size_t l = p.get_ptr_and_advance(blocks * csum_block_size, &data);
+      ceph_assert(l > 0);
+      size_t n = l / csum_block_size;
+      while (n > 0) {
+	size_t batch = std::min(n, MAX_BATCH);
+	Alg::calc_blocks(state, init_value, csum_block_size, batch, data,
+			 values);
+	if (!f(values, batch)) {
+	  return;
+	}
+	data += batch * csum_block_size;
+	n -= batch;
+	blocks -= batch;
+      }
+      size_t partial = l % csum_block_size;
+      if (partial) {
+	if (!straddle) {
+	  straddle.reset(new char[csum_block_size]);
+	}
+	memcpy(straddle.get(), data, partial);
+	p.copy(csum_block_size - partial, straddle.get() + partial);
+	Alg::calc_blocks(state, init_value, csum_block_size, 1,
+			 straddle.get(), values);
+	if (!f(values, 1)) {
+	  return;
+	}
+	--blocks;
+      }
+    }
+  }
+
   template<class Alg>
   static int calculate(
     size_t csum_block_size,
@@ -222,10 +346,14 @@ public:
     typename Alg::value_t *pv =
       reinterpret_cast<typename Alg::value_t*>(csum_data->c_str());
     pv += offset / csum_block_size;
-    while (blocks--) {
-      *pv = Alg::calc(state, init_value, csum_block_size, p);
-      ++pv;
-    }
+    for_each_batch<Alg>(
+      state, init_value, csum_block_size, blocks, p,
+      [&](const typename Alg::init_value_t *v, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+	  *pv++ = v[i];
+	}
+	return true;
+      });
     Alg::fini(&state);
     return 0;
   }
@@ -250,21 +378,25 @@ public:
       reinterpret_cast<const typename Alg::value_t*>(csum_data.c_str());
     pv += offset / csum_block_size;
     size_t pos = offset;
-    while (length > 0) {
-      typename Alg::init_value_t v = Alg::calc(state, -1, csum_block_size, p);
-      if (*pv != v) {
-	if (bad_csum) {
-	  *bad_csum = v;
+    int r = -1;  // no errors
+    for_each_batch<Alg>(
+      state, -1, csum_block_size, length / csum_block_size, p,
+      [&](const typename Alg::init_value_t *v, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+	  if (*pv != v[i]) {
+	    if (bad_csum) {
+	      *bad_csum = v[i];
+	    }
+	    r = pos;
+	    return false;
+	  }
+	  ++pv;
+	  pos += csum_block_size;
 	}
-	Alg::fini(&state);
-	return pos;
-      }
-      ++pv;
-      pos += csum_block_size;
-      length -= csum_block_size;
-    }
+	return true;
+      });
     Alg::fini(&state);
-    return -1;  // no errors
+    return r;
   }
 };
 
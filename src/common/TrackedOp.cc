@@ -171,7 +171,6 @@ bool OpTracker::dump_historic_ops(Formatter *f, bool by_duration, set<string> fi
   if (!tracking_enabled)
     return false;
 
-  std::shared_lock l{lock};
   utime_t now = ceph_clock_now();
   history.dump_ops(now, f, filters, by_duration);
   return true;
@@ -206,7 +205,6 @@ bool OpTracker::dump_historic_slow_ops(Formatter *f, set<string> filters)
   if (!tracking_enabled)
     return false;
 
-  std::shared_lock l{lock};
   utime_t now = ceph_clock_now();
   history.dump_slow_ops(now, f, filters);
   return true;
@@ -217,7 +215,6 @@ bool OpTracker::dump_ops_in_flight(Formatter *f, bool print_only_blocked, set<st
   if (!tracking_enabled)
     return false;
 
-  std::shared_lock l{lock};
   f->open_object_section("ops_in_flight"); // overall dump
   uint64_t total_ops_in_flight = 0;
   f->open_array_section("ops"); // list of TrackedOps
@@ -252,7 +249,6 @@ bool OpTracker::register_inflight_op(TrackedOp *i)
   if (!tracking_enabled)
     return false;
 
-  std::shared_lock l{lock};
   uint64_t current_seq = ++seq;
   uint32_t shard_index = current_seq % num_optracker_shards;
   ShardedTrackingData* sdata = sharded_in_flight_list[shard_index];
@@ -280,9 +276,17 @@ void OpTracker::unregister_inflight_op(TrackedOp* const i)
   }
 }
 
+bool OpTracker::want_history(const TrackedOp& i) const
+{
+  uint32_t rate = history_sample_rate.load();
+  if (rate <= 1 || i.seq % rate == 0)
+    return true;
+  // the slow op history is never sampled
+  return i.get_duration() >= history.get_slow_op_threshold();
+}
+
 void OpTracker::record_history_op(TrackedOpRef&& i)
 {
-  std::shared_lock l{lock};
   history.insert(ceph_clock_now(), std::move(i));
 }
 
@@ -304,7 +308,6 @@ bool OpTracker::visit_ops_in_flight(utime_t* oldest_secs,
   // hot path.
   std::vector<TrackedOpRef> ops_in_flight;
 
-  std::shared_lock l{lock};
   for (const auto sdata : sharded_in_flight_list) {
     ceph_assert(sdata);
     std::lock_guard locker(sdata->ops_in_flight_lock_sharded);
@@ -330,9 +333,8 @@ bool OpTracker::visit_ops_in_flight(utime_t* oldest_secs,
   if (*oldest_secs < complaint_time)
     return false;
 
-  l.unlock();
   for (auto& op : ops_in_flight) {
-    // `lock` neither `ops_in_flight_lock_sharded` should be held when
+    // `ops_in_flight_lock_sharded` should not be held when
     // calling the visitor. Otherwise `OSD::get_health_metrics()` can
     // dead-lock due to the `~TrackedOp()` calling `record_history_op()`
     // or `unregister_inflight_op()`.
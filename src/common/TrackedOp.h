@@ -93,7 +93,10 @@ public:
   }
   void set_slow_op_size_and_threshold(size_t new_size, uint32_t new_threshold) {
     history_slow_op_size = new_size;
-    history_slow_op_threshold = new_threshold;
+    history_slow_op_threshold.store(new_threshold);
+  }
+  uint32_t get_slow_op_threshold() const {
+    return history_slow_op_threshold.load();
   }
 };
 
@@ -107,7 +110,7 @@ class OpTracker {
   float complaint_time;
   int log_threshold;
   std::atomic<bool> tracking_enabled;
-  ceph::shared_mutex lock = ceph::make_shared_mutex("OpTracker::lock");
+  std::atomic<uint32_t> history_sample_rate = {1};
 
 public:
   CephContext *cct;
@@ -123,6 +126,10 @@ public:
   void set_history_slow_op_size_and_threshold(uint32_t new_size, uint32_t new_threshold) {
     history.set_slow_op_size_and_threshold(new_size, new_threshold);
   }
+  /// keep only one in @rate completed ops in the history, plus all slow ones
+  void set_history_sample_rate(uint32_t rate) {
+    history_sample_rate.store(std::max(rate, 1u));
+  }
   bool is_tracking() const {
     return tracking_enabled;
   }
@@ -134,6 +141,7 @@ public:
   bool dump_historic_slow_ops(ceph::Formatter *f, std::set<std::string> filters = {""});
   bool register_inflight_op(TrackedOp *i);
   void unregister_inflight_op(TrackedOp *i);
+  bool want_history(const TrackedOp& i) const;
   void record_history_op(TrackedOpRef&& i);
 
   void get_age_ms_histogram(pow2_hist_t *h);
@@ -306,7 +314,7 @@ public:
 	mark_event("done");
 	tracker->unregister_inflight_op(this);
 	_unregistered();
-	if (!tracker->is_tracking()) {
+	if (!tracker->is_tracking() || !tracker->want_history(*this)) {
 	  delete this;
 	} else {
 	  state = TrackedOp::STATE_HISTORY;
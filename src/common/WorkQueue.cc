@@ -45,13 +45,17 @@ ThreadPool::ThreadPool(CephContext *cct_, string nm, string tn, int n, const cha
 
 void ThreadPool::TPHandle::suspend_tp_timeout()
 {
-  cct->get_heartbeat_map()->clear_timeout(hb);
+  if (hb) {
+    cct->get_heartbeat_map()->clear_timeout(hb);
+  }
 }
 
 void ThreadPool::TPHandle::reset_tp_timeout()
 {
-  cct->get_heartbeat_map()->reset_timeout(
-    hb, grace, suicide_grace);
+  if (hb) {
+    cct->get_heartbeat_map()->reset_timeout(
+      hb, grace, suicide_grace);
+  }
 }
 
 ThreadPool::~ThreadPool()
@@ -58,7 +58,7 @@ public:
   class TPHandle : public HBHandle {
     friend class ThreadPool;
     CephContext *cct;
-    ceph::heartbeat_handle_d *hb;
+    ceph::heartbeat_handle_d *hb;  ///< null if the thread has none
     ceph::coarse_mono_clock::rep grace;
     ceph::coarse_mono_clock::rep suicide_grace;
   public:
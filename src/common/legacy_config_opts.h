@@ -105,6 +105,8 @@ OPTION(ms_cluster_type, OPT_STR)   // messenger backend
 OPTION(ms_learn_addr_from_peer, OPT_BOOL)
 OPTION(ms_tcp_nodelay, OPT_BOOL)
 OPTION(ms_tcp_rcvbuf, OPT_INT)
+OPTION(ms_tcp_zerocopy, OPT_BOOL)
+OPTION(ms_tcp_zerocopy_min_bytes, OPT_U64)
 OPTION(ms_tcp_prefetch_max_size, OPT_U32) // max prefetch size, we limit this to avoid extra memcpy
 OPTION(ms_initial_backoff, OPT_DOUBLE)
 OPTION(ms_max_backoff, OPT_DOUBLE)
@@ -611,6 +613,8 @@ OPTION(osd_op_num_threads_per_shard_ssd, OPT_INT)
 OPTION(osd_op_num_shards, OPT_INT)
 OPTION(osd_op_num_shards_hdd, OPT_INT)
 OPTION(osd_op_num_shards_ssd, OPT_INT)
+OPTION(osd_op_run_inline, OPT_BOOL)
+OPTION(osd_op_inline_max_cost, OPT_U64)
 
 // PrioritzedQueue (prio), Weighted Priority Queue (wpq ; default),
 // mclock_opclass, mclock_client, or debug_random. "mclock_opclass"
@@ -760,6 +764,7 @@ OPTION(osd_op_history_size, OPT_U32)    // Max number of completed ops to track
 OPTION(osd_op_history_duration, OPT_U32) // Oldest completed op to track
 OPTION(osd_op_history_slow_op_size, OPT_U32)           // Max number of slow ops to track
 OPTION(osd_op_history_slow_op_threshold, OPT_DOUBLE) // track the op if over this threshold
+OPTION(osd_op_history_sample_rate, OPT_U32) // keep 1 in N fast ops in the history
 OPTION(osd_target_transaction_size, OPT_INT)     // to adjust various transactions that batch smaller items
 OPTION(osd_failsafe_full_ratio, OPT_FLOAT) // what % full makes an OSD "full" (failsafe)
 OPTION(osd_fast_shutdown, OPT_BOOL)
@@ -911,22 +916,11 @@ OPTION(bluefs_buffered_io, OPT_BOOL)
 OPTION(bluefs_sync_write, OPT_BOOL)
 OPTION(bluefs_allocator, OPT_STR)     // stupid | bitmap
 OPTION(bluefs_preextend_wal_files, OPT_BOOL)  // this *requires* that rocksdb has recycling enabled
+OPTION(bluefs_wal_ring_size, OPT_U64)
 OPTION(bluefs_log_replay_check_allocations, OPT_BOOL)
 
 OPTION(bluestore_bluefs, OPT_BOOL)
 OPTION(bluestore_bluefs_env_mirror, OPT_BOOL) // mirror to normal Env for debug
-OPTION(bluestore_bluefs_min, OPT_U64) // 1gb
-OPTION(bluestore_bluefs_min_ratio, OPT_FLOAT)  // min fs free / total free
-OPTION(bluestore_bluefs_max_ratio, OPT_FLOAT)  // max fs free / total free
-OPTION(bluestore_bluefs_gift_ratio, OPT_FLOAT) // how much to add at a time
-OPTION(bluestore_bluefs_reclaim_ratio, OPT_FLOAT) // how much to reclaim at a time
-OPTION(bluestore_bluefs_balance_interval, OPT_FLOAT) // how often (sec) to balance free space between bluefs and bluestore
-// how often (sec) to dump allocator on allocation failure
-OPTION(bluestore_bluefs_alloc_failure_dump_interval, OPT_FLOAT)
-
-// Enforces db sync with legacy bluefs extents information on close.
-// Enables downgrades to pre-nautilus releases
-OPTION(bluestore_bluefs_db_compatibility, OPT_BOOL)
 
 // If you want to use spdk driver, you need to specify NVMe serial number here
 // with "spdk:" prefix.
@@ -943,6 +937,9 @@ OPTION(bluestore_block_db_create, OPT_BOOL)
 OPTION(bluestore_block_wal_path, OPT_STR)
 OPTION(bluestore_block_wal_size, OPT_U64) // rocksdb wal
 OPTION(bluestore_block_wal_create, OPT_BOOL)
+OPTION(bluestore_block_fast_path, OPT_STR)
+OPTION(bluestore_block_fast_size, OPT_U64) // object data (hot)
+OPTION(bluestore_block_fast_create, OPT_BOOL)
 OPTION(bluestore_block_preallocate_file, OPT_BOOL) //whether preallocate space if block/db_path/wal_path is file rather that block device.
 OPTION(bluestore_ignore_data_csum, OPT_BOOL)
 OPTION(bluestore_csum_type, OPT_STR) // none|xxhash32|xxhash64|crc32c|crc32c_16|crc32c_8
@@ -954,6 +951,11 @@ OPTION(bluestore_max_alloc_size, OPT_U32)
 OPTION(bluestore_prefer_deferred_size, OPT_U32)
 OPTION(bluestore_prefer_deferred_size_hdd, OPT_U32)
 OPTION(bluestore_prefer_deferred_size_ssd, OPT_U32)
+OPTION(bluestore_prefer_deferred_adaptive, OPT_BOOL)
+OPTION(bluestore_prefer_deferred_adaptive_max_size, OPT_U32)
+OPTION(bluestore_prefer_deferred_adaptive_ratio, OPT_DOUBLE)
+OPTION(bluestore_write_coalesce_window, OPT_DOUBLE)
+OPTION(bluestore_write_coalesce_max_bytes, OPT_U64)
 OPTION(bluestore_compression_mode, OPT_STR)  // force|aggressive|passive|none
 OPTION(bluestore_compression_algorithm, OPT_STR)
 OPTION(bluestore_compression_min_blob_size, OPT_U32)
@@ -988,10 +990,14 @@ OPTION(bluestore_extent_map_shard_max_size, OPT_U32)
 OPTION(bluestore_extent_map_shard_target_size, OPT_U32)
 OPTION(bluestore_extent_map_shard_min_size, OPT_U32)
 OPTION(bluestore_extent_map_shard_target_size_slop, OPT_DOUBLE)
+OPTION(bluestore_extent_map_shard_align, OPT_U32)
+OPTION(bluestore_extent_map_encode_legacy, OPT_BOOL)
+OPTION(bluestore_spanning_blobs_compress_min_size, OPT_U32)
 OPTION(bluestore_extent_map_inline_shard_prealloc_size, OPT_U32)
 OPTION(bluestore_cache_trim_interval, OPT_DOUBLE)
 OPTION(bluestore_cache_trim_max_skip_pinned, OPT_U32) // skip this many onodes pinned in cache before we give up
-OPTION(bluestore_cache_type, OPT_STR)   // lru, 2q
+OPTION(bluestore_cache_type, OPT_STR)   // lru, 2q, clock
+OPTION(bluestore_clock_cache_trim_slack_ratio, OPT_DOUBLE)
 OPTION(bluestore_2q_cache_kin_ratio, OPT_DOUBLE)    // kin page slot size / max page slot size
 OPTION(bluestore_2q_cache_kout_ratio, OPT_DOUBLE)   // number of kout page slot / total number of page slot
 OPTION(bluestore_cache_size, OPT_U64)
@@ -1002,6 +1008,7 @@ OPTION(bluestore_cache_kv_ratio, OPT_DOUBLE)
 OPTION(bluestore_kvbackend, OPT_STR)
 OPTION(bluestore_allocator, OPT_STR)     // stupid | bitmap
 OPTION(bluestore_freelist_blocks_per_key, OPT_INT)
+OPTION(bluestore_allocation_map_in_memory, OPT_BOOL)
 OPTION(bluestore_bitmapallocator_blocks_per_zone, OPT_INT) // must be power of 2 aligned, e.g., 512, 1024, 2048...
 OPTION(bluestore_bitmapallocator_span_size, OPT_INT) // must be power of 2 aligned, e.g., 512, 1024, 2048...
 OPTION(bluestore_max_deferred_txc, OPT_U64)
@@ -1017,6 +1024,7 @@ OPTION(bluestore_fsck_on_mkfs_deep, OPT_BOOL)
 OPTION(bluestore_sync_submit_transaction, OPT_BOOL) // submit kv txn in queueing thread (not kv_sync_thread)
 OPTION(bluestore_fsck_read_bytes_cap, OPT_U64)
 OPTION(bluestore_fsck_quick_fix_threads, OPT_INT)
+OPTION(bluestore_fsck_threads, OPT_INT)
 OPTION(bluestore_throttle_bytes, OPT_U64)
 OPTION(bluestore_throttle_deferred_bytes, OPT_U64)
 OPTION(bluestore_throttle_cost_per_io_hdd, OPT_U64)
@@ -1029,6 +1037,11 @@ OPTION(bluestore_nid_prealloc, OPT_INT)
 OPTION(bluestore_blobid_prealloc, OPT_U64)
 OPTION(bluestore_clone_cow, OPT_BOOL)  // do copy-on-write for clones
 OPTION(bluestore_default_buffered_read, OPT_BOOL)
+OPTION(bluestore_readahead_max_bytes, OPT_U64)
+OPTION(bluestore_readahead_max_bytes_hdd, OPT_U64)
+OPTION(bluestore_readahead_max_bytes_ssd, OPT_U64)
+OPTION(bluestore_readahead_min_bytes, OPT_U64)
+OPTION(bluestore_readahead_trigger_requests, OPT_INT)
 OPTION(bluestore_default_buffered_write, OPT_BOOL)
 OPTION(bluestore_debug_misc, OPT_BOOL)
 OPTION(bluestore_debug_no_reuse_blocks, OPT_BOOL)
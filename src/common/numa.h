@@ -22,3 +22,7 @@ int get_numa_node_cpu_set(int node,
 
 int set_cpu_affinity_all_threads(size_t cpu_set_size,
 				 cpu_set_t *cpu_set);
+
+// bind only the calling thread, e.g. from the top of a thread's entry
+int set_cpu_affinity_this_thread(size_t cpu_set_size,
+				 cpu_set_t *cpu_set);
@@ -942,6 +942,18 @@ std::vector<Option> get_global_options() {
     .set_default(0)
     .set_description("Size of TCP socket receive buffer"),
 
+    Option("ms_tcp_zerocopy", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_description("Send large messages with MSG_ZEROCOPY (posix stack only)")
+    .set_long_description("The kernel transmits directly from the message buffers instead of copying them into socket buffers, which saves a memcpy per byte sent on fast networks.  The buffers are held until the kernel reports their completion.  Only takes effect for new connections, and is turned off on connections where the kernel reports that it had to copy anyway (e.g. loopback).  A connection closed while zerocopy sends are outstanding is reset rather than shut down gracefully.")
+    .add_see_also("ms_tcp_zerocopy_min_bytes"),
+
+    Option("ms_tcp_zerocopy_min_bytes", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(64_K)
+    .set_description("Minimum amount of queued data for a zerocopy send")
+    .set_long_description("Pinning pages and processing completions costs more than copying small sends.")
+    .add_see_also("ms_tcp_zerocopy"),
+
     Option("ms_tcp_prefetch_max_size", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
     .set_default(4_K)
     .set_description("Maximum amount of data to prefetch out of the socket receive buffer"),
@@ -1087,6 +1099,12 @@ std::vector<Option> get_global_options() {
     .set_default(0)
     .set_description("Inject various internal delays to induce races (seconds)"),
 
+    Option("ms_inject_zerocopy_ignore_copied", Option::TYPE_BOOL, Option::LEVEL_DEV)
+    .set_default(false)
+    .set_description("Keep sending with MSG_ZEROCOPY when the kernel reports that it copied")
+    .set_long_description("Lets tests over loopback, where the kernel always copies, exercise the zerocopy completion and close paths.")
+    .add_see_also("ms_tcp_zerocopy"),
+
     Option("ms_blackhole_osd", Option::TYPE_BOOL, Option::LEVEL_DEV)
     .set_default(false)
     .set_description(""),
@@ -2400,6 +2418,14 @@ std::vector<Option> get_global_options() {
     .set_description("set affinity to a numa node (-1 for none)")
     .add_see_also("osd_numa_auto_affinity"),
 
+    Option("osd_numa_shard_affinity", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("bind op shard threads to the numa node of the storage devices")
+    .set_long_description("Only applies when the whole process is not bound to a numa node, e.g. because the network interfaces are attached to a different node than the storage devices.  Messenger threads are left alone.")
+    .add_see_also("osd_numa_auto_affinity")
+    .add_see_also("bluestore_numa_affinity"),
+
     Option("osd_smart_report_timeout", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
     .set_default(5)
     .set_description("Timeout (in seconds) for smarctl to run, default is set to 5"),
@@ -2833,6 +2859,17 @@ std::vector<Option> get_global_options() {
     .set_description("")
     .add_see_also("osd_op_num_shards"),
 
+    Option("osd_op_run_inline", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_description("run small client ops on the messenger thread that received them if their shard is idle")
+    .set_long_description("Instead of queueing a client op for an op shard thread, the messenger thread runs it right away, provided nothing is queued on the op's shard, nothing is waiting on its PG and the PG lock is free.  Otherwise the op is queued as usual.  This saves a thread handoff per op at low queue depths, but bypasses the op scheduler for those ops, and a slow op stalls the other connections of the messenger thread.")
+    .add_see_also("osd_op_inline_max_cost"),
+
+    Option("osd_op_inline_max_cost", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(64_K)
+    .set_description("largest op cost (roughly bytes read or written) osd_op_run_inline runs inline")
+    .add_see_also("osd_op_run_inline"),
+
     Option("osd_skip_data_digest", Option::TYPE_BOOL, Option::LEVEL_DEV)
     .set_default(false)
     .set_description("Do not store full-object checksums if the backend (bluestore) does its own checksums.  Only usable with all BlueStore OSDs."),
@@ -3204,6 +3241,13 @@ std::vector<Option> get_global_options() {
     .set_description("Maximum number of objects to scrub in a single chunk")
     .add_see_also("osd_scrub_chunk_min"),
 
+    Option("osd_scrub_chunk_window", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(1)
+    .set_min(1)
+    .set_description("Number of chunks a scrub keeps in flight")
+    .set_long_description("With a value above 1 the primary asks the replicas for the scrub maps of the following chunks while it is still building and comparing the current one, which hides the round trips of a deep scrub.  Writes to all chunks in flight are blocked (or preempt the scrub) until they have been compared.  It is treated as 1 until require_osd_release is octopus, as older replicas cannot queue these requests.")
+    .add_see_also("osd_scrub_chunk_max"),
+
     Option("osd_scrub_sleep", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
     .set_default(0)
     .set_description("Duration to inject a delay during scrubbing"),
@@ -3496,6 +3540,13 @@ std::vector<Option> get_global_options() {
     .set_default(10.0)
     .set_description(""),
 
+    Option("osd_op_history_sample_rate", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(1)
+    .set_min(1)
+    .set_description("Keep one in this many completed ops in the op history")
+    .set_long_description("Ops slower than osd_op_history_slow_op_threshold are always kept, the others are sampled. Handing every completed op to the op history is a large part of the cost of op tracking at high op rates; sampling keeps osd_enable_op_tracker affordable there, at the cost of dump_historic_ops showing only a sample of the fast ops.")
+    .add_see_also({"osd_op_history_size", "osd_op_history_slow_op_threshold"}),
+
     Option("osd_target_transaction_size", Option::TYPE_INT, Option::LEVEL_ADVANCED)
     .set_default(30)
     .set_description(""),
@@ -4000,6 +4051,12 @@ std::vector<Option> get_global_options() {
     .set_default(true)
     .set_description("Preextent rocksdb wal files on mkfs to avoid performance penalty"),
 
+    Option("bluefs_wal_ring_size", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_description("Space to preallocate for each rocksdb WAL file when it is opened")
+    .set_long_description("When non-zero, WAL files get this much space allocated and are sized to it as soon as they are created. Together with rocksdb log recycling (recycle_log_file_num) they are then reused in place and an fsync of the WAL only flushes the device, without a BlueFS log update. Should be at least the largest WAL size rocksdb produces; 0 grows WAL files on demand.")
+    .add_see_also("bluefs_preextend_wal_files"),
+
     Option("bluefs_log_replay_check_allocations", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
       .set_default(true)
       .set_description("Enables checks for allocations consistency during log replay"),
@@ -4015,48 +4072,9 @@ std::vector<Option> get_global_options() {
     .set_flag(Option::FLAG_CREATE)
     .set_description("Mirror bluefs data to file system for testing/validation"),
 
-    Option("bluestore_bluefs_min", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
-    .set_default(1_G)
-    .set_description("minimum disk space allocated to BlueFS (e.g., at mkfs)"),
-
     Option("bluestore_bluefs_min_free", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
     .set_default(1_G)
-    .set_description("minimum free space allocated to BlueFS"),
-
-    Option("bluestore_bluefs_max_free", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
-    .set_default(10_G)
-    .set_description("Maximum free space allocated to BlueFS"),
-
-    Option("bluestore_bluefs_min_ratio", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
-    .set_default(.02)
-    .set_description("Minimum fraction of free space devoted to BlueFS"),
-
-    Option("bluestore_bluefs_max_ratio", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
-    .set_default(.90)
-    .set_description("Maximum fraction of free storage devoted to BlueFS"),
-
-    Option("bluestore_bluefs_gift_ratio", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
-    .set_default(.02)
-    .set_description("Maximum fraction of free space to give to BlueFS at once"),
-
-    Option("bluestore_bluefs_reclaim_ratio", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
-    .set_default(.20)
-    .set_description("Maximum fraction of free space to reclaim from BlueFS at once"),
-
-    Option("bluestore_bluefs_balance_interval", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
-    .set_default(1)
-    .set_description("How frequently (in seconds) to balance free space between BlueFS and BlueStore"),
-
-    Option("bluestore_bluefs_alloc_failure_dump_interval", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
-    .set_default(0)
-    .set_description("How frequently (in seconds) to dump allocator on"
-      "BlueFS space allocation failure"),
-
-    Option("bluestore_bluefs_db_compatibility", Option::TYPE_BOOL, Option::LEVEL_DEV)
-    .set_default(true)
-    .set_description("Sync db with legacy bluefs extents info")
-    .set_long_description("Enforces db sync with legacy bluefs extents information on close."
-                          " Enables downgrades to pre-nautilus releases"),
+    .set_description("minimum free space required at the target device when migrating BlueFS"),
 
     Option("bluestore_spdk_mem", Option::TYPE_SIZE, Option::LEVEL_DEV)
     .set_default(512)
@@ -4125,6 +4143,24 @@ std::vector<Option> get_global_options() {
     .add_see_also("bluestore_block_wal_path")
     .add_see_also("bluestore_block_wal_size"),
 
+    Option("bluestore_block_fast_path", Option::TYPE_STR, Option::LEVEL_DEV)
+    .set_default("")
+    .set_flag(Option::FLAG_CREATE)
+    .set_description("Path to block device/file for the fast data tier")
+    .set_long_description("If set, or if bluestore_block_fast_create is set, object data is placed on this device and the main device by access heat.  Only supported when the store is created."),
+
+    Option("bluestore_block_fast_size", Option::TYPE_SIZE, Option::LEVEL_DEV)
+    .set_default(0)
+    .set_flag(Option::FLAG_CREATE)
+    .set_description("Size of file to create for bluestore_block_fast_path"),
+
+    Option("bluestore_block_fast_create", Option::TYPE_BOOL, Option::LEVEL_DEV)
+    .set_default(false)
+    .set_flag(Option::FLAG_CREATE)
+    .set_description("Create bluestore_block_fast_path if it doesn't exist")
+    .add_see_also("bluestore_block_fast_path")
+    .add_see_also("bluestore_block_fast_size"),
+
     Option("bluestore_block_preallocate_file", Option::TYPE_BOOL, Option::LEVEL_DEV)
     .set_default(false)
     .set_flag(Option::FLAG_CREATE)
@@ -4189,6 +4225,40 @@ std::vector<Option> get_global_options() {
     .set_description("Default bluestore_prefer_deferred_size for non-rotational (solid state) media")
     .add_see_also("bluestore_prefer_deferred_size"),
 
+    Option("bluestore_prefer_deferred_adaptive", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Choose between deferred and direct small writes based on measured latency")
+    .set_long_description("Instead of a fixed bluestore_prefer_deferred_size, small writes are deferred while direct writes to the main device take notably longer than a kv commit, and written directly otherwise or when deferred writes are backing up. Useful for devices that misreport themselves as (non-)rotational, such as dm-cache volumes.")
+    .add_see_also({"bluestore_prefer_deferred_size",
+                   "bluestore_prefer_deferred_adaptive_max_size",
+                   "bluestore_prefer_deferred_adaptive_ratio"}),
+
+    Option("bluestore_write_coalesce_window", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Time window in seconds for placing adjacent small writes to an object next to each other on disk")
+    .set_long_description("When a small write to an object starts where the previous write to it ended, no more than this long ago, space for it and the following writes is reserved right behind the previous write. The object's blobs then keep few physical extents and deferred writes can be merged into larger IOs. Reservations that are not used within the window are returned to the allocator. 0 disables this.")
+    .add_see_also("bluestore_write_coalesce_max_bytes"),
+
+    Option("bluestore_write_coalesce_max_bytes", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(64_K)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Space reserved behind a sequential run of small writes; larger writes are not coalesced")
+    .add_see_also("bluestore_write_coalesce_window"),
+
+    Option("bluestore_prefer_deferred_adaptive_max_size", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(64_K)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Largest write that bluestore_prefer_deferred_adaptive may defer")
+    .add_see_also("bluestore_prefer_deferred_adaptive"),
+
+    Option("bluestore_prefer_deferred_adaptive_ratio", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(2.0)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Defer small writes while direct write latency exceeds kv commit latency by this factor")
+    .add_see_also("bluestore_prefer_deferred_adaptive"),
+
     Option("bluestore_compression_mode", Option::TYPE_STR, Option::LEVEL_ADVANCED)
     .set_default("none")
     .set_enum_allowed({"none", "passive", "aggressive", "force"})
@@ -4289,6 +4359,22 @@ std::vector<Option> get_global_options() {
     .set_default(.2)
     .set_description("Ratio above/below target for a shard when trying to align to an existing extent or blob boundary"),
 
+    Option("bluestore_extent_map_shard_align", Option::TYPE_SIZE, Option::LEVEL_DEV)
+    .set_default(64_K)
+    .set_description("Preferred logical alignment of extent map shard boundaries")
+    .set_long_description("When resharding, boundaries that do not fall on a multiple of this value are disfavored the same way boundaries spanning a blob are, so repeated resharding of an object under small overwrites tends to reproduce the same shards. 0 disables."),
+
+    Option("bluestore_extent_map_encode_legacy", Option::TYPE_BOOL, Option::LEVEL_DEV)
+    .set_default(false)
+    .set_description("Encode extent map shards and spanning blobs using the pre-v3 format")
+    .set_long_description("The v3 format codes blob back-references relative to the referencing extent and spanning blob ids as deltas, and may compress large spanning blob sets. Both formats are always decodable."),
+
+    Option("bluestore_spanning_blobs_compress_min_size", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(8_K)
+    .set_description("Compress an onode's spanning blob set with lz4 when its encoded size reaches this value")
+    .set_long_description("0 disables compression. Has no effect if bluestore_extent_map_encode_legacy is set or the lz4 compressor plugin is not available.")
+    .add_see_also("bluestore_extent_map_encode_legacy"),
+
     Option("bluestore_extent_map_inline_shard_prealloc_size", Option::TYPE_SIZE, Option::LEVEL_DEV)
     .set_default(256)
     .set_description("Preallocated buffer for inline shards"),
@@ -4303,8 +4389,21 @@ std::vector<Option> get_global_options() {
 
     Option("bluestore_cache_type", Option::TYPE_STR, Option::LEVEL_DEV)
     .set_default("2q")
-    .set_enum_allowed({"2q", "lru"})
-    .set_description("Cache replacement algorithm"),
+    .set_enum_allowed({"2q", "lru", "clock"})
+    .set_description("Cache replacement algorithm")
+    .set_long_description("clock records cache hits without taking the cache shard lock and defers most trimming to the cache thread; it trades some hit ratio for less lock contention on fast devices."),
+
+    Option("bluestore_clock_cache_trim_slack_ratio", Option::TYPE_FLOAT, Option::LEVEL_DEV)
+    .set_default(.05)
+    .set_description("Fraction of its target a clock cache shard may exceed before it is trimmed inline")
+    .add_see_also("bluestore_cache_type"),
+
+    Option("bluestore_cache_partitions", Option::TYPE_STR, Option::LEVEL_ADVANCED)
+    .set_default("")
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("Dedicated onode and buffer cache partitions for pools")
+    .set_long_description("Comma separated list of <pool id>:<weight>[:<min bytes>[:<priority>]]. Collections of a listed pool use their own cache shards, so that other pools cannot evict them. The meta and data cache ratios are split between the shared shards, which have a weight of 1, and the partitions according to their weights. When autotuning, min bytes are guaranteed at the highest priority and the remaining usage of the partition is requested at the given priority (1-11, default 1, the same as the shared shards). Per pool hit/miss counters are reported in the bluestore-pool-<id> perf counters.")
+    .add_see_also("bluestore_cache_autotune"),
 
     Option("bluestore_2q_cache_kin_ratio", Option::TYPE_FLOAT, Option::LEVEL_DEV)
     .set_default(.5)
@@ -4357,14 +4456,22 @@ std::vector<Option> get_global_options() {
 
     Option("bluestore_allocator", Option::TYPE_STR, Option::LEVEL_ADVANCED)
     .set_default("bitmap")
-    .set_enum_allowed({"bitmap", "stupid", "avl"})
+    .set_enum_allowed({"bitmap", "stupid", "avl", "hybrid"})
     .set_description("Allocator policy")
-    .set_long_description("Allocator to use for bluestore.  Stupid should only be used for testing."),
+    .set_long_description("Allocator to use for bluestore.  Stupid should only be used for testing.")
+    .add_see_also("bluestore_hybrid_alloc_mem_cap"),
 
     Option("bluestore_freelist_blocks_per_key", Option::TYPE_SIZE, Option::LEVEL_DEV)
     .set_default(128)
     .set_description("Block (and bits) per database key"),
 
+    Option("bluestore_allocation_map_in_memory", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_CREATE)
+    .set_description("Keep the allocation map in memory only instead of maintaining a freelist in the key/value store")
+    .set_long_description("When enabled at mkfs time no freelist updates are written with each transaction. The allocator state is saved to the key/value store at clean shutdown and loaded at mount; after an unclean shutdown it is rebuilt by scanning all onodes using bluestore_fsck_threads worker threads, which makes such mounts slower.")
+    .add_see_also("bluestore_fsck_threads"),
+
     Option("bluestore_bitmapallocator_blocks_per_zone", Option::TYPE_SIZE, Option::LEVEL_DEV)
     .set_default(1024)
     .set_description(""),
@@ -4386,12 +4493,23 @@ std::vector<Option> get_global_options() {
     .set_description("Rocksdb options"),
 
     Option("bluestore_rocksdb_cf", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
-    .set_default(false)
-    .set_description("Enable use of rocksdb column families for bluestore metadata"),
+    .set_default(true)
+    .set_flag(Option::FLAG_CREATE)
+    .set_description("Enable use of rocksdb column families for bluestore metadata")
+    .set_long_description("Only affects newly created OSDs; use 'ceph-bluestore-tool reshard' to convert existing ones.")
+    .add_see_also("bluestore_rocksdb_cfs"),
 
     Option("bluestore_rocksdb_cfs", Option::TYPE_STR, Option::LEVEL_DEV)
-    .set_default("M= P= L=")
-    .set_description("List of whitespace-separate key/value pairs where key is CF name and value is CF options"),
+    .set_default("M(3,0-8) m(3,0-16) P O(3,0-13) L")
+    .set_description("Column family sharding of bluestore metadata")
+    .set_long_description("Whitespace separated list of prefix[(shards[,first-last])][=options]. "
+			  "The keys of each listed prefix go to a column family of their own, "
+			  "hash-split over 'shards' column families by key bytes [first, last). "
+			  "'options' are rocksdb column family options separated by ';'; "
+			  "block_cache_size=<size> gives the column family a private block cache "
+			  "that is not part of cache autotuning. The sharding is fixed when the "
+			  "OSD is created, the options are applied at every mount.")
+    .add_see_also("bluestore_rocksdb_cf"),
 
     Option("bluestore_fsck_on_mount", Option::TYPE_BOOL, Option::LEVEL_DEV)
     .set_default(false)
@@ -4434,6 +4552,107 @@ std::vector<Option> get_global_options() {
       .set_default(2)
       .set_description("Number of additional threads to perform quick-fix (shallow fsck) command"),
 
+    Option("bluestore_fsck_threads", Option::TYPE_INT, Option::LEVEL_ADVANCED)
+      .set_default(2)
+      .set_description("Number of additional threads to perform regular and deep fsck and repair")
+      .set_long_description("Onodes are verified by a pool of worker threads while the main thread iterates over the object keyspace. Set to 0 to run fsck single-threaded."),
+
+    Option("bluestore_bulk_remove_collection", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(true)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Allow removing non-empty collections and delete their objects in the background")
+    .set_long_description("When enabled, removing a collection that still contains objects only records a tombstone in the transaction; the objects are then removed in batches by a background thread, which survives restarts. This lets PG deletion skip issuing a transaction per batch of objects.")
+    .add_see_also("bluestore_bulk_remove_batch")
+    .add_see_also("bluestore_bulk_remove_sleep"),
+
+    Option("bluestore_bulk_remove_batch", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(256)
+    .set_min(1)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Number of objects removed per transaction by the background collection removal"),
+
+    Option("bluestore_bulk_remove_sleep", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(0.01)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Time in seconds to sleep between background collection removal transactions")
+    .set_long_description("The sleep is skipped while writes to a recreated collection covering the same objects are held back until the removal completes."),
+
+    Option("bluestore_defrag", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Rewrite fragmented objects in the background while the OSD is idle")
+    .set_long_description("Objects with at least bluestore_defrag_min_extents physical extents and more than bluestore_defrag_min_extents_per_mb extents per MB of data are read and written back into new, contiguous allocations. A pass can also be started with the 'bluestore defrag start' admin socket command.")
+    .add_see_also("bluestore_defrag_min_extents_per_mb")
+    .add_see_also("bluestore_defrag_bytes_per_sec"),
+
+    Option("bluestore_defrag_min_extents", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(16)
+    .set_min(2)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Minimum number of physical extents for an object to be defragmented"),
+
+    Option("bluestore_defrag_min_extents_per_mb", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(32)
+    .set_min(1)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Minimum number of physical extents per MB of stored data for an object to be defragmented"),
+
+    Option("bluestore_defrag_bytes_per_sec", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(8_M)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Rate limit for data rewritten by the defragmenter (0 for no limit)"),
+
+    Option("bluestore_defrag_idle_time", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(5)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Time in seconds without client transactions before the defragmenter runs")
+    .set_long_description("Passes started through the admin socket do not wait for the store to be idle."),
+
+    Option("bluestore_defrag_interval", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(86400)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Time in seconds between the starts of two background defragmentation passes"),
+
+    Option("bluestore_numa_affinity", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("Bind kv, finisher and aio threads to the numa node of the devices")
+    .set_long_description("The kv_sync, kv_finalize and finisher threads are bound to the CPUs of the numa node all BlueStore devices are attached to; nothing is bound if the devices span nodes.  Each device's aio thread is bound to the node of that device.")
+    .add_see_also("osd_numa_shard_affinity"),
+
+    Option("bluestore_tier_promote_hits", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(16)
+    .set_min(1)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Accesses within a decay interval that make an object hot")
+    .set_long_description("On a store with a fast data device, objects whose heat reaches this count are rewritten to the fast device, and new writes to them are placed there.")
+    .add_see_also("bluestore_block_fast_path")
+    .add_see_also("bluestore_tier_decay_interval"),
+
+    Option("bluestore_tier_demote_hits", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(4)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Objects with less heat than this may be moved off the fast device")
+    .set_long_description("Cold objects are only moved while the fast device is fuller than bluestore_tier_fast_target_ratio.")
+    .add_see_also("bluestore_tier_fast_target_ratio"),
+
+    Option("bluestore_tier_decay_interval", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(60)
+    .set_min(1)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Time in seconds after which the heat of an object is halved"),
+
+    Option("bluestore_tier_fast_target_ratio", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(.8)
+    .set_min_max(0.0, 1.0)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Fraction of the fast device that promotions fill before cold objects are demoted"),
+
+    Option("bluestore_tier_migrate_bytes_per_sec", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(64_M)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Rate limit for data moved between the fast and the main device (0 for no limit)"),
+
     Option("bluestore_throttle_bytes", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
     .set_default(64_M)
     .set_flag(Option::FLAG_RUNTIME)
@@ -4496,6 +4715,36 @@ std::vector<Option> get_global_options() {
     .set_flag(Option::FLAG_RUNTIME)
     .set_description("Cache read results by default (unless hinted NOCACHE or WONTNEED)"),
 
+    Option("bluestore_readahead_max_bytes", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Maximum readahead window for sequentially read objects (overrides bluestore_readahead_max_bytes_(hdd|ssd) if non-zero)")
+    .set_long_description("Once a sequential stream is detected on an object, bluestore prefetches the following extents into the buffer cache asynchronously.  The window grows from bluestore_readahead_min_bytes up to this size.  Only buffered reads of uncompressed blobs are prefetched.")
+    .add_see_also({"bluestore_readahead_max_bytes_hdd", "bluestore_readahead_max_bytes_ssd", "bluestore_readahead_min_bytes"}),
+
+    Option("bluestore_readahead_max_bytes_hdd", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(1_M)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Default bluestore_readahead_max_bytes for rotational media (0 disables readahead)")
+    .add_see_also("bluestore_readahead_max_bytes"),
+
+    Option("bluestore_readahead_max_bytes_ssd", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Default bluestore_readahead_max_bytes for non-rotational media (0 disables readahead)")
+    .add_see_also("bluestore_readahead_max_bytes"),
+
+    Option("bluestore_readahead_min_bytes", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(128_K)
+    .set_description("Initial readahead window once a sequential stream is detected")
+    .add_see_also("bluestore_readahead_max_bytes"),
+
+    Option("bluestore_readahead_trigger_requests", Option::TYPE_INT, Option::LEVEL_ADVANCED)
+    .set_default(2)
+    .set_min(1)
+    .set_description("Number of sequential reads of an object before readahead starts")
+    .add_see_also("bluestore_readahead_max_bytes"),
+
     Option("bluestore_default_buffered_write", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
     .set_default(false)
     .set_flag(Option::FLAG_RUNTIME)
@@ -4593,6 +4842,11 @@ std::vector<Option> get_global_options() {
     .set_default(5)
     .set_description("log omap iteration operation if it's slower than this age (seconds)"),
 
+    Option("bluestore_omap_batch_readahead", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(4_M)
+    .set_description("Upper bound on the rocksdb readahead of a batched omap read")
+    .set_long_description("After the first few entries, omap_get_batch asks rocksdb to read ahead as many bytes as the rest of the batch is expected to take, judging by the entries read so far and the requested number of entries and bytes, up to this limit.  0 disables readahead."),
+
     Option("bluestore_log_collection_list_age", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
     .set_default(60)
     .set_description("log collection list operation if it's slower than this age (seconds)"),
@@ -4611,6 +4865,13 @@ std::vector<Option> get_global_options() {
     .set_default(4)
     .set_description(""),
 
+    Option("bluestore_hybrid_alloc_mem_cap", Option::TYPE_UINT, Option::LEVEL_DEV)
+    .set_default(64_M)
+    .set_description("Maximum RAM hybrid allocator should use before enabling bitmap supplement")
+    .set_long_description("Free extents beyond this budget (the shortest ones) "
+                          "are tracked by a bitmap allocator with a fixed memory footprint.")
+    .add_see_also("bluestore_allocator"),
+
     Option("bluestore_volume_selection_policy", Option::TYPE_STR, Option::LEVEL_DEV)
     .set_default("rocksdb_original")
     .set_enum_allowed({ "rocksdb_original", "use_some_extra" })
@@ -4631,6 +4892,20 @@ std::vector<Option> get_global_options() {
     .set_default(false)
     .set_description("Enables Linux io_uring API instead of libaio"),
 
+    Option("bluestore_ioring_hipri", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("Busy-poll for io_uring completions (IORING_SETUP_IOPOLL)")
+    .set_long_description("Requires a device and driver that support polled IO. The aio thread spins while ios are in flight.")
+    .add_see_also("bluestore_ioring"),
+
+    Option("bluestore_ioring_sqthread_poll", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("Let a kernel thread poll the io_uring submission queue (IORING_SETUP_SQPOLL)")
+    .set_long_description("Saves the submission syscall at the cost of a kernel thread per device. Usually requires CAP_SYS_ADMIN.")
+    .add_see_also("bluestore_ioring"),
+
     // -----------------------------------------
     // kstore
 
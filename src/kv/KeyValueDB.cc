@@ -1,7 +1,11 @@
 // -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
 // vim: ts=8 sw=2 smarttab
 
+#include <sstream>
+
 #include "KeyValueDB.h"
+#include "common/strtol.h"
+#include "include/str_list.h"
 #ifdef WITH_LEVELDB
 #include "LevelDBStore.h"
 #endif
@@ -51,3 +55,99 @@ int KeyValueDB::test_init(const string& type, const string& dir)
   }
   return -EINVAL;
 }
+
+int KeyValueDB::parse_sharding(const string& def,
+			       vector<ColumnFamily> *cfs,
+			       std::ostream& err)
+{
+  cfs->clear();
+  for (auto& t : get_str_list(def, " \t")) {
+    size_t eq = t.find('=');
+    string head = t.substr(0, eq);
+    string option = eq == string::npos ? string() : t.substr(eq + 1);
+    string name = head;
+    uint32_t shard_cnt = 1;
+    uint32_t hash_l = 0;
+    uint32_t hash_h = UINT32_MAX;
+    size_t lp = head.find('(');
+    if (lp != string::npos) {
+      if (head.back() != ')') {
+	err << "unterminated shard spec in '" << t << "'";
+	return -EINVAL;
+      }
+      name = head.substr(0, lp);
+      string args = head.substr(lp + 1, head.size() - lp - 2);
+      string range;
+      size_t comma = args.find(',');
+      if (comma != string::npos) {
+	range = args.substr(comma + 1);
+	args.resize(comma);
+      }
+      string e;
+      long long v = strict_strtoll(args.c_str(), 10, &e);
+      if (!e.empty() || v <= 0 || v > 256) {
+	err << "bad shard count in '" << t << "'";
+	return -EINVAL;
+      }
+      shard_cnt = v;
+      if (!range.empty()) {
+	size_t dash = range.find('-');
+	if (dash == string::npos) {
+	  err << "bad hash range in '" << t << "'";
+	  return -EINVAL;
+	}
+	v = strict_strtoll(range.substr(0, dash).c_str(), 10, &e);
+	if (!e.empty() || v < 0) {
+	  err << "bad hash range in '" << t << "'";
+	  return -EINVAL;
+	}
+	hash_l = v;
+	if (dash + 1 < range.size()) {
+	  v = strict_strtoll(range.substr(dash + 1).c_str(), 10, &e);
+	  if (!e.empty() || v <= hash_l) {
+	    err << "bad hash range in '" << t << "'";
+	    return -EINVAL;
+	  }
+	  hash_h = v;
+	}
+      }
+    }
+    if (name.empty()) {
+      err << "missing column family name in '" << t << "'";
+      return -EINVAL;
+    }
+    for (auto& cf : *cfs) {
+      if (cf.name == name) {
+	err << "column family '" << name << "' defined twice";
+	return -EINVAL;
+      }
+    }
+    cfs->emplace_back(name, option, shard_cnt, hash_l, hash_h);
+  }
+  return 0;
+}
+
+string KeyValueDB::sharding_to_string(const vector<ColumnFamily>& cfs)
+{
+  std::ostringstream ss;
+  bool first = true;
+  for (auto& cf : cfs) {
+    if (!first) {
+      ss << ' ';
+    }
+    first = false;
+    ss << cf.name;
+    bool ranged = cf.hash_l != 0 || cf.hash_h != UINT32_MAX;
+    if (cf.shard_cnt > 1 || ranged) {
+      ss << '(' << cf.shard_cnt;
+      if (ranged) {
+	ss << ',' << cf.hash_l << '-';
+	if (cf.hash_h != UINT32_MAX) {
+	  ss << cf.hash_h;
+	}
+      }
+      ss << ')';
+    }
+  }
+  return ss.str();
+}
@@ -27,14 +27,38 @@ public:
    *  See RocksDB's definition of a column family(CF) and how to use it.
    *  The interfaces of KeyValueDB is extended, when a column family is created.
    *  Prefix will be the name of column family to use.
+   *
+   *  A prefix may also be hash-split over shard_cnt column families; the
+   *  shard of a key is picked by hashing key bytes [hash_l, hash_h).
    */
   struct ColumnFamily {
     string name;      //< name of this individual column family
     string option;    //< configure option string for this CF
+    uint32_t shard_cnt = 1;          //< number of CFs the prefix is split over
+    uint32_t hash_l = 0;             //< first key byte fed to the shard hash
+    uint32_t hash_h = UINT32_MAX;    //< one past the last hashed key byte
     ColumnFamily(const string &name, const string &option)
       : name(name), option(option) {}
+    ColumnFamily(const string &name, const string &option,
+		 uint32_t shard_cnt, uint32_t hash_l, uint32_t hash_h)
+      : name(name), option(option),
+	shard_cnt(shard_cnt), hash_l(hash_l), hash_h(hash_h) {}
   };
 
+  /**
+   * parse a sharding definition
+   *
+   * The definition is a whitespace separated list of
+   *   name[(shards[,l-h])][=options]
+   * e.g. "M(3,0-8) P O(3,0-13)=write_buffer_size=64M L".  The legacy
+   * "M= P= L=" form is a definition without sharding.
+   */
+  static int parse_sharding(const std::string& def,
+			    std::vector<ColumnFamily> *cfs,
+			    std::ostream& err);
+  /// canonical form of a sharding definition, without the CF options
+  static std::string sharding_to_string(const std::vector<ColumnFamily>& cfs);
+
   class TransactionImpl {
   public:
     /// Set Keys
@@ -166,6 +190,11 @@ public:
     return -ENOTSUP;
   }
 
+  /// move all keys of a closed db to the column families of a new sharding
+  virtual int reshard(const std::vector<ColumnFamily>& cfs, std::ostream &out) {
+    return -EOPNOTSUPP;
+  }
+
   virtual void close() { }
 
   /// Try to repair K/V database. leveldb and rocksdb require that database must be not opened.
@@ -277,7 +306,7 @@ public:
   };
   typedef std::shared_ptr< WholeSpaceIteratorImpl > WholeSpaceIterator;
 
-private:
+protected:
   // This class filters a WholeSpaceIterator by a prefix.
   class PrefixIteratorImpl : public IteratorImpl {
     const std::string prefix;
@@ -335,6 +364,25 @@ public:
       get_wholespace_iterator());
   }
 
+  /// key range a bounded iterator will stay in
+  struct IteratorBounds {
+    std::string lower_bound;   ///< first key, inclusive
+    std::string upper_bound;   ///< end of the range, exclusive; empty = none
+  };
+  /**
+   * Iterator over [bounds.lower_bound, bounds.upper_bound) of a prefix
+   *
+   * The backend may skip anything outside the range (e.g. deleted keys
+   * past the end) instead of stepping over it, and read @readahead bytes
+   * ahead if that is non-zero.  Seeking to a key before the range is
+   * undefined; past it, the iterator is simply not valid.
+   */
+  virtual Iterator get_bounded_iterator(const std::string &prefix,
+					const IteratorBounds &bounds,
+					size_t readahead = 0) {
+    return get_iterator(prefix);
+  }
+
   void add_column_family(const std::string& cf_name, void *handle) {
     cf_handles.insert(std::make_pair(cf_name, handle));
   }
@@ -22,6 +22,7 @@
 using std::string;
 #include "common/perf_counters.h"
 #include "common/PriorityCache.h"
+#include "include/ceph_hash.h"
 #include "include/str_list.h"
 #include "include/stringify.h"
 #include "include/str_map.h"
@@ -74,7 +75,7 @@ public:
     for (auto& p : store.merge_ops) {
       names[p.first] = p.second->name();
     }
-    for (auto& p : store.cf_handles) {
+    for (auto& p : store.cf_shards) {
       names.erase(p.first);
     }
     for (auto& p : names) {
@@ -310,19 +311,131 @@ int RocksDBStore::create_db_dir()
 }
 
 int RocksDBStore::install_cf_mergeop(
-  const string &cf_name,
+  const string &prefix,
   rocksdb::ColumnFamilyOptions *cf_opt)
 {
   ceph_assert(cf_opt != nullptr);
   cf_opt->merge_operator.reset();
   for (auto& i : merge_ops) {
-    if (i.first == cf_name) {
+    if (i.first == prefix) {
       cf_opt->merge_operator.reset(new MergeOperatorLinker(i.second));
     }
   }
   return 0;
 }
 
+rocksdb::ColumnFamilyHandle *RocksDBStore::get_shard(
+  const prefix_shards& shards,
+  const char *key, size_t keylen) const
+{
+  if (shards.handles.size() == 1) {
+    return shards.handles[0];
+  }
+  size_t l = std::min<size_t>(shards.hash_l, keylen);
+  size_t h = std::min<size_t>(shards.hash_h, keylen);
+  uint32_t hash = ceph_str_hash_rjenkins(key + l, h - l);
+  return shards.handles[hash % shards.handles.size()];
+}
+
+string RocksDBStore::get_cf_shard_name(const ColumnFamily& cf, uint32_t shard)
+{
+  if (cf.shard_cnt == 1) {
+    return cf.name;
+  }
+  return cf.name + "-" + stringify(shard);
+}
+
+// inverse of get_cf_shard_name, for CFs we find on disk without a
+// sharding definition describing them (i.e. half way through a reshard)
+static string cf_name_to_prefix(const string& name)
+{
+  size_t pos = name.rfind('-');
+  if (pos == string::npos || pos + 1 == name.size() ||
+      name.find_first_not_of("0123456789", pos + 1) != string::npos) {
+    return name;
+  }
+  return name.substr(0, pos);
+}
+
+int RocksDBStore::apply_cf_options(
+  const ColumnFamily& cf,
+  rocksdb::ColumnFamilyOptions *cf_opt)
+{
+  // block_cache_size is not a rocksdb option: it gives the CF a block
+  // cache of its own, so that e.g. cold omap data can not push onodes
+  // out of the shared cache.  Such caches are not autotuned.
+  string rocks_opts;
+  uint64_t block_cache_size = 0;
+  for (auto& i : get_str_list(cf.option, ";")) {
+    if (i.compare(0, 17, "block_cache_size=") == 0) {
+      string err;
+      block_cache_size = strict_iecstrtoll(i.c_str() + 17, &err);
+      if (!err.empty()) {
+	derr << __func__ << " invalid block_cache_size for CF '" << cf.name
+	     << "': " << err << dendl;
+	return -EINVAL;
+      }
+      continue;
+    }
+    if (!rocks_opts.empty()) {
+      rocks_opts += ';';
+    }
+    rocks_opts += i;
+  }
+  rocksdb::Status status = rocksdb::GetColumnFamilyOptionsFromString(
+    *cf_opt, rocks_opts, cf_opt);
+  if (!status.ok()) {
+    derr << __func__ << " invalid db column family options for CF '"
+	 << cf.name << "': " << cf.option << dendl;
+    return -EINVAL;
+  }
+  if (block_cache_size) {
+    rocksdb::BlockBasedTableOptions cf_bbt_opts(bbt_opts);
+    cf_bbt_opts.block_cache = rocksdb_cache::NewBinnedLRUCache(
+      cct,
+      block_cache_size,
+      g_conf()->rocksdb_cache_shard_bits);
+    cf_opt->table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(cf_bbt_opts));
+    dout(10) << __func__ << " CF '" << cf.name << "' block_cache size "
+	     << byte_u_t(block_cache_size) << dendl;
+  }
+  return 0;
+}
+
+// The sharding the db was created (or last resharded) with lives next to
+// the rocksdb files; a db without it predates sharding and has one CF per
+// prefix, named after it.
+static const string SHARDING_FILE = "/sharding";
+static const string RESHARDING_MARK = "resharding";
+
+int RocksDBStore::read_sharding(string *def)
+{
+  rocksdb::Env *e = env ? env : rocksdb::Env::Default();
+  rocksdb::Status status = rocksdb::ReadFileToString(
+    e, path + SHARDING_FILE, def);
+  if (status.IsNotFound()) {
+    return -ENOENT;
+  }
+  if (!status.ok()) {
+    derr << __func__ << " " << status.ToString() << dendl;
+    return -EIO;
+  }
+  return 0;
+}
+
+int RocksDBStore::write_sharding(const string& def)
+{
+  rocksdb::Env *e = env ? env : rocksdb::Env::Default();
+  rocksdb::Status status = rocksdb::WriteStringToFile(
+    e, def, path + SHARDING_FILE, true);
+  if (!status.ok()) {
+    derr << __func__ << " " << status.ToString() << dendl;
+    return -EIO;
+  }
+  return 0;
+}
+
 int RocksDBStore::create_and_open(ostream &out,
 				  const vector<ColumnFamily>& cfs)
 {
@@ -481,7 +594,8 @@ int RocksDBStore::load_rocksdb_options(bool create_if_missing, rocksdb::Options&
 int RocksDBStore::do_open(ostream &out,
 			  bool create_if_missing,
 			  bool open_readonly,
-			  const vector<ColumnFamily>* cfs)
+			  const vector<ColumnFamily>* cfs,
+			  bool resharding)
 {
   ceph_assert(!(create_if_missing && open_readonly));
   rocksdb::Options opt;
@@ -492,39 +606,78 @@ int RocksDBStore::do_open(ostream &out,
   }
   rocksdb::Status status;
   if (create_if_missing) {
+    // set up the prefix routing before opening, so that
+    // MergeOperatorRouter::Name() sees the final set of CF prefixes
+    if (cfs) {
+      for (auto& p : *cfs) {
+	auto& shards = cf_shards[p.name];
+	shards.hash_l = p.hash_l;
+	shards.hash_h = p.hash_h;
+	shards.handles.resize(p.shard_cnt);
+      }
+    }
     status = rocksdb::DB::Open(opt, path, &db);
     if (!status.ok()) {
       derr << status.ToString() << dendl;
       return -EINVAL;
     }
     // create and open column families
-    if (cfs) {
+    if (cfs && !cfs->empty()) {
       for (auto& p : *cfs) {
 	// copy default CF settings, block cache, merge operators as
 	// the base for new CF
 	rocksdb::ColumnFamilyOptions cf_opt(opt);
 	// user input options will override the base options
-	status = rocksdb::GetColumnFamilyOptionsFromString(
-	  cf_opt, p.option, &cf_opt);
-	if (!status.ok()) {
-	  derr << __func__ << " invalid db column family option string for CF: "
-	       << p.name << dendl;
-	  return -EINVAL;
+	r = apply_cf_options(p, &cf_opt);
+	if (r < 0) {
+	  return r;
 	}
 	install_cf_mergeop(p.name, &cf_opt);
-	rocksdb::ColumnFamilyHandle *cf;
-	status = db->CreateColumnFamily(cf_opt, p.name, &cf);
-	if (!status.ok()) {
-	  derr << __func__ << " Failed to create rocksdb column family: "
-	       << p.name << dendl;
-	  return -EINVAL;
+	for (uint32_t i = 0; i < p.shard_cnt; ++i) {
+	  string cf_name = get_cf_shard_name(p, i);
+	  rocksdb::ColumnFamilyHandle *cf;
+	  status = db->CreateColumnFamily(cf_opt, cf_name, &cf);
+	  if (!status.ok()) {
+	    derr << __func__ << " Failed to create rocksdb column family: "
+		 << cf_name << dendl;
+	    return -EINVAL;
+	  }
+	  // store the new CF handle
+	  add_column_family(cf_name, static_cast<void*>(cf));
+	  cf_shards[p.name].handles[i] = cf;
 	}
-	// store the new CF handle
-	add_column_family(p.name, static_cast<void*>(cf));
+      }
+      r = write_sharding(sharding_to_string(*cfs));
+      if (r < 0) {
+	return r;
       }
     }
     default_cf = db->DefaultColumnFamily();
   } else {
+    string def;
+    vector<ColumnFamily> layout;
+    r = read_sharding(&def);
+    if (r == 0 && def.compare(0, RESHARDING_MARK.size(), RESHARDING_MARK) == 0) {
+      if (!resharding) {
+	derr << __func__ << " db was left half way through a reshard, rerun it"
+	     << dendl;
+	out << "interrupted reshard, rerun it to completion" << std::endl;
+	return -EINVAL;
+      }
+    } else if (r == 0) {
+      stringstream err;
+      r = parse_sharding(def, &layout, err);
+      if (r < 0) {
+	derr << __func__ << " bad sharding definition '" << def << "': "
+	     << err.str() << dendl;
+	return r;
+      }
+      dout(1) << __func__ << " sharding: " << def << dendl;
+    } else if (r != -ENOENT) {
+      return r;
+    }
+    bool have_layout = (r == 0);
+
     std::vector<string> existing_cfs;
     status = rocksdb::DB::ListColumnFamilies(
       rocksdb::DBOptions(opt),
@@ -544,36 +697,65 @@ int RocksDBStore::do_open(ostream &out,
       }
       default_cf = db->DefaultColumnFamily();
     } else {
+      if (!have_layout && !resharding) {
+	// db created before sharding definitions: one CF per prefix
+	for (auto& n : existing_cfs) {
+	  if (n != rocksdb::kDefaultColumnFamilyName) {
+	    layout.emplace_back(n, "");
+	  }
+	}
+      }
+      // CF name -> (prefix, shard)
+      map<string, pair<string, uint32_t>> cf_layout;
+      for (auto& p : layout) {
+	auto& shards = cf_shards[p.name];
+	shards.hash_l = p.hash_l;
+	shards.hash_h = p.hash_h;
+	shards.handles.resize(p.shard_cnt);
+	for (uint32_t i = 0; i < p.shard_cnt; ++i) {
+	  cf_layout[get_cf_shard_name(p, i)] = make_pair(p.name, i);
+	}
+      }
       // we cannot change column families for a created database.  so, map
       // what options we are given to whatever cf's already exist.
+      map<string, rocksdb::ColumnFamilyOptions> prefix_opts;
       std::vector<rocksdb::ColumnFamilyDescriptor> column_families;
       for (auto& n : existing_cfs) {
-	// copy default CF settings, block cache, merge operators as
-	// the base for new CF
-	rocksdb::ColumnFamilyOptions cf_opt(opt);
-	bool found = false;
-	if (cfs) {
-	  for (auto& i : *cfs) {
-	    if (i.name == n) {
-	      found = true;
-	      status = rocksdb::GetColumnFamilyOptionsFromString(
-		cf_opt, i.option, &cf_opt);
-	      if (!status.ok()) {
-		derr << __func__ << " invalid db column family options for CF '"
-		     << i.name << "': " << i.option << dendl;
-		return -EINVAL;
+	if (n == rocksdb::kDefaultColumnFamilyName) {
+	  column_families.push_back(rocksdb::ColumnFamilyDescriptor(
+	    n, rocksdb::ColumnFamilyOptions(opt)));
+	  continue;
+	}
+	auto l = cf_layout.find(n);
+	string prefix;
+	if (l != cf_layout.end()) {
+	  prefix = l->second.first;
+	} else {
+	  prefix = cf_name_to_prefix(n);
+	  if (!resharding) {
+	    dout(1) << __func__ << " column family '" << n
+		    << "' exists but not expected" << dendl;
+	  }
+	}
+	auto po = prefix_opts.find(prefix);
+	if (po == prefix_opts.end()) {
+	  // copy default CF settings, block cache, merge operators as
+	  // the base for new CF; all shards of a prefix share the result
+	  rocksdb::ColumnFamilyOptions cf_opt(opt);
+	  if (cfs) {
+	    for (auto& i : *cfs) {
+	      if (i.name == prefix) {
+		r = apply_cf_options(i, &cf_opt);
+		if (r < 0) {
+		  return r;
+		}
 	      }
 	    }
 	  }
+	  install_cf_mergeop(prefix, &cf_opt);
+	  po = prefix_opts.emplace(prefix, cf_opt).first;
 	}
-	if (n != rocksdb::kDefaultColumnFamilyName) {
-	  install_cf_mergeop(n, &cf_opt);
-	}
-	column_families.push_back(rocksdb::ColumnFamilyDescriptor(n, cf_opt));
-	if (!found && n != rocksdb::kDefaultColumnFamilyName) {
-	  dout(1) << __func__ << " column family '" << n
-		  << "' exists but not expected" << dendl;
-	}
+	column_families.push_back(rocksdb::ColumnFamilyDescriptor(n, po->second));
       }
       std::vector<rocksdb::ColumnFamilyHandle*> handles;
       if (open_readonly) {
@@ -594,6 +776,19 @@ int RocksDBStore::do_open(ostream &out,
 	  must_close_default_cf = true;
 	} else {
 	  add_column_family(existing_cfs[i], static_cast<void*>(handles[i]));
+	  auto l = cf_layout.find(existing_cfs[i]);
+	  if (l != cf_layout.end()) {
+	    cf_shards[l->second.first].handles[l->second.second] = handles[i];
+	  }
+	}
+      }
+      for (auto& p : cf_shards) {
+	for (auto h : p.second.handles) {
+	  if (!h) {
+	    derr << __func__ << " missing column family for prefix '"
+		 << p.first << "' of sharding " << def << dendl;
+	    return -EINVAL;
+	  }
 	}
       }
     }
@@ -697,6 +892,147 @@ int RocksDBStore::repair(std::ostream &out)
   }
 }
 
+int RocksDBStore::reshard(const vector<ColumnFamily>& new_cfs, ostream &out)
+{
+  ceph_assert(db == nullptr);
+  int r = do_open(out, false, false, &new_cfs, true);
+  if (r < 0) {
+    return r;
+  }
+  string new_def = sharding_to_string(new_cfs);
+  dout(1) << __func__ << " to '" << new_def << "'" << dendl;
+  // a normal open refuses the db from here on until we are done; every
+  // step below can simply be repeated if we get interrupted
+  r = write_sharding(RESHARDING_MARK + " " + new_def);
+  if (r < 0) {
+    return r;
+  }
+
+  // create the target column families that do not exist yet
+  std::unordered_map<std::string, prefix_shards> target;
+  std::set<string> target_names;
+  for (auto& p : new_cfs) {
+    rocksdb::ColumnFamilyOptions cf_opt(db->GetOptions(default_cf));
+    r = apply_cf_options(p, &cf_opt);
+    if (r < 0) {
+      return r;
+    }
+    install_cf_mergeop(p.name, &cf_opt);
+    auto& shards = target[p.name];
+    shards.hash_l = p.hash_l;
+    shards.hash_h = p.hash_h;
+    for (uint32_t i = 0; i < p.shard_cnt; ++i) {
+      string cf_name = get_cf_shard_name(p, i);
+      target_names.insert(cf_name);
+      rocksdb::ColumnFamilyHandle *cf;
+      auto h = cf_handles.find(cf_name);
+      if (h != cf_handles.end()) {
+	cf = static_cast<rocksdb::ColumnFamilyHandle*>(h->second);
+      } else {
+	rocksdb::Status status = db->CreateColumnFamily(cf_opt, cf_name, &cf);
+	if (!status.ok()) {
+	  derr << __func__ << " failed to create column family " << cf_name
+	       << ": " << status.ToString() << dendl;
+	  return -EIO;
+	}
+	add_column_family(cf_name, static_cast<void*>(cf));
+	out << "created column family " << cf_name << std::endl;
+      }
+      shards.handles.push_back(cf);
+    }
+  }
+
+  // move every key whose column family changes; put and delete go in the
+  // same batch, so a key is never lost nor present twice
+  vector<pair<string, rocksdb::ColumnFamilyHandle*>> sources;
+  sources.emplace_back(string(), default_cf);
+  for (auto& p : cf_handles) {
+    sources.emplace_back(cf_name_to_prefix(p.first),
+			 static_cast<rocksdb::ColumnFamilyHandle*>(p.second));
+  }
+  uint64_t moved = 0;
+  rocksdb::WriteOptions woptions;
+  rocksdb::WriteBatch bat;
+  for (auto& [src_prefix, src_cf] : sources) {
+    std::unique_ptr<rocksdb::Iterator> it(
+      db->NewIterator(rocksdb::ReadOptions(), src_cf));
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      string prefix = src_prefix;
+      string key;
+      if (src_cf == default_cf) {
+	if (split_key(it->key(), &prefix, &key) < 0) {
+	  continue;
+	}
+      } else {
+	key = it->key().ToString();
+      }
+      rocksdb::ColumnFamilyHandle *dst = default_cf;
+      auto t = target.find(prefix);
+      if (t != target.end()) {
+	dst = get_shard(t->second, key.data(), key.size());
+      }
+      if (dst == src_cf) {
+	continue;
+      }
+      if (dst == default_cf) {
+	bat.Put(dst, combine_strings(prefix, key), it->value());
+      } else {
+	bat.Put(dst, key, it->value());
+      }
+      bat.Delete(src_cf, it->key());
+      ++moved;
+      if (bat.Count() >= 10000 || bat.GetDataSize() >= (16u << 20)) {
+	rocksdb::Status status = db->Write(woptions, &bat);
+	if (!status.ok()) {
+	  derr << __func__ << " write failed: " << status.ToString() << dendl;
+	  return -EIO;
+	}
+	bat.Clear();
+	dout(10) << __func__ << " moved " << moved << " keys" << dendl;
+      }
+    }
+    if (!it->status().ok()) {
+      derr << __func__ << " iteration failed: " << it->status().ToString()
+	   << dendl;
+      return -EIO;
+    }
+  }
+  woptions.sync = true;
+  rocksdb::Status status = db->Write(woptions, &bat);
+  if (!status.ok()) {
+    derr << __func__ << " write failed: " << status.ToString() << dendl;
+    return -EIO;
+  }
+
+  // the column families outside the new sharding are empty now
+  for (auto p = cf_handles.begin(); p != cf_handles.end();) {
+    if (target_names.count(p->first)) {
+      ++p;
+      continue;
+    }
+    auto cf = static_cast<rocksdb::ColumnFamilyHandle*>(p->second);
+    status = db->DropColumnFamily(cf);
+    if (!status.ok()) {
+      derr << __func__ << " failed to drop column family " << p->first
+	   << ": " << status.ToString() << dendl;
+      return -EIO;
+    }
+    db->DestroyColumnFamilyHandle(cf);
+    out << "dropped column family " << p->first << std::endl;
+    p = cf_handles.erase(p);
+  }
+  cf_shards = std::move(target);
+  r = write_sharding(new_def);
+  if (r < 0) {
+    return r;
+  }
+  // get rid of the tombstones the move left behind
+  compact();
+  out << "resharded to '" << new_def << "', moved " << moved << " keys"
+      << std::endl;
+  return 0;
+}
+
 void RocksDBStore::split_stats(const std::string &s, char delim, std::vector<std::string> &elems) {
     std::stringstream ss;
     ss.str(s);
@@ -716,16 +1052,20 @@ bool RocksDBStore::get_property(
 int64_t RocksDBStore::estimate_prefix_size(const string& prefix,
 					   const string& key_prefix)
 {
-  auto cf = get_cf_handle(prefix);
+  auto p_iter = cf_shards.find(prefix);
   uint64_t size = 0;
   uint8_t flags =
     //rocksdb::DB::INCLUDE_MEMTABLES |  // do not include memtables...
     rocksdb::DB::INCLUDE_FILES;
-  if (cf) {
+  if (p_iter != cf_shards.end()) {
     string start = key_prefix + string(1, '\x00');
     string limit = key_prefix + string("\xff\xff\xff\xff");
     rocksdb::Range r(start, limit);
-    db->GetApproximateSizes(cf, &r, 1, &size, flags);
+    for (auto cf : p_iter->second.handles) {
+      uint64_t s = 0;
+      db->GetApproximateSizes(cf, &r, 1, &s, flags);
+      size += s;
+    }
   } else {
     string start = combine_strings(prefix , key_prefix);
     string limit = combine_strings(prefix , key_prefix + "\xff\xff\xff\xff");
@@ -902,7 +1242,7 @@ void RocksDBStore::RocksDBTransactionImpl::set(
   const string &k,
   const bufferlist &to_set_bl)
 {
-  auto cf = db->get_cf_handle(prefix);
+  auto cf = db->get_cf_handle(prefix, k);
   if (cf) {
     put_bat(bat, cf, k, to_set_bl);
   } else {
@@ -916,21 +1256,21 @@ void RocksDBStore::RocksDBTransactionImpl::set(
   const char *k, size_t keylen,
   const bufferlist &to_set_bl)
 {
-  auto cf = db->get_cf_handle(prefix);
+  auto cf = db->get_cf_handle(prefix, k, keylen);
   if (cf) {
     string key(k, keylen);  // fixme?
     put_bat(bat, cf, key, to_set_bl);
   } else {
     string key;
     combine_strings(prefix, k, keylen, &key);
-    put_bat(bat, cf, key, to_set_bl);
+    put_bat(bat, db->default_cf, key, to_set_bl);
   }
 }
 
 void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
 					         const string &k)
 {
-  auto cf = db->get_cf_handle(prefix);
+  auto cf = db->get_cf_handle(prefix, k);
   if (cf) {
     bat.Delete(cf, rocksdb::Slice(k));
   } else {
@@ -942,7 +1282,7 @@ void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
 					         const char *k,
 						 size_t keylen)
 {
-  auto cf = db->get_cf_handle(prefix);
+  auto cf = db->get_cf_handle(prefix, k, keylen);
   if (cf) {
     bat.Delete(cf, rocksdb::Slice(k, keylen));
   } else {
@@ -955,7 +1295,7 @@ void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
 void RocksDBStore::RocksDBTransactionImpl::rm_single_key(const string &prefix,
 					                 const string &k)
 {
-  auto cf = db->get_cf_handle(prefix);
+  auto cf = db->get_cf_handle(prefix, k);
   if (cf) {
     bat.SingleDelete(cf, k);
   } else {
@@ -965,16 +1305,18 @@ void RocksDBStore::RocksDBTransactionImpl::rm_single_key(const string &prefix,
 
 void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix)
 {
-  auto cf = db->get_cf_handle(prefix);
+  auto p_iter = db->cf_shards.find(prefix);
   uint64_t cnt = db->delete_range_threshold;
   bat.SetSavePoint();
   auto it = db->get_iterator(prefix);
   for (it->seek_to_first(); it->valid(); it->next()) {
     if (!cnt) {
       bat.RollbackToSavePoint();
-      if (cf) {
+      if (p_iter != db->cf_shards.end()) {
         string endprefix = "\xff\xff\xff\xff";  // FIXME: this is cheating...
-        bat.DeleteRange(cf, string(), endprefix);
+        for (auto cf : p_iter->second.handles) {
+          bat.DeleteRange(cf, string(), endprefix);
+        }
       } else {
         string endprefix = prefix;
         endprefix.push_back('\x01');
@@ -984,8 +1326,10 @@ void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix
       }
       return;
     }
-    if (cf) {
-      bat.Delete(cf, rocksdb::Slice(it->key()));
+    if (p_iter != db->cf_shards.end()) {
+      string k = it->key();
+      bat.Delete(db->get_shard(p_iter->second, k.data(), k.size()),
+                 rocksdb::Slice(k));
     } else {
       bat.Delete(db->default_cf, combine_strings(prefix, it->key()));
     }
@@ -998,7 +1342,7 @@ void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
                                                          const string &start,
                                                          const string &end)
 {
-  auto cf = db->get_cf_handle(prefix);
+  auto p_iter = db->cf_shards.find(prefix);
 
   uint64_t cnt = db->delete_range_threshold;
   auto it = db->get_iterator(prefix);
@@ -1010,8 +1354,10 @@ void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
     }
     if (!cnt) {
       bat.RollbackToSavePoint();
-      if (cf) {
-        bat.DeleteRange(cf, rocksdb::Slice(start), rocksdb::Slice(end));
+      if (p_iter != db->cf_shards.end()) {
+        for (auto cf : p_iter->second.handles) {
+          bat.DeleteRange(cf, rocksdb::Slice(start), rocksdb::Slice(end));
+        }
       } else {
         bat.DeleteRange(db->default_cf,
                         rocksdb::Slice(combine_strings(prefix, start)),
@@ -1019,8 +1365,10 @@ void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
       }
       return;
     }
-    if (cf) {
-      bat.Delete(cf, rocksdb::Slice(it->key()));
+    if (p_iter != db->cf_shards.end()) {
+      string k = it->key();
+      bat.Delete(db->get_shard(p_iter->second, k.data(), k.size()),
+                 rocksdb::Slice(k));
     } else {
       bat.Delete(db->default_cf, combine_strings(prefix, it->key()));
     }
@@ -1035,7 +1383,7 @@ void RocksDBStore::RocksDBTransactionImpl::merge(
   const string &k,
   const bufferlist &to_set_bl)
 {
-  auto cf = db->get_cf_handle(prefix);
+  auto cf = db->get_cf_handle(prefix, k);
   if (cf) {
     // bufferlist::c_str() is non-constant, so we can't call c_str()
     if (to_set_bl.is_contiguous() && to_set_bl.length() > 0) {
@@ -1076,12 +1424,12 @@ int RocksDBStore::get(
     std::map<string, bufferlist> *out)
 {
   utime_t start = ceph_clock_now();
-  auto cf = get_cf_handle(prefix);
-  if (cf) {
+  auto p_iter = cf_shards.find(prefix);
+  if (p_iter != cf_shards.end()) {
     for (auto& key : keys) {
       std::string value;
       auto status = db->Get(rocksdb::ReadOptions(),
-			    cf,
+			    get_shard(p_iter->second, key.data(), key.size()),
 			    rocksdb::Slice(key),
 			    &value);
       if (status.ok()) {
@@ -1121,7 +1469,7 @@ int RocksDBStore::get(
   int r = 0;
   string value;
   rocksdb::Status s;
-  auto cf = get_cf_handle(prefix);
+  auto cf = get_cf_handle(prefix, key);
   if (cf) {
     s = db->Get(rocksdb::ReadOptions(),
 		cf,
@@ -1158,7 +1506,7 @@ int RocksDBStore::get(
   int r = 0;
   string value;
   rocksdb::Status s;
-  auto cf = get_cf_handle(prefix);
+  auto cf = get_cf_handle(prefix, key, keylen);
   if (cf) {
     s = db->Get(rocksdb::ReadOptions(),
 		cf,
@@ -1224,15 +1572,17 @@ void RocksDBStore::compact_thread_entry()
   std::unique_lock l{compact_queue_lock};
   while (!compact_queue_stop) {
     while (!compact_queue.empty()) {
-      pair<string,string> range = compact_queue.front();
+      auto [prefix, start, end] = compact_queue.front();
       compact_queue.pop_front();
       logger->set(l_rocksdb_compact_queue_len, compact_queue.size());
       l.unlock();
       logger->inc(l_rocksdb_compact_range);
-      if (range.first.empty() && range.second.empty()) {
+      if (!prefix.empty()) {
+        compact_cf_range(prefix, start, end);
+      } else if (start.empty() && end.empty()) {
         compact();
       } else {
-        compact_range(range.first, range.second);
+        compact_range(start, end);
       }
       l.lock();
       continue;
@@ -1242,31 +1592,43 @@ void RocksDBStore::compact_thread_entry()
 }
 
 void RocksDBStore::compact_range_async(const string& start, const string& end)
+{
+  queue_compact_range(string(), start, end);
+}
+
+void RocksDBStore::queue_compact_range(const string& prefix,
+				       const string& start, const string& end)
 {
   std::lock_guard l(compact_queue_lock);
 
   // try to merge adjacent ranges.  this is O(n), but the queue should
   // be short.  note that we do not cover all overlap cases and merge
   // opportunities here, but we capture the ones we currently need.
-  list< pair<string,string> >::iterator p = compact_queue.begin();
+  auto p = compact_queue.begin();
   while (p != compact_queue.end()) {
-    if (p->first == start && p->second == end) {
+    auto& [p_prefix, p_start, p_end] = *p;
+    if (p_prefix != prefix) {
+      ++p;
+      continue;
+    }
+    if (p_start == start && p_end == end) {
       // dup; no-op
       return;
     }
-    if (start <= p->first && p->first <= end) {
+    if (start <= p_start && p_start <= end) {
       // new region crosses start of existing range
       // select right bound that is bigger
-      compact_queue.push_back(make_pair(start, end > p->second ? end : p->second));
+      compact_queue.push_back(
+	std::make_tuple(prefix, start, end > p_end ? end : p_end));
       compact_queue.erase(p);
       logger->inc(l_rocksdb_compact_queue_merge);
       break;
     }
-    if (start <= p->second && p->second <= end) {
+    if (start <= p_end && p_end <= end) {
       // new region crosses end of existing range
-      //p->first < p->second and p->second <= end, so p->first <= end.
-      //But we break if previous condition, so start > p->first.
-      compact_queue.push_back(make_pair(p->first, end));
+      //p_start < p_end and p_end <= end, so p_start <= end.
+      //But we break if previous condition, so start > p_start.
+      compact_queue.push_back(std::make_tuple(prefix, p_start, end));
       compact_queue.erase(p);
       logger->inc(l_rocksdb_compact_queue_merge);
       break;
@@ -1275,7 +1637,7 @@ void RocksDBStore::compact_range_async(const string& start, const string& end)
   }
   if (p == compact_queue.end()) {
     // no merge, new entry.
-    compact_queue.push_back(make_pair(start, end));
+    compact_queue.push_back(std::make_tuple(prefix, start, end));
     logger->set(l_rocksdb_compact_queue_len, compact_queue.size());
   }
   compact_queue_cond.notify_all();
@@ -1301,6 +1663,61 @@ void RocksDBStore::compact_range(const string& start, const string& end)
   db->CompactRange(options, &cstart, &cend);
 }
 
+// compact [start, end) of every shard of a CF prefix; empty bounds are open
+void RocksDBStore::compact_cf_range(const string& prefix,
+				    const string& start, const string& end)
+{
+  auto p_iter = cf_shards.find(prefix);
+  ceph_assert(p_iter != cf_shards.end());
+  rocksdb::CompactRangeOptions options;
+  rocksdb::Slice cstart(start);
+  rocksdb::Slice cend(end);
+  for (auto cf : p_iter->second.handles) {
+    db->CompactRange(options, cf,
+		     start.empty() ? nullptr : &cstart,
+		     end.empty() ? nullptr : &cend);
+  }
+}
+
+void RocksDBStore::compact_prefix(const string& prefix)
+{
+  if (cf_shards.count(prefix)) {
+    compact_cf_range(prefix, string(), string());
+  } else {
+    compact_range(prefix, past_prefix(prefix));
+  }
+}
+
+void RocksDBStore::compact_prefix_async(const string& prefix)
+{
+  if (cf_shards.count(prefix)) {
+    queue_compact_range(prefix, string(), string());
+  } else {
+    compact_range_async(prefix, past_prefix(prefix));
+  }
+}
+
+void RocksDBStore::compact_range(const string& prefix,
+				 const string& start, const string& end)
+{
+  if (cf_shards.count(prefix)) {
+    compact_cf_range(prefix, start, end);
+  } else {
+    compact_range(combine_strings(prefix, start), combine_strings(prefix, end));
+  }
+}
+
+void RocksDBStore::compact_range_async(const string& prefix,
+				       const string& start, const string& end)
+{
+  if (cf_shards.count(prefix)) {
+    queue_compact_range(prefix, start, end);
+  } else {
+    compact_range_async(combine_strings(prefix, start),
+			combine_strings(prefix, end));
+  }
+}
+
 RocksDBStore::RocksDBWholeSpaceIteratorImpl::~RocksDBWholeSpaceIteratorImpl()
 {
   delete dbiter;
@@ -1430,20 +1847,39 @@ string RocksDBStore::past_prefix(const string &prefix)
   return limit;
 }
 
-RocksDBStore::WholeSpaceIterator RocksDBStore::get_wholespace_iterator()
-{
-  return std::make_shared<RocksDBWholeSpaceIteratorImpl>(
-    db->NewIterator(rocksdb::ReadOptions(), default_cf));
-}
+// read options of a bounded iterator; rocksdb only keeps pointers to the
+// bounds, so they live here for as long as the iterator does
+struct BoundedReadOptions {
+  string lower, upper;
+  rocksdb::Slice lower_slice, upper_slice;
+  rocksdb::ReadOptions opts;
+
+  BoundedReadOptions(const KeyValueDB::IteratorBounds& bounds,
+		     size_t readahead)
+    : lower(bounds.lower_bound),
+      upper(bounds.upper_bound),
+      lower_slice(lower),
+      upper_slice(upper) {
+    opts.iterate_lower_bound = &lower_slice;
+    if (!upper.empty()) {
+      opts.iterate_upper_bound = &upper_slice;
+    }
+    opts.readahead_size = readahead;
+  }
+  BoundedReadOptions(const BoundedReadOptions&) = delete;
+  BoundedReadOptions& operator=(const BoundedReadOptions&) = delete;
+};
 
 class CFIteratorImpl : public KeyValueDB::IteratorImpl {
 protected:
   string prefix;
   rocksdb::Iterator *dbiter;
+  std::unique_ptr<BoundedReadOptions> ropts;
 public:
   explicit CFIteratorImpl(const std::string& p,
-				 rocksdb::Iterator *iter)
-    : prefix(p), dbiter(iter) { }
+				 rocksdb::Iterator *iter,
+				 std::unique_ptr<BoundedReadOptions> ro = nullptr)
+    : prefix(p), dbiter(iter), ropts(std::move(ro)) { }
   ~CFIteratorImpl() {
     delete dbiter;
   }
@@ -1501,15 +1937,396 @@ public:
   }
 };
 
+// Merges the per-shard iterators of a sharded prefix back into key
+// order.  Each key lives in exactly one shard, so there are no duplicates
+// to resolve; the shard count is small, so a linear pick is used.
+class ShardMergeIteratorImpl : public KeyValueDB::IteratorImpl {
+  string prefix;
+  std::vector<rocksdb::Iterator*> iters;
+  rocksdb::Iterator *cur = nullptr;
+  bool forward = true;
+  std::unique_ptr<BoundedReadOptions> ropts;
+
+  void pick() {
+    cur = nullptr;
+    for (auto it : iters) {
+      if (!it->Valid()) {
+	continue;
+      }
+      if (!cur) {
+	cur = it;
+	continue;
+      }
+      int c = it->key().compare(cur->key());
+      if (forward ? c < 0 : c > 0) {
+	cur = it;
+      }
+    }
+  }
+public:
+  ShardMergeIteratorImpl(const std::string& p,
+			 std::vector<rocksdb::Iterator*>&& i,
+			 std::unique_ptr<BoundedReadOptions> ro = nullptr)
+    : prefix(p), iters(std::move(i)), ropts(std::move(ro)) { }
+  ~ShardMergeIteratorImpl() {
+    for (auto it : iters) {
+      delete it;
+    }
+  }
+
+  int seek_to_first() override {
+    for (auto it : iters) {
+      it->SeekToFirst();
+    }
+    forward = true;
+    pick();
+    return status();
+  }
+  int seek_to_last() override {
+    for (auto it : iters) {
+      it->SeekToLast();
+    }
+    forward = false;
+    pick();
+    return status();
+  }
+  int upper_bound(const string &after) override {
+    lower_bound(after);
+    if (valid() && (key() == after)) {
+      next();
+    }
+    return status();
+  }
+  int lower_bound(const string &to) override {
+    rocksdb::Slice slice_bound(to);
+    for (auto it : iters) {
+      it->Seek(slice_bound);
+    }
+    forward = true;
+    pick();
+    return status();
+  }
+  int next() override {
+    if (!cur) {
+      return status();
+    }
+    if (forward) {
+      cur->Next();
+    } else {
+      // reposition every shard just past the current key
+      string k = cur->key().ToString();
+      for (auto it : iters) {
+	it->Seek(k);
+	if (it->Valid() && it->key() == rocksdb::Slice(k)) {
+	  it->Next();
+	}
+      }
+      forward = true;
+    }
+    pick();
+    return status();
+  }
+  int prev() override {
+    if (!cur) {
+      return status();
+    }
+    if (!forward) {
+      cur->Prev();
+    } else {
+      // reposition every shard just before the current key
+      string k = cur->key().ToString();
+      for (auto it : iters) {
+	it->SeekForPrev(k);
+	if (it->Valid() && it->key() == rocksdb::Slice(k)) {
+	  it->Prev();
+	}
+      }
+      forward = false;
+    }
+    pick();
+    return status();
+  }
+  bool valid() override {
+    return cur != nullptr;
+  }
+  string key() override {
+    return cur->key().ToString();
+  }
+  std::pair<std::string, std::string> raw_key() override {
+    return make_pair(prefix, key());
+  }
+  bufferlist value() override {
+    return to_bufferlist(cur->value());
+  }
+  bufferptr value_as_ptr() override {
+    rocksdb::Slice val = cur->value();
+    return bufferptr(val.data(), val.size());
+  }
+  int status() override {
+    for (auto it : iters) {
+      if (!it->status().ok()) {
+	return -1;
+      }
+    }
+    return 0;
+  }
+};
+
+// Walks the default column family together with every sharded prefix,
+// in (prefix, key) order, which is the order the default column family
+// alone would have if nothing were sharded.  A prefix lives either in the
+// default column family or in its own, so keys never repeat.
+class WholeMergeIteratorImpl : public KeyValueDB::WholeSpaceIteratorImpl {
+  KeyValueDB::WholeSpaceIterator main;
+  std::map<std::string, KeyValueDB::Iterator> shards;  ///< by prefix
+  bool on_main = false;  ///< current entry is main's, else cur's
+  KeyValueDB::IteratorImpl *cur = nullptr;
+  bool forward = true;
+
+  // park a shard iterator so it is not considered by pick()
+  static void park(KeyValueDB::IteratorImpl *it) {
+    it->seek_to_last();
+    it->next();
+  }
+  void pick() {
+    std::pair<std::string, std::string> best;
+    on_main = main->valid();
+    cur = nullptr;
+    if (on_main) {
+      best = main->raw_key();
+    }
+    for (auto& [prefix, it] : shards) {
+      if (!it->valid()) {
+	continue;
+      }
+      auto k = it->raw_key();
+      if ((!on_main && !cur) || (forward ? k < best : k > best)) {
+	best = std::move(k);
+	on_main = false;
+	cur = it.get();
+      }
+    }
+  }
+public:
+  WholeMergeIteratorImpl(KeyValueDB::WholeSpaceIterator m,
+			 std::map<std::string, KeyValueDB::Iterator>&& s)
+    : main(std::move(m)), shards(std::move(s)) { }
+
+  int seek_to_first() override {
+    main->seek_to_first();
+    for (auto& [prefix, it] : shards) {
+      it->seek_to_first();
+    }
+    forward = true;
+    pick();
+    return status();
+  }
+  int seek_to_first(const std::string &prefix) override {
+    return lower_bound(prefix, std::string());
+  }
+  int seek_to_last() override {
+    main->seek_to_last();
+    for (auto& [prefix, it] : shards) {
+      it->seek_to_last();
+    }
+    forward = false;
+    pick();
+    return status();
+  }
+  int seek_to_last(const std::string &prefix) override {
+    main->seek_to_last(prefix);
+    for (auto& [p, it] : shards) {
+      if (p <= prefix) {
+	it->seek_to_last();
+      } else {
+	park(it.get());
+      }
+    }
+    forward = false;
+    pick();
+    return status();
+  }
+  int upper_bound(const std::string &prefix,
+		  const std::string &after) override {
+    lower_bound(prefix, after);
+    if (valid()) {
+      auto k = raw_key();
+      if (k.first == prefix && k.second == after) {
+	next();
+      }
+    }
+    return status();
+  }
+  int lower_bound(const std::string &prefix,
+		  const std::string &to) override {
+    main->lower_bound(prefix, to);
+    for (auto& [p, it] : shards) {
+      if (p < prefix) {
+	park(it.get());
+      } else if (p == prefix) {
+	it->lower_bound(to);
+      } else {
+	it->seek_to_first();
+      }
+    }
+    forward = true;
+    pick();
+    return status();
+  }
+  bool valid() override {
+    return on_main || cur;
+  }
+  int next() override {
+    if (!valid()) {
+      return status();
+    }
+    if (!forward) {
+      // reposition every source just past the current entry
+      auto k = raw_key();
+      return upper_bound(k.first, k.second);
+    }
+    if (on_main) {
+      main->next();
+    } else {
+      cur->next();
+    }
+    pick();
+    return status();
+  }
+  int prev() override {
+    if (!valid()) {
+      return status();
+    }
+    if (forward) {
+      // reposition every source just before the current entry
+      auto [prefix, key] = raw_key();
+      main->lower_bound(prefix, key);
+      if (main->valid()) {
+	main->prev();
+      } else {
+	main->seek_to_last();
+      }
+      for (auto& [p, it] : shards) {
+	if (p < prefix) {
+	  it->seek_to_last();
+	} else if (p == prefix) {
+	  it->lower_bound(key);
+	  if (it->valid()) {
+	    it->prev();
+	  } else {
+	    it->seek_to_last();
+	  }
+	} else {
+	  park(it.get());
+	}
+      }
+      forward = false;
+    } else if (on_main) {
+      main->prev();
+    } else {
+      cur->prev();
+    }
+    pick();
+    return status();
+  }
+  std::string key() override {
+    return on_main ? main->key() : cur->key();
+  }
+  std::pair<std::string,std::string> raw_key() override {
+    return on_main ? main->raw_key() : cur->raw_key();
+  }
+  bool raw_key_is_prefixed(const std::string &prefix) override {
+    return on_main ? main->raw_key_is_prefixed(prefix) :
+      cur->raw_key().first == prefix;
+  }
+  bufferlist value() override {
+    return on_main ? main->value() : cur->value();
+  }
+  bufferptr value_as_ptr() override {
+    return on_main ? main->value_as_ptr() : cur->value_as_ptr();
+  }
+  int status() override {
+    if (main->status() != 0) {
+      return -1;
+    }
+    for (auto& [prefix, it] : shards) {
+      if (it->status() != 0) {
+	return -1;
+      }
+    }
+    return 0;
+  }
+  size_t key_size() override {
+    if (on_main) {
+      return main->key_size();
+    }
+    auto k = cur->raw_key();
+    // as stored in the default column family: prefix, separator, key
+    return k.first.size() + 1 + k.second.size();
+  }
+  size_t value_size() override {
+    return on_main ? main->value_size() : cur->value().length();
+  }
+};
+
+RocksDBStore::WholeSpaceIterator RocksDBStore::get_wholespace_iterator()
+{
+  auto main = std::make_shared<RocksDBWholeSpaceIteratorImpl>(
+    db->NewIterator(rocksdb::ReadOptions(), default_cf));
+  if (cf_shards.empty()) {
+    return main;
+  }
+  std::map<std::string, KeyValueDB::Iterator> shards;
+  for (auto& p : cf_shards) {
+    shards[p.first] = get_iterator(p.first);
+  }
+  return std::make_shared<WholeMergeIteratorImpl>(main, std::move(shards));
+}
+
 KeyValueDB::Iterator RocksDBStore::get_iterator(const std::string& prefix)
 {
-  rocksdb::ColumnFamilyHandle *cf_handle =
-    static_cast<rocksdb::ColumnFamilyHandle*>(get_cf_handle(prefix));
-  if (cf_handle) {
-    return std::make_shared<CFIteratorImpl>(
+  auto p_iter = cf_shards.find(prefix);
+  if (p_iter == cf_shards.end()) {
+    // the prefix lives in the default column family only, no need to
+    // merge in the sharded ones
+    return std::make_shared<PrefixIteratorImpl>(
       prefix,
-      db->NewIterator(rocksdb::ReadOptions(), cf_handle));
-  } else {
-    return KeyValueDB::get_iterator(prefix);
+      std::make_shared<RocksDBWholeSpaceIteratorImpl>(
+	db->NewIterator(rocksdb::ReadOptions(), default_cf)));
   }
+  auto& handles = p_iter->second.handles;
+  if (handles.size() == 1) {
+    return std::make_shared<CFIteratorImpl>(
+      prefix,
+      db->NewIterator(rocksdb::ReadOptions(), handles[0]));
+  }
+  std::vector<rocksdb::Iterator*> iters;
+  rocksdb::Status status =
+    db->NewIterators(rocksdb::ReadOptions(), handles, &iters);
+  ceph_assert(status.ok());
+  return std::make_shared<ShardMergeIteratorImpl>(prefix, std::move(iters));
+}
+
+KeyValueDB::Iterator RocksDBStore::get_bounded_iterator(
+  const std::string& prefix,
+  const IteratorBounds& bounds,
+  size_t readahead)
+{
+  auto p_iter = cf_shards.find(prefix);
+  if (p_iter == cf_shards.end()) {
+    // keys in the default column family are stored with the prefix in
+    // front, which the bounds don't know about
+    return get_iterator(prefix);
+  }
+  auto ropts = std::make_unique<BoundedReadOptions>(bounds, readahead);
+  auto& handles = p_iter->second.handles;
+  if (handles.size() == 1) {
+    rocksdb::Iterator *it = db->NewIterator(ropts->opts, handles[0]);
+    return std::make_shared<CFIteratorImpl>(prefix, it, std::move(ropts));
+  }
+  std::vector<rocksdb::Iterator*> iters;
+  rocksdb::Status status = db->NewIterators(ropts->opts, handles, &iters);
+  ceph_assert(status.ok());
+  return std::make_shared<ShardMergeIteratorImpl>(prefix, std::move(iters),
+						  std::move(ropts));
 }
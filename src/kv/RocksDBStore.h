@@ -10,6 +10,8 @@
 #include <map>
 #include <string>
 #include <memory>
+#include <tuple>
+#include <unordered_map>
 #include <boost/scoped_ptr.hpp>
 #include "rocksdb/write_batch.h"
 #include "rocksdb/perf_context.h"
@@ -87,18 +89,37 @@ class RocksDBStore : public KeyValueDB {
   bool must_close_default_cf = false;
   rocksdb::ColumnFamilyHandle *default_cf = nullptr;
 
+  /// the column families a prefix is hash-split over
+  struct prefix_shards {
+    uint32_t hash_l = 0;
+    uint32_t hash_h = UINT32_MAX;
+    std::vector<rocksdb::ColumnFamilyHandle *> handles;
+  };
+  /// prefix -> shards, for every prefix that lives outside the default CF
+  std::unordered_map<std::string, prefix_shards> cf_shards;
+
+  rocksdb::ColumnFamilyHandle *get_shard(const prefix_shards& shards,
+					 const char *key, size_t keylen) const;
+  static string get_cf_shard_name(const ColumnFamily& cf, uint32_t shard);
+  int apply_cf_options(const ColumnFamily& cf,
+		       rocksdb::ColumnFamilyOptions *cf_opt);
+  int read_sharding(string *def);
+  int write_sharding(const string& def);
+
   int submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Transaction t);
-  int install_cf_mergeop(const string &cf_name, rocksdb::ColumnFamilyOptions *cf_opt);
+  int install_cf_mergeop(const string &prefix, rocksdb::ColumnFamilyOptions *cf_opt);
   int create_db_dir();
   int do_open(ostream &out, bool create_if_missing, bool open_readonly,
-	      const vector<ColumnFamily>* cfs = nullptr);
+	      const vector<ColumnFamily>* cfs = nullptr,
+	      bool resharding = false);
   int load_rocksdb_options(bool create_if_missing, rocksdb::Options& opt);
 
   // manage async compactions
   ceph::mutex compact_queue_lock =
     ceph::make_mutex("RocksDBStore::compact_thread_lock");
   ceph::condition_variable compact_queue_cond;
-  list< pair<string,string> > compact_queue;
+  /// (CF prefix, start, end); an empty CF prefix is a default CF range
+  list<std::tuple<string,string,string>> compact_queue;
   bool compact_queue_stop;
   class CompactThread : public Thread {
     RocksDBStore *db;
@@ -115,6 +136,10 @@ class RocksDBStore : public KeyValueDB {
 
   void compact_range(const string& start, const string& end);
   void compact_range_async(const string& start, const string& end);
+  void compact_cf_range(const string& prefix,
+			const string& start, const string& end);
+  void queue_compact_range(const string& prefix,
+			   const string& start, const string& end);
   int tryInterpret(const string& key, const string& val, rocksdb::Options& opt);
 
 public:
@@ -137,19 +162,11 @@ public:
   static int _test_init(const string& dir);
   int init(string options_str) override;
   /// compact rocksdb for all keys with a given prefix
-  void compact_prefix(const string& prefix) override {
-    compact_range(prefix, past_prefix(prefix));
-  }
-  void compact_prefix_async(const string& prefix) override {
-    compact_range_async(prefix, past_prefix(prefix));
-  }
+  void compact_prefix(const string& prefix) override;
+  void compact_prefix_async(const string& prefix) override;
 
-  void compact_range(const string& prefix, const string& start, const string& end) override {
-    compact_range(combine_strings(prefix, start), combine_strings(prefix, end));
-  }
-  void compact_range_async(const string& prefix, const string& start, const string& end) override {
-    compact_range_async(combine_strings(prefix, start), combine_strings(prefix, end));
-  }
+  void compact_range(const string& prefix, const string& start, const string& end) override;
+  void compact_range_async(const string& prefix, const string& start, const string& end) override;
 
   RocksDBStore(CephContext *c, const string &path, map<string,string> opt, void *p) :
     cct(c),
@@ -184,12 +201,19 @@ public:
 
   void close() override;
 
-  rocksdb::ColumnFamilyHandle *get_cf_handle(const std::string& cf_name) {
-    auto iter = cf_handles.find(cf_name);
-    if (iter == cf_handles.end())
+  int reshard(const vector<ColumnFamily>& cfs, ostream &out) override;
+
+  /// CF holding prefix/key, or nullptr if the prefix is in the default CF
+  rocksdb::ColumnFamilyHandle *get_cf_handle(const std::string& prefix,
+					     const std::string& key) {
+    return get_cf_handle(prefix, key.data(), key.size());
+  }
+  rocksdb::ColumnFamilyHandle *get_cf_handle(const std::string& prefix,
+					     const char *key, size_t keylen) {
+    auto iter = cf_shards.find(prefix);
+    if (iter == cf_shards.end())
       return nullptr;
-    else
-      return static_cast<rocksdb::ColumnFamilyHandle*>(iter->second);
+    return get_shard(iter->second, key, keylen);
   }
   int repair(std::ostream &out) override;
   void split_stats(const std::string &s, char delim, std::vector<std::string> &elems);
@@ -396,6 +420,9 @@ public:
   };
 
   Iterator get_iterator(const std::string& prefix) override;
+  Iterator get_bounded_iterator(const std::string& prefix,
+				const IteratorBounds& bounds,
+				size_t readahead = 0) override;
 
   /// Utility
   static string combine_strings(const string &prefix, const string &value) {
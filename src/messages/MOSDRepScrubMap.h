@@ -23,7 +23,7 @@
 
 class MOSDRepScrubMap : public MOSDFastDispatchOp {
 public:
-  static constexpr int HEAD_VERSION = 2;
+  static constexpr int HEAD_VERSION = 3;
   static constexpr int COMPAT_VERSION = 1;
 
   spg_t pgid;            // primary spg_t
@@ -31,6 +31,10 @@ public:
   pg_shard_t from;   // whose scrubmap this is
   bufferlist scrub_map_bl;
   bool preempted = false;
+  // the chunk this map answers (v3+); older peers leave has_range unset
+  hobject_t start, end;
+  eversion_t scrub_to;
+  bool has_range = false;
 
   epoch_t get_map_epoch() const override {
     return map_epoch;
@@ -56,7 +60,11 @@ public:
   void print(ostream& out) const override {
     out << "rep_scrubmap(" << pgid << " e" << map_epoch
 	<< " from shard " << from
-	<< (preempted ? " PREEMPTED":"") << ")";
+	<< (preempted ? " PREEMPTED":"");
+    if (has_range) {
+      out << " [" << start << "," << end << ") v " << scrub_to;
+    }
+    out << ")";
   }
 
   void encode_payload(uint64_t features) override {
@@ -65,6 +73,9 @@ public:
     encode(map_epoch, payload);
     encode(from, payload);
     encode(preempted, payload);
+    encode(start, payload);
+    encode(end, payload);
+    encode(scrub_to, payload);
   }
   void decode_payload() override {
     auto p = payload.cbegin();
@@ -74,6 +85,12 @@ public:
     if (header.version >= 2) {
       decode(preempted, p);
     }
+    if (header.version >= 3) {
+      decode(start, p);
+      decode(end, p);
+      decode(scrub_to, p);
+      has_range = true;
+    }
   }
 private:
   template<class T, typename... Args>
@@ -395,6 +395,12 @@ void AsyncConnection::process() {
       SocketOptions opts;
       opts.priority = async_msgr->get_socket_priority();
       opts.connect_bind_addr = msgr->get_myaddrs().front();
+      if (async_msgr->cct->_conf->ms_tcp_zerocopy) {
+        opts.zerocopy_min_bytes =
+          async_msgr->cct->_conf->ms_tcp_zerocopy_min_bytes;
+        opts.zerocopy_keep_copied = async_msgr->cct->_conf.get_val<bool>(
+          "ms_inject_zerocopy_ignore_copied");
+      }
       ssize_t r = worker->connect(target_addr, opts, &cs);
       if (r < 0) {
         protocol->fault();
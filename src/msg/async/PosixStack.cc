@@ -19,8 +19,13 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 
 #include <algorithm>
+#include <deque>
+#include <map>
 
 #include "PosixStack.h"
 
@@ -37,15 +42,94 @@
 #undef dout_prefix
 #define dout_prefix *_dout << "PosixStack "
 
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_MSG_ZEROCOPY
+#endif
+
 class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
   NetHandler &handler;
   int _fd;
   entity_addr_t sa;
   bool connected;
 
+#ifdef HAVE_MSG_ZEROCOPY
+  // pages passed to a MSG_ZEROCOPY sendmsg stay in use by the kernel until
+  // it reports their completion on the socket error queue, so the sent
+  // buffers are held here until then (or until close() aborts the
+  // connection, see there).
+  uint64_t zc_min_bytes = 0;   ///< smallest send to do zerocopy, 0 disables
+  bool zc_keep_copied = false; ///< testing: ignore SO_EE_CODE_ZEROCOPY_COPIED
+  uint32_t zc_seq = 0;         ///< zerocopy sendmsg calls issued
+  uint32_t zc_done = 0;        ///< calls completed, in order
+  std::map<uint32_t, uint32_t> zc_done_ooo;  ///< completed out of order
+  std::deque<std::pair<uint32_t, bufferlist>> zc_pending; ///< (seq end, bl)
+
+  static bool zc_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+  }
+
+  void zerocopy_complete(uint32_t lo, uint32_t hi) {
+    if (zc_before(zc_done, lo)) {
+      zc_done_ooo[lo] = hi;
+      return;
+    }
+    if (zc_before(hi, zc_done)) {
+      return;
+    }
+    zc_done = hi + 1;
+    for (auto p = zc_done_ooo.begin();
+	 p != zc_done_ooo.end() && !zc_before(zc_done, p->first);
+	 p = zc_done_ooo.erase(p)) {
+      if (!zc_before(p->second, zc_done)) {
+	zc_done = p->second + 1;
+      }
+    }
+    while (!zc_pending.empty() && !zc_before(zc_done, zc_pending.front().first)) {
+      zc_pending.pop_front();
+    }
+  }
+
+  void reap_zerocopy() {
+    while (!zc_pending.empty()) {
+      char control[128];
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      if (::recvmsg(_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+	return;
+      }
+      for (auto cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+	auto serr = reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cm));
+	if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+	  continue;
+	}
+	if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !zc_keep_copied) {
+	  // the kernel had to copy anyway (e.g. loopback), zerocopy only
+	  // adds overhead on this socket
+	  zc_min_bytes = 0;
+	}
+	zerocopy_complete(serr->ee_info, serr->ee_data);
+      }
+    }
+  }
+#endif
+
  public:
-  explicit PosixConnectedSocketImpl(NetHandler &h, const entity_addr_t &sa, int f, bool connected)
-      : handler(h), _fd(f), sa(sa), connected(connected) {}
+  explicit PosixConnectedSocketImpl(NetHandler &h, const entity_addr_t &sa, int f, bool connected,
+				    uint64_t zerocopy_min_bytes = 0,
+				    bool zerocopy_keep_copied = false)
+      : handler(h), _fd(f), sa(sa), connected(connected) {
+#ifdef HAVE_MSG_ZEROCOPY
+    int on = 1;
+    if (zerocopy_min_bytes &&
+	::setsockopt(_fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) {
+      zc_min_bytes = zerocopy_min_bytes;
+      zc_keep_copied = zerocopy_keep_copied;
+    }
+#endif
+  }
 
   int is_connected() override {
     if (connected)
@@ -63,6 +147,10 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
   }
 
   ssize_t read(char *buf, size_t len) override {
+#ifdef HAVE_MSG_ZEROCOPY
+    // completions raise EPOLLERR, which is delivered as a read event
+    reap_zerocopy();
+#endif
     ssize_t r = ::read(_fd, buf, len);
     if (r < 0)
       r = -errno;
@@ -71,21 +159,36 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
 
   // return the sent length
   // < 0 means error occurred
-  static ssize_t do_sendmsg(int fd, struct msghdr &msg, unsigned len, bool more)
+  // if zc_seq is set, send with MSG_ZEROCOPY and count the calls made
+  static ssize_t do_sendmsg(int fd, struct msghdr &msg, unsigned len, bool more,
+			    uint32_t *zc_seq = nullptr)
   {
     size_t sent = 0;
     while (1) {
       MSGR_SIGPIPE_STOPPER;
       ssize_t r;
-      r = ::sendmsg(fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+      int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+#ifdef HAVE_MSG_ZEROCOPY
+      if (zc_seq) {
+	flags |= MSG_ZEROCOPY;
+      }
+#endif
+      r = ::sendmsg(fd, &msg, flags);
       if (r < 0) {
         if (errno == EINTR) {
           continue;
         } else if (errno == EAGAIN) {
           break;
+        } else if (errno == ENOBUFS && zc_seq) {
+          // out of optmem for completions, fall back to copying
+          zc_seq = nullptr;
+          continue;
         }
         return -errno;
       }
+      if (zc_seq) {
+        ++*zc_seq;
+      }
 
       sent += r;
       if (len == sent) break;
@@ -107,6 +210,14 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
   }
 
   ssize_t send(bufferlist &bl, bool more) override {
+    uint32_t *zc_seq_p = nullptr;
+#ifdef HAVE_MSG_ZEROCOPY
+    reap_zerocopy();
+    uint32_t zc_seq_start = zc_seq;
+    if (zc_min_bytes && bl.length() >= zc_min_bytes) {
+      zc_seq_p = &zc_seq;
+    }
+#endif
     size_t sent_bytes = 0;
     auto pb = std::cbegin(bl.buffers());
     uint64_t left_pbrs = std::size(bl.buffers());
@@ -126,7 +237,7 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
 	msglen += pb->length();
 	++pb;
       }
-      ssize_t r = do_sendmsg(_fd, msg, msglen, left_pbrs || more);
+      ssize_t r = do_sendmsg(_fd, msg, msglen, left_pbrs || more, zc_seq_p);
       if (r < 0)
         return r;
 
@@ -143,8 +254,14 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
         bl.splice(sent_bytes, bl.length()-sent_bytes, &swapped);
         bl.swap(swapped);
       } else {
-        bl.clear();
+        bl.swap(swapped);
+      }
+#ifdef HAVE_MSG_ZEROCOPY
+      if (zc_seq != zc_seq_start) {
+        // swapped now holds what was sent
+        zc_pending.emplace_back(zc_seq, std::move(swapped));
       }
+#endif
     }
 
     return static_cast<ssize_t>(sent_bytes);
@@ -153,6 +270,18 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
     ::shutdown(_fd, SHUT_RDWR);
   }
   void close() override {
+#ifdef HAVE_MSG_ZEROCOPY
+    reap_zerocopy();
+    if (!zc_pending.empty()) {
+      // the kernel may still transmit from buffers that are freed (and
+      // reused) with this socket.  Reset the connection instead of a
+      // graceful close, so that it drops what it had queued rather than
+      // putting something else on the wire.  Messages still in flight are
+      // lost, as with any connection fault.
+      struct linger l = {1, 0};
+      ::setsockopt(_fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    }
+#endif
     ::close(_fd);
   }
   int fd() const override {
@@ -208,7 +337,9 @@ int PosixServerSocketImpl::accept(ConnectedSocket *sock, const SocketOptions &op
   out->set_sockaddr((sockaddr*)&ss);
   handler.set_priority(sd, opt.priority, out->get_family());
 
-  std::unique_ptr<PosixConnectedSocketImpl> csi(new PosixConnectedSocketImpl(handler, *out, sd, true));
+  std::unique_ptr<PosixConnectedSocketImpl> csi(new PosixConnectedSocketImpl(
+    handler, *out, sd, true, opt.zerocopy_min_bytes,
+    opt.zerocopy_keep_copied));
   *sock = ConnectedSocket(std::move(csi));
   return 0;
 }
@@ -277,7 +408,9 @@ int PosixWorker::connect(const entity_addr_t &addr, const SocketOptions &opts, C
 
   net.set_priority(sd, opts.priority, addr.get_family());
   *socket = ConnectedSocket(
-      std::unique_ptr<PosixConnectedSocketImpl>(new PosixConnectedSocketImpl(net, addr, sd, !opts.nonblock)));
+      std::unique_ptr<PosixConnectedSocketImpl>(new PosixConnectedSocketImpl(
+        net, addr, sd, !opts.nonblock, opts.zerocopy_min_bytes,
+        opts.zerocopy_keep_copied)));
   return 0;
 }
 
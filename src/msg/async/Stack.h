@@ -40,6 +40,8 @@ struct SocketOptions {
   bool nodelay = true;
   int rcbuf_size = 0;
   int priority = -1;
+  uint64_t zerocopy_min_bytes = 0;  ///< use MSG_ZEROCOPY for larger sends
+  bool zerocopy_keep_copied = false; ///< ms_inject_zerocopy_ignore_copied
   entity_addr_t connect_bind_addr;
 };
 
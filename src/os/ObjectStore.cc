@@ -115,3 +115,40 @@ int ObjectStore::read_meta(const std::string& key,
   *value = string(buf, r);
   return 0;
 }
+
+int ObjectStore::omap_get_batch(
+  CollectionHandle &c,
+  const ghobject_t &oid,
+  const std::string &start_after,
+  const std::string &filter_prefix,
+  uint64_t max_entries,
+  uint64_t max_bytes,
+  std::map<std::string, ceph::buffer::list> *out,
+  bool *more)
+{
+  ObjectMap::ObjectMapIterator iter = get_omap_iterator(c, oid);
+  if (!iter) {
+    return -ENOENT;
+  }
+  *more = false;
+  uint64_t num = 0, bytes = 0;
+  iter->upper_bound(start_after);
+  if (filter_prefix > start_after) {
+    iter->lower_bound(filter_prefix);
+  }
+  for (; iter->valid(); iter->next()) {
+    std::string key = iter->key();
+    if (key.compare(0, filter_prefix.size(), filter_prefix) != 0) {
+      break;
+    }
+    if (num >= max_entries || bytes >= max_bytes) {
+      *more = true;
+      break;
+    }
+    ceph::buffer::list value = iter->value();
+    ++num;
+    bytes += key.size() + value.length();
+    out->emplace_hint(out->end(), std::move(key), std::move(value));
+  }
+  return 0;
+}
@@ -383,6 +383,22 @@ public:
    */
   virtual int get_ideal_list_max() { return 64; }
 
+  /**
+   * can remove_collection() be applied to a non-empty collection?
+   *
+   * If true, the implementation removes the remaining objects in the
+   * background after the transaction that removed the collection commits,
+   * so the caller does not need to queue a remove for every object.
+   */
+  virtual bool can_remove_nonempty_collection() { return false; }
+
+  /**
+   * get collections whose contents are still being removed in the background
+   *
+   * @param removals [out] collection -> objects removed so far
+   */
+  virtual void get_collection_removals(std::map<coll_t,uint64_t> *removals) {}
+
 
   /**
    * get a collection handle
@@ -714,6 +730,29 @@ public:
     std::set<std::string> *out         ///< [out] Subset of keys defined on oid
     ) = 0;
 
+  /**
+   * Get a batch of consecutive key/value pairs
+   *
+   * Returns the keys after start_after that begin with filter_prefix, in
+   * order, stopping once max_entries pairs or max_bytes of keys and values
+   * have been returned.  Unlike stepping an iterator, the whole batch is
+   * read in one call, so a backend can do it under a single lock and with
+   * one bounded, read-ahead scan.
+   *
+   * @param more [out] true if there are more matching keys past the batch
+   * @returns 0 on success, negative error code on failure.
+   */
+  virtual int omap_get_batch(
+    CollectionHandle &c,                 ///< [in] Collection containing oid
+    const ghobject_t &oid,               ///< [in] Object containing omap
+    const std::string &start_after,      ///< [in] Return keys after this
+    const std::string &filter_prefix,    ///< [in] Only keys with this prefix
+    uint64_t max_entries,                ///< [in] Max pairs to return
+    uint64_t max_bytes,                  ///< [in] Max bytes to return
+    std::map<std::string, ceph::buffer::list> *out, ///< [out] Keys and values
+    bool *more                           ///< [out] Batch was truncated
+    );
+
   /**
    * Returns an object map iterator
    *
@@ -97,13 +97,46 @@ void AvlAllocator::_add_to_tree(uint64_t start, uint64_t size)
     rs_after->start = start;
     range_size_tree.insert(*rs_after);
   } else {
-    auto new_rs = new range_seg_t{start, end};
-    range_tree.insert_before(rs_after, *new_rs);
-    range_size_tree.insert(*new_rs);
+    _try_insert_range(start, end, &rs_after);
+    return;
   }
   num_free += size;
 }
 
+void AvlAllocator::_try_insert_range(uint64_t start,
+                                     uint64_t end,
+                                     range_tree_t::iterator* insert_pos)
+{
+  bool remove_lowest = false;
+  if (range_count_cap && range_size_tree.size() >= range_count_cap) {
+    if (end - start <= _lowest_size_available()) {
+      _spillover_range(start, end);
+      return;
+    }
+    remove_lowest = true;
+  }
+  // NB: insertion has to precede the removal below since the latter
+  // might dispose the entry insert_pos refers to.
+  auto new_rs = new range_seg_t{start, end};
+  if (insert_pos) {
+    range_tree.insert_before(*insert_pos, *new_rs);
+  } else {
+    range_tree.insert(*new_rs);
+  }
+  range_size_tree.insert(*new_rs);
+  num_free += end - start;
+
+  if (remove_lowest) {
+    auto& lowest = *range_size_tree.begin();
+    auto lowest_start = lowest.start;
+    auto lowest_end = lowest.end;
+    range_size_tree.erase(range_size_tree.begin());
+    range_tree.erase_and_dispose(range_tree.iterator_to(lowest), dispose_rs{});
+    num_free -= lowest_end - lowest_start;
+    _spillover_range(lowest_start, lowest_end);
+  }
+}
+
 void AvlAllocator::_remove_from_tree(uint64_t start, uint64_t size)
 {
   uint64_t end = start + size;
@@ -123,11 +156,13 @@ void AvlAllocator::_remove_from_tree(uint64_t start, uint64_t size)
   range_size_tree.erase(*rs);
 
   if (left_over && right_over) {
-    auto new_seg = new range_seg_t{end, rs->end};
+    auto old_right_end = rs->end;
+    auto insert_pos = std::next(rs);
     rs->end = start;
-    range_tree.insert(rs, *new_seg);
-    range_size_tree.insert(*new_seg);
     range_size_tree.insert(*rs);
+    // the right part is re-added (and accounted) by _try_insert_range
+    num_free -= old_right_end - end;
+    _try_insert_range(end, old_right_end, &insert_pos);
   } else if (left_over) {
     rs->end = start;
     range_size_tree.insert(*rs);
@@ -141,13 +176,41 @@ void AvlAllocator::_remove_from_tree(uint64_t start, uint64_t size)
   num_free -= size;
 }
 
+void AvlAllocator::_try_remove_from_tree(uint64_t start, uint64_t size,
+  std::function<void(uint64_t, uint64_t, bool)> cb)
+{
+  uint64_t end = start + size;
+
+  assert(size != 0);
+
+  auto rs = range_tree.lower_bound(range_t{start, end},
+                                   range_tree.key_comp());
+  while (start < end) {
+    if (rs == range_tree.end() || rs->start >= end) {
+      cb(start, end - start, false);
+      return;
+    }
+    if (start < rs->start) {
+      cb(start, rs->start - start, false);
+      start = rs->start;
+    }
+    // NB: advance the iterator prior to the removal, which might dispose
+    // the current entry. Splitting (and hence spilling) may only happen
+    // when the last sub-range is being removed so rs isn't used after that.
+    auto range_end = std::min(rs->end, end);
+    ++rs;
+    _remove_from_tree(start, range_end - start);
+    cb(start, range_end - start, true);
+    start = range_end;
+  }
+}
+
 int AvlAllocator::_allocate(
   uint64_t size,
   uint64_t unit,
   uint64_t *offset,
   uint64_t *length)
 {
-  std::lock_guard l(lock);
   uint64_t max_size = 0;
   if (auto p = range_size_tree.rbegin(); p != range_size_tree.rend()) {
     max_size = p->end - p->start;
@@ -212,11 +275,26 @@ AvlAllocator::AvlAllocator(CephContext* cct,
   cct(cct)
 {}
 
+AvlAllocator::AvlAllocator(CephContext* cct,
+			   int64_t device_size,
+			   int64_t block_size,
+			   uint64_t max_mem,
+			   const std::string& name) :
+  AvlAllocator(cct, device_size, block_size, name)
+{
+  range_count_cap = max_mem / sizeof(range_seg_t);
+}
+
+AvlAllocator::~AvlAllocator()
+{
+  shutdown();
+}
+
 int64_t AvlAllocator::allocate(
   uint64_t want,
   uint64_t unit,
   uint64_t max_alloc_size,
-  int64_t  hint, // unused, for now!
+  int64_t  hint,
   PExtentVector* extents)
 {
   ldout(cct, 10) << __func__ << std::hex
@@ -228,6 +306,17 @@ int64_t AvlAllocator::allocate(
   assert(isp2(unit));
   assert(want % unit == 0);
 
+  std::lock_guard l(lock);
+  return _allocate(want, unit, max_alloc_size, hint, extents);
+}
+
+int64_t AvlAllocator::_allocate(
+  uint64_t want,
+  uint64_t unit,
+  uint64_t max_alloc_size,
+  int64_t  hint,
+  PExtentVector* extents)
+{
   if (max_alloc_size == 0) {
     max_alloc_size = want;
   }
@@ -237,6 +326,23 @@ int64_t AvlAllocator::allocate(
   }
 
   uint64_t allocated = 0;
+  if (hint > 0 && hint % unit == 0) {
+    // start exactly at the hint if it is free, so that the caller can
+    // extend a previous allocation
+    uint64_t start = hint;
+    auto rs = range_tree.find(range_t{start, start + unit},
+			      range_tree.key_comp());
+    if (rs != range_tree.end() && rs->start <= start &&
+	rs->end >= start + unit) {
+      uint64_t length = p2align(std::min({rs->end - start, want,
+					  max_alloc_size}), unit);
+      if (length) {
+	_remove_from_tree(start, length);
+	extents->emplace_back(start, length);
+	allocated += length;
+      }
+    }
+  }
   while (allocated < want) {
     uint64_t offset, length;
     int r = _allocate(std::min(max_alloc_size, want - allocated),
@@ -254,6 +360,11 @@ int64_t AvlAllocator::allocate(
 void AvlAllocator::release(const interval_set<uint64_t>& release_set)
 {
   std::lock_guard l(lock);
+  _release(release_set);
+}
+
+void AvlAllocator::_release(const interval_set<uint64_t>& release_set)
+{
   for (auto p = release_set.begin(); p != release_set.end(); ++p) {
     const auto offset = p.get_start();
     const auto length = p.get_len();
@@ -274,6 +385,11 @@ uint64_t AvlAllocator::get_free()
 double AvlAllocator::get_fragmentation()
 {
   std::lock_guard l(lock);
+  return _get_fragmentation();
+}
+
+double AvlAllocator::_get_fragmentation() const
+{
   auto free_blocks = p2align(num_free, block_size) / block_size;
   if (free_blocks <= 1) {
     return .0;
@@ -284,6 +400,11 @@ double AvlAllocator::get_fragmentation()
 void AvlAllocator::dump()
 {
   std::lock_guard l(lock);
+  _dump();
+}
+
+void AvlAllocator::_dump() const
+{
   ldout(cct, 0) << __func__ << " range_tree: " << dendl;
   for (auto& rs : range_tree) {
     ldout(cct, 0) << std::hex
@@ -331,6 +452,11 @@ void AvlAllocator::init_rm_free(uint64_t offset, uint64_t length)
 void AvlAllocator::shutdown()
 {
   std::lock_guard l(lock);
+  _shutdown();
+}
+
+void AvlAllocator::_shutdown()
+{
   range_size_tree.clear();
   range_tree.clear_and_dispose(dispose_rs{});
 }
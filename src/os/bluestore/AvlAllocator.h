@@ -46,32 +46,41 @@ struct range_seg_t {
   boost::intrusive::avl_set_member_hook<> size_hook;
 };
 
-class AvlAllocator final : public Allocator {
+class AvlAllocator : public Allocator {
+protected:
+  /*
+  * ctor intended for the usage from descendant class(es) which
+  * provides handling for spilled over entries
+  * (when entry count >= max_entries)
+  */
+  AvlAllocator(CephContext* cct, int64_t device_size, int64_t block_size,
+    uint64_t max_mem,
+    const std::string& name);
+
 public:
   AvlAllocator(CephContext* cct, int64_t device_size, int64_t block_size,
 	       const std::string& name);
+  ~AvlAllocator();
   int64_t allocate(
     uint64_t want,
     uint64_t unit,
     uint64_t max_alloc_size,
     int64_t  hint,
-    PExtentVector *extents) final;
-  void release(const interval_set<uint64_t>& release_set) final;
-  uint64_t get_free() final;
-  double get_fragmentation() final;
+    PExtentVector *extents) override;
+  void release(const interval_set<uint64_t>& release_set) override;
+  uint64_t get_free() override;
+  double get_fragmentation() override;
 
-  void dump() final;
-  void dump(std::function<void(uint64_t offset, uint64_t length)> notify) final;
-  void init_add_free(uint64_t offset, uint64_t length) final;
-  void init_rm_free(uint64_t offset, uint64_t length) final;
-  void shutdown() final;
+  void dump() override;
+  void dump(std::function<void(uint64_t offset, uint64_t length)> notify) override;
+  void init_add_free(uint64_t offset, uint64_t length) override;
+  void init_rm_free(uint64_t offset, uint64_t length) override;
+  void shutdown() override;
 
 private:
   template<class Tree>
   uint64_t _block_picker(const Tree& t, uint64_t *cursor, uint64_t size,
     uint64_t align);
-  void _add_to_tree(uint64_t start, uint64_t size);
-  void _remove_from_tree(uint64_t start, uint64_t size);
   int _allocate(
     uint64_t size,
     uint64_t unit,
@@ -131,6 +140,69 @@ private:
    */
   int range_size_alloc_free_pct = 0;
 
+  /*
+   * Max amount of range entries allowed. 0 - unlimited
+   */
+  uint64_t range_count_cap = 0;
+
+  /*
+   * Inserts a new range into both trees unless range_count_cap is reached.
+   * In the latter case either the new range or the shortest existing one
+   * (whichever is smaller) is handed to _spillover_range().
+   */
+  void _try_insert_range(uint64_t start,
+                         uint64_t end,
+                         range_tree_t::iterator* insert_pos);
+
+protected:
   CephContext* cct;
   std::mutex lock;
+
+  CephContext* get_context() {
+    return cct;
+  }
+  uint64_t get_capacity() const {
+    return num_total;
+  }
+  uint64_t get_block_size() const {
+    return block_size;
+  }
+  uint64_t _lowest_size_available() const {
+    auto rs = range_size_tree.begin();
+    return rs != range_size_tree.end() ? rs->end - rs->start : 0;
+  }
+  uint64_t _get_free() const {
+    return num_free;
+  }
+  double _get_fragmentation() const;
+
+  int64_t _allocate(
+    uint64_t want,
+    uint64_t unit,
+    uint64_t max_alloc_size,
+    int64_t  hint,
+    PExtentVector *extents);
+  void _release(const interval_set<uint64_t>& release_set);
+  void _add_to_tree(uint64_t start, uint64_t size);
+  void _remove_from_tree(uint64_t start, uint64_t size);
+  /*
+   * Removes [start, start + size) from the trees, tolerating portions
+   * which aren't tracked here. cb is called for every sub-range with
+   * found = true if it has been removed and found = false if it
+   * is absent from the trees.
+   */
+  void _try_remove_from_tree(uint64_t start, uint64_t size,
+    std::function<void(uint64_t offset, uint64_t length, bool found)> cb);
+  void _dump() const;
+  void _shutdown();
+
+  /*
+   * Called when a free range doesn't fit into range_count_cap,
+   * descendants are supposed to keep track of it on their own.
+   */
+  virtual void _spillover_range(uint64_t start, uint64_t end) {
+    // this should be overriden when range count cap is present,
+    // i.e. (range_count_cap > 0)
+    ceph_assert(false);
+  }
 };
@@ -67,6 +67,9 @@ uint64_t IOContext::get_num_ios() const
   for (auto& p : pending_aios) {
     ios += p.iov.size();
   }
+  for (auto& p : fast_pending_aios) {
+    ios += p.iov.size();
+  }
 #endif
 #ifdef HAVE_SPDK
   ios += total_nseg;
@@ -84,6 +84,7 @@ public:
 #if defined(HAVE_LIBAIO) || defined(HAVE_POSIXAIO)
   std::list<aio_t> pending_aios;    ///< not yet submitted
   std::list<aio_t> running_aios;    ///< submitting or submitted
+  std::list<aio_t> fast_pending_aios; ///< not yet submitted, TieredDevice
 #endif
   std::atomic_int num_pending = {0};
   std::atomic_int num_running = {0};
@@ -98,14 +98,26 @@ private:
 	if (bluefs->bdev[dev]) {
 	  f->open_object_section("dev");
 	  f->dump_string("device", bluefs->get_device_name(dev));
-	  ceph_assert(bluefs->alloc[dev]);
-	  f->dump_int("free", bluefs->alloc[dev]->get_free());
+	  f->dump_int("free", bluefs->get_free(dev));
 	  f->close_section();
 	}
       }
-      size_t extra_space = 0;
-      if (bluefs->slow_dev_expander) {
-	extra_space = bluefs->slow_dev_expander->available_freespace(alloc_size);
+      uint64_t extra_space = 0;
+      if (bluefs->shared_alloc && bluefs->shared_alloc->a) {
+	auto iterated_allocation = [&](uint64_t off, uint64_t len) {
+	  // only count in size that is alloc_size aligned
+	  uint64_t dist_to_alignment;
+	  uint64_t offset_in_block = off & (alloc_size - 1);
+	  if (offset_in_block == 0)
+	    dist_to_alignment = 0;
+	  else
+	    dist_to_alignment = alloc_size - offset_in_block;
+	  if (dist_to_alignment >= len)
+	    return;
+	  len -= dist_to_alignment;
+	  extra_space += p2align(len, (uint64_t)alloc_size);
+	};
+	bluefs->shared_alloc->a->dump(iterated_allocation);
       }
       f->dump_int("available_from_bluestore", extra_space);
       f->close_section();
@@ -156,8 +168,6 @@ void BlueFS::_init_logger()
                         l_bluefs_first, l_bluefs_last);
   b.add_u64_counter(l_bluefs_gift_bytes, "gift_bytes",
 		    "Bytes gifted from BlueStore", NULL, 0, unit_t(UNIT_BYTES));
-  b.add_u64_counter(l_bluefs_reclaim_bytes, "reclaim_bytes",
-		    "Bytes reclaimed by BlueStore", NULL, 0, unit_t(UNIT_BYTES));
   b.add_u64(l_bluefs_db_total_bytes, "db_total_bytes",
 	    "Total bytes (main db device)",
 	    "b", PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
@@ -233,6 +243,16 @@ void BlueFS::_init_logger()
 		    "Bytes requested in prefetch read mode", NULL,
 		    PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
 
+  b.add_u64_counter(l_bluefs_wal_ring_bytes, "wal_ring_bytes",
+		    "Bytes preallocated for WAL files when opened", NULL,
+		    PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluefs_wal_fsync_nometa, "wal_fsync_nometa",
+		    "WAL fsyncs that only flushed the device",
+		    "wfsn", PerfCountersBuilder::PRIO_INTERESTING);
+  b.add_u64_counter(l_bluefs_wal_fsync_meta, "wal_fsync_meta",
+		    "WAL fsyncs that also had to sync the BlueFS log",
+		    "wfsm", PerfCountersBuilder::PRIO_INTERESTING);
+
   logger = b.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
 }
@@ -250,31 +270,28 @@ void BlueFS::_update_logger_stats()
   logger->set(l_bluefs_log_bytes, log_writer->file->fnode.size);
 
   if (alloc[BDEV_WAL]) {
-    logger->set(l_bluefs_wal_total_bytes, block_all[BDEV_WAL].size());
-    logger->set(l_bluefs_wal_used_bytes,
-		block_all[BDEV_WAL].size() - alloc[BDEV_WAL]->get_free());
+    logger->set(l_bluefs_wal_total_bytes, _get_total(BDEV_WAL));
+    logger->set(l_bluefs_wal_used_bytes, _get_used(BDEV_WAL));
   }
   if (alloc[BDEV_DB]) {
-    logger->set(l_bluefs_db_total_bytes, block_all[BDEV_DB].size());
-    logger->set(l_bluefs_db_used_bytes,
-		block_all[BDEV_DB].size() - alloc[BDEV_DB]->get_free());
+    logger->set(l_bluefs_db_total_bytes, _get_total(BDEV_DB));
+    logger->set(l_bluefs_db_used_bytes, _get_used(BDEV_DB));
   }
   if (alloc[BDEV_SLOW]) {
-    logger->set(l_bluefs_slow_total_bytes, block_all[BDEV_SLOW].size());
-    logger->set(l_bluefs_slow_used_bytes,
-		block_all[BDEV_SLOW].size() - alloc[BDEV_SLOW]->get_free());
+    logger->set(l_bluefs_slow_total_bytes, _get_total(BDEV_SLOW));
+    logger->set(l_bluefs_slow_used_bytes, _get_used(BDEV_SLOW));
   }
 }
 
 int BlueFS::add_block_device(unsigned id, const string& path, bool trim,
-			     bool shared_with_bluestore)
+			     bluefs_shared_alloc_context_t* _shared_alloc)
 {
   dout(10) << __func__ << " bdev " << id << " path " << path << dendl;
   ceph_assert(id < bdev.size());
   ceph_assert(bdev[id] == NULL);
   BlockDevice *b = BlockDevice::create(cct, path, NULL, NULL,
 				       discard_cb[id], static_cast<void*>(this));
-  if (shared_with_bluestore) {
+  if (_shared_alloc) {
     b->set_no_exclusive_lock();
   }
   int r = b->open(path);
@@ -290,6 +307,11 @@ int BlueFS::add_block_device(unsigned id, const string& path, bool trim,
 	  << " size " << byte_u_t(b->get_size()) << dendl;
   bdev[id] = b;
   ioc[id] = new IOContext(cct, NULL);
+  if (_shared_alloc) {
+    ceph_assert(!shared_alloc);
+    shared_alloc = _shared_alloc;
+    shared_alloc_id = id;
+  }
   return 0;
 }
 
@@ -315,6 +337,7 @@ void BlueFS::_add_block_extent(unsigned id, uint64_t offset, uint64_t length)
 
   ceph_assert(id < bdev.size());
   ceph_assert(bdev[id]);
+  ceph_assert(!is_shared_alloc(id));
   ceph_assert(bdev[id]->get_size() >= offset + length);
   block_all[id].insert(offset, length);
 
@@ -328,44 +351,39 @@ void BlueFS::_add_block_extent(unsigned id, uint64_t offset, uint64_t length)
   dout(10) << __func__ << " done" << dendl;
 }
 
-int BlueFS::reclaim_blocks(unsigned id, uint64_t want,
-			   PExtentVector *extents)
+void BlueFS::handle_discard(unsigned id, interval_set<uint64_t>& to_release)
 {
-  std::unique_lock l(lock);
-  dout(1) << __func__ << " bdev " << id
-          << " want 0x" << std::hex << want << std::dec << dendl;
-  ceph_assert(id < alloc.size());
+  dout(10) << __func__ << " bdev " << id << dendl;
   ceph_assert(alloc[id]);
+  alloc[id]->release(to_release);
+}
 
-  int64_t got = alloc[id]->allocate(want, alloc_size[id], 0, extents);
-  ceph_assert(got != 0);
-  if (got < 0) {
-    derr << __func__ << " failed to allocate space to return to bluestore"
-      << dendl;
-    alloc[id]->dump();
-    return got;
+uint64_t BlueFS::_get_used(unsigned id) const
+{
+  if (is_shared_alloc(id)) {
+    return shared_alloc->bluefs_used;
   }
-
-  for (auto& p : *extents) {
-    block_all[id].erase(p.offset, p.length);
-    log_t.op_alloc_rm(id, p.offset, p.length);
+  if (!alloc[id]) {
+    return 0;
   }
+  return block_all[id].size() - alloc[id]->get_free();
+}
 
-  flush_bdev();
-  int r = _flush_and_sync_log(l);
-  ceph_assert(r == 0);
-
-  logger->inc(l_bluefs_reclaim_bytes, got);
-  dout(1) << __func__ << " bdev " << id << " want 0x" << std::hex << want
-	  << " got " << *extents << dendl;
-  return 0;
+uint64_t BlueFS::_get_total(unsigned id) const
+{
+  if (is_shared_alloc(id)) {
+    // everything we use plus whatever BlueStore has free is at our disposal
+    return shared_alloc->bluefs_used + _get_free(id);
+  }
+  return block_all[id].size();
 }
 
-void BlueFS::handle_discard(unsigned id, interval_set<uint64_t>& to_release)
+uint64_t BlueFS::_get_free(unsigned id) const
 {
-  dout(10) << __func__ << " bdev " << id << dendl;
-  ceph_assert(alloc[id]);
-  alloc[id]->release(to_release);
+  if (!alloc[id]) {
+    return 0;
+  }
+  return alloc[id]->get_free();
 }
 
 uint64_t BlueFS::get_used()
@@ -373,25 +391,30 @@ uint64_t BlueFS::get_used()
   std::lock_guard l(lock);
   uint64_t used = 0;
   for (unsigned id = 0; id < MAX_BDEV; ++id) {
-    if (alloc[id]) {
-      used += block_all[id].size() - alloc[id]->get_free();
-    }
+    used += _get_used(id);
   }
   return used;
 }
 
+uint64_t BlueFS::get_used(unsigned id)
+{
+  std::lock_guard l(lock);
+  ceph_assert(id < alloc.size());
+  return _get_used(id);
+}
+
 uint64_t BlueFS::get_total(unsigned id)
 {
   std::lock_guard l(lock);
   ceph_assert(id < block_all.size());
-  return block_all[id].size();
+  return _get_total(id);
 }
 
 uint64_t BlueFS::get_free(unsigned id)
 {
   std::lock_guard l(lock);
   ceph_assert(id < alloc.size());
-  return alloc[id]->get_free();
+  return _get_free(id);
 }
 
 void BlueFS::dump_perf_counters(Formatter *f)
@@ -408,13 +431,16 @@ void BlueFS::dump_block_extents(ostream& out)
       continue;
     }
     auto owned = get_total(i);
-    auto free = get_free(i);
+    auto used = get_used(i);
     out << i << " : device size 0x" << std::hex << bdev[i]->get_size()
         << " : own 0x" << block_all[i]
         << " = 0x" << owned
-        << " : using 0x" << owned - free
-	<< std::dec << "(" << byte_u_t(owned - free) << ")"
-        << "\n";
+        << " : using 0x" << used
+	<< std::dec << "(" << byte_u_t(used) << ")";
+    if (is_shared_alloc(i)) {
+      out << " : bluestore has " << byte_u_t(get_free(i)) << " available";
+    }
+    out << "\n";
   }
 }
 
@@ -427,10 +453,11 @@ void BlueFS::get_usage(vector<pair<uint64_t,uint64_t>> *usage)
       (*usage)[id] = make_pair(0, 0);
       continue;
     }
-    (*usage)[id].first = alloc[id]->get_free();
-    (*usage)[id].second = block_all[id].size();
+    (*usage)[id].first = _get_free(id);
+    (*usage)[id].second = _get_total(id);
     uint64_t used =
-      (block_all[id].size() - (*usage)[id].first) * 100 / block_all[id].size();
+      (*usage)[id].second ?
+        _get_used(id) * 100 / (*usage)[id].second : 0;
     dout(10) << __func__ << " bdev " << id
 	     << " free " << (*usage)[id].first
 	     << " (" << byte_u_t((*usage)[id].first) << ")"
@@ -445,8 +472,50 @@ int BlueFS::get_block_extents(unsigned id, interval_set<uint64_t> *extents)
 {
   std::lock_guard l(lock);
   dout(10) << __func__ << " bdev " << id << dendl;
+  return _get_block_extents(id, extents);
+}
+
+int BlueFS::freeze_block_extents(unsigned id, interval_set<uint64_t> *extents,
+				 std::function<void()> f)
+{
+  std::unique_lock l(lock);
+  dout(10) << __func__ << " bdev " << id << dendl;
+  // a log flush hands its releases back after dropping the lock
+  while (log_flushing) {
+    log_cond.wait(l);
+  }
+  // so do async discards
+  if (id < bdev.size() && bdev[id]) {
+    bdev[id]->discard_drain();
+  }
+  int r = _get_block_extents(id, extents);
+  if (r < 0) {
+    return r;
+  }
+  if (is_shared_alloc(id)) {
+    // unlinked, but not released until the log is synced
+    extents->union_of(pending_release[id]);
+  }
+  f();
+  return 0;
+}
+
+int BlueFS::_get_block_extents(unsigned id, interval_set<uint64_t> *extents)
+{
   if (id >= block_all.size())
     return -EINVAL;
+  if (is_shared_alloc(id)) {
+    // we don't own any space on the shared device, report what is in use
+    extents->clear();
+    for (auto& p : file_map) {
+      for (auto& q : p.second->fnode.extents) {
+	if (q.bdev == id) {
+	  extents->insert(q.offset, q.length);
+	}
+      }
+    }
+    return 0;
+  }
   *extents = block_all[id];
   return 0;
 }
@@ -558,6 +627,15 @@ void BlueFS::_init_alloc()
     else
       name += to_string(uintptr_t(this));
     ceph_assert(alloc_size[id]);
+    if (is_shared_alloc(id)) {
+      // may be null when opened read-only before BlueStore's allocator
+      // is up; no allocations are possible on the shared device then
+      dout(1) << __func__ << " shared, id " << id
+	       << " alloc_size 0x" << std::hex << alloc_size[id]
+	       << " size 0x" << bdev[id]->get_size() << std::dec << dendl;
+      alloc[id] = shared_alloc->a;
+      continue;
+    }
     dout(1) << __func__ << " id " << id
 	     << " alloc_size 0x" << std::hex << alloc_size[id]
 	     << " size 0x" << bdev[id]->get_size() << std::dec << dendl;
@@ -579,10 +657,10 @@ void BlueFS::_stop_alloc()
       p->discard_drain();
   }
 
-  for (auto p : alloc) {
-    if (p != nullptr)  {
-      p->shutdown();
-      delete p;
+  for (size_t i = 0; i < alloc.size(); ++i) {
+    if (alloc[i] != nullptr && !is_shared_alloc(i)) {
+      alloc[i]->shutdown();
+      delete alloc[i];
     }
   }
   alloc.clear();
@@ -619,11 +697,19 @@ int BlueFS::mount()
     goto out;
   }
 
-  // init freelist
+  // init freelist; BlueStore takes care of the shared device itself,
+  // we only account our usage there
+  if (shared_alloc) {
+    shared_alloc->bluefs_used = 0;
+  }
   for (auto& p : file_map) {
     dout(30) << __func__ << " noting alloc for " << p.second->fnode << dendl;
     for (auto& q : p.second->fnode.extents) {
-      alloc[q.bdev]->init_rm_free(q.offset, q.length);
+      if (is_shared_alloc(q.bdev)) {
+	shared_alloc->bluefs_used += q.length;
+      } else {
+	alloc[q.bdev]->init_rm_free(q.offset, q.length);
+      }
     }
   }
 
@@ -871,6 +957,10 @@ int BlueFS::_replay(bool noop, bool to_stdout)
       if (alloc_size[i] != 0 && bdev[i] != nullptr) {
         used_blocks[i].resize(round_up_to(bdev[i]->get_size(), alloc_size[i]) / alloc_size[i]);
         owned_blocks[i].resize(round_up_to(bdev[i]->get_size(), alloc_size[i]) / alloc_size[i]);
+        if (is_shared_alloc(i)) {
+          // any block of the shared device might be handed to us
+          owned_blocks[i].set();
+        }
       }
     }
   }
@@ -1052,7 +1142,12 @@ int BlueFS::_replay(bool noop, bool to_stdout)
                       << std::endl;
           }
 
-	  if (!noop) {
+	  if (!noop && is_shared_alloc(id)) {
+	    // legacy record from the times when BlueStore gifted space to
+	    // us; the shared device is not owned by BlueFS anymore
+	    dout(20) << __func__ << " ignoring op_alloc_add for shared bdev "
+		     << (int)id << dendl;
+	  } else if (!noop) {
 	    block_all[id].insert(offset, length);
 	    alloc[id]->init_add_free(offset, length);
 
@@ -1109,7 +1204,10 @@ int BlueFS::_replay(bool noop, bool to_stdout)
                       << std::endl;
           }
 
-	  if (!noop) {
+	  if (!noop && is_shared_alloc(id)) {
+	    dout(20) << __func__ << " ignoring op_alloc_rm for shared bdev "
+		     << (int)id << dendl;
+	  } else if (!noop) {
 	    block_all[id].erase(offset, length);
 	    alloc[id]->init_rm_free(offset, length);
             if (cct->_conf->bluefs_log_replay_check_allocations) {
@@ -1515,6 +1613,9 @@ int BlueFS::device_migrate_to_existing(
       for (auto old_ext : fnode_extents) {
 	PExtentVector to_release;
 	to_release.emplace_back(old_ext.offset, old_ext.length);
+	if (is_shared_alloc(old_ext.bdev)) {
+	  shared_alloc->bluefs_used -= old_ext.length;
+	}
 	alloc[old_ext.bdev]->release(to_release);
       }
 
@@ -1653,6 +1754,9 @@ int BlueFS::device_migrate_to_new(
       for (auto old_ext : fnode_extents) {
 	PExtentVector to_release;
 	to_release.emplace_back(old_ext.offset, old_ext.length);
+	if (is_shared_alloc(old_ext.bdev)) {
+	  shared_alloc->bluefs_used -= old_ext.length;
+	}
 	alloc[old_ext.bdev]->release(to_release);
       }
 
@@ -2498,6 +2602,9 @@ int BlueFS::_flush_and_sync_log(std::unique_lock<ceph::mutex>& l,
   for (unsigned i = 0; i < to_release.size(); ++i) {
     if (!to_release[i].empty()) {
       /* OK, now we have the guarantee alloc[i] won't be null. */
+      if (is_shared_alloc(i)) {
+	shared_alloc->bluefs_used -= to_release[i].size();
+      }
       int r = 0;
       if (cct->_conf->bdev_enable_discard && cct->_conf->bdev_async_discard) {
 	r = bdev[i]->queue_discard(to_release[i]);
@@ -2837,6 +2944,10 @@ int BlueFS::_fsync(FileWriter *h, std::unique_lock<ceph::mutex>& l)
     ceph_assert(h->file->dirty_seq == 0 ||  // cleaned
 	   h->file->dirty_seq > s);    // or redirtied by someone else
   }
+  if (logger && h->writer_type == WRITER_WAL) {
+    logger->inc(old_dirty_seq ? l_bluefs_wal_fsync_meta :
+		l_bluefs_wal_fsync_nometa);
+  }
   return 0;
 }
 
@@ -2889,27 +3000,6 @@ const char* BlueFS::get_device_name(unsigned id)
   return names[id];
 }
 
-int BlueFS::_expand_slow_device(uint64_t need, PExtentVector& extents)
-{
-  int r = -ENOSPC;
-  if (slow_dev_expander) {
-    int id = _get_slow_device_id();
-    auto min_alloc_size = alloc_size[id];
-    ceph_assert(id <= (int)alloc.size() && alloc[id]);
-    auto min_need = round_up_to(need, min_alloc_size);
-    need = std::max(need,
-      slow_dev_expander->get_recommended_expansion_delta(
-        alloc[id]->get_free(), block_all[id].size()));
-
-    need = round_up_to(need, min_alloc_size);
-    dout(10) << __func__ << " expanding slow device by 0x"
-             << std::hex << need << std::dec
-	     << dendl;
-    r = slow_dev_expander->allocate_freespace(min_need, need, extents);
-  }
-  return r;
-}
-
 int BlueFS::_allocate_without_fallback(uint8_t id, uint64_t len,
 		      PExtentVector* extents)
 {
@@ -2938,6 +3028,9 @@ int BlueFS::_allocate_without_fallback(uint8_t id, uint64_t len,
       alloc[id]->dump();
     return -ENOSPC;
   }
+  if (is_shared_alloc(id)) {
+    shared_alloc->bluefs_used += alloc_len;
+  }
 
   return 0;
 }
@@ -2969,47 +3062,24 @@ int BlueFS::_allocate(uint8_t id, uint64_t len,
       if (bdev[id]) {
 	dout(1) << __func__ << " failed to allocate 0x" << std::hex << len
 		<< " on bdev " << (int)id
-		<< ", free 0x" << alloc[id]->get_free()
+		<< ", free 0x" << _get_free(id)
 		<< "; fallback to bdev " << (int)id + 1
 		<< std::dec << dendl;
       }
       return _allocate(id + 1, len, node);
     }
-    dout(1) << __func__ << " unable to allocate 0x" << std::hex << len
-	    << " on bdev " << (int)id << ", free 0x"
-	    << (alloc[id] ? alloc[id]->get_free() : (uint64_t)-1)
-	    << "; fallback to slow device expander "
-	    << std::dec << dendl;
-    extents.clear();
-    if (_expand_slow_device(len, extents) == 0) {
-      id = _get_slow_device_id();
-      for (auto& e : extents) {
-	_add_block_extent(id, e.offset, e.length);
-      }
-      extents.clear();
-      auto* last_alloc = alloc[id];
-      ceph_assert(last_alloc);
-      // try again
-      alloc_len = last_alloc->allocate(round_up_to(len, alloc_size[id]),
-				       alloc_size[id], hint, &extents);
-      if (alloc_len < 0 || alloc_len < (int64_t)len) {
-	if (alloc_len > 0) {
-	  last_alloc->release(extents);
-	}
-	derr << __func__ << " failed to allocate 0x" << std::hex << len
-	      << " on bdev " << (int)id
-	      << ", free 0x" << last_alloc->get_free() << std::dec << dendl;
-        return -ENOSPC;
-      }
-    } else {
-      derr << __func__ << " failed to expand slow device to fit +0x"
-	   << std::hex << len << std::dec
-	   << dendl;
-      return -ENOSPC;
-    }
+    derr << __func__ << " unable to allocate 0x" << std::hex << len
+	 << " on bdev " << (int)id << ", free 0x"
+	 << (alloc[id] ? alloc[id]->get_free() : (uint64_t)-1)
+	 << std::dec << dendl;
+    if (alloc[id])
+      alloc[id]->dump();
+    return -ENOSPC;
   } else {
-    uint64_t total_allocated =
-      block_all[id].size() - alloc[id]->get_free();
+    if (is_shared_alloc(id)) {
+      shared_alloc->bluefs_used += alloc_len;
+    }
+    uint64_t total_allocated = _get_used(id);
     if (max_bytes[id] < total_allocated) {
       logger->set(max_bytes_pcounters[id], total_allocated);
       max_bytes[id] = total_allocated;
@@ -3048,6 +3118,85 @@ int BlueFS::_preallocate(FileRef f, uint64_t off, uint64_t len)
   return 0;
 }
 
+void BlueFS::_preallocate_wal_ring(FileRef f)
+{
+  // Lay out the whole WAL up front and declare it full sized, like
+  // bluefs_preextend_wal_files does as the file grows: appends within it
+  // then never change the fnode, so fsync is a single device flush.
+  // rocksdb recycles the file in place (ReuseWritableFile) so the ring
+  // is only paid for once.
+  uint64_t ring = cct->_conf->bluefs_wal_ring_size;
+  if (!ring || !cct->_conf->bluefs_preextend_wal_files ||
+      f->fnode.size >= ring) {
+    return;
+  }
+  uint64_t allocated = f->fnode.get_allocated();
+  if (allocated < ring) {
+    vselector->sub_usage(f->vselector_hint, f->fnode);
+    int r = _allocate(vselector->select_prefer_bdev(f->vselector_hint),
+		      ring - allocated,
+		      &f->fnode);
+    vselector->add_usage(f->vselector_hint, f->fnode);
+    if (r < 0) {
+      dout(1) << __func__ << " unable to preallocate 0x" << std::hex << ring
+	       << std::dec << " for " << f->fnode << ": " << cpp_strerror(r)
+	       << ", growing on demand" << dendl;
+      return;
+    }
+    if (logger) {
+      logger->inc(l_bluefs_wal_ring_bytes, f->fnode.get_allocated() - allocated);
+    }
+  }
+  // whatever the device held there would sit inside the declared size and
+  // be replayed by rocksdb after a crash; zero it once, like clear_upto in
+  // _flush_range does for bluefs_preextend_wal_files
+  uint64_t zero_from = p2roundup(f->fnode.size, (uint64_t)super.block_size);
+  uint64_t zero_to = f->fnode.get_allocated();
+  if (zero_from < zero_to) {
+    const uint64_t chunk = 1 << 20;
+    bufferptr z = buffer::create_page_aligned(std::min(chunk, zero_to - zero_from));
+    z.zero();
+    std::array<bool, MAX_BDEV> dirty_devs = {false};
+    uint64_t x_off = 0;
+    auto p = f->fnode.seek(zero_from, &x_off);
+    for (uint64_t pos = zero_from; pos < zero_to; ++p, x_off = 0) {
+      ceph_assert(p != f->fnode.extents.end());
+      uint64_t x_end = std::min<uint64_t>(p->length, x_off + zero_to - pos);
+      for (uint64_t o = x_off; o < x_end; ) {
+	uint64_t l = std::min(chunk, x_end - o);
+	bufferlist bl;
+	bl.append(z, 0, l);
+	int r = bdev[p->bdev]->write(p->offset + o, bl, false);
+	if (r < 0) {
+	  derr << __func__ << " failed to zero 0x" << std::hex
+	       << p->offset + o << "~" << l << std::dec << ": "
+	       << cpp_strerror(r) << ", growing on demand" << dendl;
+	  return;
+	}
+	o += l;
+      }
+      dirty_devs[p->bdev] = true;
+      pos += x_end - x_off;
+    }
+    flush_bdev(dirty_devs);
+  }
+  vselector->sub_usage(f->vselector_hint, f->fnode.size);
+  f->fnode.size = zero_to;
+  vselector->add_usage(f->vselector_hint, f->fnode.size);
+  // the new extents must reach the log before any data synced into them
+  // is relied upon
+  if (f->dirty_seq == 0) {
+    f->dirty_seq = log_seq + 1;
+    dirty_files[f->dirty_seq].push_back(*f);
+  } else if (f->dirty_seq != log_seq + 1) {
+    auto it = dirty_files[f->dirty_seq].iterator_to(*f);
+    dirty_files[f->dirty_seq].erase(it);
+    f->dirty_seq = log_seq + 1;
+    dirty_files[f->dirty_seq].push_back(*f);
+  }
+  dout(10) << __func__ << " " << f->fnode << dendl;
+}
+
 void BlueFS::sync_metadata()
 {
   std::unique_lock l(lock);
@@ -3134,13 +3283,18 @@ int BlueFS::open_for_write(
 	   << " vsel_hint " << file->vselector_hint
 	   << dendl;
 
+  bool is_wal = boost::algorithm::ends_with(filename, ".log");
+  if (is_wal) {
+    _preallocate_wal_ring(file);
+  }
+
   log_t.op_file_update(file->fnode);
   if (create)
     log_t.op_dir_link(dirname, filename, file->fnode.ino);
 
   *h = _create_writer(file);
 
-  if (boost::algorithm::ends_with(filename, ".log")) {
+  if (is_wal) {
     (*h)->writer_type = BlueFS::WRITER_WAL;
     if (logger && !overwrite) {
       logger->inc(l_bluefs_files_written_wal);
@@ -4,6 +4,7 @@
 #define CEPH_OS_BLUESTORE_BLUEFS_H
 
 #include <atomic>
+#include <functional>
 #include <mutex>
 
 #include "bluefs_types.h"
@@ -23,7 +24,6 @@ class Allocator;
 enum {
   l_bluefs_first = 732600,
   l_bluefs_gift_bytes,
-  l_bluefs_reclaim_bytes,
   l_bluefs_db_total_bytes,
   l_bluefs_db_used_bytes,
   l_bluefs_wal_total_bytes,
@@ -52,27 +52,24 @@ enum {
   l_bluefs_read_bytes,
   l_bluefs_read_prefetch_count,
   l_bluefs_read_prefetch_bytes,
+  l_bluefs_wal_ring_bytes,
+  l_bluefs_wal_fsync_nometa,
+  l_bluefs_wal_fsync_meta,
 
   l_bluefs_last,
 };
 
-class BlueFSDeviceExpander {
-protected:
-  ~BlueFSDeviceExpander() {}
-public:
-  virtual uint64_t get_recommended_expansion_delta(uint64_t bluefs_free,
-    uint64_t bluefs_total) = 0;
-  virtual int allocate_freespace(
-    uint64_t min_size,
-    uint64_t size,
-    PExtentVector& extents) = 0;
-  /** Reports amount of space that can be transferred to BlueFS.
-   * This gives either current state, when alloc_size is currently used
-   * BlueFS's size, or simulation when alloc_size is different.
-   * @params
-   * alloc_size - allocation unit size to check
-   */
-  virtual uint64_t available_freespace(uint64_t alloc_size) = 0;
+/// allocator state shared between BlueStore and BlueFS for the main device
+struct bluefs_shared_alloc_context_t {
+  Allocator* a = nullptr;                     ///< BlueStore's allocator
+  std::atomic<uint64_t> bluefs_used = {0};    ///< bytes held by BlueFS files
+
+  void set(Allocator* _a) {
+    a = _a;
+  }
+  void reset() {
+    a = nullptr;
+  }
 };
 
 class BlueFSVolumeSelector {
@@ -323,7 +320,13 @@ private:
 
   BlockDevice::aio_callback_t discard_cb[3]; //discard callbacks for each dev
 
-  BlueFSDeviceExpander* slow_dev_expander = nullptr;
+  /// BlueStore's allocator, used for the device shared with BlueStore
+  bluefs_shared_alloc_context_t* shared_alloc = nullptr;
+  unsigned shared_alloc_id = unsigned(-1);
+  inline bool is_shared_alloc(unsigned id) const {
+    return id == shared_alloc_id;
+  }
+
   std::unique_ptr<BlueFSVolumeSelector> vselector;
 
   class SocketHook;
@@ -336,14 +339,18 @@ private:
   void _init_alloc();
   void _stop_alloc();
 
+  uint64_t _get_used(unsigned id) const;
+  uint64_t _get_total(unsigned id) const;
+  uint64_t _get_free(unsigned id) const;
+
   void _pad_bl(bufferlist& bl);  ///< pad bufferlist to block size w/ zeros
 
   FileRef _get_file(uint64_t ino);
   void _drop_link(FileRef f);
 
   int _get_slow_device_id() { return bdev[BDEV_SLOW] ? BDEV_SLOW : BDEV_DB; }
+  int _get_block_extents(unsigned id, interval_set<uint64_t> *extents);
   const char* get_device_name(unsigned id);
-  int _expand_slow_device(uint64_t min_size, PExtentVector& extents);
   int _allocate(uint8_t bdev, uint64_t len,
 		bluefs_fnode_t* node);
   int _allocate_without_fallback(uint8_t id, uint64_t len,
@@ -352,6 +359,7 @@ private:
   int _flush_range(FileWriter *h, uint64_t offset, uint64_t length);
   int _flush(FileWriter *h, bool force);
   int _fsync(FileWriter *h, std::unique_lock<ceph::mutex>& l);
+  void _preallocate_wal_ring(FileRef f);
 
 #ifdef HAVE_LIBAIO
   void _claim_completed_aios(FileWriter *h, list<aio_t> *ls);
@@ -460,6 +468,7 @@ public:
     const bluefs_layout_t& layout);
 
   uint64_t get_used();
+  uint64_t get_used(unsigned id);
   uint64_t get_total(unsigned id);
   uint64_t get_free(unsigned id);
   void get_usage(vector<pair<uint64_t,uint64_t>> *usage); // [<free,total> ...]
@@ -467,8 +476,14 @@ public:
 
   void dump_block_extents(ostream& out);
 
-  /// get current extents that we own for given block device
+  /// get current extents that we own for given block device; for the
+  /// device shared with BlueStore these are the extents used by files
   int get_block_extents(unsigned id, interval_set<uint64_t> *extents);
+  /// as above, but also count releases not yet handed back to the
+  /// allocator, and call f before anything can move again so the caller
+  /// can take its own view of the shared allocator consistently
+  int freeze_block_extents(unsigned id, interval_set<uint64_t> *extents,
+			   std::function<void()> f);
 
   int open_for_write(
     const string& dir,
@@ -509,9 +524,6 @@ public:
   /// sync any uncommitted state to disk
   void sync_metadata();
 
-  void set_slow_device_expander(BlueFSDeviceExpander* a) {
-    slow_dev_expander = a;
-  }
   void set_volume_selector(BlueFSVolumeSelector* s) {
     vselector.reset(s);
   }
@@ -524,7 +536,7 @@ public:
   }
 
   int add_block_device(unsigned bdev, const string& path, bool trim,
-		       bool shared_with_bluestore=false);
+		       bluefs_shared_alloc_context_t* _shared_alloc = nullptr);
   bool bdev_support_label(unsigned id);
   uint64_t get_block_device_size(unsigned bdev);
 
@@ -536,10 +548,6 @@ public:
     ceph_assert(r == 0);
   }
 
-  /// reclaim block space
-  int reclaim_blocks(unsigned bdev, uint64_t want,
-		     PExtentVector *extents);
-
   // handler for discard event
   void handle_discard(unsigned dev, interval_set<uint64_t>& to_release);
 
@@ -36,6 +36,8 @@
 #include "common/PriorityCache.h"
 #include "common/RWLock.h"
 #include "Allocator.h"
+#include "TieredAllocator.h"
+#include "TieredDevice.h"
 #include "FreelistManager.h"
 #include "BlueFS.h"
 #include "BlueRocksEnv.h"
@@ -44,6 +46,7 @@
 #include "perfglue/heap_profiler.h"
 #include "common/blkdev.h"
 #include "common/numa.h"
+#include "common/admin_socket.h"
 
 #if defined(WITH_LTTNG)
 #define TRACEPOINT_DEFINE
@@ -91,6 +94,8 @@ const string PREFIX_DEFERRED = "L";    // id -> deferred_transaction_t
 const string PREFIX_ALLOC = "B";       // u64 offset -> u64 length (freelist)
 const string PREFIX_ALLOC_BITMAP = "b";// (see BitmapFreelistManager)
 const string PREFIX_SHARED_BLOB = "X"; // u64 offset -> shared_blob_t
+const string PREFIX_ALLOC_SNAPSHOT = "A"; // u64 chunk -> interval_set<u64>
+const string PREFIX_REMOVED_COLL = "R"; // collection name -> cnode_t
 
 const string BLUESTORE_GLOBAL_STATFS_KEY = "bluestore_statfs";
 
@@ -117,6 +122,9 @@ const string BLUESTORE_GLOBAL_STATFS_KEY = "bluestore_statfs";
 #define BLOBID_FLAG_SPANNING   0x8  // has spanning blob id
 #define BLOBID_SHIFT_BITS        4
 
+// spanning blob set flags, v3+
+#define SPANNING_BLOBS_FLAG_LZ4 0x1  // the set is lz4 compressed
+
 /*
  * object name key structure
  *
@@ -947,6 +955,101 @@ struct LruOnodeCacheShard : public BlueStore::OnodeCacheShard {
   }
 };
 
+// ClockOnodeCacheShard
+//
+// Onodes never move between lists here: a hit only sets the onode's
+// reference bit, and pinning only counts it, so neither _touch() nor
+// _pin()/_unpin() need the lock and a hit costs just the lock around
+// the onode_map lookup.  Pinned (referenced from outside the cache)
+// onodes stay in the lru, count towards the shard's size and are passed
+// over by trimming.  Trimming gives referenced onodes a second chance,
+// and is only done inline once the shard overshoots its target by
+// bluestore_clock_cache_trim_slack_ratio; the mempool thread takes care
+// of the rest.
+struct ClockOnodeCacheShard : public LruOnodeCacheShard {
+  explicit ClockOnodeCacheShard(CephContext *cct) : LruOnodeCacheShard(cct) {}
+
+  bool lockless_touch() const override {
+    return true;
+  }
+  void _add(BlueStore::OnodeRef& o, int level) override
+  {
+    ceph_assert(o->s == nullptr);
+    o->s = this;
+    o->cache_referenced.store(false, std::memory_order_relaxed);
+    if (o->nref > 1) {
+      ++num_pinned;
+    }
+    (level > 0) ? lru.push_front(*o) : lru.push_back(*o);
+    num = lru.size();
+  }
+  void _rm(BlueStore::OnodeRef& o) override
+  {
+    o->s = nullptr;
+    if (o->nref > 1) {
+      _unpin(*o);
+    }
+    lru.erase(lru.iterator_to(*o));
+    num = lru.size();
+  }
+  void _touch(BlueStore::OnodeRef& o) override
+  {
+    o->cache_referenced.store(true, std::memory_order_relaxed);
+  }
+  // num_pinned is only reported; a reference dropped while the onode is
+  // being added or removed may be missed, so keep it from wrapping
+  void _pin(BlueStore::Onode& o) override
+  {
+    ++num_pinned;
+  }
+  void _unpin(BlueStore::Onode& o) override
+  {
+    uint64_t n = num_pinned;
+    while (n > 0 && !num_pinned.compare_exchange_weak(n, n - 1)) ;
+  }
+  void _trim() override
+  {
+    uint64_t m = max;
+    if (num <= m + m * cct->_conf->bluestore_clock_cache_trim_slack_ratio) {
+      return;
+    }
+    LruOnodeCacheShard::_trim();
+  }
+  void _trim_to(uint64_t new_size) override
+  {
+    if (new_size >= lru.size()) {
+      return; // don't even try
+    }
+    uint64_t n = lru.size() - new_size;
+    // a referenced onode is passed over once (clearing its bit) and a
+    // pinned one every time, so two rounds are enough
+    uint64_t visits = 2 * lru.size();
+    while (n > 0 && visits-- > 0) {
+      BlueStore::Onode *o = &lru.back();
+      lru.pop_back();
+      // no new reference can show up without the lock held here, so an
+      // onode only the cache refers to stays that way
+      if (o->nref > 1 ||
+	  o->cache_referenced.exchange(false, std::memory_order_relaxed)) {
+	lru.push_front(*o);
+	continue;
+      }
+      dout(30) << __func__ << "  rm " << o->oid << dendl;
+      o->s = nullptr;
+      o->get();  // paranoia
+      o->c->onode_map.remove(o->oid);
+      o->put();
+      --n;
+    }
+    num = lru.size();
+  }
+  void add_stats(uint64_t *onodes, uint64_t *pinned_onodes) override
+  {
+    *onodes += num;
+    *pinned_onodes += num_pinned;
+  }
+};
+
 // OnodeCacheShard
 BlueStore::OnodeCacheShard *BlueStore::OnodeCacheShard::create(
     CephContext* cct,
@@ -954,8 +1057,11 @@ BlueStore::OnodeCacheShard *BlueStore::OnodeCacheShard::create(
     PerfCounters *logger)
 {
   BlueStore::OnodeCacheShard *c = nullptr;
-  // Currently we only implement an LRU cache for onodes
-  c = new LruOnodeCacheShard(cct);
+  // onodes use CLOCK when asked to, and LRU otherwise (including 2q)
+  if (type == "clock")
+    c = new ClockOnodeCacheShard(cct);
+  else
+    c = new LruOnodeCacheShard(cct);
   c->logger = logger;
   return c;
 }
@@ -1055,6 +1161,54 @@ struct LruBufferCacheShard : public BlueStore::BufferCacheShard {
 #endif
 };
 
+// ClockBufferCacheShard
+//
+// Same idea as ClockOnodeCacheShard: cache_private is the reference bit.
+struct ClockBufferCacheShard : public LruBufferCacheShard {
+  explicit ClockBufferCacheShard(CephContext *cct) : LruBufferCacheShard(cct) {}
+
+  void _add(BlueStore::Buffer *b, int level, BlueStore::Buffer *near) override {
+    b->cache_private = 0;
+    LruBufferCacheShard::_add(b, level, near);
+  }
+  void _touch(BlueStore::Buffer *b) override {
+    b->cache_private = 1;
+  }
+  void _trim() override
+  {
+    uint64_t m = max;
+    if (buffer_bytes <= m + m * cct->_conf->bluestore_clock_cache_trim_slack_ratio) {
+      return;
+    }
+    LruBufferCacheShard::_trim();
+  }
+  void _trim_to(uint64_t max) override
+  {
+    // every referenced buffer is passed over at most once per call
+    uint64_t chances = lru.size();
+    while (buffer_bytes > max) {
+      auto i = lru.rbegin();
+      if (i == lru.rend()) {
+        // stop if lru is now empty
+        break;
+      }
+
+      BlueStore::Buffer *b = &*i;
+      if (chances > 0 && b->cache_private) {
+	--chances;
+	b->cache_private = 0;
+	lru.erase(lru.iterator_to(*b));
+	lru.push_front(*b);
+	continue;
+      }
+      ceph_assert(b->is_clean());
+      dout(20) << __func__ << " rm " << *b << dendl;
+      b->space->_rm_buffer(this, b);
+    }
+    num = lru.size();
+  }
+};
+
 // TwoQBufferCacheShard
 
 struct TwoQBufferCacheShard : public BlueStore::BufferCacheShard {
@@ -1383,6 +1537,8 @@ BlueStore::BufferCacheShard *BlueStore::BufferCacheShard::create(
     c = new LruBufferCacheShard(cct);
   else if (type == "2q")
     c = new TwoQBufferCacheShard(cct);
+  else if (type == "clock")
+    c = new ClockBufferCacheShard(cct);
   else
     ceph_abort_msg("unrecognized cache type");
   c->logger = logger;
@@ -1547,6 +1703,10 @@ void BlueStore::BufferSpace::read(
   uint64_t miss_bytes = want_bytes - hit_bytes;
   cache->logger->inc(l_bluestore_buffer_hit_bytes, hit_bytes);
   cache->logger->inc(l_bluestore_buffer_miss_bytes, miss_bytes);
+  if (cache->partition_logger) {
+    cache->partition_logger->inc(l_bluestore_buffer_hit_bytes, hit_bytes);
+    cache->partition_logger->inc(l_bluestore_buffer_miss_bytes, miss_bytes);
+  }
 }
 
 void BlueStore::BufferSpace::_finish_write(BufferCacheShard* cache, uint64_t seq)
@@ -1668,16 +1828,27 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
     } else {
       ldout(cache->cct, 30) << __func__ << " " << oid << " hit " << p->second
 			    << dendl;
-      cache->_touch(p->second);
       hit = true;
       o = p->second;
+      if (!cache->lockless_touch()) {
+	cache->_touch(o);
+      }
     }
   }
 
   if (hit) {
+    if (cache->lockless_touch()) {
+      cache->_touch(o);
+    }
     cache->logger->inc(l_bluestore_onode_hits);
+    if (cache->partition_logger) {
+      cache->partition_logger->inc(l_bluestore_onode_hits);
+    }
   } else {
     cache->logger->inc(l_bluestore_onode_misses);
+    if (cache->partition_logger) {
+      cache->partition_logger->inc(l_bluestore_onode_misses);
+    }
   }
   return o;
 }
@@ -2478,9 +2649,11 @@ void BlueStore::ExtentMap::reshard(
   unsigned target = cct->_conf->bluestore_extent_map_shard_target_size;
   unsigned slop = target *
     cct->_conf->bluestore_extent_map_shard_target_size_slop;
+  unsigned align = cct->_conf->bluestore_extent_map_shard_align;
   unsigned extent_avg = bytes / std::max(1u, extents);
   dout(20) << __func__ << "  extent_avg " << extent_avg << ", target " << target
-	   << ", slop " << slop << dendl;
+	   << ", slop " << slop << ", align 0x" << std::hex << align << std::dec
+	   << dendl;
 
   // reshard
   unsigned estimate = 0;
@@ -2496,10 +2669,13 @@ void BlueStore::ExtentMap::reshard(
     }
     dout(30) << " extent " << *e << dendl;
 
-    // disfavor shard boundaries that span a blob
+    // disfavor shard boundaries that span a blob or are misaligned;
+    // aligned boundaries tend to survive subsequent reshards
     bool would_span = (e->logical_offset < max_blob_end) || e->blob_offset;
+    bool misaligned = align && (e->logical_offset % align);
     if (estimate &&
-	estimate + extent_avg > target + (would_span ? slop : 0)) {
+	estimate + extent_avg > target +
+	  (would_span || misaligned ? slop : 0)) {
       // new shard
       if (offset == needs_reshard_begin) {
 	new_shard_info.emplace_back(bluestore_onode_t::shard_info());
@@ -2727,9 +2903,13 @@ bool BlueStore::ExtentMap::encode_some(
   auto start = extent_map.lower_bound(dummy);
   uint32_t end = offset + length;
 
-  __u8 struct_v = 2; // Version 2 differs from v1 in blob's ref_map
-                     // serialization only. Hence there is no specific
-                     // handling at ExtentMap level.
+  // Version 2 differs from v1 in blob's ref_map serialization only.
+  // Version 3 encodes references to blobs already included in the
+  // shard as a distance back from the referencing extent, which
+  // normally fits into a single byte; blobs themselves are encoded
+  // as in v2.
+  __u8 struct_v = cct->_conf->bluestore_extent_map_encode_legacy ? 2 : 3;
+  __u8 blob_v = std::min<__u8>(struct_v, 2);
 
   unsigned n = 0;
   size_t bound = 0;
@@ -2753,7 +2933,7 @@ bool BlueStore::ExtentMap::encode_some(
 
       p->blob->bound_encode(
         bound,
-        struct_v,
+        blob_v,
         p->blob->shared_blob->get_sbid(),
         false);
     }
@@ -2788,8 +2968,11 @@ bool BlueStore::ExtentMap::encode_some(
 	p->blob->last_encoded_id = n + 1;  // so it is always non-zero
 	include_blob = true;
 	blobid = 0;  // the decoder will infer the id from n
-      } else {
+      } else if (struct_v < 3) {
 	blobid = p->blob->last_encoded_id << BLOBID_SHIFT_BITS;
+      } else {
+	// last_encoded_id is the 1-based index of the including extent
+	blobid = (n + 1 - p->blob->last_encoded_id) << BLOBID_SHIFT_BITS;
       }
       if (p->logical_offset == pos) {
 	blobid |= BLOBID_FLAG_CONTIGUOUS;
@@ -2814,7 +2997,7 @@ bool BlueStore::ExtentMap::encode_some(
       }
       pos = p->logical_end();
       if (include_blob) {
-	p->blob->encode(app, struct_v, p->blob->shared_blob->get_sbid(), false);
+	p->blob->encode(app, blob_v, p->blob->shared_blob->get_sbid(), false);
       }
     }
   }
@@ -2840,9 +3023,10 @@ unsigned BlueStore::ExtentMap::decode_some(bufferlist& bl)
   __u8 struct_v;
   denc(struct_v, p);
   // Version 2 differs from v1 in blob's ref_map
-  // serialization only. Hence there is no specific
-  // handling at ExtentMap level below.
-  ceph_assert(struct_v == 1 || struct_v == 2);
+  // serialization only. Version 3 changes blob back-references,
+  // see encode_some().
+  ceph_assert(struct_v >= 1 && struct_v <= 3);
+  __u8 blob_v = std::min<__u8>(struct_v, 2);
 
   uint32_t num;
   denc_varint(num, p);
@@ -2878,12 +3062,17 @@ unsigned BlueStore::ExtentMap::decode_some(bufferlist& bl)
     } else {
       blobid >>= BLOBID_SHIFT_BITS;
       if (blobid) {
-	le->assign_blob(blobs[blobid - 1]);
+	if (struct_v < 3) {
+	  le->assign_blob(blobs[blobid - 1]);
+	} else {
+	  ceph_assert(blobid <= n);
+	  le->assign_blob(blobs[n - blobid]);
+	}
 	ceph_assert(le->blob);
       } else {
 	Blob *b = new Blob();
         uint64_t sbid = 0;
-        b->decode(onode->c, p, struct_v, &sbid, false);
+        b->decode(onode->c, p, blob_v, &sbid, false);
 	blobs[n] = b;
 	onode->c->open_shared_blob(sbid, b);
 	le->assign_blob(b);
@@ -2906,58 +3095,157 @@ unsigned BlueStore::ExtentMap::decode_some(bufferlist& bl)
 void BlueStore::ExtentMap::bound_encode_spanning_blobs(size_t& p)
 {
   // Version 2 differs from v1 in blob's ref_map
-  // serialization only. Hence there is no specific
-  // handling at ExtentMap level.
-  __u8 struct_v = 2;
+  // serialization only. Version 3 adds flags and
+  // delta encoded blob ids, see encode_spanning_blobs().
+  __u8 struct_v = 3;
 
   denc(struct_v, p);
+  denc(struct_v, p); // flags
+  _bound_encode_spanning_blob_list(p);
+}
+
+void BlueStore::ExtentMap::_bound_encode_spanning_blob_list(size_t& p)
+{
   denc_varint((uint32_t)0, p);
   size_t key_size = 0;
   denc_varint((uint32_t)0, key_size);
   p += spanning_blob_map.size() * key_size;
   for (const auto& i : spanning_blob_map) {
-    i.second->bound_encode(p, struct_v, i.second->shared_blob->get_sbid(), true);
+    i.second->bound_encode(p, 2, i.second->shared_blob->get_sbid(), true);
+  }
+}
+
+void BlueStore::ExtentMap::_encode_spanning_blob_list(
+  bufferlist::contiguous_appender& p,
+  __u8 struct_v)
+{
+  denc_varint(spanning_blob_map.size(), p);
+  int prev_id = 0;
+  for (auto& i : spanning_blob_map) {
+    if (struct_v < 3) {
+      denc_varint(i.second->id, p);
+    } else {
+      // the map is ordered by id, so deltas are small and non-negative
+      denc_varint((uint32_t)(i.second->id - prev_id), p);
+      prev_id = i.second->id;
+    }
+    i.second->encode(p, 2, i.second->shared_blob->get_sbid(), true);
   }
 }
 
 void BlueStore::ExtentMap::encode_spanning_blobs(
   bufferlist::contiguous_appender& p)
 {
+  auto cct = onode->c->store->cct;
   // Version 2 differs from v1 in blob's ref_map
-  // serialization only. Hence there is no specific
-  // handling at ExtentMap level.
-  __u8 struct_v = 2;
+  // serialization only. Version 3 adds a flags byte,
+  // delta encodes blob ids and lz4 compresses large sets.
+  __u8 struct_v = cct->_conf->bluestore_extent_map_encode_legacy ? 2 : 3;
 
   denc(struct_v, p);
-  denc_varint(spanning_blob_map.size(), p);
-  for (auto& i : spanning_blob_map) {
-    denc_varint(i.second->id, p);
-    i.second->encode(p, struct_v, i.second->shared_blob->get_sbid(), true);
+  if (struct_v < 3) {
+    _encode_spanning_blob_list(p, struct_v);
+    return;
+  }
+  __u8 flags = 0;
+  size_t min_size = cct->_conf->bluestore_spanning_blobs_compress_min_size;
+  if (min_size && spanning_blob_map.size() > 1) {
+    size_t bound = 0;
+    _bound_encode_spanning_blob_list(bound);
+    bufferlist raw;
+    {
+      auto app = raw.get_contiguous_appender(bound);
+      _encode_spanning_blob_list(app, struct_v);
+    }
+    CompressorRef cp = onode->c->store->spanning_blob_compressor;
+    if (cp && raw.length() >= min_size) {
+      bufferlist compressed;
+      // header is a flags byte plus two varints, make sure
+      // the result still fits into the uncompressed bound
+      if (cp->compress(raw, compressed) == 0 &&
+	  compressed.length() + 2 * sizeof(uint64_t) < raw.length()) {
+	flags |= SPANNING_BLOBS_FLAG_LZ4;
+	denc(flags, p);
+	denc_varint(raw.length(), p);
+	denc_varint(compressed.length(), p);
+	p.append(compressed);
+	dout(20) << __func__ << " compressed " << spanning_blob_map.size()
+		 << " spanning blobs 0x" << std::hex << raw.length()
+		 << " -> 0x" << compressed.length() << std::dec << dendl;
+	return;
+      }
+    }
+    denc(flags, p);
+    p.append(raw);
+    return;
   }
+  denc(flags, p);
+  _encode_spanning_blob_list(p, struct_v);
 }
 
-void BlueStore::ExtentMap::decode_spanning_blobs(
-  bufferptr::const_iterator& p)
+void BlueStore::ExtentMap::_decode_spanning_blob_list(
+  bufferptr::const_iterator& p,
+  __u8 struct_v)
 {
-  __u8 struct_v;
-  denc(struct_v, p);
-  // Version 2 differs from v1 in blob's ref_map
-  // serialization only. Hence there is no specific
-  // handling at ExtentMap level.
-  ceph_assert(struct_v == 1 || struct_v == 2);
-
   unsigned n;
   denc_varint(n, p);
+  int id = 0;
   while (n--) {
     BlobRef b(new Blob());
-    denc_varint(b->id, p);
+    if (struct_v < 3) {
+      denc_varint(b->id, p);
+    } else {
+      uint32_t delta;
+      denc_varint(delta, p);
+      id += delta;
+      b->id = id;
+    }
     spanning_blob_map[b->id] = b;
     uint64_t sbid = 0;
-    b->decode(onode->c, p, struct_v, &sbid, true);
+    b->decode(onode->c, p, std::min<__u8>(struct_v, 2), &sbid, true);
     onode->c->open_shared_blob(sbid, b);
   }
 }
 
+void BlueStore::ExtentMap::decode_spanning_blobs(
+  bufferptr::const_iterator& p)
+{
+  __u8 struct_v;
+  denc(struct_v, p);
+  // Version 2 differs from v1 in blob's ref_map
+  // serialization only. Version 3 adds flags and
+  // delta encoded blob ids.
+  ceph_assert(struct_v >= 1 && struct_v <= 3);
+
+  __u8 flags = 0;
+  if (struct_v >= 3) {
+    denc(flags, p);
+  }
+  if ((flags & SPANNING_BLOBS_FLAG_LZ4) == 0) {
+    _decode_spanning_blob_list(p, struct_v);
+    return;
+  }
+  auto cct = onode->c->store->cct;
+  uint32_t raw_len, compressed_len;
+  denc_varint(raw_len, p);
+  denc_varint(compressed_len, p);
+  bufferlist compressed, raw;
+  compressed.append(p.get_pos_add(compressed_len), compressed_len);
+  CompressorRef cp = onode->c->store->spanning_blob_compressor;
+  if (!cp) {
+    derr << __func__ << " lz4 compressor is not available, unable to decode "
+	 << onode->oid << dendl;
+    ceph_abort_msg("lz4 compressor is not available");
+  }
+  int r = cp->decompress(compressed, raw);
+  ceph_assert(r == 0);
+  ceph_assert(raw.length() == raw_len);
+  raw.rebuild();
+  auto q = raw.front().begin_deep();
+  _decode_spanning_blob_list(q, struct_v);
+  ceph_assert(q.end());
+}
+
 void BlueStore::ExtentMap::init_shards(bool loaded, bool dirty)
 {
   shards.resize(onode->onode.extent_map_shards.size());
@@ -3028,6 +3316,10 @@ void BlueStore::ExtentMap::dirty_range(
   auto cct = onode->c->store->cct; //used by dout
   dout(30) << __func__ << " 0x" << std::hex << offset << "~" << length
 	   << std::dec << dendl;
+  if (auto ra = onode->readahead.load(); ra) {
+    // invalidate any prefetch issued against the old lextents
+    ++ra->gen;
+  }
   if (shards.empty()) {
     dout(20) << __func__ << " mark inline shard dirty" << dendl;
     inline_bl.clear();
@@ -3324,6 +3616,11 @@ BlueStore::Onode* BlueStore::Onode::decode(
   return on;
 }
 
+BlueStore::Onode::~Onode()
+{
+  delete readahead.load();
+}
+
 void BlueStore::Onode::flush()
 {
   if (flushing_count.load()) {
@@ -3683,7 +3980,8 @@ BlueStore::OnodeRef BlueStore::Collection::get_onode(
   bufferlist v;
   int r = -ENOENT;
   Onode *on;
-  if (!is_createop) {
+  if (!is_createop &&
+      !(bulk_remove_fenced && store->_bulk_remove_covers(oid))) {
     r = store->db->get(PREFIX_OBJ, key.c_str(), key.size(), &v);
     ldout(store->cct, 20) << " r " << r << " v.len " << v.length() << dendl;
   }
@@ -3812,10 +4110,28 @@ void *BlueStore::MempoolThread::entry()
     pcm->insert("meta", meta_cache, true);
     pcm->insert("data", data_cache, true);
   }
+  double meta_data_ratio = store->cache_meta_ratio + store->cache_data_ratio;
+  for (auto& p : store->cache_partitions) {
+    auto part = p.second.get();
+    // split the guaranteed minimum the same way as the rest of the cache
+    uint64_t meta_min = meta_data_ratio > 0 ?
+      part->min_bytes * store->cache_meta_ratio / meta_data_ratio : 0;
+    part->meta_cache = std::make_shared<PartitionCache>(
+      store, part, meta_cache, meta_min);
+    part->data_cache = std::make_shared<PartitionCache>(
+      store, part, nullptr, part->min_bytes - meta_min);
+    if (pcm != nullptr) {
+      string suffix = "_pool_" + std::to_string(p.first);
+      pcm->insert("meta" + suffix, part->meta_cache, true);
+      pcm->insert("data" + suffix, part->data_cache, true);
+    }
+  }
+  _adjust_cache_settings();
 
   utime_t next_balance = ceph_clock_now();
   utime_t next_resize = ceph_clock_now();
   utime_t next_deferred_force_submit = ceph_clock_now();
+  utime_t next_write_stream_prune = ceph_clock_now();
 
   bool interval_stats_trim = false;
   while (!stop) {
@@ -3862,6 +4178,12 @@ void *BlueStore::MempoolThread::entry()
       next_deferred_force_submit += max_defer_interval/3;
     }
 
+    if (next_write_stream_prune < ceph_clock_now()) {
+      store->_prune_write_streams();
+      next_write_stream_prune = ceph_clock_now();
+      next_write_stream_prune += 1.0;
+    }
+
     // Now Resize the shards 
     _resize_shards(interval_stats_trim);
     interval_stats_trim = false;
@@ -3880,8 +4202,21 @@ void BlueStore::MempoolThread::_adjust_cache_settings()
   if (binned_kv_cache != nullptr) {
     binned_kv_cache->set_cache_ratio(store->cache_kv_ratio);
   }
-  meta_cache->set_cache_ratio(store->cache_meta_ratio);
-  data_cache->set_cache_ratio(store->cache_data_ratio);
+  // the shared shards have a weight of 1, partitions get their share
+  // of the meta and data ratios according to their weights
+  double total_weight = 1.0;
+  for (auto& p : store->cache_partitions) {
+    total_weight += p.second->weight;
+  }
+  meta_cache->set_cache_ratio(store->cache_meta_ratio / total_weight);
+  data_cache->set_cache_ratio(store->cache_data_ratio / total_weight);
+  for (auto& p : store->cache_partitions) {
+    auto part = p.second.get();
+    part->meta_cache->set_cache_ratio(
+      store->cache_meta_ratio * part->weight / total_weight);
+    part->data_cache->set_cache_ratio(
+      store->cache_data_ratio * part->weight / total_weight);
+  }
 }
 
 void BlueStore::MempoolThread::_resize_shards(bool interval_stats)
@@ -3897,9 +4232,9 @@ void BlueStore::MempoolThread::_resize_shards(bool interval_stats)
   int64_t kv_alloc =
      static_cast<int64_t>(store->cache_kv_ratio * cache_size); 
   int64_t meta_alloc =
-     static_cast<int64_t>(store->cache_meta_ratio * cache_size);
+     static_cast<int64_t>(meta_cache->get_cache_ratio() * cache_size);
   int64_t data_alloc =
-     static_cast<int64_t>(store->cache_data_ratio * cache_size);
+     static_cast<int64_t>(data_cache->get_cache_ratio() * cache_size);
 
   if (pcm != nullptr && binned_kv_cache != nullptr) {
     cache_size = pcm->get_tuned_mem();
@@ -3935,9 +4270,46 @@ void BlueStore::MempoolThread::_resize_shards(bool interval_stats)
 
   for (auto i : store->onode_cache_shards) {
     i->set_max(max_shard_onodes);
+    i->trim();
   }
   for (auto i : store->buffer_cache_shards) {
     i->set_max(max_shard_buffer);
+    i->trim();
+  }
+
+  for (auto& p : store->cache_partitions) {
+    auto part = p.second.get();
+    auto pmeta = static_cast<PartitionCache*>(part->meta_cache.get());
+    auto pdata = static_cast<PartitionCache*>(part->data_cache.get());
+    int64_t part_meta_alloc, part_data_alloc;
+    if (pcm != nullptr && binned_kv_cache != nullptr) {
+      part_meta_alloc = pmeta->get_committed_size();
+      part_data_alloc = pdata->get_committed_size();
+    } else {
+      part_meta_alloc = std::max<int64_t>(
+        pmeta->get_cache_ratio() * store->cache_size, pmeta->min_bytes);
+      part_data_alloc = std::max<int64_t>(
+        pdata->get_cache_ratio() * store->cache_size, pdata->min_bytes);
+    }
+    uint64_t part_shard_onodes = static_cast<uint64_t>(
+      (part_meta_alloc / (double)part->onode_shards.size()) /
+      meta_cache->get_bytes_per_onode());
+    uint64_t part_shard_buffer =
+      static_cast<uint64_t>(part_data_alloc / part->buffer_shards.size());
+    ldout(cct, 20) << __func__
+                  << " pool " << p.first
+                  << " meta_alloc: " << part_meta_alloc
+                  << " meta_used: " << pmeta->_get_used_bytes()
+                  << " data_alloc: " << part_data_alloc
+                  << " data_used: " << pdata->_get_used_bytes() << dendl;
+    for (auto i : part->onode_shards) {
+      i->set_max(part_shard_onodes);
+      i->trim();
+    }
+    for (auto i : part->buffer_shards) {
+      i->set_max(part_shard_buffer);
+      i->trim();
+    }
   }
 }
 
@@ -4158,7 +4530,10 @@ BlueStore::BlueStore(CephContext *cct,
     kv_finalize_thread(this),
     min_alloc_size(_min_alloc_size),
     min_alloc_size_order(ctz(_min_alloc_size)),
-    mempool_thread(this)
+    mempool_thread(this),
+    bulk_remove_thread(this),
+    defrag_thread(this),
+    tier_thread(this)
 {
   _init_logger();
   cct->_conf.add_observer(this);
@@ -4182,6 +4557,17 @@ BlueStore::~BlueStore()
   }
   onode_cache_shards.clear();
   buffer_cache_shards.clear();
+  for (auto& p : cache_partitions) {
+    for (auto i : p.second->onode_shards) {
+      delete i;
+    }
+    for (auto i : p.second->buffer_shards) {
+      delete i;
+    }
+    cct->get_perfcounters_collection()->remove(p.second->logger);
+    delete p.second->logger;
+  }
+  cache_partitions.clear();
 }
 
 const char **BlueStore::get_tracked_conf_keys() const
@@ -4201,6 +4587,15 @@ const char **BlueStore::get_tracked_conf_keys() const
     "bluestore_prefer_deferred_size",
     "bluestore_prefer_deferred_size_hdd",
     "bluestore_prefer_deferred_size_ssd",
+    "bluestore_prefer_deferred_adaptive",
+    "bluestore_write_coalesce_window",
+    "bluestore_write_coalesce_max_bytes",
+    "bluestore_defrag",
+    "bluestore_tier_promote_hits",
+    "bluestore_tier_demote_hits",
+    "bluestore_tier_decay_interval",
+    "bluestore_tier_fast_target_ratio",
+    "bluestore_tier_migrate_bytes_per_sec",
     "bluestore_deferred_batch_ops",
     "bluestore_deferred_batch_ops_hdd",
     "bluestore_deferred_batch_ops_ssd",
@@ -4212,6 +4607,9 @@ const char **BlueStore::get_tracked_conf_keys() const
     "bluestore_max_blob_size",
     "bluestore_max_blob_size_ssd",
     "bluestore_max_blob_size_hdd",
+    "bluestore_readahead_max_bytes",
+    "bluestore_readahead_max_bytes_hdd",
+    "bluestore_readahead_max_bytes_ssd",
     "osd_memory_target",
     "osd_memory_target_cgroup_limit_ratio",
     "osd_memory_base",
@@ -4256,9 +4654,20 @@ void BlueStore::handle_conf_change(const ConfigProxy& conf,
       _set_blob_size();
     }
   }
+  if (changed.count("bluestore_readahead_max_bytes") ||
+      changed.count("bluestore_readahead_max_bytes_hdd") ||
+      changed.count("bluestore_readahead_max_bytes_ssd")) {
+    if (bdev) {
+      // only after startup
+      _set_readahead();
+    }
+  }
   if (changed.count("bluestore_prefer_deferred_size") ||
       changed.count("bluestore_prefer_deferred_size_hdd") ||
       changed.count("bluestore_prefer_deferred_size_ssd") ||
+      changed.count("bluestore_prefer_deferred_adaptive") ||
+      changed.count("bluestore_write_coalesce_window") ||
+      changed.count("bluestore_write_coalesce_max_bytes") ||
       changed.count("bluestore_max_alloc_size") ||
       changed.count("bluestore_deferred_batch_ops") ||
       changed.count("bluestore_deferred_batch_ops_hdd") ||
@@ -4268,6 +4677,21 @@ void BlueStore::handle_conf_change(const ConfigProxy& conf,
       _set_alloc_sizes();
     }
   }
+  if (changed.count("bluestore_defrag")) {
+    std::lock_guard l(defrag_lock);
+    defrag_cond.notify_all();
+  }
+  if (changed.count("bluestore_tier_promote_hits")) {
+    _set_tier();
+  }
+  if (changed.count("bluestore_tier_promote_hits") ||
+      changed.count("bluestore_tier_demote_hits") ||
+      changed.count("bluestore_tier_decay_interval") ||
+      changed.count("bluestore_tier_fast_target_ratio") ||
+      changed.count("bluestore_tier_migrate_bytes_per_sec")) {
+    std::lock_guard l(tier_lock);
+    tier_cond.notify_all();
+  }
   if (changed.count("bluestore_throttle_cost_per_io") ||
       changed.count("bluestore_throttle_cost_per_io_hdd") ||
       changed.count("bluestore_throttle_cost_per_io_ssd")) {
@@ -4395,6 +4819,22 @@ void BlueStore::_set_blob_size()
            << std::dec << dendl;
 }
 
+void BlueStore::_set_readahead()
+{
+  if (cct->_conf->bluestore_readahead_max_bytes) {
+    readahead_max_bytes = cct->_conf->bluestore_readahead_max_bytes;
+  } else {
+    ceph_assert(bdev);
+    if (_use_rotational_settings()) {
+      readahead_max_bytes = cct->_conf->bluestore_readahead_max_bytes_hdd;
+    } else {
+      readahead_max_bytes = cct->_conf->bluestore_readahead_max_bytes_ssd;
+    }
+  }
+  dout(10) << __func__ << " readahead_max_bytes 0x" << std::hex
+           << readahead_max_bytes << std::dec << dendl;
+}
+
 void BlueStore::_update_osd_memory_options()
 {
   osd_memory_target = cct->_conf.get_val<Option::size_t>("osd_memory_target");
@@ -4635,6 +5075,24 @@ void BlueStore::_init_logger()
 		    "cached) to fill out the block");
   b.add_u64_counter(l_bluestore_write_small_new, "bluestore_write_small_new",
 		    "Small write into new (sparse) blob");
+  b.add_u64_counter(l_bluestore_write_adaptive_deferred,
+		    "bluestore_write_adaptive_deferred",
+		    "Small writes deferred because direct writes are slow");
+  b.add_u64_counter(l_bluestore_write_adaptive_direct,
+		    "bluestore_write_adaptive_direct",
+		    "Small writes done directly because direct writes are fast");
+  b.add_u64_counter(l_bluestore_write_adaptive_direct_backlog,
+		    "bluestore_write_adaptive_direct_backlog",
+		    "Small writes done directly because deferred writes are "
+		    "backing up");
+  b.add_u64_counter(l_bluestore_write_adaptive_direct_probe,
+		    "bluestore_write_adaptive_direct_probe",
+		    "Small writes done directly to keep measuring direct write "
+		    "latency");
+  b.add_time(l_bluestore_direct_write_lat_avg, "direct_write_lat_avg",
+	     "Moving average of direct write latency");
+  b.add_time(l_bluestore_kv_commit_lat_avg, "kv_commit_lat_avg",
+	     "Moving average of kv commit latency");
 
   b.add_u64_counter(l_bluestore_txc, "bluestore_txc", "Transactions committed");
   b.add_u64_counter(l_bluestore_onode_reshard, "bluestore_onode_reshard",
@@ -4650,6 +5108,15 @@ void BlueStore::_init_logger()
                     "Read EIO errors propagated to high level callers");
   b.add_u64_counter(l_bluestore_reads_with_retries, "bluestore_reads_with_retries",
                     "Read operations that required at least one retry due to failed checksum validation");
+  b.add_u64_counter(l_bluestore_readahead_issued, "bluestore_readahead_issued",
+                    "Readahead requests submitted for sequential streams");
+  b.add_u64_counter(l_bluestore_readahead_bytes, "bluestore_readahead_bytes",
+                    "Bytes prefetched into the buffer cache by readahead",
+                    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_readahead_hits, "bluestore_readahead_hits",
+                    "Reads served from a completed readahead");
+  b.add_u64_counter(l_bluestore_readahead_dropped, "bluestore_readahead_dropped",
+                    "Readahead results discarded due to races or errors");
   b.add_u64(l_bluestore_fragmentation, "bluestore_fragmentation_micros",
             "How fragmented bluestore free space is (free extents / max possible number of free extents) * 1000");
   b.add_time_avg(l_bluestore_omap_seek_to_first_lat, "omap_seek_to_first_lat",
@@ -4660,8 +5127,56 @@ void BlueStore::_init_logger()
     "Average omap iterator lower_bound call latency");
   b.add_time_avg(l_bluestore_omap_next_lat, "omap_next_lat",
     "Average omap iterator next call latency");
+  b.add_time_avg(l_bluestore_omap_get_batch_lat, "omap_get_batch_lat",
+    "Average batched omap read latency");
   b.add_time_avg(l_bluestore_clist_lat, "clist_lat",
     "Average collection listing latency");
+  b.add_time(l_bluestore_alloc_map_load_lat, "alloc_map_load_lat",
+    "Time spent loading the in-memory allocation map at mount");
+  b.add_u64_counter(l_bluestore_alloc_map_rebuilds, "alloc_map_rebuilds",
+    "Allocation map rebuilds from onodes after unclean shutdown");
+  b.add_u64(l_bluestore_bulk_remove_pending, "bulk_remove_pending",
+    "Removed collections whose objects are still being deleted");
+  b.add_u64_counter(l_bluestore_bulk_remove_objects, "bulk_remove_objects",
+    "Objects deleted by background collection removal");
+  b.add_u64_counter(l_bluestore_bulk_remove_bytes, "bulk_remove_bytes",
+    "Logical bytes deleted by background collection removal",
+    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_write_coalesced, "write_coalesced",
+    "Writes allocated right behind the previous write to the object");
+  b.add_u64_counter(l_bluestore_write_coalesce_missed, "write_coalesce_missed",
+    "Adjacent writes that needed a new reservation");
+  b.add_u64(l_bluestore_write_coalesce_reserved, "write_coalesce_reserved",
+    "Space reserved behind sequential small writes",
+    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_defrag_scanned, "defrag_scanned",
+    "Objects checked for fragmentation");
+  b.add_u64_counter(l_bluestore_defrag_objects, "defrag_objects",
+    "Fragmented objects rewritten");
+  b.add_u64_counter(l_bluestore_defrag_bytes, "defrag_bytes",
+    "Data rewritten by the defragmenter",
+    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_defrag_extents_saved, "defrag_extents_saved",
+    "Physical extents saved by the defragmenter");
+  b.add_u64_counter(l_bluestore_tier_placed_fast, "tier_placed_fast",
+    "Data allocated on the fast device",
+    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_tier_placed_slow, "tier_placed_slow",
+    "Data allocated on the main device of a tiered store",
+    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_tier_promoted, "tier_promoted",
+    "Hot objects moved to the fast device");
+  b.add_u64_counter(l_bluestore_tier_promoted_bytes, "tier_promoted_bytes",
+    "Data moved to the fast device",
+    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_tier_demoted, "tier_demoted",
+    "Cold objects moved off the fast device");
+  b.add_u64_counter(l_bluestore_tier_demoted_bytes, "tier_demoted_bytes",
+    "Data moved off the fast device",
+    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64(l_bluestore_tier_fast_used, "tier_fast_used",
+    "Space used on the fast device",
+    NULL, 0, unit_t(UNIT_BYTES));
   logger = b.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
 }
@@ -4852,21 +5367,91 @@ void BlueStore::_set_alloc_sizes(void)
     }
   }
 
+  prefer_deferred_adaptive = cct->_conf->bluestore_prefer_deferred_adaptive;
+  write_coalesce_window_ns = std::max(
+    0.0, cct->_conf->bluestore_write_coalesce_window * 1000000000.0);
+  write_coalesce_max_bytes = cct->_conf->bluestore_write_coalesce_max_bytes;
+
   dout(10) << __func__ << " min_alloc_size 0x" << std::hex << min_alloc_size
 	   << std::dec << " order " << (int)min_alloc_size_order
 	   << " max_alloc_size 0x" << std::hex << max_alloc_size
 	   << " prefer_deferred_size 0x" << prefer_deferred_size
 	   << std::dec
+	   << " prefer_deferred_adaptive " << prefer_deferred_adaptive
+	   << " write_coalesce_window_ns " << write_coalesce_window_ns
 	   << " deferred_batch_ops " << deferred_batch_ops
 	   << dendl;
 }
 
+static void update_lat_avg(std::atomic<uint64_t>& avg, ceph::timespan lat)
+{
+  // racy, but it is only a hint
+  uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(lat).count();
+  uint64_t cur = avg.load();
+  avg = cur ? (cur * 7 + ns) / 8 : ns;
+}
+
+bool BlueStore::_use_deferred_write(uint64_t length)
+{
+  if (!prefer_deferred_adaptive) {
+    return length <= prefer_deferred_size;
+  }
+  if (length > cct->_conf->bluestore_prefer_deferred_adaptive_max_size) {
+    return false;
+  }
+  uint64_t direct_lat = direct_write_lat_avg;
+  uint64_t kv_lat = kv_commit_lat_avg;
+  if (!direct_lat || !kv_lat ||
+      direct_lat <= kv_lat * cct->_conf->bluestore_prefer_deferred_adaptive_ratio) {
+    logger->inc(l_bluestore_write_adaptive_direct);
+    return false;
+  }
+  if (throttle.should_submit_deferred()) {
+    // deferring more would only make the device catch up later
+    logger->inc(l_bluestore_write_adaptive_direct_backlog);
+    return false;
+  }
+  // we would never learn that the device got faster otherwise
+  if (++adaptive_probe % 16 == 0) {
+    logger->inc(l_bluestore_write_adaptive_direct_probe);
+    return false;
+  }
+  logger->inc(l_bluestore_write_adaptive_deferred);
+  return true;
+}
+
 int BlueStore::_open_bdev(bool create)
 {
   ceph_assert(bdev == NULL);
   string p = path + "/block";
-  bdev = BlockDevice::create(cct, p, aio_cb, static_cast<void*>(this), discard_cb, static_cast<void*>(this));
-  int r = bdev->open(p);
+  // a fast data device can only be added at mkfs time; after that the
+  // offset it is mapped at is part of the on-disk format
+  uint64_t tier_fast_offset = 0;
+  bool tiered = false;
+  if (!create) {
+    string s;
+    if (read_meta("tier_fast_offset", &s) == 0) {
+      tier_fast_offset = strtoull(s.c_str(), nullptr, 10);
+      tiered = true;
+    }
+  } else {
+    tiered = ::faccessat(path_fd, "block.fast", F_OK, 0) == 0;
+  }
+  int r;
+  if (tiered) {
+#if defined(HAVE_LIBAIO) || defined(HAVE_POSIXAIO)
+    tier_bdev = new TieredDevice(cct, tier_fast_offset,
+				 aio_cb, static_cast<void*>(this),
+				 discard_cb, static_cast<void*>(this));
+    bdev = tier_bdev;
+#else
+    derr << __func__ << " a fast data device needs kernel aio" << dendl;
+    return -EOPNOTSUPP;
+#endif
+  } else {
+    bdev = BlockDevice::create(cct, p, aio_cb, static_cast<void*>(this), discard_cb, static_cast<void*>(this));
+  }
+  r = bdev->open(p);
   if (r < 0)
     goto fail;
 
@@ -4875,7 +5460,21 @@ int BlueStore::_open_bdev(bool create)
   }
 
   if (bdev->supported_bdev_label()) {
-    r = _check_or_set_bdev_label(p, bdev->get_size(), "main", create);
+    r = _check_or_set_bdev_label(
+      p, tier_bdev ? tier_bdev->get_slow_size() : bdev->get_size(),
+      "main", create);
+    if (r < 0)
+      goto fail_close;
+    if (tier_bdev) {
+      r = _check_or_set_bdev_label(path + "/block.fast",
+				   tier_bdev->get_fast_size(), "fast", create);
+      if (r < 0)
+	goto fail_close;
+    }
+  }
+  if (create && tier_bdev) {
+    r = write_meta("tier_fast_offset",
+		   stringify(tier_bdev->get_fast_offset()));
     if (r < 0)
       goto fail_close;
   }
@@ -4898,6 +5497,7 @@ int BlueStore::_open_bdev(bool create)
  fail:
   delete bdev;
   bdev = NULL;
+  tier_bdev = nullptr;
   return r;
 }
 
@@ -4906,16 +5506,7 @@ void BlueStore::_validate_bdev()
   ceph_assert(bdev);
   ceph_assert(min_alloc_size); // _get_odisk_reserved depends on that
   uint64_t dev_size = bdev->get_size();
-  if (dev_size < 
-    _get_ondisk_reserved() + cct->_conf->bluestore_bluefs_min) {
-    dout(1) << __func__ << " main device size " << byte_u_t(dev_size)
-            << " is too small, disable bluestore_bluefs_min for now"
-            << dendl;
-    ceph_assert(dev_size >= _get_ondisk_reserved());
-
-    int r = cct->_conf.set_val("bluestore_bluefs_min", "0");
-    ceph_assert(r == 0);
-  }
+  ceph_assert(dev_size >= _get_ondisk_reserved());
 }
 
 void BlueStore::_close_bdev()
@@ -4924,6 +5515,7 @@ void BlueStore::_close_bdev()
   bdev->close();
   delete bdev;
   bdev = NULL;
+  tier_bdev = nullptr;
 }
 
 int BlueStore::_open_fm(KeyValueDB::Transaction t)
@@ -4946,19 +5538,17 @@ int BlueStore::_open_fm(KeyValueDB::Transaction t)
 
     // allocate superblock reserved space.  note that we do not mark
     // bluefs space as allocated in the freelist; we instead rely on
-    // bluefs_extents.
+    // bluefs reporting the extents it uses when the allocator is opened.
     auto reserved = _get_ondisk_reserved();
     fm->allocate(0, reserved, t);
 
-    if (cct->_conf->bluestore_bluefs) {
-      ceph_assert(bluefs_extents.num_intervals() == 1);
-      interval_set<uint64_t>::iterator p = bluefs_extents.begin();
-      reserved = round_up_to(p.get_start() + p.get_len(), min_alloc_size);
-      dout(20) << __func__ << " reserved 0x" << std::hex << reserved << std::dec
-	       << " for bluefs" << dendl;
-    }
-
     if (cct->_conf->bluestore_debug_prefill > 0) {
+      // don't prefill what bluefs has already taken from the allocator
+      interval_set<uint64_t> bluefs_used;
+      if (bluefs) {
+	bluefs->get_block_extents(bluefs_layout.shared_bdev, &bluefs_used);
+      }
+
       uint64_t end = bdev->get_size() - reserved;
       dout(1) << __func__ << " pre-fragmenting freespace, using "
 	      << cct->_conf->bluestore_debug_prefill << " with max free extent "
@@ -4995,7 +5585,18 @@ int BlueStore::_open_fm(KeyValueDB::Transaction t)
           break;
         }
 
-	fm->allocate(start + l, u, t);
+	interval_set<uint64_t> fill, busy;
+	fill.insert(start + l, u);
+	busy.intersection_of(fill, bluefs_used);
+	fill.subtract(busy);
+	for (auto p = fill.begin(); p != fill.end(); ++p) {
+	  fm->allocate(p.get_start(), p.get_len(), t);
+	  // keep the allocator in sync as bluefs may allocate more
+	  // before mkfs completes
+	  if (alloc) {
+	    alloc->init_rm_free(p.get_start(), p.get_len());
+	  }
+	}
 	start += l + u;
       }
     }
@@ -5033,11 +5634,51 @@ void BlueStore::_close_fm()
   fm = NULL;
 }
 
-int BlueStore::_open_alloc()
+int BlueStore::_create_alloc()
 {
   ceph_assert(alloc == NULL);
   ceph_assert(bdev->get_size());
 
+  if (tier_bdev) {
+    uint64_t slow_size = p2align(tier_bdev->get_slow_size(),
+				 (uint64_t)min_alloc_size);
+    uint64_t fast_size = p2align(tier_bdev->get_fast_size(),
+				 (uint64_t)min_alloc_size);
+    Allocator *slow = Allocator::create(cct, cct->_conf->bluestore_allocator,
+					slow_size, min_alloc_size,
+					"block.slow");
+    Allocator *fast = Allocator::create(cct, cct->_conf->bluestore_allocator,
+					fast_size, min_alloc_size,
+					"block.fast");
+    if (!slow || !fast) {
+      lderr(cct) << __func__ << " Allocator::unknown alloc type "
+		 << cct->_conf->bluestore_allocator
+		 << dendl;
+      delete slow;
+      delete fast;
+      return -EINVAL;
+    }
+    tier_alloc = new TieredAllocator(cct, slow, slow_size,
+				     fast, tier_bdev->get_fast_offset(),
+				     fast_size, "block");
+    alloc = tier_alloc;
+    return 0;
+  }
+
+  alloc = Allocator::create(cct, cct->_conf->bluestore_allocator,
+                            bdev->get_size(),
+                            min_alloc_size, "block");
+  if (!alloc) {
+    lderr(cct) << __func__ << " Allocator::unknown alloc type "
+               << cct->_conf->bluestore_allocator
+               << dendl;
+    return -EINVAL;
+  }
+  return 0;
+}
+
+int BlueStore::_open_alloc()
+{
   if (bluefs) {
     bluefs_extents.clear();
     auto r = bluefs->get_block_extents(bluefs_layout.shared_bdev,
@@ -5053,36 +5694,61 @@ int BlueStore::_open_alloc()
 	     << dendl;
   }
 
-  alloc = Allocator::create(cct, cct->_conf->bluestore_allocator,
-                            bdev->get_size(),
-                            min_alloc_size, "block");
-  if (!alloc) {
-    lderr(cct) << __func__ << " Allocator::unknown alloc type "
-               << cct->_conf->bluestore_allocator
-               << dendl;
-    return -EINVAL;
+  int r = _create_alloc();
+  if (r < 0) {
+    return r;
   }
 
   uint64_t num = 0, bytes = 0;
 
   dout(1) << __func__ << " opening allocation metadata" << dendl;
-  // initialize from freelist
-  fm->enumerate_reset();
-  uint64_t offset, length;
-  while (fm->enumerate_next(db, &offset, &length)) {
-    alloc->init_add_free(offset, length);
-    ++num;
-    bytes += length;
-  }
-  fm->enumerate_reset();
-  dout(1) << __func__ << " loaded " << byte_u_t(bytes)
-	  << " in " << num << " extents"
-	  << dendl;
-
-  // also mark bluefs space as allocated
-  for (auto e = bluefs_extents.begin(); e != bluefs_extents.end(); ++e) {
-    alloc->init_rm_free(e.get_start(), e.get_len());
+  if (fm->is_null_manager()) {
+    // the allocator is the only record of free space: take it from the
+    // snapshot saved at the last clean shutdown, or rebuild it
+    auto start = mono_clock::now();
+    r = _load_alloc_snapshot(&num, &bytes);
+    if (r < 0) {
+      if (r != -ENOENT) {
+	// might have been partially loaded
+	alloc->shutdown();
+	delete alloc;
+	alloc = nullptr;
+	r = _create_alloc();
+	if (r < 0) {
+	  return r;
+	}
+      }
+      num = bytes = 0;
+      r = _rebuild_alloc_from_onodes(&num, &bytes);
+      if (r < 0) {
+	alloc->shutdown();
+	delete alloc;
+	alloc = nullptr;
+	return r;
+      }
+    }
+    logger->tinc(l_bluestore_alloc_map_load_lat, mono_clock::now() - start);
+  } else {
+    // initialize from freelist
+    fm->enumerate_reset();
+    uint64_t offset, length;
+    while (fm->enumerate_next(db, &offset, &length)) {
+      alloc->init_add_free(offset, length);
+      ++num;
+      bytes += length;
+    }
+    fm->enumerate_reset();
+  }
+  dout(1) << __func__ << " loaded " << byte_u_t(bytes)
+	  << " in " << num << " extents"
+	  << dendl;
+
+  // also mark bluefs space as allocated
+  for (auto e = bluefs_extents.begin(); e != bluefs_extents.end(); ++e) {
+    alloc->init_rm_free(e.get_start(), e.get_len());
   }
+  // from now on bluefs allocates from us on the shared device
+  shared_alloc.set(tier_alloc ? tier_alloc->get_slow() : alloc);
 
   return 0;
 }
@@ -5093,12 +5759,337 @@ void BlueStore::_close_alloc()
   bdev->discard_drain();
 
   ceph_assert(alloc);
+  shared_alloc.reset();
   alloc->shutdown();
   delete alloc;
   alloc = NULL;
+  tier_alloc = nullptr;
   bluefs_extents.clear();
 }
 
+int BlueStore::_load_alloc_snapshot(uint64_t *num, uint64_t *bytes)
+{
+  bufferlist bl;
+  int r = db->get(PREFIX_SUPER, "alloc_snapshot", &bl);
+  if (r < 0) {
+    dout(1) << __func__ << " no allocation snapshot, store was not shut "
+	    << "down cleanly" << dendl;
+    return -ENOENT;
+  }
+  uint64_t size = 0, alloc_unit = 0, extents = 0, free_bytes = 0;
+  uint32_t chunks = 0, loaded_chunks = 0;
+  try {
+    auto p = bl.cbegin();
+    DECODE_START(1, p);
+    decode(size, p);
+    decode(alloc_unit, p);
+    decode(chunks, p);
+    decode(extents, p);
+    decode(free_bytes, p);
+    DECODE_FINISH(p);
+  } catch (buffer::error& e) {
+    derr << __func__ << " failed to decode allocation snapshot header"
+	 << dendl;
+    return -EIO;
+  }
+  if (size != fm->get_size() || alloc_unit != min_alloc_size) {
+    derr << __func__ << " allocation snapshot is for size 0x" << std::hex
+	 << size << " alloc unit 0x" << alloc_unit << ", expected 0x"
+	 << fm->get_size() << "/0x" << min_alloc_size << std::dec << dendl;
+    return -EIO;
+  }
+
+  KeyValueDB::Iterator it = db->get_iterator(PREFIX_ALLOC_SNAPSHOT);
+  for (it->lower_bound(string()); it->valid(); it->next()) {
+    interval_set<uint64_t> chunk;
+    try {
+      bufferlist v = it->value();
+      auto p = v.cbegin();
+      decode(chunk, p);
+    } catch (buffer::error& e) {
+      derr << __func__ << " failed to decode allocation snapshot chunk "
+	   << pretty_binary_string(it->key()) << dendl;
+      return -EIO;
+    }
+    for (auto e = chunk.begin(); e != chunk.end(); ++e) {
+      if (e.get_start() + e.get_len() > size) {
+	derr << __func__ << " allocation snapshot extent 0x" << std::hex
+	     << e.get_start() << "~" << e.get_len() << " is past the end 0x"
+	     << size << std::dec << dendl;
+	return -EIO;
+      }
+      alloc->init_add_free(e.get_start(), e.get_len());
+      ++*num;
+      *bytes += e.get_len();
+    }
+    ++loaded_chunks;
+  }
+  if (loaded_chunks != chunks || *num != extents || *bytes != free_bytes) {
+    derr << __func__ << " allocation snapshot is inconsistent, loaded "
+	 << loaded_chunks << "/" << chunks << " chunks, "
+	 << *num << "/" << extents << " extents, "
+	 << *bytes << "/" << free_bytes << " bytes" << dendl;
+    return -EIO;
+  }
+  dout(1) << __func__ << " loaded " << byte_u_t(*bytes) << " in "
+	  << *num << " extents from " << chunks << " chunks" << dendl;
+  return 0;
+}
+
+int BlueStore::_rebuild_alloc_from_onodes(uint64_t *num, uint64_t *bytes)
+{
+  dout(1) << __func__ << " rebuilding allocation map from onodes" << dendl;
+  auto start = mono_clock::now();
+
+  // everything referenced by a blob (or about to be released by a
+  // pending deferred transaction) is in use; so is the reserved area.
+  interval_set<uint64_t> used;
+  used.insert(0, _get_ondisk_reserved());
+  ceph::mutex used_lock =
+    ceph::make_mutex("BlueStore::rebuild_alloc::used_lock");
+  std::atomic<uint64_t> num_onodes = {0};
+  std::atomic<uint64_t> errors = {0};
+
+  typedef std::vector<std::pair<string, bufferlist>> batch_t;
+  const size_t batch_size = 1024;
+  const size_t thread_count = cct->_conf->bluestore_fsck_threads;
+  std::deque<batch_t> queue;
+  bool done = false;
+  ceph::mutex queue_lock =
+    ceph::make_mutex("BlueStore::rebuild_alloc::queue_lock");
+  ceph::condition_variable queue_cond;
+
+  auto process = [&](batch_t& batch, BlueStore::Collection *c,
+		     interval_set<uint64_t>& local) {
+    for (auto& [key, value] : batch) {
+      ghobject_t oid;
+      if (get_key_object(key, &oid) < 0) {
+	derr << __func__ << " bad object key "
+	     << pretty_binary_string(key) << dendl;
+	++errors;
+	continue;
+      }
+      try {
+	OnodeRef o(Onode::decode(c, oid, key, value));
+	o->extent_map.fault_range(db, 0, OBJECT_MAX_SIZE);
+	auto note = [&](const BlobRef& b) {
+	  for (auto& p : b->get_blob().get_extents()) {
+	    if (p.is_valid()) {
+	      local.union_insert(p.offset, p.length);
+	    }
+	  }
+	};
+	for (auto& e : o->extent_map.extent_map) {
+	  note(e.blob);
+	}
+	for (auto& i : o->extent_map.spanning_blob_map) {
+	  note(i.second);
+	}
+      } catch (buffer::error& e) {
+	derr << __func__ << " failed to decode onode " << oid << dendl;
+	++errors;
+	continue;
+      }
+      ++num_onodes;
+    }
+  };
+  auto new_coll = [&](size_t i) {
+    return ceph::make_ref<Collection>(
+      this,
+      onode_cache_shards[i % onode_cache_shards.size()],
+      buffer_cache_shards[i % buffer_cache_shards.size()],
+      coll_t());
+  };
+  auto worker = [&](size_t i) {
+    CollectionRef c = new_coll(i);
+    interval_set<uint64_t> local;
+    std::unique_lock l(queue_lock);
+    while (true) {
+      queue_cond.wait(l, [&] { return done || !queue.empty(); });
+      if (queue.empty()) {
+	break;
+      }
+      batch_t batch = std::move(queue.front());
+      queue.pop_front();
+      queue_cond.notify_all();
+      l.unlock();
+      process(batch, c.get(), local);
+      l.lock();
+    }
+    l.unlock();
+    std::lock_guard ul(used_lock);
+    used.union_of(local);
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads.emplace_back(make_named_thread("bstore_alloc_rb", worker, i));
+  }
+  CollectionRef c = new_coll(thread_count);
+  interval_set<uint64_t> mine;
+  batch_t batch;
+  auto dispatch = [&]() {
+    if (thread_count == 0) {
+      process(batch, c.get(), mine);
+    } else {
+      std::unique_lock l(queue_lock);
+      queue_cond.wait(l, [&] { return queue.size() < thread_count * 2; });
+      queue.emplace_back(std::move(batch));
+      queue_cond.notify_all();
+    }
+    batch.clear();
+  };
+  KeyValueDB::Iterator it = db->get_iterator(PREFIX_OBJ);
+  for (it->lower_bound(string()); it->valid(); it->next()) {
+    // extent shards are faulted in with their onode
+    if (is_extent_shard_key(it->key())) {
+      continue;
+    }
+    batch.emplace_back(it->key(), it->value());
+    if (batch.size() >= batch_size) {
+      dispatch();
+    }
+  }
+  if (!batch.empty()) {
+    dispatch();
+  }
+  {
+    std::lock_guard l(queue_lock);
+    done = true;
+    queue_cond.notify_all();
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  used.union_of(mine);
+
+  it = db->get_iterator(PREFIX_DEFERRED);
+  for (it->lower_bound(string()); it->valid(); it->next()) {
+    bluestore_deferred_transaction_t wt;
+    try {
+      bufferlist bl = it->value();
+      auto p = bl.cbegin();
+      decode(wt, p);
+    } catch (buffer::error& e) {
+      derr << __func__ << " failed to decode deferred txn "
+	   << pretty_binary_string(it->key()) << dendl;
+      ++errors;
+      continue;
+    }
+    used.union_of(wt.released);
+  }
+  if (errors) {
+    derr << __func__ << " " << errors << " errors, refusing to guess "
+	 << "free space; run fsck" << dendl;
+    return -EIO;
+  }
+
+  uint64_t end = fm->get_size();
+  uint64_t pos = 0;
+  auto add_free = [&](uint64_t offset, uint64_t length) {
+    alloc->init_add_free(offset, length);
+    ++*num;
+    *bytes += length;
+  };
+  for (auto p = used.begin(); p != used.end() && pos < end; ++p) {
+    if (p.get_start() > pos) {
+      add_free(pos, std::min(p.get_start(), end) - pos);
+    }
+    pos = std::max(pos, p.get_end());
+  }
+  if (pos < end) {
+    add_free(pos, end - pos);
+  }
+
+  double secs = std::chrono::duration<double>(mono_clock::now() - start).count();
+  dout(1) << __func__ << " scanned " << num_onodes << " onodes with "
+	  << thread_count << " threads in " << secs << "s ("
+	  << (secs > 0 ? (uint64_t)(num_onodes / secs) : (uint64_t)num_onodes)
+	  << " onodes/s), " << byte_u_t(*bytes) << " free in " << *num
+	  << " extents" << dendl;
+  logger->inc(l_bluestore_alloc_map_rebuilds);
+  return 0;
+}
+
+void BlueStore::_invalidate_alloc_snapshot()
+{
+  // any allocation change from now on makes the snapshot stale; drop it
+  // before the first transaction so a crash forces a rebuild
+  dout(10) << __func__ << dendl;
+  KeyValueDB::Transaction t = db->get_transaction();
+  t->rmkey(PREFIX_SUPER, "alloc_snapshot");
+  db->submit_transaction_sync(t);
+  alloc_snapshot_stale = true;
+}
+
+void BlueStore::_write_alloc_snapshot()
+{
+  ceph_assert(fm->is_null_manager());
+  // let async discards hand their extents back first
+  bdev->discard_drain();
+
+  // Save bluefs' extents as free too: bluefs keeps allocating from us
+  // until the db is closed and reports what it owns when we next mount.
+  interval_set<uint64_t> free;
+  auto dump_alloc = [&]() {
+    alloc->dump([&](uint64_t offset, uint64_t length) {
+      free.union_insert(offset, length);
+    });
+  };
+  if (bluefs) {
+    // an extent bluefs released between the two views would be in
+    // neither, so dump the allocator while bluefs is held still
+    interval_set<uint64_t> bluefs_used;
+    int r = bluefs->freeze_block_extents(bluefs_layout.shared_bdev,
+					 &bluefs_used, dump_alloc);
+    ceph_assert(r == 0);
+    free.union_of(bluefs_used);
+  } else {
+    dump_alloc();
+  }
+
+  const uint64_t max_chunk_extents = 65536;
+  KeyValueDB::Transaction t = db->get_transaction();
+  t->rmkeys_by_prefix(PREFIX_ALLOC_SNAPSHOT);
+  uint32_t chunks = 0;
+  uint64_t extents = 0, free_bytes = 0;
+  interval_set<uint64_t> chunk;
+  auto flush_chunk = [&]() {
+    string key;
+    _key_encode_u64(chunks++, &key);
+    bufferlist bl;
+    encode(chunk, bl);
+    t->set(PREFIX_ALLOC_SNAPSHOT, key, bl);
+    chunk.clear();
+  };
+  for (auto p = free.begin(); p != free.end(); ++p) {
+    chunk.insert(p.get_start(), p.get_len());
+    ++extents;
+    free_bytes += p.get_len();
+    if (chunk.num_intervals() >= max_chunk_extents) {
+      flush_chunk();
+    }
+  }
+  if (!chunk.empty()) {
+    flush_chunk();
+  }
+  {
+    bufferlist bl;
+    ENCODE_START(1, 1, bl);
+    encode(fm->get_size(), bl);
+    encode((uint64_t)min_alloc_size, bl);
+    encode(chunks, bl);
+    encode(extents, bl);
+    encode(free_bytes, bl);
+    ENCODE_FINISH(bl);
+    t->set(PREFIX_SUPER, "alloc_snapshot", bl);
+  }
+  db->submit_transaction_sync(t);
+  alloc_snapshot_stale = false;
+  dout(1) << __func__ << " saved " << byte_u_t(free_bytes) << " in "
+	  << extents << " extents, " << chunks << " chunks" << dendl;
+}
+
 int BlueStore::_open_fsid(bool create)
 {
   ceph_assert(fsid_fd < 0);
@@ -5310,18 +6301,15 @@ int BlueStore::_minimal_open_bluefs(bool create)
   bfn = path + "/block";
   // never trim here
   r = bluefs->add_block_device(bluefs_layout.shared_bdev, bfn, false,
-			       true /* shared with bluestore */);
+			       &shared_alloc);
   if (r < 0) {
     derr << __func__ << " add block device(" << bfn << ") returned: "
 	  << cpp_strerror(r) << dendl;
     goto free_bluefs;
   }
   if (create) {
-    // note: we always leave the first SUPER_RESERVED (8k) of the device unused
-    uint64_t initial =
-      bdev->get_size() * (cct->_conf->bluestore_bluefs_min_ratio +
-			  cct->_conf->bluestore_bluefs_gift_ratio);
-    initial = std::max(initial, cct->_conf->bluestore_bluefs_min);
+    // bluefs allocates from our allocator on the shared device, so its
+    // allocation unit has to be compatible with ours
     uint64_t alloc_size = cct->_conf->bluefs_shared_alloc_size;
     if (alloc_size % min_alloc_size) {
       derr << __func__ << " bluefs_shared_alloc_size 0x" << std::hex
@@ -5330,17 +6318,6 @@ int BlueStore::_minimal_open_bluefs(bool create)
       r = -EINVAL;
       goto free_bluefs;
     }
-    // align to bluefs's alloc_size
-    initial = p2roundup(initial, alloc_size);
-    // put bluefs in the middle of the device in case it is an HDD
-    uint64_t start = p2align((bdev->get_size() - initial) / 2, alloc_size);
-    //avoiding superblock overwrite
-    start = std::max(alloc_size, start);
-    ceph_assert(start >=_get_ondisk_reserved());
-
-    bluefs->add_block_extent(bluefs_layout.shared_bdev, start, initial);
-    bluefs_extents.insert(start, initial);
-    ++out_of_sync_fm;
   }
 
   bfn = path + "/block.wal";
@@ -5511,6 +6488,9 @@ int BlueStore::_open_db_and_around(bool read_only)
 	_close_fm();
 	return r;
       }
+      if (fm->is_null_manager()) {
+	_invalidate_alloc_snapshot();
+      }
     }
   } else {
     r = _open_db(false, false);
@@ -5529,6 +6509,10 @@ int BlueStore::_open_db_and_around(bool read_only)
     r = _open_alloc();
     if (r < 0)
       goto out_fm;
+
+    if (!read_only && fm->is_null_manager()) {
+      _invalidate_alloc_snapshot();
+    }
   }
   return 0;
 
@@ -5542,23 +6526,7 @@ int BlueStore::_open_db_and_around(bool read_only)
 void BlueStore::_close_db_and_around()
 {
   if (bluefs) {
-    if (out_of_sync_fm.fetch_and(0)) {
-      _sync_bluefs_and_fm();
-    }
     _close_db();
-    while(out_of_sync_fm.fetch_and(0)) {
-      // if seen some allocations during close - repeat open_db, sync fm, close
-      dout(0) << __func__ << " syncing FreelistManager" << dendl;
-      int r = _open_db(false, false, false);
-      if (r < 0) {
-	derr << __func__
-	      << " unable to open db, FreelistManager is probably out of sync"
-	      << dendl;
-	break;
-      }
-      _sync_bluefs_and_fm();
-      _close_db();
-    }
     if (!_kv_only) {
       _close_alloc();
       _close_fm();
@@ -5570,30 +6538,6 @@ void BlueStore::_close_db_and_around()
   }
 }
 
-// updates legacy bluefs related recs in DB to a state valid for
-// downgrades from nautilus.
-void BlueStore::_sync_bluefs_and_fm()
-{
-  if (cct->_conf->bluestore_bluefs_db_compatibility) {
-    bufferlist bl;
-    encode(bluefs_extents, bl);
-    dout(20) << __func__ << " bluefs_extents at KV is now 0x"
-             << std::hex << bluefs_extents << std::dec
-	     << dendl;
-    KeyValueDB::Transaction synct = db->get_transaction();
-    synct->set(PREFIX_SUPER, "bluefs_extents", bl);
-    synct->set(PREFIX_SUPER, "bluefs_extents_back", bl);
-
-    // Nice thing is that we don't need to update FreelistManager here.
-    // It always has corresponding bits set to 'Free' for both Nautilus+ and
-    // pre-Nautilis releases.
-    // So once we get an extent to bluefs_extents this means it's
-    // been free in allocator and hence it's free in FM too.
-
-    db->submit_transaction_sync(synct);
-  }
-}
-
 int BlueStore::_open_db(bool create, bool to_repair_db, bool read_only)
 {
   int r;
@@ -5659,7 +6603,6 @@ int BlueStore::_open_db(bool create, bool to_repair_db, bool read_only)
       // simplify the dir names, too, as "seen" by rocksdb
       fn = "db";
     }
-    bluefs->set_slow_device_expander(this);
     BlueFSVolumeSelector::paths paths;
     bluefs->get_vselector_paths(fn, paths);
 
@@ -5751,14 +6694,17 @@ int BlueStore::_open_db(bool create, bool to_repair_db, bool read_only)
   if (kv_backend == "rocksdb") {
     options = cct->_conf->bluestore_rocksdb_options;
 
-    map<string,string> cf_map;
-    cct->_conf.with_val<string>("bluestore_rocksdb_cfs",
-                                 get_str_map,
-                                 &cf_map,
-                                 " \t");
-    for (auto& i : cf_map) {
-      dout(10) << "column family " << i.first << ": " << i.second << dendl;
-      cfs.push_back(KeyValueDB::ColumnFamily(i.first, i.second));
+    r = KeyValueDB::parse_sharding(
+      cct->_conf.get_val<string>("bluestore_rocksdb_cfs"), &cfs, err);
+    if (r < 0) {
+      derr << __func__ << " invalid bluestore_rocksdb_cfs: " << err.str()
+	   << dendl;
+      _close_db();
+      return r;
+    }
+    for (auto& i : cfs) {
+      dout(10) << "column family " << i.name << " shards " << i.shard_cnt
+	       << ": " << i.option << dendl;
     }
   }
 
@@ -5798,194 +6744,19 @@ void BlueStore::_close_db()
   }
 }
 
-void BlueStore::_dump_alloc_on_failure()
-{
-  auto dump_interval =
-    cct->_conf->bluestore_bluefs_alloc_failure_dump_interval;
-  if (dump_interval > 0 &&
-    next_dump_on_bluefs_alloc_failure <= ceph_clock_now()) {
-    alloc->dump();
-    next_dump_on_bluefs_alloc_failure = ceph_clock_now();
-    next_dump_on_bluefs_alloc_failure += dump_interval;
-  }
-}
-
-
-int BlueStore::allocate_bluefs_freespace(
-  uint64_t min_size,
-  uint64_t size,
-  PExtentVector* extents_out)
-{
-  ceph_assert(min_size <= size);
-  if (size) {
-    // round up to alloc size
-    uint64_t alloc_size = bluefs->get_alloc_size(bluefs_layout.shared_bdev);
-    min_size = p2roundup(min_size, alloc_size);
-    size = p2roundup(size, alloc_size);
-
-    PExtentVector extents_local;
-    PExtentVector* extents = extents_out ? extents_out : &extents_local;
-
-
-    uint64_t gift;
-    uint64_t allocated = 0;
-    int64_t alloc_len;
-    do {
-      // hard cap to fit into 32 bits
-      gift = std::min<uint64_t>(size, 1ull << 30);
-      dout(10) << __func__ << " gifting " << gift
-	       << " (" << byte_u_t(gift) << ")" << dendl;
-
-      alloc_len = alloc->allocate(gift, alloc_size, 0, 0, extents);
-      if (alloc_len > 0) {
-	allocated += alloc_len;
-	size -= alloc_len;
-      }
-
-      if (alloc_len < 0 || 
-          (alloc_len < (int64_t)gift && (min_size > allocated))) {
-	derr << __func__
-	      << " failed to allocate on 0x" << std::hex << gift
-	      << " min_size 0x" << min_size
-	      << " > allocated total 0x" << allocated
-	      << " bluefs_shared_alloc_size 0x" << alloc_size
-	      << " allocated 0x" << (alloc_len < 0 ? 0 : alloc_len)
-	      << " available 0x " << alloc->get_free()
-	      << std::dec << dendl;
-
-	_dump_alloc_on_failure();
-	alloc->release(*extents);
-	extents->clear();
-	return -ENOSPC;
-      }
-    } while (size && alloc_len > 0);
-    for (auto& e : *extents) {
-      dout(5) << __func__ << " gifting " << e << " to bluefs" << dendl;
-      bluefs_extents.insert(e.offset, e.length);
-      ++out_of_sync_fm;
-      // apply to bluefs if not requested from outside
-      if (!extents_out) {
-        bluefs->add_block_extent(bluefs_layout.shared_bdev, e.offset, e.length);
-      }
-    }
-  }
-  return 0;
-}
-
-uint64_t BlueStore::available_freespace(uint64_t alloc_size) {
-  uint64_t total = 0;
-  auto iterated_allocation = [&](uint64_t off, uint64_t len) {
-    //only count in size that is alloc_size aligned
-    uint64_t dist_to_alignment;
-    uint64_t offset_in_block = off & (alloc_size - 1);
-    if (offset_in_block == 0)
-      dist_to_alignment = 0;
-    else
-      dist_to_alignment = alloc_size - offset_in_block;
-    if (dist_to_alignment >= len)
-      return;
-    len -= dist_to_alignment;
-    total += p2align(len, alloc_size);
-  };
-  alloc->dump(iterated_allocation);
-  return total;
-}
-
-int64_t BlueStore::_get_bluefs_size_delta(uint64_t bluefs_free, uint64_t bluefs_total)
+void BlueStore::_check_bluefs_spillover()
 {
-  float bluefs_free_ratio = (float)bluefs_free / (float)bluefs_total;
-
-  uint64_t my_free = alloc->get_free();
-  uint64_t total = bdev->get_size();
-  float my_free_ratio = (float)my_free / (float)total;
-
-  uint64_t total_free = bluefs_free + my_free;
-
-  float bluefs_ratio = (float)bluefs_free / (float)total_free;
-
-  dout(10) << __func__
-	   << " bluefs " << byte_u_t(bluefs_free)
-	   << " free (" << bluefs_free_ratio
-	   << ") bluestore " << byte_u_t(my_free)
-	   << " free (" << my_free_ratio
-	   << "), bluefs_ratio " << bluefs_ratio
-	   << dendl;
-
-  uint64_t gift = 0;
-  uint64_t reclaim = 0;
-  if (bluefs_ratio < cct->_conf->bluestore_bluefs_min_ratio) {
-    gift = cct->_conf->bluestore_bluefs_gift_ratio * total_free;
-    if (gift >= my_free)
-      gift = my_free / 2;
-    dout(10) << __func__ << " bluefs_ratio " << bluefs_ratio
-	     << " < min_ratio " << cct->_conf->bluestore_bluefs_min_ratio
-	     << ", should gift " << byte_u_t(gift) << dendl;
-  } else if (bluefs_ratio > cct->_conf->bluestore_bluefs_max_ratio) {
-    reclaim = cct->_conf->bluestore_bluefs_reclaim_ratio * total_free;
-    if (bluefs_total - reclaim < cct->_conf->bluestore_bluefs_min)
-      reclaim = bluefs_total - cct->_conf->bluestore_bluefs_min;
-    if (reclaim >= bluefs_free)
-      reclaim = bluefs_free / 2;
-    dout(10) << __func__ << " bluefs_ratio " << bluefs_ratio
-	     << " > max_ratio " << cct->_conf->bluestore_bluefs_max_ratio
-	     << ", should reclaim " << byte_u_t(reclaim) << dendl;
-  }
-
-  // don't take over too much of the freespace
-  uint64_t free_cap = cct->_conf->bluestore_bluefs_max_ratio * total_free;
-  if (bluefs_total < cct->_conf->bluestore_bluefs_min &&
-      cct->_conf->bluestore_bluefs_min < free_cap) {
-    uint64_t g = cct->_conf->bluestore_bluefs_min - bluefs_total;
-    dout(10) << __func__ << " bluefs_total " << bluefs_total
-	     << " < min " << cct->_conf->bluestore_bluefs_min
-	     << ", should gift " << byte_u_t(g) << dendl;
-    if (g > gift)
-      gift = g;
-    reclaim = 0;
-  }
-  uint64_t min_free =
-    cct->_conf.get_val<Option::size_t>("bluestore_bluefs_min_free");
-  if (bluefs_free < min_free &&
-      min_free < free_cap) {
-    uint64_t g = min_free - bluefs_free;
-    dout(10) << __func__ << " bluefs_free " << bluefs_free
-	     << " < min " << min_free
-	     << ", should gift " << byte_u_t(g) << dendl;
-    if (g > gift)
-      gift = g;
-    reclaim = 0;
-  }
-  uint64_t max_free =
-    cct->_conf.get_val<Option::size_t>("bluestore_bluefs_max_free");
-  if (bluefs_free > max_free) {
-    dout(10) << __func__ << " bluefs_free " << bluefs_free
-             << " > max " << max_free
-             << ", stop gifting for now" << dendl;
-    gift = 0;
-  }
-  ceph_assert((int64_t)gift >= 0);
-  ceph_assert((int64_t)reclaim >= 0);
-  return gift > 0 ? (int64_t)gift : -(int64_t)reclaim;
-}
-
-int BlueStore::_balance_bluefs_freespace()
-{
-  int ret = 0;
   ceph_assert(bluefs);
-
-  vector<pair<uint64_t,uint64_t>> bluefs_usage;  // <free, total> ...
-  bluefs->get_usage(&bluefs_usage);
-  ceph_assert(bluefs_usage.size() > bluefs_layout.shared_bdev);
-
   bool clear_alert = true;
   if (bluefs_layout.shared_bdev == BlueFS::BDEV_SLOW) {
-    auto& p = bluefs_usage[bluefs_layout.shared_bdev];
-    if (p.first != p.second) {
-      auto& db = bluefs_usage[BlueFS::BDEV_DB];
+    uint64_t slow_used = bluefs->get_used(BlueFS::BDEV_SLOW);
+    if (slow_used) {
+      uint64_t db_used = bluefs->get_used(BlueFS::BDEV_DB);
       ostringstream ss;
-      ss << "spilled over " << byte_u_t(p.second - p.first)
-	 << " metadata from 'db' device (" << byte_u_t(db.second - db.first)
-	 << " used of " << byte_u_t(db.second) << ") to slow device";
+      ss << "spilled over " << byte_u_t(slow_used)
+	 << " metadata from 'db' device (" << byte_u_t(db_used)
+	 << " used of " << byte_u_t(bluefs->get_total(BlueFS::BDEV_DB))
+	 << ") to slow device";
       _set_spillover_alert(ss.str());
       clear_alert = false;
     }
@@ -5993,45 +6764,6 @@ int BlueStore::_balance_bluefs_freespace()
   if (clear_alert) {
     _clear_spillover_alert();
   }
-
-  // fixme: look at primary bdev only for now
-  int64_t delta = _get_bluefs_size_delta(
-    bluefs_usage[bluefs_layout.shared_bdev].first,
-    bluefs_usage[bluefs_layout.shared_bdev].second);
-
-  // reclaim from bluefs?
-  if (delta < 0) {
-    // round up to alloc size
-    uint64_t alloc_size = bluefs->get_alloc_size(bluefs_layout.shared_bdev);
-    auto reclaim = p2roundup(uint64_t(-delta), alloc_size);
-
-    // hard cap to fit into 32 bits
-    reclaim = std::min<uint64_t>(reclaim, 1ull << 30);
-    dout(10) << __func__ << " reclaiming " << reclaim
-	     << " (" << byte_u_t(reclaim) << ")" << dendl;
-
-    while (reclaim > 0) {
-      // NOTE: this will block and do IO.
-      PExtentVector extents;
-      int r = bluefs->reclaim_blocks(bluefs_layout.shared_bdev, reclaim,
-				     &extents);
-      if (r < 0) {
-	derr << __func__ << " failed to reclaim space from bluefs"
-	     << dendl;
-	break;
-      }
-      for (auto e : extents) {
-	++out_of_sync_fm;
-	bluefs_extents.erase(e.offset, e.length);
-	bluefs_extents_reclaiming.insert(e.offset, e.length);
-	reclaim -= e.length;
-      }
-    }
-
-    ret = 1;
-  }
-
-  return ret;
 }
 
 int BlueStore::_open_collections()
@@ -6047,8 +6779,8 @@ int BlueStore::_open_collections()
     if (cid.parse(it->key())) {
       auto c = ceph::make_ref<Collection>(
 	  this,
-	  onode_cache_shards[cid.hash_to_shard(onode_cache_shards.size())],
-          buffer_cache_shards[cid.hash_to_shard(buffer_cache_shards.size())],
+	  _get_onode_cache_shard(cid),
+	  _get_buffer_cache_shard(cid),
 	  cid);
       bufferlist bl = it->value();
       auto p = bl.cbegin();
@@ -6069,6 +6801,41 @@ int BlueStore::_open_collections()
       collections_had_errors = true;
     }
   }
+
+  // collections removed while non-empty; their objects are still around
+  std::lock_guard l(bulk_remove_lock);
+  ceph_assert(bulk_remove_map.empty());
+  it = db->get_iterator(PREFIX_REMOVED_COLL);
+  for (it->upper_bound(string());
+       it->valid();
+       it->next()) {
+    coll_t cid;
+    if (!cid.parse(it->key())) {
+      derr << __func__ << " unrecognized removed collection " << it->key()
+	   << dendl;
+      continue;
+    }
+    auto c = ceph::make_ref<Collection>(
+      this,
+      _get_onode_cache_shard(cid),
+      _get_buffer_cache_shard(cid),
+      cid);
+    bufferlist bl = it->value();
+    auto p = bl.cbegin();
+    try {
+      decode(c->cnode, p);
+    } catch (buffer::error& e) {
+      derr << __func__ << " failed to decode cnode, key:"
+	   << pretty_binary_string(it->key()) << dendl;
+      return -EIO;
+    }
+    dout(10) << __func__ << " resuming removal of " << cid << " " << c->cnode
+	     << dendl;
+    c->osr = ceph::make_ref<OpSequencer>(this, next_sequencer_id++, cid);
+    auto& b = bulk_remove_map.emplace(cid, bulk_removal_t())->second;
+    b.c = c;
+    b.ready = true;
+  }
   return 0;
 }
 
@@ -6275,7 +7042,8 @@ int BlueStore::mkfs()
     }
   }
 
-  freelist_type = "bitmap";
+  freelist_type = cct->_conf->bluestore_allocation_map_in_memory ?
+    "null" : "bitmap";
 
   r = _open_path();
   if (r < 0)
@@ -6325,6 +7093,12 @@ int BlueStore::mkfs()
     if (r < 0)
       goto out_close_fsid;
   }
+  r = _setup_block_symlink_or_file("block.fast",
+    cct->_conf->bluestore_block_fast_path,
+    cct->_conf->bluestore_block_fast_size,
+    cct->_conf->bluestore_block_fast_create);
+  if (r < 0)
+    goto out_close_fsid;
 
   r = _open_bdev(true);
   if (r < 0)
@@ -6353,9 +7127,21 @@ int BlueStore::mkfs()
     goto out_close_bdev;
   }
 
-  r = _open_db(true);
+  // bluefs allocates from our allocator while creating the db, so bring
+  // it up first with everything but the reserved area marked free
+  r = _create_alloc();
   if (r < 0)
     goto out_close_bdev;
+  {
+    auto reserved = _get_ondisk_reserved();
+    alloc->init_add_free(reserved,
+      p2align(bdev->get_size(), min_alloc_size) - reserved);
+    shared_alloc.set(tier_alloc ? tier_alloc->get_slow() : alloc);
+  }
+
+  r = _open_db(true);
+  if (r < 0)
+    goto out_close_alloc;
 
   {
     KeyValueDB::Transaction t = db->get_transaction();
@@ -6400,14 +7186,17 @@ int BlueStore::mkfs()
     }
   }
 
-  if (out_of_sync_fm.fetch_and(0)) {
-    _sync_bluefs_and_fm();
+  if (fm->is_null_manager()) {
+    _write_alloc_snapshot();
   }
 
+
  out_close_fm:
   _close_fm();
  out_close_db:
   _close_db();
+ out_close_alloc:
+  _close_alloc();
  out_close_bdev:
   _close_bdev();
  out_close_fsid:
@@ -6449,6 +7238,13 @@ int BlueStore::_mount_for_bluefs()
   ceph_assert(r == 0);
   r = _lock_fsid();
   ceph_assert(r == 0);
+  r = _open_bdev(false);
+  ceph_assert(r == 0);
+  // bluefs needs our allocator to use the shared device, bring it up
+  // from the db and then reopen bluefs alone
+  r = _open_db_and_around(true);
+  ceph_assert(r == 0);
+  _close_db();
   r = _open_bluefs(false);
   ceph_assert(r == 0);
   return r;
@@ -6457,6 +7253,9 @@ int BlueStore::_mount_for_bluefs()
 void BlueStore::_umount_for_bluefs()
 {
   _close_bluefs();
+  _close_alloc();
+  _close_fm();
+  _close_bdev();
   _close_fsid();
   _close_path();
 }
@@ -6562,39 +7361,15 @@ int BlueStore::migrate_to_existing_bluefs_device(const set<int>& devs_source,
   // require bluestore_bluefs_min_free to be free at target device!
   uint64_t used_space = cct->_conf.get_val<Option::size_t>("bluestore_bluefs_min_free");
   for(auto src_id : devs_source) {
-    used_space += bluefs->get_total(src_id) - bluefs->get_free(src_id);
+    used_space += bluefs->get_used(src_id);
   }
   uint64_t target_free = bluefs->get_free(id);
-  if (id == BlueFS::BDEV_SLOW && target_free < used_space) {
-    // will need to remount full BlueStore instance to allocate more space
+  if (target_free < used_space) {
+    derr << __func__
+         << " can't migrate, free space at target: " << target_free
+	 << " is less than required space: " << used_space
+	 << dendl;
     _umount_for_bluefs();
-
-    r = mount();
-    ceph_assert(r == 0);
-    dout(1) << __func__
-            << " Allocating more space at slow device for BlueFS: +"
-	    << used_space - target_free << " bytes" << dendl;
-    r = allocate_bluefs_freespace(
-      used_space - target_free,
-      used_space - target_free,
-      nullptr);
-
-    umount();
-    if (r != 0) {
-      derr << __func__
-	   << " can't migrate, unable to allocate extra space: "
-	   << used_space - target_free << " at target:" << id
-	   << dendl;
-      return -ENOSPC;
-    }
-
-    r = _mount_for_bluefs();
-    ceph_assert(r == 0);
-  } else if (target_free < used_space) {
-    derr << __func__
-         << " can't migrate, free space at target: " << target_free
-	 << " is less than required space: " << used_space
-	 << dendl;
     return -ENOSPC;
   }
   if (devs_source.count(BlueFS::BDEV_DB)) {
@@ -6806,7 +7581,13 @@ int BlueStore::expand_devices(ostream& out)
   }
   uint64_t size0 = fm->get_size();
   uint64_t size = bdev->get_size();
-  if (size0 < size) {
+  if (tier_bdev) {
+    // the freelist already covers everything up to the fast device, and
+    // the allocator picks up a grown main device on the next mount
+    out << bluefs_layout.shared_bdev
+	<< " : main device of a tiered store, not expanding the freelist"
+	<< std::endl;
+  } else if (size0 < size) {
     out << bluefs_layout.shared_bdev
 	<<" : expanding " << " from 0x" << std::hex
 	<< size0 << " to 0x" << size << std::dec << std::endl;
@@ -6842,6 +7623,80 @@ int BlueStore::expand_devices(ostream& out)
   return r;
 }
 
+int BlueStore::reshard(const string& new_sharding, ostream& out)
+{
+  vector<KeyValueDB::ColumnFamily> cfs;
+  bool have_alloc = false;
+  int r = KeyValueDB::parse_sharding(new_sharding, &cfs, out);
+  if (r < 0) {
+    return r;
+  }
+  r = _open_path();
+  if (r < 0)
+    return r;
+  r = _open_fsid(false);
+  if (r < 0)
+    goto out_path;
+  r = _read_fsid(&fsid);
+  if (r < 0)
+    goto out_fsid;
+  r = _lock_fsid();
+  if (r < 0)
+    goto out_fsid;
+  r = _open_bdev(false);
+  if (r < 0)
+    goto out_fsid;
+  // like _open_db_and_around: open read-only first to load the freelist
+  // and the allocator, bluefs needs the latter to grow on a shared device
+  r = _open_db(false, false, true);
+  if (r < 0) {
+    // a previously interrupted reshard makes a normal open fail; resume
+    // it anyway, bluefs just cannot take space from the main device then
+    derr << __func__ << " unable to load the allocator, continuing"
+	 << " without it" << dendl;
+  } else {
+    r = _open_super_meta();
+    if (r < 0)
+      goto out_db;
+    r = _open_fm(nullptr);
+    if (r < 0)
+      goto out_db;
+    r = _open_alloc();
+    if (r < 0)
+      goto out_fm;
+    have_alloc = true;
+    _close_db();
+  }
+
+  // now only set up bluefs and the kv backend; the db itself is opened
+  // by reshard
+  r = _open_db(false, true);
+  if (r < 0)
+    goto out_alloc;
+  r = db->reshard(cfs, out);
+  if (r < 0) {
+    derr << __func__ << " failed: " << cpp_strerror(r) << dendl;
+  }
+  _close_db();
+ out_alloc:
+  if (have_alloc) {
+    _close_alloc();
+    _close_fm();
+  }
+  goto out_bdev;
+ out_fm:
+  _close_fm();
+ out_db:
+  _close_db();
+ out_bdev:
+  _close_bdev();
+ out_fsid:
+  _close_fsid();
+ out_path:
+  _close_path();
+  return r;
+}
+
 void BlueStore::set_cache_shards(unsigned num)
 {
   dout(10) << __func__ << " " << num << dendl;
@@ -6860,6 +7715,125 @@ void BlueStore::set_cache_shards(unsigned num)
         BufferCacheShard::create(cct, cct->_conf->bluestore_cache_type,
                                  logger);
   }
+  _set_cache_partitions(num);
+}
+
+void BlueStore::_set_cache_partitions(unsigned num)
+{
+  // <pool>:<weight>[:<min bytes>[:<priority>]], ...
+  list<string> entries;
+  get_str_list(cct->_conf.get_val<string>("bluestore_cache_partitions"),
+	       ", ", entries);
+  for (auto& e : entries) {
+    vector<string> fields;
+    get_str_vec(e, ":", fields);
+    string err;
+    int64_t pool = -1;
+    double weight = 1.0;
+    uint64_t min_bytes = 0;
+    int64_t pri = PriorityCache::Priority::PRI1;
+    if (fields.size() >= 2 && fields.size() <= 4) {
+      pool = strict_strtoll(fields[0].c_str(), 10, &err);
+      if (err.empty()) {
+	weight = strict_strtod(fields[1].c_str(), &err);
+      }
+      if (err.empty() && fields.size() > 2) {
+	min_bytes = strict_iecstrtoll(fields[2].c_str(), &err);
+      }
+      if (err.empty() && fields.size() > 3) {
+	pri = strict_strtoll(fields[3].c_str(), 10, &err);
+      }
+    } else {
+      err = "unexpected number of fields";
+    }
+    // PRI0 is reserved for the minimum guarantees
+    if (err.empty() &&
+	(pool < 0 || weight <= 0 ||
+	 pri < PriorityCache::Priority::PRI1 ||
+	 pri > PriorityCache::Priority::LAST)) {
+      err = "value out of range";
+    }
+    if (!err.empty()) {
+      derr << __func__ << " ignoring invalid cache partition '" << e
+	   << "': " << err << dendl;
+      continue;
+    }
+
+    auto& part = cache_partitions[pool];
+    if (!part) {
+      part.reset(new CachePartition(pool));
+      PerfCountersBuilder b(cct, "bluestore-pool-" + std::to_string(pool),
+			    l_bluestore_first, l_bluestore_last);
+      b.add_u64_counter(l_bluestore_onode_hits, "bluestore_onode_hits",
+			"Sum for onode-lookups hit in the cache");
+      b.add_u64_counter(l_bluestore_onode_misses, "bluestore_onode_misses",
+			"Sum for onode-lookups missed in the cache");
+      b.add_u64_counter(l_bluestore_buffer_hit_bytes,
+			"bluestore_buffer_hit_bytes",
+			"Sum for bytes of read hit in the cache",
+			NULL, 0, unit_t(UNIT_BYTES));
+      b.add_u64_counter(l_bluestore_buffer_miss_bytes,
+			"bluestore_buffer_miss_bytes",
+			"Sum for bytes of read missed in the cache",
+			NULL, 0, unit_t(UNIT_BYTES));
+      b.add_u64(l_bluestore_onodes, "bluestore_onodes",
+		"Number of onodes in cache");
+      b.add_u64(l_bluestore_buffer_bytes, "bluestore_buffer_bytes",
+		"Number of buffer bytes in cache", NULL, 0,
+		unit_t(UNIT_BYTES));
+      part->logger = b.create_perf_counters();
+      cct->get_perfcounters_collection()->add(part->logger);
+    }
+    part->weight = weight;
+    part->min_bytes = min_bytes;
+    part->pri = static_cast<PriorityCache::Priority>(pri);
+    dout(1) << __func__ << " pool " << pool << " weight " << weight
+	    << " min_bytes " << byte_u_t(min_bytes) << " priority " << pri
+	    << dendl;
+
+    size_t oold = part->onode_shards.size();
+    size_t bold = part->buffer_shards.size();
+    ceph_assert(num >= oold && num >= bold);
+    part->onode_shards.resize(num);
+    part->buffer_shards.resize(num);
+    for (unsigned i = oold; i < num; ++i) {
+      part->onode_shards[i] =
+	OnodeCacheShard::create(cct, cct->_conf->bluestore_cache_type, logger);
+      part->onode_shards[i]->partition_logger = part->logger;
+    }
+    for (unsigned i = bold; i < num; ++i) {
+      part->buffer_shards[i] =
+	BufferCacheShard::create(cct, cct->_conf->bluestore_cache_type, logger);
+      part->buffer_shards[i]->partition_logger = part->logger;
+    }
+  }
+}
+
+BlueStore::CachePartition* BlueStore::_get_cache_partition(const coll_t& cid)
+{
+  spg_t pgid;
+  if (cache_partitions.empty() ||
+      !(cid.is_pg(&pgid) || cid.is_temp(&pgid))) {
+    return nullptr;
+  }
+  auto p = cache_partitions.find(pgid.pool());
+  return p != cache_partitions.end() ? p->second.get() : nullptr;
+}
+
+BlueStore::OnodeCacheShard* BlueStore::_get_onode_cache_shard(
+  const coll_t& cid)
+{
+  auto part = _get_cache_partition(cid);
+  auto& shards = part ? part->onode_shards : onode_cache_shards;
+  return shards[cid.hash_to_shard(shards.size())];
+}
+
+BlueStore::BufferCacheShard* BlueStore::_get_buffer_cache_shard(
+  const coll_t& cid)
+{
+  auto part = _get_cache_partition(cid);
+  auto& shards = part ? part->buffer_shards : buffer_cache_shards;
+  return shards[cid.hash_to_shard(shards.size())];
 }
 
 int BlueStore::_mount(bool kv_only, bool open_db)
@@ -6966,6 +7940,11 @@ int BlueStore::_mount(bool kv_only, bool open_db)
     _check_legacy_statfs_alert();
   }
 
+  // background writers only once the quick-fix above is done with the db
+  _bulk_remove_start();
+  _defrag_start();
+  _tier_start();
+
   mounted = true;
   return 0;
 
@@ -6989,6 +7968,11 @@ int BlueStore::umount()
   ceph_assert(_kv_only || mounted);
   dout(1) << __func__ << dendl;
 
+  if (!_kv_only) {
+    _tier_stop();
+    _defrag_stop();
+    _bulk_remove_stop();
+  }
   _osr_drain_all();
 
   mounted = false;
@@ -6996,9 +7980,16 @@ int BlueStore::umount()
     mempool_thread.shutdown();
     dout(20) << __func__ << " stopping kv thread" << dendl;
     _kv_stop();
+    {
+      std::unique_lock l(readahead_lock);
+      readahead_cond.wait(l, [this] { return readahead_in_flight == 0; });
+    }
     _flush_cache();
     dout(20) << __func__ << " closing" << dendl;
 
+    if (fm->is_null_manager() && alloc_snapshot_stale) {
+      _write_alloc_snapshot();
+    }
   }
   _close_db_and_around();
   _close_bdev();
@@ -7404,6 +8395,10 @@ BlueStore::OnodeRef BlueStore::fsck_check_objects_shallow(
       }
     } else if (depth != FSCK_SHALLOW) {
       ceph_assert(used_blocks);
+      // the below lock is optional and provided in multithreading mode only
+      if (ctx.used_lock) {
+        ctx.used_lock->lock();
+      }
       errors += _fsck_check_extents(c->cid, oid, blob.get_extents(),
         blob.is_compressed(),
         *used_blocks,
@@ -7411,6 +8406,9 @@ BlueStore::OnodeRef BlueStore::fsck_check_objects_shallow(
         repairer,
         *res_statfs,
         depth);
+      if (ctx.used_lock) {
+        ctx.used_lock->unlock();
+      }
     } else {
       errors += _fsck_sum_extents(
         blob.get_extents(),
@@ -7421,6 +8419,245 @@ BlueStore::OnodeRef BlueStore::fsck_check_objects_shallow(
   return o;
 }
 
+int64_t BlueStore::fsck_check_shard_keys(
+  const ghobject_t& oid,
+  const mempool::bluestore_fsck::list<string>& expecting_shards,
+  const mempool::bluestore_fsck::list<string>& shard_keys)
+{
+  // both lists are ordered the same way the keys are laid out in the db
+  int64_t errors = 0;
+  auto e = expecting_shards.begin();
+  auto k = shard_keys.begin();
+  while (e != expecting_shards.end() || k != shard_keys.end()) {
+    if (k == shard_keys.end() ||
+        (e != expecting_shards.end() && *e < *k)) {
+      derr << "fsck error: " << oid << " missing shard key "
+        << pretty_binary_string(*e) << dendl;
+      ++errors;
+      ++e;
+    } else if (e == expecting_shards.end() || *k < *e) {
+      uint32_t offset;
+      string okey;
+      get_key_extent_shard(*k, &okey, &offset);
+      derr << "fsck error: " << oid << " stray shard 0x" << std::hex << offset
+        << std::dec << " " << pretty_binary_string(*k)
+        << " is unexpected" << dendl;
+      ++errors;
+      ++k;
+    } else {
+      // all good
+      ++e;
+      ++k;
+    }
+  }
+  return errors;
+}
+
+void BlueStore::fsck_check_objects_detailed(
+  BlueStore::FSCKDepth depth,
+  BlueStore::CollectionRef c,
+  BlueStore::OnodeRef o,
+  const map<BlobRef, bluestore_blob_t::unused_t>& referenced,
+  const BlueStore::FSCK_ObjectCtx& ctx)
+{
+  auto& errors = ctx.errors;
+  auto& warnings = ctx.warnings;
+  auto used_nids = ctx.used_nids;
+  auto used_omap_head = ctx.used_omap_head;
+  auto used_per_pool_omap_head = ctx.used_per_pool_omap_head;
+  auto used_pgmeta_omap_head = ctx.used_pgmeta_omap_head;
+  auto used_lock = ctx.used_lock;
+  auto repairer = ctx.repairer;
+  const ghobject_t& oid = o->oid;
+
+  ceph_assert(depth != FSCK_SHALLOW);
+  ceph_assert(used_nids);
+  if (o->onode.nid) {
+    if (o->onode.nid > nid_max) {
+      derr << "fsck error: " << oid << " nid " << o->onode.nid
+        << " > nid_max " << nid_max << dendl;
+      ++errors;
+    }
+    // the below lock is optional and provided in multithreading mode only
+    if (used_lock) {
+      used_lock->lock();
+    }
+    bool in_use = !used_nids->insert(o->onode.nid).second;
+    if (used_lock) {
+      used_lock->unlock();
+    }
+    if (in_use) {
+      derr << "fsck error: " << oid << " nid " << o->onode.nid
+        << " already in use" << dendl;
+      ++errors;
+      return; // go for next object
+    }
+  }
+  for (auto& i : referenced) {
+    dout(20) << __func__ << "  referenced 0x" << std::hex << i.second
+      << std::dec << " for " << *i.first << dendl;
+    const bluestore_blob_t& blob = i.first->get_blob();
+    if (i.second & blob.unused) {
+      derr << "fsck error: " << oid << " blob claims unused 0x"
+        << std::hex << blob.unused
+        << " but extents reference 0x" << i.second << std::dec
+        << " on blob " << *i.first << dendl;
+      ++errors;
+    }
+    if (blob.has_csum()) {
+      uint64_t blob_len = blob.get_logical_length();
+      uint64_t unused_chunk_size = blob_len / (sizeof(blob.unused) * 8);
+      unsigned csum_count = blob.get_csum_count();
+      unsigned csum_chunk_size = blob.get_csum_chunk_size();
+      for (unsigned p = 0; p < csum_count; ++p) {
+        unsigned pos = p * csum_chunk_size;
+        unsigned firstbit = pos / unused_chunk_size;    // [firstbit,lastbit]
+        unsigned lastbit = (pos + csum_chunk_size - 1) / unused_chunk_size;
+        unsigned mask = 1u << firstbit;
+        for (unsigned b = firstbit + 1; b <= lastbit; ++b) {
+          mask |= 1u << b;
+        }
+        if ((blob.unused & mask) == mask) {
+          // this csum chunk region is marked unused
+          if (blob.get_csum_item(p) != 0) {
+            derr << "fsck error: " << oid
+              << " blob claims csum chunk 0x" << std::hex << pos
+              << "~" << csum_chunk_size
+              << " is unused (mask 0x" << mask << " of unused 0x"
+              << blob.unused << ") but csum is non-zero 0x"
+              << blob.get_csum_item(p) << std::dec << " on blob "
+              << *i.first << dendl;
+            ++errors;
+          }
+        }
+      }
+    }
+  }
+  // omap
+  if (o->onode.has_omap()) {
+    ceph_assert(used_omap_head);
+    ceph_assert(used_per_pool_omap_head);
+    ceph_assert(used_pgmeta_omap_head);
+    auto m =
+      o->onode.is_pgmeta_omap() ? used_pgmeta_omap_head :
+      (o->onode.is_perpool_omap() ? used_per_pool_omap_head : used_omap_head);
+    if (used_lock) {
+      used_lock->lock();
+    }
+    bool in_use = !m->insert(o->onode.nid).second;
+    if (used_lock) {
+      used_lock->unlock();
+    }
+    if (in_use) {
+      derr << "fsck error: " << oid << " omap_head " << o->onode.nid
+        << " already in use" << dendl;
+      ++errors;
+    }
+    if (!o->onode.is_perpool_omap() && !o->onode.is_pgmeta_omap()) {
+      if (per_pool_omap) {
+        derr << "fsck error: " << oid
+          << " has omap that is not per-pool or pgmeta" << dendl;
+        ++errors;
+      }
+      else {
+        const char* w;
+        if (cct->_conf->bluestore_fsck_error_on_no_per_pool_omap) {
+          ++errors;
+          w = "error";
+        }
+        else {
+          ++warnings;
+          w = "warning";
+        }
+        derr << "fsck " << w << ": " << oid
+          << " has omap that is not per-pool or pgmeta" << dendl;
+      }
+    }
+    if (repairer &&
+      o->onode.has_omap() &&
+      !o->onode.is_perpool_omap() &&
+      !o->oid.is_pgmeta()) {
+      derr << "fsck converting " << oid << " omap to per-pool" << dendl;
+      if (used_lock) {
+        used_lock->lock();
+      }
+      used_omap_head->erase(o->onode.nid);
+      used_per_pool_omap_head->insert(o->onode.nid);
+      if (used_lock) {
+        used_lock->unlock();
+      }
+      bufferlist h;
+      map<string, bufferlist> kv;
+      int r = _omap_get(c.get(), oid, &h, &kv);
+      if (r < 0) {
+        derr << " got " << r << " " << cpp_strerror(r) << dendl;
+      }
+      else {
+        KeyValueDB::Transaction txn = db->get_transaction();
+        // remove old keys
+        const string& old_omap_prefix = o->get_omap_prefix();
+        string old_head, old_tail;
+        o->get_omap_header(&old_head);
+        o->get_omap_tail(&old_tail);
+        txn->rm_range_keys(old_omap_prefix, old_head, old_tail);
+        txn->rmkey(old_omap_prefix, old_tail);
+        // set flag
+        o->onode.set_flag(bluestore_onode_t::FLAG_PERPOOL_OMAP);
+        _record_onode(o, txn);
+        const string& new_omap_prefix = o->get_omap_prefix();
+        // head
+        if (h.length()) {
+          string new_head;
+          o->get_omap_header(&new_head);
+          txn->set(new_omap_prefix, new_head, h);
+        }
+        // tail
+        string new_tail;
+        o->get_omap_tail(&new_tail);
+        bufferlist empty;
+        txn->set(new_omap_prefix, new_tail, empty);
+        // values
+        string final_key;
+        o->get_omap_key(string(), &final_key);
+        size_t base_key_len = final_key.size();
+        for (auto& i : kv) {
+          final_key.resize(base_key_len);
+          final_key += i.first;
+          txn->set(new_omap_prefix, final_key, i.second);
+        }
+        db->submit_transaction_sync(txn);
+        if (used_lock) {
+          used_lock->lock();
+        }
+        repairer->inc_repaired();
+        if (used_lock) {
+          used_lock->unlock();
+        }
+      }
+    }
+  } // if (o->onode.has_omap())
+  if (depth == FSCK_DEEP) {
+    bufferlist bl;
+    uint64_t max_read_block = cct->_conf->bluestore_fsck_read_bytes_cap;
+    uint64_t offset = 0;
+    do {
+      uint64_t l = std::min(uint64_t(o->onode.size - offset), max_read_block);
+      int r = _do_read(c.get(), o, offset, l, bl,
+        CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+      if (r < 0) {
+        ++errors;
+        derr << "fsck error: " << oid << std::hex
+          << " error during read: "
+          << " " << offset << "~" << l
+          << " " << cpp_strerror(r) << std::dec
+          << dendl;
+        break;
+      }
+      offset += l;
+    } while (offset < o->onode.size);
+  } // deep
+}
+
 #include "common/WorkQueue.h"
 
 class ShallowFSCKThreadPool : public ThreadPool
@@ -7453,6 +8690,9 @@ public:
       ghobject_t oid;
       string key;
       bufferlist value;
+      // extent shard keys found in the db for this onode,
+      // non-shallow mode only
+      mempool::bluestore_fsck::list<string> shard_keys;
     };
     struct Batch {
       std::atomic<size_t> running = { 0 };
@@ -7472,11 +8712,20 @@ public:
 
     size_t batchCount;
     BlueStore* store = nullptr;
+    BlueStore::FSCKDepth depth;
 
     ceph::mutex* sb_info_lock = nullptr;
     BlueStore::sb_info_map_t* sb_info = nullptr;
     BlueStoreRepairer* repairer = nullptr;
 
+    // non-shallow mode only
+    BlueStore::mempool_dynamic_bitset* used_blocks = nullptr;
+    BlueStore::uint64_t_btree_t* used_omap_head = nullptr;
+    BlueStore::uint64_t_btree_t* used_per_pool_omap_head = nullptr;
+    BlueStore::uint64_t_btree_t* used_pgmeta_omap_head = nullptr;
+    BlueStore::uint64_t_btree_t* used_nids = nullptr;
+    ceph::mutex* used_lock = nullptr;
+
     Batch* batches = nullptr;
     size_t last_batch_pos = 0;
     bool batch_acquired = false;
@@ -7484,15 +8733,21 @@ public:
     FSCKWorkQueue(std::string n,
                   size_t _batchCount,
                   BlueStore* _store,
-                  ceph::mutex* _sb_info_lock,
-                  BlueStore::sb_info_map_t& _sb_info,
-                  BlueStoreRepairer* _repairer) :
+                  BlueStore::FSCKDepth _depth,
+                  BlueStore::FSCK_ObjectCtx& ctx) :
       WorkQueue_(n, time_t(), time_t()),
       batchCount(_batchCount),
       store(_store),
-      sb_info_lock(_sb_info_lock),
-      sb_info(&_sb_info),
-      repairer(_repairer)
+      depth(_depth),
+      sb_info_lock(ctx.sb_info_lock),
+      sb_info(&ctx.sb_info),
+      repairer(ctx.repairer),
+      used_blocks(ctx.used_blocks),
+      used_omap_head(ctx.used_omap_head),
+      used_per_pool_omap_head(ctx.used_per_pool_omap_head),
+      used_pgmeta_omap_head(ctx.used_pgmeta_omap_head),
+      used_nids(ctx.used_nids),
+      used_lock(ctx.used_lock)
     {
       batches = new Batch[batchCount];
     }
@@ -7540,29 +8795,20 @@ public:
         batch->num_blobs,
         batch->num_sharded_objects,
         batch->num_spanning_blobs,
-        nullptr, // used_blocks
-        nullptr, // used_omap_head;
-        nullptr, // used_per_pool_omap_head;
-        nullptr, // used_pgmeta_omap_head;
+        used_blocks,
+        used_omap_head,
+        used_per_pool_omap_head,
+        used_pgmeta_omap_head,
         sb_info_lock,
         *sb_info,
         batch->expected_store_statfs,
         batch->expected_pool_statfs,
         repairer);
+      ctx.used_nids = used_nids;
+      ctx.used_lock = used_lock;
 
       for (size_t i = 0; i < batch->entry_count; i++) {
-        auto& entry = batch->entries[i];
-
-        store->fsck_check_objects_shallow(
-          BlueStore::FSCK_SHALLOW,
-          entry.pool_id,
-          entry.c,
-          entry.oid,
-          entry.key,
-          entry.value,
-          nullptr, // expecting_shards - this will need a protection if passed
-          nullptr, // referenced
-          ctx);
+        process_entry(batch->entries[i], ctx);
       }
       //std::cout << "processed " << batch << std::endl;
       batch->entry_count = 0;
@@ -7576,12 +8822,47 @@ public:
       ceph_assert(false);
     }
 
+    /// Check a single object, either from a worker or from the main
+    /// thread when no batch is available.
+    void process_entry(Entry& entry, BlueStore::FSCK_ObjectCtx& ctx) {
+      if (depth == BlueStore::FSCK_SHALLOW) {
+        store->fsck_check_objects_shallow(
+          BlueStore::FSCK_SHALLOW,
+          entry.pool_id,
+          entry.c,
+          entry.oid,
+          entry.key,
+          entry.value,
+          nullptr, // expecting_shards
+          nullptr, // referenced
+          ctx);
+        return;
+      }
+      mempool::bluestore_fsck::list<string> expecting_shards;
+      map<BlueStore::BlobRef, bluestore_blob_t::unused_t> referenced;
+      BlueStore::OnodeRef o = store->fsck_check_objects_shallow(
+        depth,
+        entry.pool_id,
+        entry.c,
+        entry.oid,
+        entry.key,
+        entry.value,
+        &expecting_shards,
+        &referenced,
+        ctx);
+      ctx.errors += store->fsck_check_shard_keys(
+        entry.oid, expecting_shards, entry.shard_keys);
+      entry.shard_keys.clear();
+      store->fsck_check_objects_detailed(depth, entry.c, o, referenced, ctx);
+    }
+
     bool queue(
       int64_t pool_id,
       BlueStore::CollectionRef c,
       const ghobject_t& oid,
       const string& key,
-      const bufferlist& value) {
+      const bufferlist& value,
+      mempool::bluestore_fsck::list<string>* shard_keys = nullptr) {
       bool res = false;
       size_t pos0 = last_batch_pos;
       if (!batch_acquired) {
@@ -7609,6 +8890,10 @@ public:
         entry.oid = oid;
         entry.key = key;
         entry.value = value;
+        entry.shard_keys.clear();
+        if (shard_keys) {
+          entry.shard_keys.swap(*shard_keys);
+        }
 
         ++batch.entry_count;
         if (batch.entry_count == BatchLen) {
@@ -7669,48 +8954,71 @@ public:
 void BlueStore::_fsck_check_objects(FSCKDepth depth,
   BlueStore::FSCK_ObjectCtx& ctx)
 {
-  //no need for the below lock when in non-shallow mode as
-  // there is no multithreading in this case
-  if (depth != FSCK_SHALLOW) {
+  const size_t thread_count = depth == FSCK_SHALLOW ?
+    cct->_conf->bluestore_fsck_quick_fix_threads :
+    cct->_conf->bluestore_fsck_threads;
+  //no need for the below lock when running single-threaded
+  if (thread_count == 0) {
     ctx.sb_info_lock = nullptr;
   }
 
+  uint64_t_btree_t used_nids;
+  ceph::mutex used_lock = ceph::make_mutex("BlueStore::fsck::used_lock");
+  ctx.used_nids = &used_nids;
+  if (depth != FSCK_SHALLOW && thread_count > 0) {
+    ctx.used_lock = &used_lock;
+  }
+
   auto& errors = ctx.errors;
-  auto& warnings = ctx.warnings;
-  auto used_omap_head = ctx.used_omap_head;
-  auto used_per_pool_omap_head = ctx.used_per_pool_omap_head;
-  auto used_pgmeta_omap_head = ctx.used_pgmeta_omap_head;
   auto sb_info_lock = ctx.sb_info_lock;
-  auto& sb_info = ctx.sb_info;
-  auto repairer = ctx.repairer;
-
-  uint64_t_btree_t used_nids;
 
   size_t processed_myself = 0;
+  uint64_t num_onode_keys = 0;
+  auto progress_stamp = mono_clock::now();
 
   auto it = db->get_iterator(PREFIX_OBJ);
   mempool::bluestore_fsck::list<string> expecting_shards;
   if (it) {
-    const size_t thread_count = cct->_conf->bluestore_fsck_quick_fix_threads;
     typedef ShallowFSCKThreadPool::FSCKWorkQueue<256> WQ;
     std::unique_ptr<WQ> wq(
       new WQ(
         "FSCKWorkQueue",
         (thread_count ? : 1) * 32,
         this,
-        sb_info_lock,
-        sb_info,
-        repairer));
+        depth,
+        ctx));
 
     ShallowFSCKThreadPool thread_pool(cct, "ShallowFSCKThreadPool", "ShallowFSCK", thread_count);
 
     thread_pool.add_work_queue(wq.get());
-    if (depth == FSCK_SHALLOW && thread_count > 0) {
+    if (thread_count > 0) {
       //not the best place but let's check anyway
       ceph_assert(sb_info_lock);
       thread_pool.start();
     }
 
+    // In multithreaded non-shallow mode the onode is held back until
+    // all its extent shard keys (which immediately follow the onode key)
+    // are collected, then the whole lot is handed over to the workers.
+    bool have_pending = false;
+    WQ::Entry pending;
+    auto flush_pending = [&]() {
+      if (!have_pending) {
+        return;
+      }
+      have_pending = false;
+      if (!wq->queue(
+            pending.pool_id,
+            pending.c,
+            pending.oid,
+            pending.key,
+            pending.value,
+            &pending.shard_keys)) {
+        ++processed_myself;
+        wq->process_entry(pending, ctx);
+      }
+    };
+
     //fill global if not overriden below
     CollectionRef c;
     int64_t pool_id = -1;
@@ -7722,6 +9030,20 @@ void BlueStore::_fsck_check_objects(FSCKDepth depth,
         if (depth == FSCK_SHALLOW) {
           continue;
         }
+        if (have_pending) {
+          uint32_t offset;
+          string okey;
+          get_key_extent_shard(it->key(), &okey, &offset);
+          if (okey == pending.key) {
+            pending.shard_keys.push_back(it->key());
+          } else {
+            derr << "fsck error: stray shard 0x" << std::hex << offset
+              << std::dec << " " << pretty_binary_string(it->key())
+              << " is unexpected" << dendl;
+            ++errors;
+          }
+          continue;
+        }
         while (!expecting_shards.empty() &&
           expecting_shards.front() < it->key()) {
           derr << "fsck error: missing shard key "
@@ -7762,6 +9084,16 @@ void BlueStore::_fsck_check_objects(FSCKDepth depth,
         continue;
       }
 
+      flush_pending();
+      if ((++num_onode_keys % 1024) == 0) {
+        auto now = mono_clock::now();
+        if (now - progress_stamp >= make_timespan(10)) {
+          progress_stamp = now;
+          dout(1) << __func__ << " checked " << num_onode_keys
+                  << " objects so far" << dendl;
+        }
+      }
+
       ghobject_t oid;
       int r = get_key_object(it->key(), &oid);
       if (r < 0) {
@@ -7781,6 +9113,16 @@ void BlueStore::_fsck_check_objects(FSCKDepth depth,
             break;
           }
         }
+        if (!c) {
+          // removed collection still being emptied in the background
+          std::lock_guard l(bulk_remove_lock);
+          for (auto& p : bulk_remove_map) {
+            if (p.second.c->contains(oid)) {
+              c = p.second.c;
+              break;
+            }
+          }
+        }
         if (!c) {
           derr << "fsck error: stray object " << oid
             << " not owned by any collection" << dendl;
@@ -7802,8 +9144,19 @@ void BlueStore::_fsck_check_objects(FSCKDepth depth,
         expecting_shards.clear();
       }
 
+      if (depth != FSCK_SHALLOW && thread_count > 0) {
+        have_pending = true;
+        pending.pool_id = pool_id;
+        pending.c = c;
+        pending.oid = oid;
+        pending.key = it->key();
+        pending.value = it->value();
+        pending.shard_keys.clear();
+        continue;
+      }
+
       bool queued = false;
-      if (depth == FSCK_SHALLOW && thread_count > 0) {
+      if (thread_count > 0) {
         queued = wq->queue(
           pool_id,
           c,
@@ -7831,170 +9184,11 @@ void BlueStore::_fsck_check_objects(FSCKDepth depth,
 
       if (depth != FSCK_SHALLOW) {
         ceph_assert(o != nullptr);
-        if (o->onode.nid) {
-          if (o->onode.nid > nid_max) {
-            derr << "fsck error: " << oid << " nid " << o->onode.nid
-              << " > nid_max " << nid_max << dendl;
-            ++errors;
-          }
-          if (used_nids.count(o->onode.nid)) {
-            derr << "fsck error: " << oid << " nid " << o->onode.nid
-              << " already in use" << dendl;
-            ++errors;
-            continue; // go for next object
-          }
-          used_nids.insert(o->onode.nid);
-        }
-        for (auto& i : referenced) {
-          dout(20) << __func__ << "  referenced 0x" << std::hex << i.second
-            << std::dec << " for " << *i.first << dendl;
-          const bluestore_blob_t& blob = i.first->get_blob();
-          if (i.second & blob.unused) {
-            derr << "fsck error: " << oid << " blob claims unused 0x"
-              << std::hex << blob.unused
-              << " but extents reference 0x" << i.second << std::dec
-              << " on blob " << *i.first << dendl;
-            ++errors;
-          }
-          if (blob.has_csum()) {
-            uint64_t blob_len = blob.get_logical_length();
-            uint64_t unused_chunk_size = blob_len / (sizeof(blob.unused) * 8);
-            unsigned csum_count = blob.get_csum_count();
-            unsigned csum_chunk_size = blob.get_csum_chunk_size();
-            for (unsigned p = 0; p < csum_count; ++p) {
-              unsigned pos = p * csum_chunk_size;
-              unsigned firstbit = pos / unused_chunk_size;    // [firstbit,lastbit]
-              unsigned lastbit = (pos + csum_chunk_size - 1) / unused_chunk_size;
-              unsigned mask = 1u << firstbit;
-              for (unsigned b = firstbit + 1; b <= lastbit; ++b) {
-                mask |= 1u << b;
-              }
-              if ((blob.unused & mask) == mask) {
-                // this csum chunk region is marked unused
-                if (blob.get_csum_item(p) != 0) {
-                  derr << "fsck error: " << oid
-                    << " blob claims csum chunk 0x" << std::hex << pos
-                    << "~" << csum_chunk_size
-                    << " is unused (mask 0x" << mask << " of unused 0x"
-                    << blob.unused << ") but csum is non-zero 0x"
-                    << blob.get_csum_item(p) << std::dec << " on blob "
-                    << *i.first << dendl;
-                  ++errors;
-                }
-              }
-            }
-          }
-        }
-        // omap
-        if (o->onode.has_omap()) {
-          ceph_assert(used_omap_head);
-          ceph_assert(used_per_pool_omap_head);
-          ceph_assert(used_pgmeta_omap_head);
-          auto m =
-            o->onode.is_pgmeta_omap() ? used_pgmeta_omap_head :
-            (o->onode.is_perpool_omap() ? used_per_pool_omap_head : used_omap_head);
-          if (m->count(o->onode.nid)) {
-            derr << "fsck error: " << oid << " omap_head " << o->onode.nid
-              << " already in use" << dendl;
-            ++errors;
-          }
-          else {
-            m->insert(o->onode.nid);
-          }
-          if (!o->onode.is_perpool_omap() && !o->onode.is_pgmeta_omap()) {
-            if (per_pool_omap) {
-              derr << "fsck error: " << oid
-                << " has omap that is not per-pool or pgmeta" << dendl;
-              ++errors;
-            }
-            else {
-              const char* w;
-              if (cct->_conf->bluestore_fsck_error_on_no_per_pool_omap) {
-                ++errors;
-                w = "error";
-              }
-              else {
-                ++warnings;
-                w = "warning";
-              }
-              derr << "fsck " << w << ": " << oid
-                << " has omap that is not per-pool or pgmeta" << dendl;
-            }
-          }
-          if (repairer &&
-            o->onode.has_omap() &&
-            !o->onode.is_perpool_omap() &&
-            !o->oid.is_pgmeta()) {
-            derr << "fsck converting " << oid << " omap to per-pool" << dendl;
-            used_omap_head->erase(o->onode.nid);
-            used_per_pool_omap_head->insert(o->onode.nid);
-            bufferlist h;
-            map<string, bufferlist> kv;
-            int r = _omap_get(c.get(), oid, &h, &kv);
-            if (r < 0) {
-              derr << " got " << r << " " << cpp_strerror(r) << dendl;
-            }
-            else {
-              KeyValueDB::Transaction txn = db->get_transaction();
-              // remove old keys
-              const string& old_omap_prefix = o->get_omap_prefix();
-              string old_head, old_tail;
-              o->get_omap_header(&old_head);
-              o->get_omap_tail(&old_tail);
-              txn->rm_range_keys(old_omap_prefix, old_head, old_tail);
-              txn->rmkey(old_omap_prefix, old_tail);
-              // set flag
-              o->onode.set_flag(bluestore_onode_t::FLAG_PERPOOL_OMAP);
-              _record_onode(o, txn);
-              const string& new_omap_prefix = o->get_omap_prefix();
-              // head
-              if (h.length()) {
-                string new_head;
-                o->get_omap_header(&new_head);
-                txn->set(new_omap_prefix, new_head, h);
-              }
-              // tail
-              string new_tail;
-              o->get_omap_tail(&new_tail);
-              bufferlist empty;
-              txn->set(new_omap_prefix, new_tail, empty);
-              // values
-              string final_key;
-              o->get_omap_key(string(), &final_key);
-              size_t base_key_len = final_key.size();
-              for (auto& i : kv) {
-                final_key.resize(base_key_len);
-                final_key += i.first;
-                txn->set(new_omap_prefix, final_key, i.second);
-              }
-              db->submit_transaction_sync(txn);
-              repairer->inc_repaired();
-            }
-          }
-        } // if (depth != FSCK_SHALLOW && o->onode.has_omap())
-        if (depth == FSCK_DEEP) {
-          bufferlist bl;
-          uint64_t max_read_block = cct->_conf->bluestore_fsck_read_bytes_cap;
-          uint64_t offset = 0;
-          do {
-            uint64_t l = std::min(uint64_t(o->onode.size - offset), max_read_block);
-            int r = _do_read(c.get(), o, offset, l, bl,
-              CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
-            if (r < 0) {
-              ++errors;
-              derr << "fsck error: " << oid << std::hex
-                << " error during read: "
-                << " " << offset << "~" << l
-                << " " << cpp_strerror(r) << std::dec
-                << dendl;
-              break;
-            }
-            offset += l;
-          } while (offset < o->onode.size);
-        } // deep
-      } //if (depth != FSCK_SHALLOW)
+        fsck_check_objects_detailed(depth, c, o, referenced, ctx);
+      }
     } // for (it->lower_bound(string()); it->valid(); it->next())
-    if (depth == FSCK_SHALLOW && thread_count > 0) {
+    flush_pending();
+    if (thread_count > 0) {
       wq->finalize(thread_pool, ctx);
       if (processed_myself) {
         // may be needs more threads?
@@ -8006,6 +9200,11 @@ void BlueStore::_fsck_check_objects(FSCKDepth depth,
       }
     }
   } // if (it)
+  dout(1) << __func__ << " checked " << num_onode_keys << " objects"
+          << ", threads " << thread_count << dendl;
+  // both are local to this function
+  ctx.used_nids = nullptr;
+  ctx.used_lock = nullptr;
 }
 /**
 An overview for currently implemented repair logics 
@@ -8166,31 +9365,11 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
   }
 
   if (bluefs) {
-    if( cct->_conf->bluestore_bluefs_db_compatibility) {
-      interval_set<uint64_t> bluefs_extents_db;
-      bufferlist bl;
-      db->get(PREFIX_SUPER, "bluefs_extents", &bl);
-      auto p = bl.cbegin();
-      auto prev_errors = errors;
-      try {
-        decode(bluefs_extents_db, p);
-	bluefs_extents_db.union_of(bluefs_extents);
-	bluefs_extents_db.subtract(bluefs_extents);
-	if (!bluefs_extents_db.empty()) {
-	  derr << "fsck error: bluefs_extents inconsistency, "
-	       << "downgrade to previous releases might be broken."
-	       << dendl;
-	  ++errors;
-	}
-      }
-      catch (buffer::error& e) {
-	derr << "fsck error: failed to retrieve bluefs_extents from kv" << dendl;
-	++errors;
-      }
-      if (errors != prev_errors && repair) {
-	repairer.fix_bluefs_extents(out_of_sync_fm);
-      }
-    }
+    // bluefs might have allocated more since our allocator was opened
+    bluefs_extents.clear();
+    bluefs->get_block_extents(bluefs_layout.shared_bdev, &bluefs_extents);
+    dout(10) << __func__ << " bluefs extents 0x"
+             << std::hex << bluefs_extents << std::dec << dendl;
 
     for (auto e = bluefs_extents.begin(); e != bluefs_extents.end(); ++e) {
       apply_for_bitset_range(
@@ -8678,19 +9857,55 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
 
     dout(1) << __func__ << " checking freelist vs allocated" << dendl;
     {
-      // remove bluefs_extents from used set since the freelist doesn't
-      // know they are allocated.
-      for (auto e = bluefs_extents.begin(); e != bluefs_extents.end(); ++e) {
-        apply_for_bitset_range(
-          e.get_start(), e.get_len(), fm->get_alloc_size(), used_blocks,
-          [&](uint64_t pos, mempool_dynamic_bitset &bs) {
-	    bs.reset(pos);
-          }
-        );
+      // With the allocation map kept in memory the allocator is the only
+      // record of free space; it knows about bluefs' extents and repairs
+      // are applied to it directly.
+      const bool null_fm = fm->is_null_manager();
+      std::vector<std::pair<uint64_t, uint64_t>> alloc_free;
+      if (null_fm) {
+        alloc->dump([&](uint64_t offset, uint64_t length) {
+          alloc_free.emplace_back(offset, length);
+        });
+        if (tier_alloc) {
+          // nothing lives between the main and the fast device, and the
+          // allocator doesn't track it
+          uint64_t gap = tier_alloc->get_slow_size();
+          apply_for_bitset_range(
+            gap, tier_alloc->get_fast_offset() - gap, fm->get_alloc_size(),
+            used_blocks,
+            [&](uint64_t pos, mempool_dynamic_bitset &bs) {
+              bs.set(pos);
+            }
+          );
+        }
+      } else {
+        // remove bluefs_extents from used set since the freelist doesn't
+        // know they are allocated.
+        for (auto e = bluefs_extents.begin(); e != bluefs_extents.end(); ++e) {
+          apply_for_bitset_range(
+            e.get_start(), e.get_len(), fm->get_alloc_size(), used_blocks,
+            [&](uint64_t pos, mempool_dynamic_bitset &bs) {
+	      bs.reset(pos);
+            }
+          );
+        }
       }
+      auto free_it = alloc_free.begin();
+      auto next_free = [&](uint64_t *offset, uint64_t *length) {
+        if (!null_fm) {
+          return fm->enumerate_next(db, offset, length);
+        }
+        if (free_it == alloc_free.end()) {
+          return false;
+        }
+        *offset = free_it->first;
+        *length = free_it->second;
+        ++free_it;
+        return true;
+      };
       fm->enumerate_reset();
       uint64_t offset, length;
-      while (fm->enumerate_next(db, &offset, &length)) {
+      while (next_free(&offset, &length)) {
         bool intersects = false;
         apply_for_bitset_range(
           offset, length, fm->get_alloc_size(), used_blocks,
@@ -8712,6 +9927,9 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
 		  repairer.fix_false_free(db, fm,
 					  pos * min_alloc_size,
 					  min_alloc_size);
+		  if (null_fm) {
+		    alloc->init_rm_free(pos * min_alloc_size, min_alloc_size);
+		  }
 	        }
 	      }
             } else {
@@ -8747,6 +9965,10 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
 				    fm,
 				    start * min_alloc_size,
 				    (cur + 1 - start) * min_alloc_size);
+		if (null_fm) {
+		  alloc->init_add_free(start * min_alloc_size,
+				       (cur + 1 - start) * min_alloc_size);
+		}
 	      }
 	      start = next;
 	      break;
@@ -9055,24 +10277,16 @@ void BlueStore::_get_statfs_overall(struct store_statfs_t *buf)
   uint64_t bfree = alloc->get_free();
 
   if (bluefs) {
-    int64_t bluefs_total = bluefs->get_total(bluefs_layout.shared_bdev);
-    int64_t bluefs_free = bluefs->get_free(bluefs_layout.shared_bdev);
-    // part of our shared device is "free" according to BlueFS, but we
-    // can't touch bluestore_bluefs_min of it.
-    int64_t shared_available = std::min(
-      bluefs_free,
-      int64_t(bluefs_total - cct->_conf->bluestore_bluefs_min));
-    buf->internally_reserved = bluefs_total - shared_available;
-    if (shared_available > 0) {
-      bfree += shared_available;
-    }
+    // bluefs allocates from us on the shared device, so whatever it is
+    // not using is already accounted in bfree
+    buf->internally_reserved = 0;
     // include dedicated db, too, if that isn't the shared device.
     if (bluefs_layout.shared_bdev != BlueFS::BDEV_DB) {
       buf->total += bluefs->get_total(BlueFS::BDEV_DB);
     }
     // call any non-omap bluefs space "internal metadata"
     buf->internal_metadata =
-      std::max(bluefs->get_used(), (uint64_t)cct->_conf->bluestore_bluefs_min)
+      bluefs->get_used()
       - buf->omap_allocated;
   }
 
@@ -9085,6 +10299,9 @@ void BlueStore::_get_statfs_overall(struct store_statfs_t *buf)
     bfree = std::min(bfree, thin_avail);
 
     buf->allocated = thin_total - thin_avail;
+  } else if (tier_bdev) {
+    // leave out the unused address space between the devices
+    buf->total += tier_bdev->get_slow_size() + tier_bdev->get_fast_size();
   } else {
     buf->total += bdev->get_size();
   }
@@ -9096,6 +10313,9 @@ int BlueStore::statfs(struct store_statfs_t *buf,
 {
   if (alerts) {
     alerts->clear();
+    if (bluefs) {
+      _check_bluefs_spillover();
+    }
     _log_alerts(*alerts);
   }
   _get_statfs_overall(buf);
@@ -9211,6 +10431,10 @@ void BlueStore::_reap_collections()
       ++p;
       continue;
     }
+    {
+      std::unique_lock l(c->lock);
+      _release_write_streams(c.get(), mono_clock::time_point::max());
+    }
     c->onode_map.clear();
     p = removed_colls.erase(p);
     dout(10) << __func__ << " " << c << " " << c->cid << " done" << dendl;
@@ -9222,6 +10446,44 @@ void BlueStore::_reap_collections()
   }
 }
 
+void BlueStore::_release_write_stream(Collection::write_stream_t *ws)
+{
+  if (ws->reserved.length) {
+    dout(20) << __func__ << " " << ws->reserved << dendl;
+    alloc->release(PExtentVector{ws->reserved});
+    logger->dec(l_bluestore_write_coalesce_reserved, ws->reserved.length);
+    ws->reserved = bluestore_pextent_t();
+  }
+}
+
+void BlueStore::_release_write_streams(Collection *c,
+				       mono_clock::time_point expire)
+{
+  // caller holds c->lock
+  auto p = c->write_streams.begin();
+  while (p != c->write_streams.end()) {
+    if (p->second.stamp < expire) {
+      _release_write_stream(&p->second);
+      p = c->write_streams.erase(p);
+    } else {
+      ++p;
+    }
+  }
+}
+
+void BlueStore::_prune_write_streams()
+{
+  auto expire = mono_clock::now() -
+    std::chrono::nanoseconds(write_coalesce_window_ns.load());
+  std::shared_lock l(coll_lock);
+  for (auto& p : coll_map) {
+    std::unique_lock cl(p.second->lock, std::try_to_lock);
+    if (cl.owns_lock()) {
+      _release_write_streams(p.second.get(), expire);
+    }
+  }
+}
+
 void BlueStore::_update_cache_logger()
 {
   uint64_t num_onodes = 0;
@@ -9237,6 +10499,21 @@ void BlueStore::_update_cache_logger()
     c->add_stats(&num_extents, &num_blobs,
                  &num_buffers, &num_buffer_bytes);
   }
+  for (auto& p : cache_partitions) {
+    uint64_t part_onodes = 0;
+    uint64_t part_buffer_bytes = 0;
+    for (auto c : p.second->onode_shards) {
+      c->add_stats(&part_onodes, &num_pinned_onodes);
+    }
+    for (auto c : p.second->buffer_shards) {
+      c->add_stats(&num_extents, &num_blobs,
+                   &num_buffers, &part_buffer_bytes);
+    }
+    p.second->logger->set(l_bluestore_onodes, part_onodes);
+    p.second->logger->set(l_bluestore_buffer_bytes, part_buffer_bytes);
+    num_onodes += part_onodes;
+    num_buffer_bytes += part_buffer_bytes;
+  }
   logger->set(l_bluestore_onodes, num_onodes);
   logger->set(l_bluestore_pinned_onodes, num_pinned_onodes);
   logger->set(l_bluestore_extents, num_extents);
@@ -9259,8 +10536,8 @@ ObjectStore::CollectionHandle BlueStore::create_new_collection(
   std::unique_lock l{coll_lock};
   auto c = ceph::make_ref<Collection>(
     this,
-    onode_cache_shards[cid.hash_to_shard(onode_cache_shards.size())],
-    buffer_cache_shards[cid.hash_to_shard(buffer_cache_shards.size())],
+    _get_onode_cache_shard(cid),
+    _get_buffer_cache_shard(cid),
     cid);
   new_coll_map[cid] = c;
   _osr_attach(c.get());
@@ -9378,6 +10655,7 @@ int BlueStore::read(
     if (offset == length && offset == 0)
       length = o->onode.size;
 
+    _tier_hit(c, o);
     r = _do_read(c, o, offset, length, bl, op_flags);
     if (r == -EIO) {
       logger->inc(l_bluestore_read_eio);
@@ -9664,6 +10942,228 @@ int BlueStore::_generate_read_result_bl(
   return 0;
 }
 
+struct BlueStore::ReadaheadContext : public BlueStore::AioContext {
+  /// an uncached blob region to fill, and its physical pieces
+  struct region_t {
+    BlobRef blob;
+    uint64_t b_off;
+    uint64_t b_len;
+    PExtentVector pextents;
+    region_t(const BlobRef& b, uint64_t off, uint64_t len)
+      : blob(b), b_off(off), b_len(len) {}
+  };
+  /// a single device read covering one or more adjacent pieces
+  struct run_t {
+    uint64_t offset;
+    uint64_t length;
+    bufferlist bl;
+    run_t(uint64_t o, uint64_t l) : offset(o), length(l) {}
+  };
+
+  CollectionRef c;
+  OnodeRef o;
+  OnodeReadahead *ra;
+  uint64_t gen;
+  IOContext ioc;
+  vector<region_t> regions;
+  vector<run_t> runs;   ///< sorted by device offset, disjoint
+
+  ReadaheadContext(CephContext *cct, Collection *c, OnodeRef o,
+		   OnodeReadahead *ra)
+    : c(c), o(o), ra(ra), gen(ra->gen), ioc(cct, this, true) {}
+
+  void aio_finish(BlueStore *store) override {
+    store->_readahead_finish(this);
+  }
+};
+
+BlueStore::OnodeReadahead* BlueStore::_get_readahead(
+  OnodeRef& o,
+  uint64_t offset,
+  uint64_t length)
+{
+  uint64_t prev_end = o->last_read_end.exchange(offset + length);
+  if (readahead_max_bytes == 0) {
+    return nullptr;
+  }
+  OnodeReadahead *ra = o->readahead.load();
+  if (ra) {
+    return ra;
+  }
+  // only set up stream tracking once an object is read sequentially, so that
+  // randomly accessed onodes don't carry the extra state
+  if (offset == 0 || offset != prev_end || offset + length >= o->onode.size) {
+    return nullptr;
+  }
+  auto n = new OnodeReadahead;
+  n->ra.set_trigger_requests(cct->_conf->bluestore_readahead_trigger_requests);
+  n->ra.set_min_readahead_size(cct->_conf->bluestore_readahead_min_bytes);
+  n->ra.set_max_readahead_size(readahead_max_bytes);
+  n->ra.set_alignments({ block_size });
+  OnodeReadahead *expected = nullptr;
+  if (!o->readahead.compare_exchange_strong(expected, n)) {
+    // lost the race against a concurrent reader
+    delete n;
+    return expected;
+  }
+  dout(20) << __func__ << " " << o->oid << " sequential stream at 0x"
+           << std::hex << offset << std::dec << dendl;
+  return n;
+}
+
+void BlueStore::_do_readahead(
+  Collection *c,
+  OnodeRef o,
+  OnodeReadahead *ra,
+  uint64_t offset,
+  uint64_t length)
+{
+  dout(20) << __func__ << " " << o->oid << " 0x" << std::hex << offset
+           << "~" << length << std::dec << dendl;
+  {
+    std::lock_guard l(ra->lock);
+    if (ra->in_flight) {
+      dout(20) << __func__ << " previous readahead still in flight" << dendl;
+      return;
+    }
+  }
+  o->extent_map.fault_range(db, offset, length);
+
+  ready_regions_t ready_regions;
+  blobs2read_t blobs2read;
+  _read_cache(o, offset, length, 0, ready_regions, blobs2read);
+
+  auto rc = new ReadaheadContext(cct, c, o, ra);
+  vector<bluestore_pextent_t> pieces;
+  uint64_t bytes = 0;
+  for (auto& p : blobs2read) {
+    const BlobRef& bptr = p.first;
+    if (bptr->get_blob().is_compressed()) {
+      // decompressing in the aio thread is too expensive, leave these
+      // to the foreground read
+      continue;
+    }
+    for (auto& req : p.second) {
+      rc->regions.emplace_back(bptr, req.r_off, req.r_len);
+      auto& r = rc->regions.back();
+      bptr->get_blob().map(
+	req.r_off, req.r_len,
+	[&](uint64_t offset, uint64_t length) {
+	  r.pextents.emplace_back(offset, length);
+	  pieces.emplace_back(offset, length);
+	  return 0;
+	});
+      bytes += req.r_len;
+    }
+  }
+  if (pieces.empty()) {
+    dout(20) << __func__ << " nothing to prefetch" << dendl;
+    delete rc;
+    return;
+  }
+
+  // merge physically adjacent pieces so that consecutive blobs are fetched
+  // with a single device read
+  std::sort(pieces.begin(), pieces.end(),
+	    [](const bluestore_pextent_t& a, const bluestore_pextent_t& b) {
+	      return a.offset < b.offset;
+	    });
+  for (auto& p : pieces) {
+    if (!rc->runs.empty() &&
+	p.offset <= rc->runs.back().offset + rc->runs.back().length) {
+      auto& run = rc->runs.back();
+      run.length = std::max(run.offset + run.length,
+			    p.offset + p.length) - run.offset;
+    } else {
+      rc->runs.emplace_back(p.offset, p.length);
+    }
+  }
+  for (auto& run : rc->runs) {
+    int r = bdev->aio_read(run.offset, run.length, &run.bl, &rc->ioc);
+    if (r < 0) {
+      dout(10) << __func__ << " aio_read failed: " << cpp_strerror(r) << dendl;
+      delete rc;
+      return;
+    }
+  }
+  dout(20) << __func__ << " prefetching 0x" << std::hex << bytes << std::dec
+           << " bytes in " << rc->regions.size() << " regions with "
+           << rc->runs.size() << " ios" << dendl;
+
+  {
+    std::lock_guard l(ra->lock);
+    ra->in_flight = true;
+    ra->ra_off = offset;
+    ra->ra_end = offset + length;
+  }
+  {
+    std::lock_guard l(readahead_lock);
+    ++readahead_in_flight;
+  }
+  logger->inc(l_bluestore_readahead_issued);
+  logger->inc(l_bluestore_readahead_bytes, bytes);
+  bdev->aio_submit(&rc->ioc);
+}
+
+void BlueStore::_readahead_finish(ReadaheadContext *rc)
+{
+  // we are called from the aio thread and must not block: populate the
+  // cache only if the collection lock can be taken right away and the
+  // lextents we prefetched have not changed since
+  bool filled = false;
+  std::shared_lock l(rc->c->lock, std::try_to_lock);
+  if (l.owns_lock() &&
+      rc->ioc.get_return_value() >= 0 &&
+      rc->ra->gen == rc->gen) {
+    filled = true;
+    for (auto& r : rc->regions) {
+      bufferlist bl;
+      for (auto& p : r.pextents) {
+	auto run = std::upper_bound(
+	  rc->runs.begin(), rc->runs.end(), p.offset,
+	  [](uint64_t off, const ReadaheadContext::run_t& run) {
+	    return off < run.offset;
+	  });
+	ceph_assert(run != rc->runs.begin());
+	--run;
+	bufferlist t;
+	t.substr_of(run->bl, p.offset - run->offset, p.length);
+	bl.claim_append(t);
+      }
+      int bad;
+      uint64_t bad_csum;
+      if (r.blob->get_blob().verify_csum(r.b_off, bl, &bad, &bad_csum) != 0) {
+	// leave it to the foreground read to retry and report
+	dout(10) << __func__ << " csum mismatch in " << *r.blob << ", skipping"
+		 << dendl;
+	filled = false;
+	continue;
+      }
+      r.blob->shared_blob->bc.did_read(r.blob->shared_blob->get_cache(),
+				       r.b_off, bl);
+    }
+  }
+  if (l.owns_lock()) {
+    l.unlock();
+  }
+  if (!filled) {
+    logger->inc(l_bluestore_readahead_dropped);
+  }
+  {
+    std::lock_guard rl(rc->ra->lock);
+    rc->ra->in_flight = false;
+    if (!filled) {
+      rc->ra->ra_off = rc->ra->ra_end = 0;
+    }
+    rc->ra->cond.notify_all();
+  }
+  delete rc;
+  std::lock_guard rl(readahead_lock);
+  if (--readahead_in_flight == 0) {
+    readahead_cond.notify_all();
+  }
+}
+
 int BlueStore::_do_read(
   Collection *c,
   OnodeRef o,
@@ -9718,6 +11218,23 @@ int BlueStore::_do_read(
     read_cache_policy = BufferSpace::BYPASS_CLEAN_CACHE;
   }
 
+  // readahead only helps reads that can be served from the cache
+  OnodeReadahead *ra = nullptr;
+  if (buffered && read_cache_policy == 0 && retry_count == 0 &&
+      (op_flags & CEPH_OSD_OP_FLAG_FADVISE_RANDOM) == 0) {
+    ra = _get_readahead(o, offset, length);
+  }
+  if (ra) {
+    std::unique_lock l(ra->lock);
+    if (offset < ra->ra_end && offset + length > ra->ra_off) {
+      // wait for the prefetch rather than reading the same extents twice
+      ra->cond.wait(l, [ra] { return !ra->in_flight; });
+      if (offset < ra->ra_end && offset + length > ra->ra_off) {
+	logger->inc(l_bluestore_readahead_hits);
+      }
+    }
+  }
+
   // build blob-wise list to of stuff read (that isn't cached)
   ready_regions_t ready_regions;
   blobs2read_t blobs2read;
@@ -9775,6 +11292,12 @@ int BlueStore::_do_read(
     dout(5) << __func__ << " read at 0x" << std::hex << offset << "~" << length
             << " failed " << std::dec << retry_count << " times before succeeding" << dendl;
   }
+  if (ra) {
+    auto ext = ra->ra.update(offset, length, o->onode.size);
+    if (ext.second > 0) {
+      _do_readahead(c, o, ra, ext.first, ext.second);
+    }
+  }
   return r;
 }
 
@@ -10002,6 +11525,7 @@ int BlueStore::readv(
       goto out;
     }
 
+    _tier_hit(c, o);
     r = _do_readv(c, o, m, bl, op_flags);
     if (r == -EIO) {
       logger->inc(l_bluestore_read_eio);
@@ -10406,6 +11930,11 @@ int BlueStore::_collection_list(
     int r = get_key_object(it->key(), &oid);
     ceph_assert(r == 0);
     dout(20) << __func__ << " oid " << oid << " end " << end << dendl;
+    if (c->bulk_remove_fenced && _bulk_remove_covers(oid)) {
+      // left behind by a removal that is still in progress
+      it->next();
+      continue;
+    }
     if (ls->size() >= (unsigned)max) {
       dout(20) << __func__ << " reached max " << max << dendl;
       *pnext = oid;
@@ -10670,6 +12199,123 @@ int BlueStore::omap_check_keys(
   return r;
 }
 
+// entries omap_get_batch reads before it sizes the readahead
+static const uint64_t OMAP_BATCH_PROBE_ENTRIES = 16;
+
+int BlueStore::omap_get_batch(
+  CollectionHandle &c_,          ///< [in] Collection containing oid
+  const ghobject_t &oid,         ///< [in] Object containing omap
+  const string &start_after,     ///< [in] Return keys after this
+  const string &filter_prefix,   ///< [in] Only keys with this prefix
+  uint64_t max_entries,          ///< [in] Max pairs to return
+  uint64_t max_bytes,            ///< [in] Max bytes to return
+  map<string, bufferlist> *out,  ///< [out] Keys and values
+  bool *more                     ///< [out] Batch was truncated
+  )
+{
+  Collection *c = static_cast<Collection *>(c_.get());
+  dout(15) << __func__ << " " << c->get_cid() << " oid " << oid
+	   << " after " << start_after << " prefix " << filter_prefix
+	   << " max " << max_entries << "/" << max_bytes << dendl;
+  if (!c->exists)
+    return -ENOENT;
+  auto start1 = mono_clock::now();
+  std::shared_lock l(c->lock);
+  int r = 0;
+  uint64_t num = 0, bytes = 0;
+  *more = false;
+  OnodeRef o = c->get_onode(oid, false);
+  if (!o || !o->exists) {
+    r = -ENOENT;
+    goto out;
+  }
+  if (!o->onode.has_omap()) {
+    goto out;
+  }
+  o->flush();
+  {
+    // keep the scan within the object's keys that carry filter_prefix, so
+    // that rocksdb neither returns nor steps over anything past them
+    KeyValueDB::IteratorBounds bounds;
+    string tail;
+    o->get_omap_key(filter_prefix, &bounds.lower_bound);
+    o->get_omap_tail(&tail);
+    if (!filter_prefix.empty()) {
+      bounds.upper_bound = bounds.lower_bound;
+      while (!bounds.upper_bound.empty() &&
+	     (unsigned char)bounds.upper_bound.back() == 0xff) {
+	bounds.upper_bound.pop_back();
+      }
+      ceph_assert(!bounds.upper_bound.empty());
+      bounds.upper_bound.back()++;
+      if (bounds.upper_bound > tail) {
+	bounds.upper_bound = tail;
+      }
+    } else {
+      bounds.upper_bound = tail;
+    }
+    size_t readahead_max =
+      cct->_conf.get_val<Option::size_t>("bluestore_omap_batch_readahead");
+    // the first few entries are read without readahead; what they take
+    // tells how much the rest of the batch will need, so that a small
+    // max_entries doesn't pull in max_bytes worth of sst blocks
+    KeyValueDB::Iterator it = db->get_bounded_iterator(
+      o->get_omap_prefix(), bounds);
+    if (filter_prefix > start_after) {
+      it->lower_bound(bounds.lower_bound);
+    } else {
+      string key;
+      o->get_omap_key(start_after, &key);
+      it->upper_bound(key);
+    }
+    size_t base_key_len = bounds.lower_bound.size() - filter_prefix.size();
+    while (it->valid()) {
+      string db_key = it->key();
+      // backends that can't bound the iterator leave this to us
+      if (db_key >= bounds.upper_bound) {
+	break;
+      }
+      if (num >= max_entries || bytes >= max_bytes) {
+	*more = true;
+	break;
+      }
+      bufferlist value = it->value();
+      ++num;
+      bytes += db_key.size() - base_key_len + value.length();
+      dout(30) << __func__ << "  got " << pretty_binary_string(db_key)
+	       << dendl;
+      out->emplace_hint(out->end(), db_key.substr(base_key_len),
+			std::move(value));
+      if (num == OMAP_BATCH_PROBE_ENTRIES && readahead_max) {
+	uint64_t left = max_bytes > bytes ? max_bytes - bytes : 0;
+	uint64_t per_entry = bytes / num;
+	if (per_entry && max_entries - num < left / per_entry) {
+	  left = (max_entries - num) * per_entry;
+	}
+	size_t readahead = std::min<uint64_t>(left, readahead_max);
+	if (readahead) {
+	  dout(20) << __func__ << " readahead " << readahead << dendl;
+	  it = db->get_bounded_iterator(o->get_omap_prefix(), bounds,
+					readahead);
+	  it->upper_bound(db_key);
+	  continue;
+	}
+      }
+      it->next();
+    }
+  }
+ out:
+  log_latency(
+    __func__,
+    l_bluestore_omap_get_batch_lat,
+    mono_clock::now() - start1,
+    cct->_conf->bluestore_log_omap_iterator_age);
+  dout(10) << __func__ << " " << c->get_cid() << " oid " << oid << " = " << r
+	   << " (" << num << " keys, " << bytes << " bytes"
+	   << (*more ? ", more" : "") << ")" << dendl;
+  return r;
+}
+
 ObjectMap::ObjectMapIterator BlueStore::get_omap_iterator(
   CollectionHandle &c_,              ///< [in] collection
   const ghobject_t &oid  ///< [in] object
@@ -10702,8 +12348,12 @@ uint64_t BlueStore::_get_ondisk_reserved() const {
 
 void BlueStore::_prepare_ondisk_format_super(KeyValueDB::Transaction& t)
 {
+  // older releases would open block alone and misread every extent
+  // that lives on the fast device
+  int32_t compat = tier_bdev ?
+    min_compat_tiered_ondisk_format : min_compat_ondisk_format;
   dout(10) << __func__ << " ondisk_format " << ondisk_format
-	   << " min_compat_ondisk_format " << min_compat_ondisk_format
+	   << " min_compat_ondisk_format " << compat
 	   << dendl;
   ceph_assert(ondisk_format == latest_ondisk_format);
   {
@@ -10713,7 +12363,7 @@ void BlueStore::_prepare_ondisk_format_super(KeyValueDB::Transaction& t)
   }
   {
     bufferlist bl;
-    encode(min_compat_ondisk_format, bl);
+    encode(compat, bl);
     t->set(PREFIX_SUPER, "min_compat_ondisk_format", bl);
   }
 }
@@ -10845,10 +12495,19 @@ int BlueStore::_open_super_meta()
   _open_statfs();
   _set_alloc_sizes();
   _set_throttle_params();
+  _set_tier();
 
   _set_csum();
   _set_compression();
   _set_blob_size();
+  _set_readahead();
+
+  // shared by all spanning blob encodes/decodes, see encode_spanning_blobs
+  spanning_blob_compressor = Compressor::create(cct, "lz4");
+  if (!spanning_blob_compressor) {
+    dout(1) << __func__ << " lz4 compressor is not available,"
+	    << " spanning blobs will be stored uncompressed" << dendl;
+  }
 
   _validate_bdev();
   return 0;
@@ -10903,6 +12562,31 @@ int BlueStore::_upgrade_super()
       int r = db->submit_transaction_sync(t);
       ceph_assert(r == 0);
     }
+    if (ondisk_format == 3) {
+      // changes:
+      // - bluefs allocates from bluestore's allocator on the shared device
+      //   and doesn't own any extents there; older releases would expect
+      //   the space to be gifted and can't read us anymore.
+      // - super: removed legacy bluefs_extents and bluefs_extents_back
+      ondisk_format = 4;
+      KeyValueDB::Transaction t = db->get_transaction();
+      t->rmkey(PREFIX_SUPER, "bluefs_extents");
+      t->rmkey(PREFIX_SUPER, "bluefs_extents_back");
+      _prepare_ondisk_format_super(t);
+      int r = db->submit_transaction_sync(t);
+      ceph_assert(r == 0);
+    }
+    if (ondisk_format == 4) {
+      // changes:
+      // - block.fast: extents may live on a fast data device mapped past
+      //   the end of block (see tier_fast_offset); such stores raise
+      //   min_compat_ondisk_format to 5.
+      ondisk_format = 5;
+      KeyValueDB::Transaction t = db->get_transaction();
+      _prepare_ondisk_format_super(t);
+      int r = db->submit_transaction_sync(t);
+      ceph_assert(r == 0);
+    }
   }
   // done
   dout(1) << __func__ << " done" << dendl;
@@ -11003,6 +12687,7 @@ void BlueStore::_txc_state_proc(TransContext *txc)
       if (txc->ioc.has_pending_aios()) {
 	txc->state = TransContext::STATE_AIO_WAIT;
 	txc->had_ios = true;
+	++txc_aio_in_flight;
 	_txc_aio_submit(txc);
 	return;
       }
@@ -11017,8 +12702,20 @@ void BlueStore::_txc_state_proc(TransContext *txc)
 		  << ", latency = " << lat
 		  << dendl;
 	}
+	if (txc->had_ios) {
+	  --txc_aio_in_flight;
+	  // large writes would skew what a small direct write costs
+	  if (txc->bytes <=
+	      cct->_conf->bluestore_prefer_deferred_adaptive_max_size) {
+	    update_lat_avg(direct_write_lat_avg, lat);
+	  }
+	}
       }
 
+      if (txc->bulk_remove_fence && _bulk_remove_park(txc)) {
+	// the removal thread submits it once the old objects are gone
+	return;
+      }
       _txc_finish_io(txc);  // may trigger blocked txc's too
       return;
 
@@ -11372,6 +13069,11 @@ void BlueStore::_txc_finish(TransContext *txc)
     // blocks
     auto txc = &releasing_txc.front();
     _txc_release_alloc(txc);
+    // likewise, only start emptying collections removed by this txc now
+    while (!txc->bulk_removed_collections.empty()) {
+      _bulk_remove_ready(txc->bulk_removed_collections.front());
+      txc->bulk_removed_collections.pop_front();
+    }
     releasing_txc.pop_front();
     throttle.log_state_latency(*txc, logger, l_bluestore_state_done_lat);
     throttle.complete(*txc);
@@ -11530,6 +13232,12 @@ void BlueStore::_osr_drain_all()
       zombies.push_back(i.second);
     }
   }
+  {
+    std::lock_guard l(bulk_remove_lock);
+    for (auto& i : bulk_remove_map) {
+      s.insert(i.second.c->osr);
+    }
+  }
   dout(20) << __func__ << " osr_set " << s << dendl;
 
   ++deferred_aggressive;
@@ -11577,11 +13285,56 @@ void BlueStore::_kv_start()
 {
   dout(10) << __func__ << dendl;
 
+  _numa_init();
   finisher.start();
+  if (numa_node >= 0) {
+    // runs on the finisher thread itself
+    finisher.queue(make_lambda_context([this](int) {
+      _numa_bind_thread("finisher");
+    }));
+  }
   kv_sync_thread.create("bstore_kv_sync");
   kv_finalize_thread.create("bstore_kv_final");
 }
 
+void BlueStore::_numa_init()
+{
+  numa_node = -1;
+  if (!cct->_conf.get_val<bool>("bluestore_numa_affinity")) {
+    return;
+  }
+  int node = -1;
+  set<int> nodes;
+  get_numa_node(&node, &nodes, nullptr);
+  if (node < 0) {
+    dout(1) << __func__ << " devices are not on a single known numa node "
+	    << nodes << ", not binding kv threads" << dendl;
+    return;
+  }
+  int r = get_numa_node_cpu_set(node, &numa_cpu_set_size, &numa_cpu_set);
+  if (r < 0) {
+    dout(1) << __func__ << " unable to determine numa node " << node
+	    << " CPUs" << dendl;
+    return;
+  }
+  numa_node = node;
+  dout(1) << __func__ << " binding kv threads to numa node " << numa_node
+	  << " cpus " << cpu_set_to_str_list(numa_cpu_set_size, &numa_cpu_set)
+	  << dendl;
+}
+
+void BlueStore::_numa_bind_thread(const char *name)
+{
+  int r = set_cpu_affinity_this_thread(numa_cpu_set_size, &numa_cpu_set);
+  if (r < 0) {
+    derr << __func__ << " " << name << " failed to set numa affinity: "
+	 << cpp_strerror(r) << dendl;
+  } else {
+    dout(10) << __func__ << " " << name << " on numa node " << numa_node
+	     << dendl;
+  }
+}
+
 void BlueStore::_kv_stop()
 {
   dout(10) << __func__ << dendl;
@@ -11622,6 +13375,9 @@ void BlueStore::_kv_sync_thread()
 {
   dout(10) << __func__ << " start" << dendl;
   deque<DeferredBatch*> deferred_stable_queue; ///< deferred ios done + stable
+  if (numa_node >= 0) {
+    _numa_bind_thread("kv_sync");
+  }
   std::unique_lock l{kv_lock};
   ceph_assert(!kv_sync_started);
   kv_sync_started = true;
@@ -11747,14 +13503,6 @@ void BlueStore::_kv_sync_thread()
       // transaction is ready for commit.
       throttle.release_kv_throttle(costs);
 
-      if (bluefs &&
-	  after_flush - bluefs_last_balance >
-	  ceph::make_timespan(cct->_conf->bluestore_bluefs_balance_interval)) {
-	bluefs_last_balance = after_flush;
-	int r = _balance_bluefs_freespace();
-	ceph_assert(r >= 0);
-      }
-
       // cleanup sync deferred keys
       for (auto b : deferred_stable) {
 	for (auto& txc : b->txcs) {
@@ -11846,34 +13594,13 @@ void BlueStore::_kv_sync_thread()
 	  l_bluestore_kv_commit_lat,
 	  dur_kv,
 	  cct->_conf->bluestore_log_op_age);
+	update_lat_avg(kv_commit_lat_avg, dur_kv);
 	log_latency("kv_sync",
 	  l_bluestore_kv_sync_lat,
 	  dur,
 	  cct->_conf->bluestore_log_op_age);
       }
 
-      if (bluefs) {
-	if (!bluefs_extents_reclaiming.empty()) {
-	  dout(0) << __func__ << " releasing old bluefs 0x" << std::hex
-		   << bluefs_extents_reclaiming << std::dec << dendl;
-	  int r = 0;
-	  if (cct->_conf->bdev_enable_discard && cct->_conf->bdev_async_discard) {
-	    r = bdev->queue_discard(bluefs_extents_reclaiming);
-	    if (r == 0) {
-	      goto clear;
-	    }
-	  } else if (cct->_conf->bdev_enable_discard) {
-	    for (auto p = bluefs_extents_reclaiming.begin(); p != bluefs_extents_reclaiming.end(); ++p) {
-	      bdev->discard(p.get_start(), p.get_len());
-	    }
-	  }
-
-	  alloc->release(bluefs_extents_reclaiming);
-clear:
-	  bluefs_extents_reclaiming.clear();
-	}
-      }
-
       l.lock();
       // previously deferred "done" are now "stable" by virtue of this
       // commit cycle.
@@ -11889,6 +13616,9 @@ void BlueStore::_kv_finalize_thread()
   deque<TransContext*> kv_committed;
   deque<DeferredBatch*> deferred_stable;
   dout(10) << __func__ << " start" << dendl;
+  if (numa_node >= 0) {
+    _numa_bind_thread("kv_finalize");
+  }
   std::unique_lock l(kv_finalize_lock);
   ceph_assert(!kv_finalize_started);
   kv_finalize_started = true;
@@ -11935,6 +13665,10 @@ void BlueStore::_kv_finalize_thread()
 	if (deferred_queue_size >= deferred_batch_ops.load() ||
 	    throttle.should_submit_deferred()) {
 	  deferred_try_submit();
+	} else if (prefer_deferred_adaptive && deferred_queue_size > 0 &&
+		   txc_aio_in_flight == 0) {
+	  // the device is idle, there is nothing to wait for
+	  deferred_try_submit();
 	}
       }
 
@@ -11943,6 +13677,13 @@ void BlueStore::_kv_finalize_thread()
 
       logger->set(l_bluestore_fragmentation,
 	  (uint64_t)(alloc->get_fragmentation() * 1000));
+      {
+	utime_t lat;
+	lat.set_from_double(direct_write_lat_avg / 1000000000.0);
+	logger->tset(l_bluestore_direct_write_lat_avg, lat);
+	lat.set_from_double(kv_commit_lat_avg / 1000000000.0);
+	logger->tset(l_bluestore_kv_commit_lat_avg, lat);
+      }
 
       log_latency("kv_final",
 	l_bluestore_kv_final_lat,
@@ -12202,27 +13943,68 @@ int BlueStore::queue_transactions(
     tls, &on_applied, &on_commit, &on_applied_sync);
 
   auto start = mono_clock::now();
+  last_submit_ns = start.time_since_epoch().count();
 
   Collection *c = static_cast<Collection*>(ch.get());
   OpSequencer *osr = c->osr.get();
   dout(10) << __func__ << " ch " << c << " " << c->cid << dendl;
 
-  // prepare
-  TransContext *txc = _txc_create(static_cast<Collection*>(ch.get()), osr,
-				  &on_commit);
+  mono_clock::duration throttle_lat;
+  {
+    std::lock_guard l(osr->submit_lock);
 
-  for (vector<Transaction>::iterator p = tls.begin(); p != tls.end(); ++p) {
-    txc->bytes += (*p).get_num_bytes();
-    _txc_add_transaction(txc, &(*p));
-  }
-  _txc_calc_cost(txc);
+    // prepare
+    TransContext *txc = _txc_create(static_cast<Collection*>(ch.get()), osr,
+				    &on_commit);
 
-  _txc_write_nodes(txc, txc->t);
+    for (vector<Transaction>::iterator p = tls.begin(); p != tls.end(); ++p) {
+      txc->bytes += (*p).get_num_bytes();
+      _txc_add_transaction(txc, &(*p));
+    }
+    throttle_lat = _txc_submit(txc, handle);
+  }
 
-  // journal deferred items
-  if (txc->deferred_txn) {
-    txc->deferred_txn->seq = ++deferred_seq;
-    bufferlist bl;
+  // we're immediately readable (unlike FileStore)
+  for (auto c : on_applied_sync) {
+    c->complete(0);
+  }
+  if (!on_applied.empty()) {
+    if (c->commit_queue) {
+      c->commit_queue->queue(on_applied);
+    } else {
+      finisher.queue(on_applied);
+    }
+  }
+
+  log_latency("submit_transact",
+    l_bluestore_submit_lat,
+    mono_clock::now() - start,
+    cct->_conf->bluestore_log_op_age);
+  log_latency("throttle_transact",
+    l_bluestore_throttle_lat,
+    throttle_lat,
+    cct->_conf->bluestore_log_op_age);
+  return 0;
+}
+
+mono_clock::duration BlueStore::_txc_submit(
+  TransContext *txc,
+  ThreadPool::TPHandle *handle,
+  bool throttled)
+{
+  _txc_calc_cost(txc);
+  if (!throttled) {
+    // nothing is taken, so nothing is released at kv commit
+    ceph_assert(!txc->deferred_txn);
+    txc->cost = 0;
+  }
+
+  _txc_write_nodes(txc, txc->t);
+
+  // journal deferred items
+  if (txc->deferred_txn) {
+    txc->deferred_txn->seq = ++deferred_seq;
+    bufferlist bl;
     encode(*txc->deferred_txn, bl);
     string key;
     get_deferred_key(txc->deferred_txn->seq, &key);
@@ -12235,7 +14017,9 @@ int BlueStore::queue_transactions(
 
   auto tstart = mono_clock::now();
 
-  if (!throttle.try_start_transaction(
+  if (!throttled) {
+    throttle.start_unthrottled(*db, *txc, tstart);
+  } else if (!throttle.try_start_transaction(
 	*db,
 	*txc,
 	tstart)) {
@@ -12264,28 +14048,7 @@ int BlueStore::queue_transactions(
 
   // execute (start)
   _txc_state_proc(txc);
-
-  // we're immediately readable (unlike FileStore)
-  for (auto c : on_applied_sync) {
-    c->complete(0);
-  }
-  if (!on_applied.empty()) {
-    if (c->commit_queue) {
-      c->commit_queue->queue(on_applied);
-    } else {
-      finisher.queue(on_applied);
-    }
-  }
-
-  log_latency("submit_transact",
-    l_bluestore_submit_lat,
-    mono_clock::now() - start,
-    cct->_conf->bluestore_log_op_age);
-  log_latency("throttle_transact",
-    l_bluestore_throttle_lat,
-    tend - tstart,
-    cct->_conf->bluestore_log_op_age);
-  return 0;
+  return tend - tstart;
 }
 
 void BlueStore::_txc_aio_submit(TransContext *txc)
@@ -12861,7 +14624,7 @@ void BlueStore::_do_write_small(
 			      wctx->buffered ? 0 : Buffer::FLAG_NOCACHE);
 
 	  if (!g_conf()->bluestore_debug_omit_block_device_write) {
-	    if (b_len <= prefer_deferred_size) {
+	    if (_use_deferred_write(b_len)) {
 	      dout(20) << __func__ << " deferring small 0x" << std::hex
 		       << b_len << std::dec << " unused write via deferred" << dendl;
 	      bluestore_deferred_op_t *op = _get_deferred_op(txc);
@@ -13336,12 +15099,57 @@ int BlueStore::_do_alloc_write(
       need += wi.blob_length;
     }
   }
+  // small writes that continue the previous one to an object take their
+  // space from a reservation right behind it, so that the blob grows
+  // physically contiguous and deferred batches can merge the IOs
+  Collection::write_stream_t *ws = nullptr;
+  bool adjacent = false;
+  uint64_t reserve = 0;
+  // (not for migrations between tiers, which must not reuse a reservation
+  // on the device they are moving away from)
+  if (uint64_t window = write_coalesce_window_ns;
+      window && !wctx->compress && need && txc->tier == TIER_AUTO &&
+      need < write_coalesce_max_bytes) {
+    auto now = mono_clock::now();
+    auto p = coll->write_streams.find(o->oid);
+    if (p == coll->write_streams.end()) {
+      p = coll->write_streams.emplace(o->oid,
+				      Collection::write_stream_t()).first;
+    } else {
+      adjacent = p->second.logical_end ==
+	  p2align(wctx->writes.front().logical_offset, min_alloc_size) &&
+	now - p->second.stamp <= std::chrono::nanoseconds(window);
+    }
+    ws = &p->second;
+    ws->stamp = now;
+    if (adjacent && ws->reserved.length >= need) {
+      logger->inc(l_bluestore_write_coalesced);
+    } else {
+      if (adjacent) {
+	logger->inc(l_bluestore_write_coalesce_missed);
+	reserve = write_coalesce_max_bytes;
+      }
+      _release_write_stream(ws);
+    }
+  }
+
   PExtentVector prealloc;
   prealloc.reserve(2 * wctx->writes.size());;
   int64_t prealloc_left = 0;
-  prealloc_left = alloc->allocate(
-    need, min_alloc_size, need,
-    0, &prealloc);
+  if (ws && adjacent && !reserve) {
+    prealloc.emplace_back(ws->reserved.offset, need);
+    ws->reserved.offset += need;
+    ws->reserved.length -= need;
+    logger->dec(l_bluestore_write_coalesce_reserved, need);
+    prealloc_left = need;
+  } else {
+    int64_t hint = adjacent ? ws->physical_end : 0;
+    if (tier_alloc) {
+      hint = _tier_alloc_hint(txc, o, hint);
+    }
+    prealloc_left = alloc->allocate(
+      need + reserve, min_alloc_size, need + reserve, hint, &prealloc);
+  }
   if (prealloc_left < 0 || prealloc_left < (int64_t)need) {
     derr << __func__ << " failed to allocate 0x" << std::hex << need
          << " allocated 0x " << (prealloc_left < 0 ? 0 : prealloc_left)
@@ -13353,8 +15161,42 @@ int BlueStore::_do_alloc_write(
     }
     return -ENOSPC;
   }
+  if (prealloc_left > (int64_t)need) {
+    // keep what directly follows the space for this write, return the rest
+    uint64_t pos = 0;
+    auto p = prealloc.begin();
+    while (pos + p->length <= need) {
+      pos += p->length;
+      ++p;
+    }
+    PExtentVector extra;
+    if (pos < need) {
+      uint64_t l = need - pos;
+      extra.emplace_back(p->offset + l, p->length - l);
+      p->length = l;
+      ++p;
+    }
+    extra.insert(extra.end(), p, prealloc.end());
+    prealloc.erase(p, prealloc.end());
+    if (extra.front().offset == prealloc.back().end()) {
+      ws->reserved = extra.front();
+      logger->inc(l_bluestore_write_coalesce_reserved, ws->reserved.length);
+      extra.erase(extra.begin());
+    }
+    if (!extra.empty()) {
+      alloc->release(extra);
+    }
+    prealloc_left = need;
+  }
 
   dout(20) << __func__ << " prealloc " << prealloc << dendl;
+  if (tier_alloc) {
+    for (auto& e : prealloc) {
+      logger->inc(tier_alloc->is_fast(e.offset) ?
+		  l_bluestore_tier_placed_fast : l_bluestore_tier_placed_slow,
+		  e.length);
+    }
+  }
   auto prealloc_pos = prealloc.begin();
 
   for (auto& wi : wctx->writes) {
@@ -13427,6 +15269,11 @@ int BlueStore::_do_alloc_write(
     for (auto& p : extents) {
       txc->allocated.insert(p.offset, p.length);
     }
+    if (ws) {
+      ws->logical_end = p2roundup(wi.logical_offset + wi.length0,
+				  min_alloc_size);
+      ws->physical_end = extents.back().end();
+    }
     dblob.allocated(p2align(b_off, min_alloc_size), final_length, extents);
 
     dout(20) << __func__ << " blob " << *b << dendl;
@@ -13457,7 +15304,7 @@ int BlueStore::_do_alloc_write(
 
     // queue io
     if (!g_conf()->bluestore_debug_omit_block_device_write) {
-      if (l->length() <= prefer_deferred_size.load()) {
+      if (_use_deferred_write(l->length())) {
 	dout(20) << __func__ << " deferring small 0x" << std::hex
 		 << l->length() << std::dec << " write via deferred" << dendl;
 	bluestore_deferred_op_t *op = _get_deferred_op(txc);
@@ -13867,6 +15714,7 @@ int BlueStore::_write(TransContext *txc,
     r = -E2BIG;
   } else {
     _assign_nid(txc, o);
+    _tier_hit(c.get(), o);
     r = _do_write(txc, c, o, offset, length, bl, fadvise_flags);
     txc->write_onode(o);
   }
@@ -14623,6 +16471,7 @@ int BlueStore::_create_collection(
     coll_map[cid] = *c;
     new_coll_map.erase(p);
   }
+  _bulk_remove_fence(txc, *c);
   encode((*c)->cnode, bl);
   txc->t->set(PREFIX_COLL, stringify(cid), bl);
   r = 0;
@@ -14638,7 +16487,11 @@ int BlueStore::_remove_collection(TransContext *txc, const coll_t &cid,
   dout(15) << __func__ << " " << cid << dendl;
   int r;
 
-  (*c)->flush_all_but_last();
+  // a fenced collection has nothing in the db yet and the txcs ahead of
+  // us wait for a background removal, which we must not block on
+  if (!(*c)->bulk_remove_fenced) {
+    (*c)->flush_all_but_last();
+  }
   {
     std::unique_lock l(coll_lock);
     if (!*c) {
@@ -14647,7 +16500,7 @@ int BlueStore::_remove_collection(TransContext *txc, const coll_t &cid,
     }
     size_t nonexistent_count = 0;
     ceph_assert((*c)->exists);
-    if ((*c)->onode_map.map_any([&](OnodeRef o) {
+    bool exists = (*c)->onode_map.map_any([&](OnodeRef o) {
         if (o->exists) {
           dout(1) << __func__ << " " << o->oid << " " << o
 		  << " exists in onode_map" << dendl;
@@ -14655,22 +16508,22 @@ int BlueStore::_remove_collection(TransContext *txc, const coll_t &cid,
         }
         ++nonexistent_count;
         return false;
-        })) {
-      r = -ENOTEMPTY;
-      goto out;
-    }
+        });
 
-    vector<ghobject_t> ls;
-    ghobject_t next;
-    // Enumerate onodes in db, up to nonexistent_count + 1
-    // then check if all of them are marked as non-existent.
-    // Bypass the check if (next != ghobject_t::get_max())
-    r = _collection_list(c->get(), ghobject_t(), ghobject_t::get_max(),
-                         nonexistent_count + 1, &ls, &next);
-    if (r >= 0) {
+    if (!exists) {
+      vector<ghobject_t> ls;
+      ghobject_t next;
+      // Enumerate onodes in db, up to nonexistent_count + 1
+      // then check if all of them are marked as non-existent.
+      // Bypass the check if (next != ghobject_t::get_max())
+      r = _collection_list(c->get(), ghobject_t(), ghobject_t::get_max(),
+			   nonexistent_count + 1, &ls, &next);
+      if (r < 0) {
+	goto out;
+      }
       // If true mean collecton has more objects than nonexistent_count,
       // so bypass check.
-      bool exists = (!next.is_max());
+      exists = (!next.is_max());
       for (auto it = ls.begin(); !exists && it < ls.end(); ++it) {
         dout(10) << __func__ << " oid " << *it << dendl;
         auto onode = (*c)->onode_map.lookup(*it);
@@ -14682,14 +16535,17 @@ int BlueStore::_remove_collection(TransContext *txc, const coll_t &cid,
 		  << dendl;
         }
       }
-      if (!exists) {
-	_do_remove_collection(txc, c);
-        r = 0;
-      } else {
-        dout(10) << __func__ << " " << cid
-                 << " is non-empty" << dendl;
-        r = -ENOTEMPTY;
-      }
+    }
+    if (!exists) {
+      _do_remove_collection(txc, c);
+      r = 0;
+    } else if (cct->_conf.get_val<bool>("bluestore_bulk_remove_collection")) {
+      _do_bulk_remove_collection(txc, c);
+      r = 0;
+    } else {
+      dout(10) << __func__ << " " << cid
+	       << " is non-empty" << dendl;
+      r = -ENOTEMPTY;
     }
   }
 
@@ -14709,6 +16565,955 @@ void BlueStore::_do_remove_collection(TransContext *txc,
   c->reset();
 }
 
+void BlueStore::_do_bulk_remove_collection(TransContext *txc,
+					   CollectionRef *c)
+{
+  coll_t cid = (*c)->cid;
+  dout(10) << __func__ << " " << cid << dendl;
+
+  // the remaining objects are removed through a private handle with its
+  // own osr so that nothing queued on the old one waits behind them.
+  auto rc = ceph::make_ref<Collection>(
+    this,
+    _get_onode_cache_shard(cid),
+    _get_buffer_cache_shard(cid),
+    cid);
+  rc->cnode = (*c)->cnode;
+  rc->osr = ceph::make_ref<OpSequencer>(this, next_sequencer_id++, cid);
+  {
+    std::lock_guard l(bulk_remove_lock);
+    auto p = bulk_remove_map.emplace(cid, bulk_removal_t());
+    p->second.c = rc;
+    if ((*c)->bulk_remove_fenced) {
+      p->second.fenced = *c;
+    }
+  }
+  logger->inc(l_bluestore_bulk_remove_pending);
+
+  bufferlist bl;
+  encode(rc->cnode, bl);
+  txc->t->set(PREFIX_REMOVED_COLL, stringify(cid), bl);
+  txc->bulk_removed_collections.push_back(rc);
+
+  // onodes cached on the old handle are gone as far as it is concerned
+  (*c)->onode_map.map_any([](OnodeRef o) {
+      o->exists = false;
+      return false;
+    });
+  _do_remove_collection(txc, c);
+}
+
+static bool _colls_overlap(const coll_t& a, unsigned abits,
+			   const coll_t& b, unsigned bbits)
+{
+  spg_t pa, pb;
+  if (!a.is_pg(&pa) || !b.is_pg(&pb)) {
+    return a == b;
+  }
+  if (pa.pool() != pb.pool() || pa.shard != pb.shard) {
+    return false;
+  }
+  unsigned bits = std::min(abits, bbits);
+  uint32_t mask = bits >= 32 ? ~0u : (1u << bits) - 1;
+  return (pa.ps() & mask) == (pb.ps() & mask);
+}
+
+// A collection created or merged over the key range of a pending removal
+// must neither see the old objects nor have its own ones swept away with
+// them.  Rather than waiting for the removal here, its txc (and with it
+// everything after it on the same osr) is held back from the kv store
+// until the removal is done, and reads skip whatever the removal covers.
+void BlueStore::_bulk_remove_fence(TransContext *txc, CollectionRef& c)
+{
+  std::lock_guard l(bulk_remove_lock);
+  bool overlaps = false;
+  for (auto& p : bulk_remove_map) {
+    if (_colls_overlap(p.first, p.second.c->cnode.bits,
+		       c->cid, c->cnode.bits)) {
+      overlaps = true;
+      break;
+    }
+  }
+  if (!overlaps) {
+    return;
+  }
+  dout(1) << __func__ << " " << c->cid << " bits " << c->cnode.bits
+	  << " overlaps a background removal, holding back " << txc << dendl;
+  if (!c->bulk_remove_fenced) {
+    c->bulk_remove_fenced = true;
+    bulk_remove_fenced.push_back(c);
+  }
+  txc->bulk_remove_fence = c;
+}
+
+bool BlueStore::_bulk_remove_park(TransContext *txc)
+{
+  std::lock_guard l(bulk_remove_lock);
+  if (!txc->bulk_remove_fence->bulk_remove_fenced) {
+    txc->bulk_remove_fence.reset();
+    return false;
+  }
+  dout(10) << __func__ << " " << txc << dendl;
+  bulk_remove_parked.push_back(txc);
+  // someone is waiting now, skip the sleep between batches
+  bulk_remove_cond.notify_all();
+  return true;
+}
+
+void BlueStore::_bulk_remove_unfence(list<TransContext*> *released)
+{
+  ceph_assert(ceph_mutex_is_locked(bulk_remove_lock));
+  auto p = bulk_remove_fenced.begin();
+  while (p != bulk_remove_fenced.end()) {
+    auto& c = *p;
+    bool overlaps = false;
+    for (auto& i : bulk_remove_map) {
+      if (i.second.fenced != c &&
+	  _colls_overlap(i.first, i.second.c->cnode.bits,
+			 c->cid, c->cnode.bits)) {
+	overlaps = true;
+	break;
+      }
+    }
+    if (overlaps) {
+      ++p;
+      continue;
+    }
+    dout(10) << __func__ << " " << c->cid << dendl;
+    c->bulk_remove_fenced = false;
+    p = bulk_remove_fenced.erase(p);
+  }
+  auto q = bulk_remove_parked.begin();
+  while (q != bulk_remove_parked.end()) {
+    if ((*q)->bulk_remove_fence->bulk_remove_fenced) {
+      ++q;
+      continue;
+    }
+    (*q)->bulk_remove_fence.reset();
+    released->push_back(*q);
+    q = bulk_remove_parked.erase(q);
+  }
+}
+
+bool BlueStore::_bulk_remove_covers(const ghobject_t& oid)
+{
+  std::lock_guard l(bulk_remove_lock);
+  for (auto& p : bulk_remove_map) {
+    if (p.second.c->contains(oid)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void BlueStore::_bulk_remove_ready(CollectionRef& c)
+{
+  dout(10) << __func__ << " " << c->cid << dendl;
+  std::lock_guard l(bulk_remove_lock);
+  auto range = bulk_remove_map.equal_range(c->cid);
+  auto p = std::find_if(range.first, range.second,
+			[&](auto& i) { return i.second.c == c; });
+  ceph_assert(p != range.second);
+  p->second.ready = true;
+  bulk_remove_cond.notify_all();
+}
+
+void BlueStore::_bulk_remove_start()
+{
+  std::lock_guard l(bulk_remove_lock);
+  dout(10) << __func__ << " " << bulk_remove_map.size()
+	   << " pending removals" << dendl;
+  logger->set(l_bluestore_bulk_remove_pending, bulk_remove_map.size());
+  bulk_remove_stop = false;
+  bulk_remove_thread.create("bstore_bulk_rm");
+}
+
+void BlueStore::_bulk_remove_stop()
+{
+  if (!bulk_remove_thread.is_started()) {
+    return;
+  }
+  {
+    std::lock_guard l(bulk_remove_lock);
+    bulk_remove_stop = true;
+    bulk_remove_cond.notify_all();
+  }
+  bulk_remove_thread.join();
+  dout(10) << __func__ << " stopped" << dendl;
+}
+
+void BlueStore::_bulk_remove_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock l(bulk_remove_lock);
+  // txcs held back by a removal must not be left behind at umount
+  while (!bulk_remove_stop || !bulk_remove_parked.empty()) {
+    auto p = std::find_if(
+      bulk_remove_map.begin(), bulk_remove_map.end(),
+      [](auto& i) { return i.second.ready; });
+    if (p == bulk_remove_map.end()) {
+      bulk_remove_cond.wait(l);
+      continue;
+    }
+    // only this thread erases entries, so p stays valid while unlocked
+    l.unlock();
+    uint64_t removed = 0;
+    bool done = _bulk_remove_batch(&p->second, &removed);
+    l.lock();
+    p->second.objects += removed;
+    if (done) {
+      dout(10) << __func__ << " " << p->first << " done, removed "
+	       << p->second.objects << " objects" << dendl;
+      bulk_remove_map.erase(p);
+      logger->dec(l_bluestore_bulk_remove_pending);
+      list<TransContext*> released;
+      _bulk_remove_unfence(&released);
+      if (!released.empty()) {
+	l.unlock();
+	for (auto txc : released) {
+	  dout(10) << __func__ << " releasing " << txc << dendl;
+	  _txc_finish_io(txc);
+	}
+	l.lock();
+      }
+      continue;
+    }
+    double sleep = cct->_conf.get_val<double>("bluestore_bulk_remove_sleep");
+    if (sleep > 0 && bulk_remove_parked.empty() && !bulk_remove_stop) {
+      bulk_remove_cond.wait_for(l, make_timespan(sleep));
+    }
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+bool BlueStore::_bulk_remove_batch(bulk_removal_t *b, uint64_t *removed)
+{
+  CollectionRef c = b->c;
+  int max = cct->_conf.get_val<uint64_t>("bluestore_bulk_remove_batch");
+  C_SaferCond committed;
+  list<Context*> on_commits;
+  on_commits.push_back(&committed);
+  TransContext *txc = _txc_create(c.get(), c->osr.get(), &on_commits);
+  uint64_t bytes = 0;
+  {
+    std::unique_lock l(c->lock);
+    vector<ghobject_t> ls;
+    int r = _collection_list(c.get(), b->next, ghobject_t::get_max(), max,
+			     &ls, &b->next);
+    ceph_assert(r == 0);
+    for (auto& oid : ls) {
+      OnodeRef o = c->get_onode(oid, false);
+      if (!o || !o->exists) {
+	continue;
+      }
+      bytes += o->onode.size;
+      r = _do_remove(txc, c, o);
+      ceph_assert(r == 0);
+      ++(*removed);
+    }
+  }
+  bool done = b->next.is_max();
+  if (done) {
+    // sweep anything left in the key range (e.g. stray shards) with a
+    // range delete and drop the tombstone
+    string temp_start, temp_end, start, end;
+    get_coll_key_range(c->cid, c->cnode.bits, &temp_start, &temp_end,
+		       &start, &end);
+    txc->t->rm_range_keys(PREFIX_OBJ, temp_start, temp_end);
+    txc->t->rm_range_keys(PREFIX_OBJ, start, end);
+    txc->t->rmkey(PREFIX_REMOVED_COLL, stringify(c->cid));
+  }
+  dout(20) << __func__ << " " << c->cid << " removing " << *removed
+	   << " objects, " << bytes << " bytes" << (done ? ", last" : "")
+	   << dendl;
+  // txcs parked on this removal hold throttle budget; waiting for more
+  // of it here could wait for them
+  _txc_submit(txc, nullptr, false);
+  committed.wait();
+
+  logger->inc(l_bluestore_bulk_remove_objects, *removed);
+  logger->inc(l_bluestore_bulk_remove_bytes, bytes);
+  if (done) {
+    _osr_drain(c->osr.get());
+    c->onode_map.clear();
+  }
+  return done;
+}
+
+void BlueStore::get_collection_removals(map<coll_t,uint64_t> *removals)
+{
+  std::lock_guard l(bulk_remove_lock);
+  for (auto& p : bulk_remove_map) {
+    (*removals)[p.first] = p.second.objects;
+  }
+}
+
+class BlueStore::SocketHook : public AdminSocketHook {
+  BlueStore *store;
+public:
+  static BlueStore::SocketHook* create(BlueStore *store)
+  {
+    BlueStore::SocketHook *hook = nullptr;
+    AdminSocket *admin_socket = store->cct->get_admin_socket();
+    if (admin_socket) {
+      hook = new BlueStore::SocketHook(store);
+      int r = admin_socket->register_command(
+	"bluestore defrag status",
+	hook,
+	"Show the state of the background defragmenter");
+      if (r != 0) {
+	delete hook;
+	hook = nullptr;
+      } else {
+	r = admin_socket->register_command(
+	  "bluestore defrag start",
+	  hook,
+	  "Start a defragmentation pass now, whether or not bluestore_defrag "
+	  "is set or the store is idle");
+	ceph_assert(r == 0);
+	r = admin_socket->register_command(
+	  "bluestore defrag stop",
+	  hook,
+	  "Abort the current defragmentation pass");
+	ceph_assert(r == 0);
+      }
+    }
+    return hook;
+  }
+
+  ~SocketHook() {
+    AdminSocket *admin_socket = store->cct->get_admin_socket();
+    admin_socket->unregister_commands(this);
+  }
+private:
+  explicit SocketHook(BlueStore *store) : store(store) {}
+  int call(std::string_view command, const cmdmap_t& cmdmap,
+	   Formatter *f,
+	   std::ostream& ss,
+	   bufferlist& out) override {
+    if (command == "bluestore defrag start") {
+      store->defrag_request(true);
+    } else if (command == "bluestore defrag stop") {
+      store->defrag_request(false);
+    }
+    store->_defrag_dump(f);
+    return 0;
+  }
+};
+
+void BlueStore::_defrag_start()
+{
+  last_submit_ns = mono_clock::now().time_since_epoch().count();
+  {
+    std::lock_guard l(defrag_lock);
+    defrag_stop = false;
+  }
+  defrag_thread.create("bstore_defrag");
+  asok_hook = SocketHook::create(this);
+  if (!asok_hook) {
+    dout(1) << __func__ << " cannot register admin socket commands" << dendl;
+  }
+}
+
+void BlueStore::_defrag_stop()
+{
+  delete asok_hook;
+  asok_hook = nullptr;
+  if (!defrag_thread.is_started()) {
+    return;
+  }
+  {
+    std::lock_guard l(defrag_lock);
+    defrag_stop = true;
+    defrag_cond.notify_all();
+  }
+  defrag_thread.join();
+  dout(10) << __func__ << " stopped" << dendl;
+}
+
+void BlueStore::_defrag_begin_pass()
+{
+  defrag_pass_start = ceph_clock_now();
+  defrag_cursor.reset();
+  ++defrag_gen;
+}
+
+void BlueStore::defrag_request(bool start)
+{
+  std::lock_guard l(defrag_lock);
+  dout(1) << __func__ << (start ? " start" : " stop") << dendl;
+  if (start) {
+    defrag_forced = true;
+    _defrag_begin_pass();
+  } else {
+    defrag_forced = false;
+    if (defrag_pass_start != utime_t()) {
+      defrag_pass_start = utime_t();
+      defrag_last_pass = ceph_clock_now();
+    }
+    ++defrag_gen;
+  }
+  defrag_cond.notify_all();
+}
+
+bool BlueStore::_defrag_idle()
+{
+  auto idle = cct->_conf.get_val<double>("bluestore_defrag_idle_time");
+  auto last = mono_clock::time_point(mono_clock::duration(last_submit_ns));
+  return mono_clock::now() - last >= make_timespan(idle);
+}
+
+BlueStore::CollectionRef BlueStore::_scan_next_collection(
+  scan_cursor_t *cursor)
+{
+  // coll_map is unordered; visit collections in cid order so that the
+  // cursor survives collections coming and going
+  std::shared_lock l(coll_lock);
+  CollectionRef next;
+  for (auto& p : coll_map) {
+    if (cursor->valid &&
+	(p.first < cursor->cid || (cursor->cid_done && p.first == cursor->cid))) {
+      continue;
+    }
+    if (!next || p.first < next->cid) {
+      next = p.second;
+    }
+  }
+  if (next && !(cursor->valid && next->cid == cursor->cid)) {
+    cursor->cid = next->cid;
+    cursor->cid_done = false;
+    cursor->valid = true;
+    cursor->next = ghobject_t();
+  }
+  return next;
+}
+
+void BlueStore::_defrag_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock l(defrag_lock);
+  while (!defrag_stop) {
+    bool enabled = cct->_conf.get_val<bool>("bluestore_defrag");
+    if (defrag_pass_start == utime_t()) {
+      if (!enabled) {
+	defrag_cond.wait(l);
+	continue;
+      }
+      utime_t next_pass = defrag_last_pass;
+      next_pass += cct->_conf.get_val<double>("bluestore_defrag_interval");
+      utime_t now = ceph_clock_now();
+      if (now < next_pass) {
+	defrag_cond.wait_for(l, make_timespan(next_pass - now));
+	continue;
+      }
+      _defrag_begin_pass();
+      dout(10) << __func__ << " starting pass" << dendl;
+    } else if (!defrag_forced) {
+      if (!enabled) {
+	dout(10) << __func__ << " disabled, abandoning pass" << dendl;
+	defrag_pass_start = utime_t();
+	continue;
+      }
+      if (!_defrag_idle()) {
+	defrag_cond.wait_for(
+	  l,
+	  make_timespan(
+	    cct->_conf.get_val<double>("bluestore_defrag_idle_time")));
+	continue;
+      }
+    }
+    CollectionRef c = _scan_next_collection(&defrag_cursor);
+    if (!c) {
+      defrag_last_pass = ceph_clock_now();
+      ++defrag_passes;
+      dout(10) << __func__ << " pass " << defrag_passes << " done in "
+	       << (defrag_last_pass - defrag_pass_start) << dendl;
+      defrag_pass_start = utime_t();
+      defrag_forced = false;
+      continue;
+    }
+    ghobject_t next = defrag_cursor.next;
+    uint64_t gen = defrag_gen;
+    l.unlock();
+    bool done = _defrag_batch(c, &next, gen);
+    l.lock();
+    if (gen == defrag_gen) {
+      defrag_cursor.next = next;
+      defrag_cursor.cid_done = done;
+    }
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+bool BlueStore::_defrag_batch(CollectionRef& c, ghobject_t *next,
+			      uint64_t gen)
+{
+  vector<ghobject_t> ls;
+  ghobject_t list_next;
+  {
+    std::shared_lock l(c->lock);
+    if (!c->exists) {
+      return true;
+    }
+    int r = _collection_list(c.get(), *next, ghobject_t::get_max(), 32,
+			     &ls, &list_next);
+    if (r < 0) {
+      return true;
+    }
+  }
+  for (auto& oid : ls) {
+    {
+      std::lock_guard l(defrag_lock);
+      if (defrag_stop || gen != defrag_gen ||
+	  (!defrag_forced && !_defrag_idle())) {
+	*next = oid;
+	return false;
+      }
+    }
+    uint64_t bytes = _defrag_object(c, oid);
+    auto rate = cct->_conf.get_val<Option::size_t>(
+      "bluestore_defrag_bytes_per_sec");
+    if (bytes && rate) {
+      std::unique_lock l(defrag_lock);
+      if (!defrag_stop) {
+	defrag_cond.wait_for(l, make_timespan((double)bytes / rate));
+      }
+    }
+  }
+  *next = list_next;
+  return list_next.is_max();
+}
+
+bool BlueStore::_defrag_check(OnodeRef& o, unsigned *extents)
+{
+  o->extent_map.fault_range(db, 0, OBJECT_MAX_SIZE);
+  uint64_t stored = 0;
+  *extents = 0;
+  std::set<Blob*> blobs;
+  for (auto& e : o->extent_map.extent_map) {
+    stored += e.length;
+    if (!blobs.insert(e.blob.get()).second) {
+      continue;
+    }
+    const bluestore_blob_t& b = e.blob->get_blob();
+    if (b.is_compressed() || b.is_shared()) {
+      // rewriting would inflate compressed data or break clone sharing
+      return false;
+    }
+    for (auto& p : b.get_extents()) {
+      if (p.is_valid()) {
+	++*extents;
+      }
+    }
+  }
+  auto min_extents = cct->_conf.get_val<uint64_t>(
+    "bluestore_defrag_min_extents");
+  auto min_per_mb = cct->_conf.get_val<uint64_t>(
+    "bluestore_defrag_min_extents_per_mb");
+  return stored && *extents >= min_extents &&
+    ((uint64_t)*extents << 20) >= min_per_mb * stored;
+}
+
+uint64_t BlueStore::_defrag_object(CollectionRef& c, const ghobject_t& oid)
+{
+  unsigned before = 0, after = 0;
+  uint64_t bytes = _rewrite_object(
+    c, oid, TIER_AUTO,
+    [&](OnodeRef& o) {
+      return _defrag_check(o, &before);
+    },
+    [&](OnodeRef& o) {
+      _defrag_check(o, &after);
+    });
+  if (bytes) {
+    dout(20) << __func__ << " " << c->cid << " " << oid << " 0x" << std::hex
+	     << bytes << std::dec << " bytes, " << before << " -> " << after
+	     << " extents" << dendl;
+    logger->inc(l_bluestore_defrag_objects);
+    logger->inc(l_bluestore_defrag_bytes, bytes);
+    if (after < before) {
+      logger->inc(l_bluestore_defrag_extents_saved, before - after);
+    }
+  }
+  // counted last, so whoever sees an object scanned also sees its rewrite
+  logger->inc(l_bluestore_defrag_scanned);
+  return bytes;
+}
+
+uint64_t BlueStore::_rewrite_object(CollectionRef& c, const ghobject_t& oid,
+				    int tier,
+				    std::function<bool(OnodeRef&)> check,
+				    std::function<void(OnodeRef&)> done)
+{
+  OpSequencer *osr = c->osr.get();
+  OnodeRef o;
+  uint64_t write_gen;
+  map<uint64_t,bufferlist> runs;
+  uint64_t bytes = 0;
+  {
+    // read like any other reader, clients are not held up meanwhile
+    std::shared_lock l(c->lock);
+    if (!c->exists) {
+      return 0;
+    }
+    o = c->get_onode(oid, false);
+    if (!o || !o->exists || !check(o)) {
+      return 0;
+    }
+    write_gen = o->write_gen;
+
+    // rewrite each logically contiguous run of data; holes stay holes
+    uint64_t run_end = 0;
+    for (auto& e : o->extent_map.extent_map) {
+      if (!runs.empty() && run_end == e.logical_offset) {
+	runs.rbegin()->second.append_zero(e.length);
+      } else {
+	runs[e.logical_offset].append_zero(e.length);
+      }
+      run_end = e.logical_end();
+    }
+    for (auto& [offset, bl] : runs) {
+      uint64_t length = bl.length();
+      bl.clear();
+      int r = _do_read(c.get(), o, offset, length, bl,
+		       CEPH_OSD_OP_FLAG_FADVISE_DONTNEED);
+      if (r != (int)length) {
+	dout(1) << __func__ << " " << c->cid << " " << oid
+		<< " read 0x" << std::hex << offset << "~" << length
+		<< std::dec << " failed: " << cpp_strerror(r) << dendl;
+	return 0;
+      }
+      bytes += length;
+    }
+  }
+
+  // the new copy is allocated before the old one is released, and a
+  // failed _do_write can't be backed out of a half-built txc.  leave
+  // headroom for concurrent writers and skip the object when short.
+  uint64_t need = 0;
+  for (auto& [offset, bl] : runs) {
+    need += p2roundup(p2phase(offset, min_alloc_size) + bl.length(),
+		      min_alloc_size);
+  }
+  uint64_t margin = std::max(need, bdev->get_size() / 100);
+  uint64_t free = alloc->get_free();
+  if (free < need + margin) {
+    dout(10) << __func__ << " " << c->cid << " " << oid
+	     << " needs 0x" << std::hex << need << " + 0x" << margin
+	     << " but only 0x" << free << std::dec << " free, skipping"
+	     << dendl;
+    return 0;
+  }
+
+  C_SaferCond committed;
+  list<Context*> on_commits;
+  on_commits.push_back(&committed);
+  {
+    // ordered with client transactions on this sequencer, see submit_lock
+    std::lock_guard sl(osr->submit_lock);
+    TransContext *txc = nullptr;
+    {
+      std::unique_lock l(c->lock);
+      // anything written since we read would be reverted; skip the
+      // object this time round
+      if (!c->exists || !o->exists || o->write_gen != write_gen ||
+	  c->get_onode(oid, false) != o) {
+	dout(10) << __func__ << " " << c->cid << " " << oid
+		 << " changed while reading, skipping" << dendl;
+	return 0;
+      }
+      txc = _txc_create(c.get(), osr, &on_commits);
+      txc->tier = tier;
+      for (auto& [offset, bl] : runs) {
+	int r = _do_write(txc, c, o, offset, bl.length(), bl,
+			  CEPH_OSD_OP_FLAG_FADVISE_DONTNEED);
+	// only ENOSPC is possible here, ruled out by the free check above
+	ceph_assert(r == 0);
+      }
+      txc->write_onode(o);
+      if (done) {
+	done(o);
+      }
+    }
+    _txc_submit(txc, nullptr);
+  }
+  committed.wait();
+  return bytes;
+}
+
+void BlueStore::_defrag_dump(Formatter *f)
+{
+  std::lock_guard l(defrag_lock);
+  f->open_object_section("defrag");
+  f->dump_bool("enabled", cct->_conf.get_val<bool>("bluestore_defrag"));
+  f->dump_bool("running", defrag_pass_start != utime_t());
+  f->dump_bool("forced", defrag_forced);
+  f->dump_unsigned("passes", defrag_passes);
+  f->dump_stream("pass_start") << defrag_pass_start;
+  f->dump_stream("last_pass") << defrag_last_pass;
+  if (defrag_pass_start != utime_t() && defrag_cursor.valid) {
+    f->dump_stream("collection") << defrag_cursor.cid;
+    f->dump_stream("next") << defrag_cursor.next;
+  }
+  f->dump_unsigned("scanned", logger->get(l_bluestore_defrag_scanned));
+  f->dump_unsigned("objects", logger->get(l_bluestore_defrag_objects));
+  f->dump_unsigned("bytes", logger->get(l_bluestore_defrag_bytes));
+  f->dump_unsigned("extents_saved",
+		   logger->get(l_bluestore_defrag_extents_saved));
+  f->close_section();
+}
+
+// tiering
+//
+// heat is an in-memory access count per onode, halved every
+// bluestore_tier_decay_interval; an onode that drops out of the cache
+// starts over cold.  reaching bluestore_tier_promote_hits queues the object
+// for promotion and sends its new writes to the fast device.  while the
+// fast device is fuller than bluestore_tier_fast_target_ratio, a scan over
+// all objects moves those with less than bluestore_tier_demote_hits back
+// to the main device.
+
+static const size_t TIER_PROMOTE_QUEUE_MAX = 1024;
+
+void BlueStore::_set_tier()
+{
+  tier_promote_hits = cct->_conf.get_val<uint64_t>(
+    "bluestore_tier_promote_hits");
+  dout(10) << __func__ << " promote_hits " << tier_promote_hits << dendl;
+}
+
+void BlueStore::_tier_start()
+{
+  if (!tier_alloc) {
+    return;
+  }
+  {
+    std::lock_guard l(tier_lock);
+    tier_stop = false;
+    tier_demote_cursor.reset();
+  }
+  tier_thread.create("bstore_tier");
+}
+
+void BlueStore::_tier_stop()
+{
+  if (tier_thread.is_started()) {
+    {
+      std::lock_guard l(tier_lock);
+      tier_stop = true;
+      tier_cond.notify_all();
+    }
+    tier_thread.join();
+    dout(10) << __func__ << " stopped" << dendl;
+  }
+  std::lock_guard l(tier_lock);
+  tier_promote_queue.clear();
+}
+
+uint32_t BlueStore::_tier_heat(Onode *o)
+{
+  uint32_t age = tier_epoch - o->tier_epoch;
+  return age >= 32 ? 0 : o->tier_heat >> age;
+}
+
+void BlueStore::_tier_hit(Collection *c, OnodeRef& o)
+{
+  if (!tier_alloc) {
+    return;
+  }
+  // racing hits may get lost, which is fine for an estimate
+  uint32_t heat = _tier_heat(o.get()) + 1;
+  o->tier_epoch = tier_epoch.load();
+  o->tier_heat = heat;
+  if (heat < tier_promote_hits) {
+    if (o->tier_queued) {
+      o->tier_queued = false;
+    }
+    return;
+  }
+  // a hit racing with the epoch change may skip the exact threshold, so
+  // queue on anything above it, but only once
+  if (o->tier_queued.exchange(true)) {
+    return;
+  }
+  std::lock_guard l(tier_lock);
+  if (tier_promote_queue.size() < TIER_PROMOTE_QUEUE_MAX) {
+    tier_promote_queue.emplace_back(c, o->oid);
+    tier_cond.notify_all();
+  } else {
+    // full; let a later hit try again
+    o->tier_queued = false;
+  }
+}
+
+int64_t BlueStore::_tier_alloc_hint(TransContext *txc, OnodeRef& o,
+				    int64_t hint)
+{
+  int tier = txc->tier;
+  if (tier == TIER_AUTO) {
+    tier = _tier_heat(o.get()) >= tier_promote_hits ? TIER_FAST : TIER_SLOW;
+  }
+  bool fast = tier_alloc->is_fast(hint);
+  if (tier == TIER_FAST) {
+    return fast ? hint : tier_alloc->get_fast_offset();
+  }
+  return fast ? 0 : hint;
+}
+
+bool BlueStore::_tier_check(OnodeRef& o, uint64_t *fast, uint64_t *slow)
+{
+  o->extent_map.fault_range(db, 0, OBJECT_MAX_SIZE);
+  *fast = *slow = 0;
+  std::set<Blob*> blobs;
+  for (auto& e : o->extent_map.extent_map) {
+    if (!blobs.insert(e.blob.get()).second) {
+      continue;
+    }
+    const bluestore_blob_t& b = e.blob->get_blob();
+    if (b.is_compressed() || b.is_shared()) {
+      // see _defrag_check
+      return false;
+    }
+    for (auto& p : b.get_extents()) {
+      if (p.is_valid()) {
+	(tier_alloc->is_fast(p.offset) ? *fast : *slow) += p.length;
+      }
+    }
+  }
+  return true;
+}
+
+double BlueStore::_tier_fast_used()
+{
+  uint64_t size = tier_alloc->get_fast_size();
+  uint64_t used = size - tier_alloc->get_fast_free();
+  logger->set(l_bluestore_tier_fast_used, used);
+  return (double)used / size;
+}
+
+void BlueStore::_tier_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock l(tier_lock);
+  auto next_decay = mono_clock::now() + make_timespan(
+    cct->_conf.get_val<double>("bluestore_tier_decay_interval"));
+  while (!tier_stop) {
+    auto now = mono_clock::now();
+    if (now >= next_decay) {
+      ++tier_epoch;
+      next_decay = now + make_timespan(
+	cct->_conf.get_val<double>("bluestore_tier_decay_interval"));
+      dout(20) << __func__ << " epoch " << tier_epoch << dendl;
+    }
+    double used = _tier_fast_used();
+    double target = cct->_conf.get_val<double>(
+      "bluestore_tier_fast_target_ratio");
+    if (used > target) {
+      CollectionRef c = _scan_next_collection(&tier_demote_cursor);
+      if (!c) {
+	dout(10) << __func__ << " demotion pass done, fast device "
+		 << used << " full" << dendl;
+	tier_demote_cursor.reset();
+	tier_cond.wait_for(l, next_decay - now);
+	continue;
+      }
+      ghobject_t next = tier_demote_cursor.next;
+      l.unlock();
+      bool done = _tier_demote_batch(c, &next);
+      l.lock();
+      tier_demote_cursor.next = next;
+      tier_demote_cursor.cid_done = done;
+      continue;
+    }
+    if (tier_promote_queue.empty() || used >= target) {
+      tier_cond.wait_for(l, next_decay - now);
+      continue;
+    }
+    auto [c, oid] = std::move(tier_promote_queue.front());
+    tier_promote_queue.pop_front();
+    l.unlock();
+    uint64_t bytes = _rewrite_object(
+      c, oid, TIER_FAST,
+      [&](OnodeRef& o) {
+	uint64_t fast, slow;
+	return _tier_check(o, &fast, &slow) && slow &&
+	  _tier_heat(o.get()) >= tier_promote_hits;
+      });
+    l.lock();
+    if (bytes) {
+      dout(20) << __func__ << " promoted " << c->cid << " " << oid
+	       << " 0x" << std::hex << bytes << std::dec << dendl;
+      _tier_fast_used();
+      logger->inc(l_bluestore_tier_promoted);
+      logger->inc(l_bluestore_tier_promoted_bytes, bytes);
+      auto rate = cct->_conf.get_val<Option::size_t>(
+	"bluestore_tier_migrate_bytes_per_sec");
+      if (rate && !tier_stop) {
+	tier_cond.wait_for(l, make_timespan((double)bytes / rate));
+      }
+    }
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+bool BlueStore::_tier_demote_batch(CollectionRef& c, ghobject_t *next)
+{
+  vector<ghobject_t> ls;
+  ghobject_t list_next;
+  {
+    std::shared_lock l(c->lock);
+    if (!c->exists) {
+      return true;
+    }
+    int r = _collection_list(c.get(), *next, ghobject_t::get_max(), 32,
+			     &ls, &list_next);
+    if (r < 0) {
+      return true;
+    }
+  }
+  auto demote_hits = cct->_conf.get_val<uint64_t>(
+    "bluestore_tier_demote_hits");
+  for (auto& oid : ls) {
+    {
+      std::lock_guard l(tier_lock);
+      if (tier_stop ||
+	  _tier_fast_used() <= cct->_conf.get_val<double>(
+	    "bluestore_tier_fast_target_ratio")) {
+	*next = oid;
+	return false;
+      }
+    }
+    uint64_t bytes = _rewrite_object(
+      c, oid, TIER_SLOW,
+      [&](OnodeRef& o) {
+	uint64_t fast, slow;
+	if (!_tier_check(o, &fast, &slow) || !fast ||
+	    _tier_heat(o.get()) >= demote_hits) {
+	  return false;
+	}
+	o->tier_queued = false;
+	return true;
+      });
+    if (!bytes) {
+      continue;
+    }
+    dout(20) << __func__ << " demoted " << c->cid << " " << oid
+	     << " 0x" << std::hex << bytes << std::dec << dendl;
+    logger->inc(l_bluestore_tier_demoted);
+    logger->inc(l_bluestore_tier_demoted_bytes, bytes);
+    auto rate = cct->_conf.get_val<Option::size_t>(
+      "bluestore_tier_migrate_bytes_per_sec");
+    if (rate) {
+      std::unique_lock l(tier_lock);
+      if (!tier_stop) {
+	tier_cond.wait_for(l, make_timespan((double)bytes / rate));
+      }
+    }
+  }
+  *next = list_next;
+  return list_next.is_max();
+}
+
 int BlueStore::_split_collection(TransContext *txc,
 				CollectionRef& c,
 				CollectionRef& d,
@@ -14797,6 +17602,9 @@ int BlueStore::_merge_collection(
   // merge call for the parent/target.
   d->cnode.bits = bits;
 
+  // the merged range may cover a collection still being emptied
+  _bulk_remove_fence(txc, d);
+
   // behavior depends on target (d) bits, so this after that is updated.
   (*c)->split_cache(d.get());
 
@@ -15200,7 +18008,18 @@ void BlueStore::_flush_cache()
     i->flush();
     ceph_assert(i->empty());
   }
+  for (auto& p : cache_partitions) {
+    for (auto i : p.second->onode_shards) {
+      i->flush();
+      ceph_assert(i->empty());
+    }
+    for (auto i : p.second->buffer_shards) {
+      i->flush();
+      ceph_assert(i->empty());
+    }
+  }
   for (auto& p : coll_map) {
+    _release_write_streams(p.second.get(), mono_clock::time_point::max());
     if (!p.second->onode_map.empty()) {
       derr << __func__ << " stray onodes on " << p.first << dendl;
       p.second->onode_map.dump<0>(cct);
@@ -15213,6 +18032,10 @@ void BlueStore::_flush_cache()
     ceph_assert(p.second->shared_blob_set.empty());
   }
   coll_map.clear();
+  std::lock_guard l(bulk_remove_lock);
+  ceph_assert(bulk_remove_parked.empty());
+  bulk_remove_map.clear();
+  bulk_remove_fenced.clear();
 }
 
 // For external caller.
@@ -15228,6 +18051,14 @@ int BlueStore::flush_cache(ostream *os)
   for (auto i : buffer_cache_shards) {
     i->flush();
   }
+  for (auto& p : cache_partitions) {
+    for (auto i : p.second->onode_shards) {
+      i->flush();
+    }
+    for (auto i : p.second->buffer_shards) {
+      i->flush();
+    }
+  }
 
   return 0;
 }
@@ -15471,16 +18302,6 @@ bool BlueStoreRepairer::fix_false_free(KeyValueDB *db,
   return true;
 }
 
-bool BlueStoreRepairer::fix_bluefs_extents(std::atomic<uint64_t>& out_of_sync_flag)
-{
-  // this is just a stub to count num of repairs properly,
-  // actual repair happens in BlueStore::_close_db_and_around()
-  // while doing _sync_bluefs_and_fm
-  ++out_of_sync_flag;
-  ++to_repair_cnt;
-  return true;
-}
-
 bool BlueStoreRepairer::preprocess_misreference(KeyValueDB *db)
 {
   if (misreferenced_extents.size()) {
@@ -44,6 +44,7 @@
 #include "common/Throttle.h"
 #include "common/perf_counters.h"
 #include "common/PriorityCache.h"
+#include "common/Readahead.h"
 #include "compressor/Compressor.h"
 #include "os/ObjectStore.h"
 
@@ -54,6 +55,8 @@
 
 class Allocator;
 class FreelistManager;
+class TieredAllocator;
+class TieredDevice;
 class BlueStoreRepairer;
 
 //#define DEBUG_CACHE
@@ -123,6 +126,12 @@ enum {
   l_bluestore_write_small_deferred,
   l_bluestore_write_small_pre_read,
   l_bluestore_write_small_new,
+  l_bluestore_write_adaptive_deferred,
+  l_bluestore_write_adaptive_direct,
+  l_bluestore_write_adaptive_direct_backlog,
+  l_bluestore_write_adaptive_direct_probe,
+  l_bluestore_direct_write_lat_avg,
+  l_bluestore_kv_commit_lat_avg,
   l_bluestore_txc,
   l_bluestore_onode_reshard,
   l_bluestore_blob_split,
@@ -130,19 +139,42 @@ enum {
   l_bluestore_gc_merged,
   l_bluestore_read_eio,
   l_bluestore_reads_with_retries,
+  l_bluestore_readahead_issued,
+  l_bluestore_readahead_bytes,
+  l_bluestore_readahead_hits,
+  l_bluestore_readahead_dropped,
   l_bluestore_fragmentation,
   l_bluestore_omap_seek_to_first_lat,
   l_bluestore_omap_upper_bound_lat,
   l_bluestore_omap_lower_bound_lat,
   l_bluestore_omap_next_lat,
+  l_bluestore_omap_get_batch_lat,
   l_bluestore_clist_lat,
+  l_bluestore_alloc_map_load_lat,
+  l_bluestore_alloc_map_rebuilds,
+  l_bluestore_bulk_remove_pending,
+  l_bluestore_bulk_remove_objects,
+  l_bluestore_bulk_remove_bytes,
+  l_bluestore_write_coalesced,
+  l_bluestore_write_coalesce_missed,
+  l_bluestore_write_coalesce_reserved,
+  l_bluestore_defrag_scanned,
+  l_bluestore_defrag_objects,
+  l_bluestore_defrag_bytes,
+  l_bluestore_defrag_extents_saved,
+  l_bluestore_tier_placed_fast,
+  l_bluestore_tier_placed_slow,
+  l_bluestore_tier_promoted,
+  l_bluestore_tier_promoted_bytes,
+  l_bluestore_tier_demoted,
+  l_bluestore_tier_demoted_bytes,
+  l_bluestore_tier_fast_used,
   l_bluestore_last
 };
 
 #define META_POOL_ID ((uint64_t)-1ull)
 
 class BlueStore : public ObjectStore,
-		  public BlueFSDeviceExpander,
 		  public md_config_obs_t {
   // -----------------------------------------------------
   // types
@@ -842,6 +874,13 @@ public:
     void bound_encode_spanning_blobs(size_t& p);
     void encode_spanning_blobs(bufferlist::contiguous_appender& p);
     void decode_spanning_blobs(bufferptr::const_iterator& p);
+  private:
+    void _bound_encode_spanning_blob_list(size_t& p);
+    void _encode_spanning_blob_list(bufferlist::contiguous_appender& p,
+				    __u8 struct_v);
+    void _decode_spanning_blob_list(bufferptr::const_iterator& p,
+				    __u8 struct_v);
+  public:
 
     BlobRef get_spanning_blob(int id) {
       auto p = spanning_blob_map.find(id);
@@ -1049,6 +1088,18 @@ public:
 				    uint64_t min_alloc_size);
   };
 
+  /// sequential stream detection and prefetch state of an onode
+  struct OnodeReadahead {
+    Readahead ra;
+    std::atomic<uint64_t> gen = {0}; ///< bumped whenever the lextents change
+
+    ceph::mutex lock = ceph::make_mutex("BlueStore::OnodeReadahead::lock");
+    ceph::condition_variable cond;  ///< wait here for an in-flight prefetch
+    bool in_flight = false;
+    uint64_t ra_off = 0;            ///< logical range of the last prefetch
+    uint64_t ra_end = 0;
+  };
+
   struct OnodeSpace;
   struct OnodeCacheShard;
   /// an in-memory object
@@ -1057,6 +1108,8 @@ public:
     // Not persisted and updated on cache insertion/removal
     OnodeCacheShard *s;
     bool pinned = false; // Only to be used by the onode cache shard
+    /// CLOCK reference bit, set on cache hits without the shard lock
+    std::atomic<bool> cache_referenced = {false};
 
     std::atomic_int nref;  ///< reference count
     Collection *c;
@@ -1076,10 +1129,25 @@ public:
     // effects cannot be read via the kvdb read methods)
     std::atomic<int> flushing_count = {0};
     std::atomic<int> waiting_count = {0};
+    /// bumped by TransContext::write_onode, i.e. under the collection
+    /// lock; lets a background rewrite detect writes made since it read
+    uint64_t write_gen = 0;
     /// protect flush_txns
     ceph::mutex flush_lock = ceph::make_mutex("BlueStore::Onode::flush_lock");
     ceph::condition_variable flush_cond;   ///< wait here for uncommitted txns
 
+    /// end of the last read, used to detect the start of a stream
+    std::atomic<uint64_t> last_read_end = {0};
+    /// allocated on the second sequential read, see _do_read
+    std::atomic<OnodeReadahead*> readahead = {nullptr};
+
+    /// accesses, halved every tier epoch; see _tier_hit
+    std::atomic<uint32_t> tier_heat = {0};
+    std::atomic<uint32_t> tier_epoch = {0};  ///< epoch tier_heat is as of
+    /// queued for promotion, or already considered while hot; cleared
+    /// once it cools down or is demoted
+    std::atomic<bool> tier_queued = {false};
+
     Onode(Collection *c, const ghobject_t& o,
 	  const mempool::bluestore_cache_other::string& k)
       : s(nullptr),
@@ -1110,6 +1178,7 @@ public:
       exists(false),
       extent_map(this) {
     }
+    ~Onode();
 
     static Onode* decode(
       CollectionRef c,
@@ -1148,6 +1217,7 @@ public:
   struct CacheShard {
     CephContext *cct;
     PerfCounters *logger;
+    PerfCounters *partition_logger = nullptr; ///< per pool hit/miss counters
 
     /// protect lru and other structures
     ceph::recursive_mutex lock = {
@@ -1168,7 +1238,9 @@ public:
     }
 
     virtual void _trim_to(uint64_t new_size) = 0;
-    void _trim() {
+    /// called inline from the IO path; implementations may defer the
+    /// work to the periodic trim() from the mempool thread
+    virtual void _trim() {
       if (cct->_conf->objectstore_blackhole) {
 	// do not trim if we are throwing away IOs a layer down
 	return;
@@ -1178,7 +1250,7 @@ public:
 
     void trim() {
       std::lock_guard l(lock);
-      _trim();    
+      CacheShard::_trim();
     }
     void flush() {
       std::lock_guard l(lock);
@@ -1207,14 +1279,27 @@ public:
     virtual void _rm(OnodeRef& o) = 0;
     virtual void _touch(OnodeRef& o) = 0;
     virtual void _pin(Onode& o) = 0;
+    /// true if _touch(), _pin() and _unpin() are safe to call without
+    /// holding lock
+    virtual bool lockless_touch() const {
+      return false;
+    }
     virtual void _unpin(Onode& o) = 0;
 
     void pin(Onode& o) {
+      if (lockless_touch()) {
+	_pin(o);
+	return;
+      }
       std::lock_guard l(lock);
       _pin(o);
     }
 
     void unpin(Onode& o) {
+      if (lockless_touch()) {
+	_unpin(o);
+	return;
+      }
       std::lock_guard l(lock);
       _unpin(o);
     }
@@ -1316,6 +1401,10 @@ public:
 
     bool exists;
 
+    /// our key range overlaps a pending background removal; until it is
+    /// done whatever the db has in that range is not ours
+    std::atomic<bool> bulk_remove_fenced = {false};
+
     SharedBlobSet shared_blob_set;      ///< open SharedBlobs
 
     // cache onodes on a per-collection basis to avoid lock
@@ -1326,6 +1415,16 @@ public:
     pool_opts_t pool_opts;
     ContextQueue *commit_queue;
 
+    /// end of the last small write per object and the space reserved
+    /// behind it, see bluestore_write_coalesce_window (protected by lock)
+    struct write_stream_t {
+      uint64_t logical_end = 0;
+      uint64_t physical_end = 0;
+      bluestore_pextent_t reserved;
+      mono_clock::time_point stamp;
+    };
+    map<ghobject_t,write_stream_t> write_streams;
+
     OnodeRef get_onode(const ghobject_t& oid, bool create, bool is_createop=false);
 
     // the terminology is confusing here, sorry!
@@ -1490,6 +1589,13 @@ public:
     }
   };
 
+  /// where new allocations of a transaction go on a tiered store
+  enum {
+    TIER_AUTO,  ///< by object heat
+    TIER_FAST,
+    TIER_SLOW,
+  };
+
   struct TransContext final : public AioContext {
     MEMPOOL_CLASS_HELPERS();
 
@@ -1558,6 +1664,8 @@ public:
     KeyValueDB::Transaction t; ///< then we will commit this
     list<Context*> oncommits;  ///< more commit completions
     list<CollectionRef> removed_collections; ///< colls we removed
+    list<CollectionRef> bulk_removed_collections; ///< emptied after commit
+    CollectionRef bulk_remove_fence; ///< kv submit waits for its removals
 
     boost::intrusive::list_member_hook<> deferred_queue_item;
     bluestore_deferred_transaction_t *deferred_txn = nullptr; ///< if any
@@ -1576,6 +1684,8 @@ public:
     uint64_t last_nid = 0;     ///< if non-zero, highest new nid we allocated
     uint64_t last_blobid = 0;  ///< if non-zero, highest new blobid we allocated
 
+    int tier = TIER_AUTO;  ///< placement of new allocations
+
 #if defined(WITH_LTTNG)
     bool tracing = false;
 #endif
@@ -1596,6 +1706,7 @@ public:
     }
 
     void write_onode(OnodeRef &o) {
+      ++o->write_gen;
       onodes.insert(o);
     }
     void write_shared_blob(SharedBlobRef &sb) {
@@ -1707,6 +1818,13 @@ public:
       KeyValueDB &db,
       TransContext &txc,
       mono_clock::time_point);
+    /// for txcs others may be waiting on to release their budget
+    void start_unthrottled(
+      KeyValueDB &db,
+      TransContext &txc,
+      mono_clock::time_point start_throttle_acquire) {
+      emit_initial_tracepoint(db, txc, start_throttle_acquire);
+    }
     void release_kv_throttle(uint64_t cost) {
       throttle_bytes.put(cost);
     }
@@ -1793,6 +1911,12 @@ public:
 
     std::atomic_bool zombie = {false};    ///< in zombie_osr set (collection going away)
 
+    /// held from txc creation through submit by queue_transactions and by
+    /// the defragmenter, so that a background rewrite never lands between
+    /// another txc's construction and the encoding of its onodes
+    ceph::mutex submit_lock =
+      ceph::make_mutex("BlueStore::OpSequencer::submit_lock");
+
     const uint32_t sequencer_id;
 
     uint32_t get_sequencer_id() const {
@@ -1942,14 +2066,15 @@ public:
 private:
   BlueFS *bluefs = nullptr;
   bluefs_layout_t bluefs_layout;
-  mono_time bluefs_last_balance;
-  utime_t next_dump_on_bluefs_alloc_failure;
 
   KeyValueDB *db = nullptr;
   BlockDevice *bdev = nullptr;
   std::string freelist_type;
   FreelistManager *fm = nullptr;
   Allocator *alloc = nullptr;
+  bluefs_shared_alloc_context_t shared_alloc; ///< lets bluefs use our alloc
+  TieredDevice *tier_bdev = nullptr;     ///< bdev, if there is a fast device
+  TieredAllocator *tier_alloc = nullptr; ///< alloc, if there is a fast device
   uuid_d fsid;
   int path_fd = -1;  ///< open handle to $path
   int fsid_fd = -1;  ///< open handle (locked) to $path/fsid
@@ -1963,6 +2088,41 @@ private:
   vector<OnodeCacheShard*> onode_cache_shards;
   vector<BufferCacheShard*> buffer_cache_shards;
 
+  /// cache shards dedicated to the collections of a single pool, sized
+  /// by the cache balancer independently of the shared shards above
+  struct CachePartition {
+    int64_t pool;
+    double weight = 1.0;     ///< relative to the shared shards' weight of 1
+    uint64_t min_bytes = 0;  ///< guaranteed at PRI0 when autotuning
+    PriorityCache::Priority pri = PriorityCache::Priority::PRI1;
+
+    vector<OnodeCacheShard*> onode_shards;
+    vector<BufferCacheShard*> buffer_shards;
+    PerfCounters *logger = nullptr;
+
+    // meta and data PriorityCache entries, owned by MempoolThread
+    std::shared_ptr<PriorityCache::PriCache> meta_cache;
+    std::shared_ptr<PriorityCache::PriCache> data_cache;
+
+    explicit CachePartition(int64_t p) : pool(p) {}
+
+    uint64_t get_num_onodes() const {
+      uint64_t n = 0;
+      for (auto i : onode_shards) {
+        n += i->_get_num();
+      }
+      return n;
+    }
+    uint64_t get_buffer_bytes() const {
+      uint64_t bytes = 0;
+      for (auto i : buffer_shards) {
+        bytes += i->_get_bytes();
+      }
+      return bytes;
+    }
+  };
+  map<int64_t, std::unique_ptr<CachePartition>> cache_partitions;
+
   /// protect zombie_osr_set
   ceph::mutex zombie_osr_lock = ceph::make_mutex("BlueStore::zombie_osr_lock");
   uint32_t next_sequencer_id = 0;
@@ -1973,8 +2133,9 @@ private:
   std::atomic<uint64_t> blobid_last = {0};
   std::atomic<uint64_t> blobid_max = {0};
 
-  interval_set<uint64_t> bluefs_extents;  ///< block extents owned by bluefs
-  interval_set<uint64_t> bluefs_extents_reclaiming; ///< currently reclaiming
+  interval_set<uint64_t> bluefs_extents;  ///< extents used by bluefs on
+                                          ///  the shared device
+  bool alloc_snapshot_stale = false; ///< on-disk allocation snapshot removed
 
   ceph::mutex deferred_lock = ceph::make_mutex("BlueStore::deferred_lock");
   std::atomic<uint64_t> deferred_seq = {0};
@@ -1984,6 +2145,10 @@ private:
   Finisher  finisher;
   utime_t  deferred_last_submitted = utime_t();
 
+  int numa_node = -1;          ///< node kv threads and finisher are bound to
+  size_t numa_cpu_set_size = 0;
+  cpu_set_t numa_cpu_set;
+
   KVSyncThread kv_sync_thread;
   ceph::mutex kv_lock = ceph::make_mutex("BlueStore::kv_lock");
   ceph::condition_variable kv_cond;
@@ -2038,16 +2203,34 @@ private:
   ///< size threshold for forced deferred writes
   std::atomic<uint64_t> prefer_deferred_size = {0};
 
+  /// see bluestore_prefer_deferred_adaptive
+  std::atomic<bool> prefer_deferred_adaptive = {false};
+  std::atomic<uint64_t> direct_write_lat_avg = {0};  ///< ns, moving average
+  std::atomic<uint64_t> kv_commit_lat_avg = {0};     ///< ns, moving average
+  std::atomic<int> txc_aio_in_flight = {0};
+  std::atomic<unsigned> adaptive_probe = {0};
+
+  /// see bluestore_write_coalesce_window
+  std::atomic<uint64_t> write_coalesce_window_ns = {0};
+  std::atomic<uint64_t> write_coalesce_max_bytes = {0};
+
   ///< approx cost per io, in bytes
   std::atomic<uint64_t> throttle_cost_per_io = {0};
 
   std::atomic<Compressor::CompressionMode> comp_mode =
     {Compressor::COMP_NONE}; ///< compression mode
   CompressorRef compressor;
+  CompressorRef spanning_blob_compressor; ///< lz4, set at mount
   std::atomic<uint64_t> comp_min_blob_size = {0};
   std::atomic<uint64_t> comp_max_blob_size = {0};
 
   std::atomic<uint64_t> max_blob_size = {0};  ///< maximum blob size
+  std::atomic<uint64_t> readahead_max_bytes = {0};  ///< 0 disables readahead
+
+  struct ReadaheadContext;
+  ceph::mutex readahead_lock = ceph::make_mutex("BlueStore::readahead_lock");
+  ceph::condition_variable readahead_cond;
+  int readahead_in_flight = 0;  ///< protected by readahead_lock
 
   uint64_t kv_ios = 0;
   uint64_t kv_throttle_costs = 0;
@@ -2150,11 +2333,21 @@ private:
     struct MetaCache : public MempoolCache {
       MetaCache(BlueStore *s) : MempoolCache(s) {};
 
-      virtual uint64_t _get_used_bytes() const {
+      uint64_t _get_total_used_bytes() const {
         return mempool::bluestore_cache_other::allocated_bytes() +
             mempool::bluestore_cache_onode::allocated_bytes();
       }
 
+      virtual uint64_t _get_used_bytes() const {
+        // onodes of partitioned pools are accounted to their partitions
+        uint64_t bytes = _get_total_used_bytes();
+        uint64_t partitioned = 0;
+        for (auto& p : store->cache_partitions) {
+          partitioned += p.second->get_num_onodes() * get_bytes_per_onode();
+        }
+        return bytes > partitioned ? bytes - partitioned : 0;
+      }
+
       virtual string get_cache_name() const {
         return "BlueStore Meta Cache";
       }
@@ -2166,7 +2359,7 @@ private:
       }
 
       double get_bytes_per_onode() const {
-        return (double)_get_used_bytes() / (double)_get_num_onodes();
+        return (double)_get_total_used_bytes() / (double)_get_num_onodes();
       }
     };
     std::shared_ptr<MetaCache> meta_cache;
@@ -2187,6 +2380,45 @@ private:
     };
     std::shared_ptr<DataCache> data_cache;
 
+    /// meta or data share of a CachePartition
+    struct PartitionCache : public MempoolCache {
+      const CachePartition *part;
+      std::shared_ptr<MetaCache> meta; ///< set for the meta share only
+      uint64_t min_bytes;
+
+      PartitionCache(BlueStore *s, const CachePartition *p,
+                     std::shared_ptr<MetaCache> m, uint64_t min)
+        : MempoolCache(s), part(p), meta(m), min_bytes(min) {}
+
+      virtual uint64_t _get_used_bytes() const {
+        if (meta) {
+          return part->get_num_onodes() * meta->get_bytes_per_onode();
+        }
+        return part->get_buffer_bytes();
+      }
+
+      virtual int64_t request_cache_bytes(
+          PriorityCache::Priority pri, uint64_t total_cache) const {
+        int64_t assigned = get_cache_bytes(pri);
+        if (pri == PriorityCache::Priority::PRI0) {
+          // the guaranteed minimum, whether it is used yet or not
+          int64_t request = min_bytes;
+          return (request > assigned) ? request - assigned : 0;
+        }
+        if (pri == part->pri) {
+          int64_t request = (int64_t)_get_used_bytes() -
+            get_cache_bytes(PriorityCache::Priority::PRI0);
+          return (request > assigned) ? request - assigned : 0;
+        }
+        return -EOPNOTSUPP;
+      }
+
+      virtual string get_cache_name() const {
+        return string("BlueStore ") + (meta ? "Meta" : "Data") +
+          " Cache, pool " + std::to_string(part->pool);
+      }
+    };
+
   public:
     explicit MempoolThread(BlueStore *s)
       : store(s),
@@ -2212,6 +2444,89 @@ private:
     void _resize_shards(bool interval_stats);
   } mempool_thread;
 
+  // background removal of non-empty collections
+  struct bulk_removal_t {
+    CollectionRef c;       ///< private handle with its own osr
+    ghobject_t next;       ///< listing cursor
+    uint64_t objects = 0;  ///< objects removed so far
+    bool ready = false;    ///< tombstone is committed
+    /// fenced collection this removal was issued on; its tombstone is
+    /// queued behind that fence, so it must not hold the fence itself
+    CollectionRef fenced;
+  };
+  struct BulkRemoveThread : public Thread {
+    BlueStore *store;
+    explicit BulkRemoveThread(BlueStore *s) : store(s) {}
+    void *entry() override {
+      store->_bulk_remove_thread();
+      return NULL;
+    }
+  } bulk_remove_thread;
+  ceph::mutex bulk_remove_lock =
+    ceph::make_mutex("BlueStore::bulk_remove_lock");
+  ceph::condition_variable bulk_remove_cond;
+  /// a recreated collection may be removed again before the previous
+  /// removal is done, hence the multimap (protected by bulk_remove_lock)
+  multimap<coll_t,bulk_removal_t> bulk_remove_map;
+  list<CollectionRef> bulk_remove_fenced;  ///< overlap a pending removal
+  list<TransContext*> bulk_remove_parked;  ///< held back in STATE_AIO_WAIT
+  bool bulk_remove_stop = false;
+
+  /// position of a background pass over all objects, in cid order
+  struct scan_cursor_t {
+    bool valid = false;
+    coll_t cid;              ///< collection being scanned
+    bool cid_done = false;
+    ghobject_t next;         ///< next object in cid
+
+    void reset() {
+      valid = false;
+      cid_done = false;
+      next = ghobject_t();
+    }
+  };
+
+  // background rewrite of fragmented objects
+  struct DefragThread : public Thread {
+    BlueStore *store;
+    explicit DefragThread(BlueStore *s) : store(s) {}
+    void *entry() override {
+      store->_defrag_thread();
+      return NULL;
+    }
+  } defrag_thread;
+  ceph::mutex defrag_lock = ceph::make_mutex("BlueStore::defrag_lock");
+  ceph::condition_variable defrag_cond;
+  bool defrag_stop = false;
+  bool defrag_forced = false;  ///< pass requested via admin socket
+  uint64_t defrag_gen = 0;     ///< bumped when the cursor is reset
+  scan_cursor_t defrag_cursor;
+  utime_t defrag_pass_start;   ///< zero if no pass is running
+  utime_t defrag_last_pass;
+  uint64_t defrag_passes = 0;
+  std::atomic<uint64_t> last_submit_ns = {0};  ///< mono time of last client txc
+
+  // migration between the fast and the main device
+  struct TierThread : public Thread {
+    BlueStore *store;
+    explicit TierThread(BlueStore *s) : store(s) {}
+    void *entry() override {
+      store->_tier_thread();
+      return NULL;
+    }
+  } tier_thread;
+  ceph::mutex tier_lock = ceph::make_mutex("BlueStore::tier_lock");
+  ceph::condition_variable tier_cond;
+  bool tier_stop = false;
+  /// objects that got hot, protected by tier_lock
+  std::deque<std::pair<CollectionRef,ghobject_t>> tier_promote_queue;
+  scan_cursor_t tier_demote_cursor;  ///< protected by tier_lock
+  std::atomic<uint32_t> tier_epoch = {0};  ///< see Onode::tier_heat
+  std::atomic<uint32_t> tier_promote_hits = {0};
+
+  class SocketHook;
+  SocketHook *asok_hook = nullptr;
+
   // --------------------------------------------------------
   // private methods
 
@@ -2227,7 +2542,13 @@ private:
   int _write_fsid();
   void _close_fsid();
   void _set_alloc_sizes();
+  void _set_cache_partitions(unsigned num_shards);
+  CachePartition* _get_cache_partition(const coll_t& cid);
+  OnodeCacheShard* _get_onode_cache_shard(const coll_t& cid);
+  BufferCacheShard* _get_buffer_cache_shard(const coll_t& cid);
+  bool _use_deferred_write(uint64_t length);
   void _set_blob_size();
+  void _set_readahead();
   void _set_finisher_num();
   void _update_osd_memory_options();
 
@@ -2257,10 +2578,6 @@ private:
   int _open_db_and_around(bool read_only);
   void _close_db_and_around();
 
-  // updates legacy bluefs related recs in DB to a state valid for
-  // downgrades from nautilus.
-  void _sync_bluefs_and_fm();
-
   /*
    * @warning to_repair_db means that we open this db to repair it, will not
    * hold the rocksdb's file lock.
@@ -2271,8 +2588,13 @@ private:
   void _close_db();
   int _open_fm(KeyValueDB::Transaction t);
   void _close_fm();
+  int _create_alloc();
   int _open_alloc();
   void _close_alloc();
+  int _load_alloc_snapshot(uint64_t *num, uint64_t *bytes);
+  int _rebuild_alloc_from_onodes(uint64_t *num, uint64_t *bytes);
+  void _invalidate_alloc_snapshot();
+  void _write_alloc_snapshot();
   int _open_collections();
   void _fsck_collections(int64_t* errors);
   void _close_collections();
@@ -2299,15 +2621,15 @@ private:
   void _open_statfs();
   void _get_statfs_overall(struct store_statfs_t *buf);
 
-  void _dump_alloc_on_failure();
-
-  int64_t _get_bluefs_size_delta(uint64_t bluefs_free, uint64_t bluefs_total);
-  int _balance_bluefs_freespace();
+  void _check_bluefs_spillover();
 
   CollectionRef _get_collection(const coll_t& cid);
   void _queue_reap_collection(CollectionRef& c);
   void _reap_collections();
   void _update_cache_logger();
+  void _release_write_stream(Collection::write_stream_t *ws);
+  void _release_write_streams(Collection *c, mono_clock::time_point expire);
+  void _prune_write_streams();
 
   void _assign_nid(TransContext *txc, OnodeRef o);
   uint64_t _assign_blobid(TransContext *txc);
@@ -2326,6 +2648,9 @@ private:
   void _txc_calc_cost(TransContext *txc);
   void _txc_write_nodes(TransContext *txc, KeyValueDB::Transaction t);
   void _txc_state_proc(TransContext *txc);
+  mono_clock::duration _txc_submit(TransContext *txc,
+				   ThreadPool::TPHandle *handle,
+				   bool throttled = true);
   void _txc_aio_submit(TransContext *txc);
 public:
   void txc_aio_finish(void *p) {
@@ -2349,6 +2674,47 @@ private:
   void _kv_stop();
   void _kv_sync_thread();
   void _kv_finalize_thread();
+  void _numa_init();
+  void _numa_bind_thread(const char *name);
+
+  void _bulk_remove_start();
+  void _bulk_remove_stop();
+  void _bulk_remove_thread();
+  bool _bulk_remove_batch(bulk_removal_t *b, uint64_t *removed);
+  void _bulk_remove_ready(CollectionRef& c);
+  void _bulk_remove_fence(TransContext *txc, CollectionRef& c);
+  bool _bulk_remove_park(TransContext *txc);
+  void _bulk_remove_unfence(list<TransContext*> *released);
+  bool _bulk_remove_covers(const ghobject_t& oid);
+
+  void _defrag_start();
+  void _defrag_stop();
+  void _defrag_begin_pass();
+  void _defrag_thread();
+  bool _defrag_idle();
+  CollectionRef _scan_next_collection(scan_cursor_t *cursor);
+  bool _defrag_batch(CollectionRef& c, ghobject_t *next, uint64_t gen);
+  bool _defrag_check(OnodeRef& o, unsigned *extents);
+  uint64_t _defrag_object(CollectionRef& c, const ghobject_t& oid);
+  void _defrag_dump(Formatter *f);
+  /// read an object and write its data back into new allocations placed
+  /// per @tier, if @check (called under the collection lock) agrees;
+  /// @done sees the result.  returns the bytes rewritten.
+  uint64_t _rewrite_object(CollectionRef& c, const ghobject_t& oid, int tier,
+			   std::function<bool(OnodeRef&)> check,
+			   std::function<void(OnodeRef&)> done = nullptr);
+
+  void _set_tier();
+  void _tier_start();
+  void _tier_stop();
+  void _tier_thread();
+  uint32_t _tier_heat(Onode *o);
+  void _tier_hit(Collection *c, OnodeRef& o);
+  int64_t _tier_alloc_hint(TransContext *txc, OnodeRef& o, int64_t hint);
+  /// false if the object must not move; else its bytes on either device
+  bool _tier_check(OnodeRef& o, uint64_t *fast, uint64_t *slow);
+  double _tier_fast_used();
+  bool _tier_demote_batch(CollectionRef& c, ghobject_t *next);
 
   bluestore_deferred_op_t *_get_deferred_op(TransContext *txc);
   void _deferred_queue(TransContext *txc);
@@ -2426,9 +2792,11 @@ private:
 
   // -- ondisk version ---
 public:
-  const int32_t latest_ondisk_format = 3;        ///< our version
+  const int32_t latest_ondisk_format = 5;        ///< our version
   const int32_t min_readable_ondisk_format = 1;  ///< what we can read
-  const int32_t min_compat_ondisk_format = 3;    ///< who can read us
+  const int32_t min_compat_ondisk_format = 4;    ///< who can read us
+  /// who can read us when there is a fast data device (block.fast)
+  const int32_t min_compat_tiered_ondisk_format = 5;
 
 private:
   int32_t ondisk_format = 0;  ///< value detected on mount
@@ -2460,6 +2828,14 @@ public:
   bool is_rotational() override;
   bool is_journal_rotational() override;
 
+  bool can_remove_nonempty_collection() override {
+    return cct->_conf.get_val<bool>("bluestore_bulk_remove_collection");
+  }
+  void get_collection_removals(map<coll_t,uint64_t> *removals) override;
+
+  /// start (or abort) a defragmentation pass, see bluestore_defrag
+  void defrag_request(bool start);
+
   string get_default_device_class() override {
     string device_class;
     map<string, string> metadata;
@@ -2522,8 +2898,21 @@ public:
     for (auto i: buffer_cache_shards) {
       buffers_bytes += i->_get_bytes();
     }
+    for (auto& p : cache_partitions) {
+      onode_count += p.second->get_num_onodes();
+      buffers_bytes += p.second->get_buffer_bytes();
+    }
     f->dump_int("bluestore_onode", onode_count);
     f->dump_int("bluestore_buffers", buffers_bytes);
+    f->open_array_section("bluestore_cache_partitions");
+    for (auto& p : cache_partitions) {
+      f->open_object_section("partition");
+      f->dump_int("pool", p.first);
+      f->dump_int("bluestore_onode", p.second->get_num_onodes());
+      f->dump_int("bluestore_buffers", p.second->get_buffer_bytes());
+      f->close_section();
+    }
+    f->close_section();
   }
   void dump_cache_stats(ostream& ss) override {
     int onode_count = 0, buffers_bytes = 0;
@@ -2533,6 +2922,10 @@ public:
     for (auto i: buffer_cache_shards) {
       buffers_bytes += i->_get_bytes();
     }
+    for (auto& p : cache_partitions) {
+      onode_count += p.second->get_num_onodes();
+      buffers_bytes += p.second->get_buffer_bytes();
+    }
     ss << "bluestore_onode: " << onode_count;
     ss << "bluestore_buffers: " << buffers_bytes;
   }
@@ -2566,6 +2959,8 @@ public:
     int id,
     const string& path);
   int expand_devices(ostream& out);
+  /// move the db of an unmounted store to a new column family sharding
+  int reshard(const string& new_sharding, ostream& out);
   string get_device_path(unsigned id);
 
 public:
@@ -2676,6 +3071,16 @@ private:
     uint32_t op_flags = 0,
     uint64_t retry_count = 0);
 
+  OnodeReadahead* _get_readahead(OnodeRef& o, uint64_t offset,
+				 uint64_t length);
+  void _do_readahead(
+    Collection *c,
+    OnodeRef o,
+    OnodeReadahead *ra,
+    uint64_t offset,
+    uint64_t length);
+  void _readahead_finish(ReadaheadContext *rc);
+
   int _do_readv(
     Collection *c,
     OnodeRef o,
@@ -2769,6 +3174,17 @@ public:
     set<string> *out         ///< [out] Subset of keys defined on oid
     ) override;
 
+  int omap_get_batch(
+    CollectionHandle &c,                 ///< [in] Collection containing oid
+    const ghobject_t &oid,               ///< [in] Object containing omap
+    const string &start_after,           ///< [in] Return keys after this
+    const string &filter_prefix,         ///< [in] Only keys with this prefix
+    uint64_t max_entries,                ///< [in] Max pairs to return
+    uint64_t max_bytes,                  ///< [in] Max bytes to return
+    map<string, bufferlist> *out,        ///< [out] Keys and values
+    bool *more                           ///< [out] Batch was truncated
+    ) override;
+
   ObjectMap::ObjectMapIterator get_omap_iterator(
     CollectionHandle &c,   ///< [in] collection
     const ghobject_t &oid  ///< [in] object
@@ -2837,6 +3253,11 @@ public:
 			   coll_t cid2, ghobject_t oid2,
 			   uint64_t offset);
 
+  /// normally set at mount, lets unit tests encode on an unmounted store
+  void set_spanning_blob_compressor(CompressorRef cp) {
+    spanning_blob_compressor = cp;
+  }
+
   void compact() override {
     ceph_assert(db);
     db->compact();
@@ -2845,16 +3266,6 @@ public:
     return true;
   }
 
-  /*
-  Allocate space for BlueFS from slow device.
-  Either automatically applies allocated extents to underlying 
-  BlueFS (extents == nullptr) or just return them (non-null extents) provided
-  */
-  int allocate_bluefs_freespace(
-    uint64_t min_size,
-    uint64_t size,
-    PExtentVector* extents);
-
   inline void log_latency(const char* name,
     int idx,
     const ceph::timespan& lat,
@@ -3183,6 +3594,7 @@ private:
   int _remove_collection(TransContext *txc, const coll_t &cid,
                          CollectionRef *c);
   void _do_remove_collection(TransContext *txc, CollectionRef *c);
+  void _do_bulk_remove_collection(TransContext *txc, CollectionRef *c);
   int _split_collection(TransContext *txc,
 			CollectionRef& c,
 			CollectionRef& d,
@@ -3193,21 +3605,6 @@ private:
 			unsigned bits);
 
 private:
-  std::atomic<uint64_t> out_of_sync_fm = {0};
-  // --------------------------------------------------------
-  // BlueFSDeviceExpander implementation
-  uint64_t get_recommended_expansion_delta(uint64_t bluefs_free,
-    uint64_t bluefs_total) override {
-    auto delta = _get_bluefs_size_delta(bluefs_free, bluefs_total);
-    return delta > 0 ? delta : 0;
-  }
-  int allocate_freespace(
-    uint64_t min_size,
-    uint64_t size,
-    PExtentVector& extents) override {
-    return allocate_bluefs_freespace(min_size, size, &extents);
-  };
-  uint64_t available_freespace(uint64_t alloc_size) override;
   inline bool _use_rotational_settings();
 
 public:
@@ -3247,6 +3644,12 @@ public:
     per_pool_statfs& expected_pool_statfs;
     BlueStoreRepairer* repairer;
 
+    // used by regular and deep fsck only, the lock (if any) protects
+    // used_blocks, used_nids, used_*omap_head and repairer when
+    // objects are checked by multiple threads
+    uint64_t_btree_t* used_nids = nullptr;
+    ceph::mutex* used_lock = nullptr;
+
     FSCK_ObjectCtx(int64_t& e,
                    int64_t& w,
                    uint64_t& _num_objects,
@@ -3293,6 +3696,18 @@ public:
     map<BlobRef, bluestore_blob_t::unused_t>* referenced,
     const BlueStore::FSCK_ObjectCtx& ctx);
 
+  int64_t fsck_check_shard_keys(
+    const ghobject_t& oid,
+    const mempool::bluestore_fsck::list<string>& expecting_shards,
+    const mempool::bluestore_fsck::list<string>& shard_keys);
+
+  void fsck_check_objects_detailed(
+    FSCKDepth depth,
+    CollectionRef c,
+    OnodeRef o,
+    const map<BlobRef, bluestore_blob_t::unused_t>& referenced,
+    const BlueStore::FSCK_ObjectCtx& ctx);
+
 private:
   void _fsck_check_objects(FSCKDepth depth,
     FSCK_ObjectCtx& ctx);
@@ -3469,7 +3884,6 @@ public:
   bool fix_false_free(KeyValueDB *db,
 		      FreelistManager* fm,
 		      uint64_t offset, uint64_t len);
-  bool fix_bluefs_extents(std::atomic<uint64_t>& out_of_sync_flag);
 
   void init(uint64_t total_space, uint64_t lres_tracking_unit_size);
 
@@ -3,6 +3,7 @@
 
 #include "FreelistManager.h"
 #include "BitmapFreelistManager.h"
+#include "NullFreelistManager.h"
 
 FreelistManager *FreelistManager::create(
   CephContext* cct,
@@ -16,6 +17,8 @@ FreelistManager *FreelistManager::create(
   ceph_assert(prefix == "B");
   if (type == "bitmap")
     return new BitmapFreelistManager(cct, "B", "b");
+  if (type == "null")
+    return new NullFreelistManager(cct, "B");
   return NULL;
 }
 
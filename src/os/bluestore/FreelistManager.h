@@ -48,6 +48,10 @@ public:
   virtual uint64_t get_alloc_units() const = 0;
   virtual uint64_t get_alloc_size() const = 0;
 
+  /// true if free space is not persisted by the freelist itself
+  virtual bool is_null_manager() const {
+    return false;
+  }
 };
 
 
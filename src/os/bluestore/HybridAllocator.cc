@@ -0,0 +1,233 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "HybridAllocator.h"
+
+#include <limits>
+
+#include "common/config_proxy.h"
+#include "common/debug.h"
+#include "common/perf_counters.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_bluestore
+#undef  dout_prefix
+#define dout_prefix *_dout << "HybridAllocator "
+
+HybridAllocator::HybridAllocator(CephContext* cct,
+				 int64_t device_size,
+				 int64_t _block_size,
+				 uint64_t max_mem,
+				 const std::string& name) :
+  AvlAllocator(cct, device_size, _block_size, max_mem, name),
+  name(name)
+{
+  _init_logger();
+}
+
+HybridAllocator::~HybridAllocator()
+{
+  shutdown();
+  _shutdown_logger();
+}
+
+void HybridAllocator::_init_logger()
+{
+  std::string logger_name = "hybrid_alloc";
+  if (!name.empty()) {
+    logger_name += "-" + name;
+  }
+  PerfCountersBuilder b(cct, logger_name,
+                        l_hybrid_alloc_first, l_hybrid_alloc_last);
+  b.add_u64_counter(l_hybrid_alloc_spilled_bytes, "spilled_bytes",
+		    "Free bytes spilled over from AVL tree to bitmap",
+		    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_hybrid_alloc_spilled_ranges, "spilled_ranges",
+		    "Free ranges spilled over from AVL tree to bitmap");
+  b.add_u64_counter(l_hybrid_alloc_bmap_alloc_bytes, "bmap_alloc_bytes",
+		    "Bytes allocated from bitmap backing store",
+		    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64(l_hybrid_alloc_bmap_free_bytes, "bmap_free_bytes",
+	    "Free bytes tracked by bitmap backing store",
+	    NULL, 0, unit_t(UNIT_BYTES));
+  logger = b.create_perf_counters();
+  cct->get_perfcounters_collection()->add(logger);
+}
+
+void HybridAllocator::_shutdown_logger()
+{
+  if (logger) {
+    cct->get_perfcounters_collection()->remove(logger);
+    delete logger;
+    logger = nullptr;
+  }
+}
+
+void HybridAllocator::_update_bmap_free()
+{
+  logger->set(l_hybrid_alloc_bmap_free_bytes,
+	      bmap_alloc ? bmap_alloc->get_free() : 0);
+}
+
+int64_t HybridAllocator::allocate(
+  uint64_t want,
+  uint64_t unit,
+  uint64_t max_alloc_size,
+  int64_t  hint,
+  PExtentVector* extents)
+{
+  ldout(cct, 10) << __func__ << std::hex
+                 << " want 0x" << want
+                 << " unit 0x" << unit
+                 << " max_alloc_size 0x" << max_alloc_size
+                 << " hint 0x" << hint
+                 << std::dec << dendl;
+  ceph_assert(isp2(unit));
+  ceph_assert(want % unit == 0);
+
+  if (max_alloc_size == 0) {
+    max_alloc_size = want;
+  }
+  if (constexpr auto cap = std::numeric_limits<decltype(bluestore_pextent_t::length)>::max();
+      max_alloc_size >= cap) {
+    max_alloc_size = cap;
+  }
+
+  std::lock_guard l(lock);
+
+  uint64_t allocated = 0;
+  uint64_t bmap_allocated = 0;
+  // try bitmap first to avoid unneeded split of contiguous AVL ranges
+  // if the desired amount is less than the shortest one
+  if (bmap_alloc && bmap_alloc->get_free() &&
+      want < _lowest_size_available()) {
+    auto r = bmap_alloc->allocate(want, unit, max_alloc_size, hint, extents);
+    if (r > 0) {
+      bmap_allocated += r;
+      allocated += r;
+    }
+  }
+  if (allocated < want) {
+    auto r = _allocate(want - allocated, unit, max_alloc_size, hint, extents);
+    if (r > 0) {
+      allocated += r;
+    }
+  }
+  if (allocated < want && bmap_alloc && bmap_alloc->get_free()) {
+    auto r = bmap_alloc->allocate(want - allocated, unit, max_alloc_size,
+				  hint, extents);
+    if (r > 0) {
+      bmap_allocated += r;
+      allocated += r;
+    }
+  }
+  if (bmap_allocated) {
+    logger->inc(l_hybrid_alloc_bmap_alloc_bytes, bmap_allocated);
+    _update_bmap_free();
+  }
+  return allocated ? allocated : -ENOSPC;
+}
+
+uint64_t HybridAllocator::get_free()
+{
+  std::lock_guard l(lock);
+  return (bmap_alloc ? bmap_alloc->get_free() : 0) + _get_free();
+}
+
+double HybridAllocator::get_fragmentation()
+{
+  std::lock_guard l(lock);
+  auto f = _get_fragmentation();
+  auto bmap_free = bmap_alloc ? bmap_alloc->get_free() : 0;
+  if (bmap_free) {
+    auto _free = _get_free() + bmap_free;
+    auto bf = bmap_alloc->get_fragmentation();
+
+    f = f * _get_free() / _free + bf * bmap_free / _free;
+  }
+  return f;
+}
+
+void HybridAllocator::dump()
+{
+  std::lock_guard l(lock);
+  _dump();
+  if (bmap_alloc) {
+    bmap_alloc->dump();
+  }
+  ldout(cct, 0) << __func__
+    << " avl_free: " << _get_free()
+    << " bmap_free: " << (bmap_alloc ? bmap_alloc->get_free() : 0)
+    << dendl;
+}
+
+void HybridAllocator::dump(std::function<void(uint64_t offset, uint64_t length)> notify)
+{
+  AvlAllocator::dump(notify);
+  if (bmap_alloc) {
+    bmap_alloc->dump(notify);
+  }
+}
+
+void HybridAllocator::init_rm_free(uint64_t offset, uint64_t length)
+{
+  std::lock_guard l(lock);
+  ldout(cct, 10) << __func__ << std::hex
+                 << " offset 0x" << offset
+                 << " length 0x" << length
+                 << std::dec << dendl;
+  _try_remove_from_tree(offset, length,
+    [&](uint64_t o, uint64_t len, bool found) {
+      if (!found) {
+	if (bmap_alloc) {
+	  bmap_alloc->init_rm_free(o, len);
+	} else {
+	  lderr(cct) << "init_rm_free lambda" << std::hex
+		     << " unexpected extent: " << o << "~" << len
+		     << std::dec << dendl;
+	  ceph_assert(false);
+	}
+      }
+    });
+  if (bmap_alloc) {
+    _update_bmap_free();
+  }
+}
+
+void HybridAllocator::shutdown()
+{
+  std::lock_guard l(lock);
+  _shutdown();
+  if (bmap_alloc) {
+    bmap_alloc->shutdown();
+    delete bmap_alloc;
+    bmap_alloc = nullptr;
+  }
+  if (logger) {
+    _update_bmap_free();
+  }
+}
+
+void HybridAllocator::_spillover_range(uint64_t start, uint64_t end)
+{
+  auto size = end - start;
+  dout(20) << __func__
+	   << std::hex << " "
+	   << start << "~" << size
+	   << std::dec
+	   << dendl;
+  ceph_assert(size);
+  if (!bmap_alloc) {
+    dout(1) << __func__
+	    << " constructing fallback allocator"
+	    << dendl;
+    bmap_alloc = new BitmapAllocator(cct,
+				     get_capacity(),
+				     get_block_size(),
+				     name + ".fallback");
+  }
+  bmap_alloc->init_add_free(start, size);
+  logger->inc(l_hybrid_alloc_spilled_bytes, size);
+  logger->inc(l_hybrid_alloc_spilled_ranges);
+  _update_bmap_free();
+}
@@ -0,0 +1,60 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#pragma once
+
+#include <mutex>
+
+#include "AvlAllocator.h"
+#include "BitmapAllocator.h"
+
+class PerfCounters;
+
+enum {
+  l_hybrid_alloc_first = 733100,
+  l_hybrid_alloc_spilled_bytes,
+  l_hybrid_alloc_spilled_ranges,
+  l_hybrid_alloc_bmap_alloc_bytes,
+  l_hybrid_alloc_bmap_free_bytes,
+  l_hybrid_alloc_last
+};
+
+/*
+ * AVL allocator whose range count is capped by a memory budget.
+ * Free ranges which don't fit into the budget (the shortest ones)
+ * are spilled over to a bitmap allocator which has a fixed memory
+ * footprint and is instantiated on demand.
+ */
+class HybridAllocator : public AvlAllocator {
+  BitmapAllocator* bmap_alloc = nullptr;
+  PerfCounters* logger = nullptr;
+  const std::string name;
+
+public:
+  HybridAllocator(CephContext* cct, int64_t device_size, int64_t _block_size,
+                  uint64_t max_mem,
+	          const std::string& name);
+  ~HybridAllocator();
+
+  int64_t allocate(
+    uint64_t want,
+    uint64_t unit,
+    uint64_t max_alloc_size,
+    int64_t  hint,
+    PExtentVector *extents) override;
+  uint64_t get_free() override;
+  double get_fragmentation() override;
+
+  void dump() override;
+  void dump(std::function<void(uint64_t offset, uint64_t length)> notify) override;
+  void init_rm_free(uint64_t offset, uint64_t length) override;
+  void shutdown() override;
+
+protected:
+  void _spillover_range(uint64_t start, uint64_t end) override;
+
+private:
+  void _init_logger();
+  void _shutdown_logger();
+  void _update_bmap_free();
+};
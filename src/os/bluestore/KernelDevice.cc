@@ -55,11 +55,15 @@ KernelDevice::KernelDevice(CephContext* cct, aio_callback_t cb, void *cbpriv, ai
   fd_directs.resize(WRITE_LIFE_MAX, -1);
   fd_buffereds.resize(WRITE_LIFE_MAX, -1);
 
-  bool use_ioring = g_ceph_context->_conf.get_val<bool>("bluestore_ioring");
+  bool use_ioring = cct->_conf.get_val<bool>("bluestore_ioring");
   unsigned int iodepth = cct->_conf->bdev_aio_max_queue_depth;
 
   if (use_ioring && ioring_queue_t::supported()) {
-    io_queue = std::make_unique<ioring_queue_t>(iodepth);
+    auto& conf = cct->_conf;
+    io_queue = std::make_unique<ioring_queue_t>(
+      iodepth,
+      conf.get_val<bool>("bluestore_ioring_hipri"),
+      conf.get_val<bool>("bluestore_ioring_sqthread_poll"));
   } else {
     static bool once;
     if (use_ioring && !once) {
@@ -247,6 +251,12 @@ int KernelDevice::get_devices(std::set<std::string> *ls) const
   return 0;
 }
 
+int KernelDevice::get_numa_node(int *node) const
+{
+  BlkDev blkdev{fd_buffereds[WRITE_LIFE_NOT_SET]};
+  return blkdev.get_numa_node(node);
+}
+
 void KernelDevice::close()
 {
   dout(1) << __func__ << dendl;
@@ -503,9 +513,41 @@ static bool is_expected_ioerr(const int r)
 	  );
 }
 
+void KernelDevice::_set_numa_affinity()
+{
+  int node = -1;
+  int r = get_numa_node(&node);
+  if (r < 0) {
+    dout(1) << __func__ << " unable to identify numa node: "
+	    << cpp_strerror(r) << dendl;
+    return;
+  }
+  size_t cpu_set_size;
+  cpu_set_t cpu_set;
+  r = get_numa_node_cpu_set(node, &cpu_set_size, &cpu_set);
+  if (r < 0) {
+    dout(1) << __func__ << " unable to determine numa node " << node
+	    << " CPUs" << dendl;
+    return;
+  }
+  r = set_cpu_affinity_this_thread(cpu_set_size, &cpu_set);
+  if (r < 0) {
+    derr << __func__ << " failed to set numa affinity: " << cpp_strerror(r)
+	 << dendl;
+    return;
+  }
+  dout(1) << __func__ << " numa node " << node << " cpus "
+	  << cpu_set_to_str_list(cpu_set_size, &cpu_set) << dendl;
+}
+
 void KernelDevice::_aio_thread()
 {
   dout(10) << __func__ << " start" << dendl;
+  if (cct->_conf.get_val<bool>("bluestore_numa_affinity")) {
+    // completions are handed straight to the BlueStore kv threads, which
+    // live on the same node when the option is set
+    _set_numa_affinity();
+  }
   int inject_crash_count = 0;
   while (!aio_stop) {
     dout(40) << __func__ << " polling" << dendl;
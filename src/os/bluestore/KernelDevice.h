@@ -79,6 +79,7 @@ class KernelDevice : public BlockDevice {
   std::atomic_int injecting_crash;
 
   void _aio_thread();
+  void _set_numa_affinity();
   void _discard_thread();
   int queue_discard(interval_set<uint64_t> &to_release) override;
 
@@ -123,6 +124,7 @@ public:
     return 0;
   }
   int get_devices(std::set<std::string> *ls) const override;
+  int get_numa_node(int *node) const override;
 
   bool get_thin_utilization(uint64_t *total, uint64_t *avail) const override;
 
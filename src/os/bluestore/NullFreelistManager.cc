@@ -0,0 +1,108 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "NullFreelistManager.h"
+#include "kv/KeyValueDB.h"
+
+#include "common/debug.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_bluestore
+#undef dout_prefix
+#define dout_prefix *_dout << "freelist "
+
+NullFreelistManager::NullFreelistManager(CephContext* cct,
+					 std::string meta_prefix)
+  : FreelistManager(cct),
+    meta_prefix(meta_prefix)
+{
+}
+
+void NullFreelistManager::_write_meta(KeyValueDB::Transaction txn)
+{
+  {
+    bufferlist bl;
+    encode(bytes_per_block, bl);
+    txn->set(meta_prefix, "bytes_per_block", bl);
+  }
+  {
+    bufferlist bl;
+    encode(size, bl);
+    txn->set(meta_prefix, "size", bl);
+  }
+}
+
+int NullFreelistManager::create(uint64_t new_size, uint64_t granularity,
+				KeyValueDB::Transaction txn)
+{
+  bytes_per_block = granularity;
+  ceph_assert(isp2(bytes_per_block));
+  size = p2align(new_size, bytes_per_block);
+  dout(10) << __func__
+	   << " size 0x" << std::hex << size
+	   << " bytes_per_block 0x" << bytes_per_block
+	   << std::dec << dendl;
+  _write_meta(txn);
+  return 0;
+}
+
+int NullFreelistManager::expand(uint64_t new_size,
+				KeyValueDB::Transaction txn)
+{
+  ceph_assert(new_size > size);
+  size = p2align(new_size, bytes_per_block);
+  dout(10) << __func__
+	   << " size 0x" << std::hex << size
+	   << " bytes_per_block 0x" << bytes_per_block
+	   << std::dec << dendl;
+  _write_meta(txn);
+  return 0;
+}
+
+int NullFreelistManager::init(KeyValueDB *kvdb)
+{
+  dout(1) << __func__ << dendl;
+
+  KeyValueDB::Iterator it = kvdb->get_iterator(meta_prefix);
+  it->lower_bound(string());
+
+  // load meta
+  while (it->valid()) {
+    string k = it->key();
+    if (k == "bytes_per_block") {
+      bufferlist bl = it->value();
+      auto p = bl.cbegin();
+      decode(bytes_per_block, p);
+    } else if (k == "size") {
+      bufferlist bl = it->value();
+      auto p = bl.cbegin();
+      decode(size, p);
+    } else {
+      derr << __func__ << " unrecognized meta " << k << dendl;
+      return -EIO;
+    }
+    it->next();
+  }
+  if (!bytes_per_block || !size) {
+    derr << __func__ << " missing meta, size 0x" << std::hex << size
+	 << " bytes_per_block 0x" << bytes_per_block << std::dec << dendl;
+    return -EIO;
+  }
+  dout(10) << __func__ << std::hex
+	   << " size 0x" << size
+	   << " bytes_per_block 0x" << bytes_per_block
+	   << std::dec << dendl;
+  return 0;
+}
+
+void NullFreelistManager::shutdown()
+{
+  dout(1) << __func__ << dendl;
+}
+
+void NullFreelistManager::dump(KeyValueDB *kvdb)
+{
+  dout(20) << __func__ << " size 0x" << std::hex << size
+	  << " bytes_per_block 0x" << bytes_per_block << std::dec
+	  << ", free space is tracked by the allocator only" << dendl;
+}
@@ -0,0 +1,70 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_OS_BLUESTORE_NULLFREELISTMANAGER_H
+#define CEPH_OS_BLUESTORE_NULLFREELISTMANAGER_H
+
+#include "FreelistManager.h"
+
+#include <string>
+
+#include "kv/KeyValueDB.h"
+
+/*
+ * Freelist manager that keeps nothing in the kv store beyond the
+ * device geometry.  The allocator is the only record of free space at
+ * runtime; BlueStore persists it as a snapshot at clean shutdown and
+ * rebuilds it from the onodes after a crash.  This keeps the freelist
+ * updates out of every transaction's commit path.
+ */
+class NullFreelistManager : public FreelistManager {
+  std::string meta_prefix;
+
+  uint64_t size = 0;            ///< size of device (bytes)
+  uint64_t bytes_per_block = 0; ///< allocation granularity (bytes)
+
+  void _write_meta(KeyValueDB::Transaction txn);
+
+public:
+  NullFreelistManager(CephContext* cct, std::string meta_prefix);
+
+  int create(uint64_t size, uint64_t granularity,
+	     KeyValueDB::Transaction txn) override;
+
+  int expand(uint64_t new_size,
+	     KeyValueDB::Transaction txn) override;
+
+  int init(KeyValueDB *kvdb) override;
+  void shutdown() override;
+
+  void dump(KeyValueDB *kvdb) override;
+
+  void enumerate_reset() override {}
+  bool enumerate_next(KeyValueDB *kvdb, uint64_t *offset,
+		      uint64_t *length) override {
+    return false;
+  }
+
+  void allocate(
+    uint64_t offset, uint64_t length,
+    KeyValueDB::Transaction txn) override {}
+  void release(
+    uint64_t offset, uint64_t length,
+    KeyValueDB::Transaction txn) override {}
+
+  bool is_null_manager() const override {
+    return true;
+  }
+
+  inline uint64_t get_size() const override {
+    return size;
+  }
+  inline uint64_t get_alloc_units() const override {
+    return size / bytes_per_block;
+  }
+  inline uint64_t get_alloc_size() const override {
+    return bytes_per_block;
+  }
+};
+
+#endif
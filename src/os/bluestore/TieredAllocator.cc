@@ -0,0 +1,150 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "TieredAllocator.h"
+
+#include "common/debug.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_bluestore
+#undef  dout_prefix
+#define dout_prefix *_dout << "TieredAllocator "
+
+TieredAllocator::TieredAllocator(CephContext* cct,
+				 Allocator *slow, uint64_t slow_size,
+				 Allocator *fast, uint64_t fast_offset,
+				 uint64_t fast_size,
+				 const std::string& name)
+  : Allocator(name),
+    cct(cct),
+    slow(slow),
+    fast(fast),
+    slow_size(slow_size),
+    fast_offset(fast_offset),
+    fast_size(fast_size)
+{
+  ceph_assert(slow_size <= fast_offset);
+}
+
+TieredAllocator::~TieredAllocator()
+{
+  delete fast;
+  delete slow;
+}
+
+template <typename F1, typename F2>
+void TieredAllocator::split(uint64_t offset, uint64_t length,
+			    F1&& on_slow, F2&& on_fast)
+{
+  uint64_t end = offset + length;
+  if (offset < slow_size) {
+    on_slow(offset, std::min(end, slow_size) - offset);
+  }
+  uint64_t fs = std::max(offset, fast_offset);
+  uint64_t fe = std::min(end, fast_offset + fast_size);
+  if (fe > fs) {
+    on_fast(fs - fast_offset, fe - fs);
+  }
+}
+
+int64_t TieredAllocator::allocate(
+  uint64_t want,
+  uint64_t unit,
+  uint64_t max_alloc_size,
+  int64_t hint,
+  PExtentVector *extents)
+{
+  if (hint < 0 || !is_fast(hint)) {
+    if ((uint64_t)hint >= slow_size) {
+      hint = 0;
+    }
+    return slow->allocate(want, unit, max_alloc_size, hint, extents);
+  }
+  uint64_t rel_hint = hint - fast_offset;
+  if (rel_hint >= fast_size) {
+    rel_hint = 0;
+  }
+  PExtentVector fast_extents;
+  int64_t allocated = fast->allocate(want, unit, max_alloc_size, rel_hint,
+				     &fast_extents);
+  if (allocated < 0) {
+    allocated = 0;
+  }
+  for (auto& e : fast_extents) {
+    extents->emplace_back(e.offset + fast_offset, e.length);
+  }
+  if ((uint64_t)allocated < want) {
+    dout(20) << __func__ << " fast device short by 0x" << std::hex
+	     << want - allocated << std::dec << dendl;
+    int64_t r = slow->allocate(want - allocated, unit, max_alloc_size, 0,
+			       extents);
+    if (r > 0) {
+      allocated += r;
+    }
+  }
+  return allocated ? allocated : -ENOSPC;
+}
+
+void TieredAllocator::release(const interval_set<uint64_t>& release_set)
+{
+  interval_set<uint64_t> slow_set, fast_set;
+  for (auto p = release_set.begin(); p != release_set.end(); ++p) {
+    split(p.get_start(), p.get_len(),
+	  [&](uint64_t o, uint64_t l) { slow_set.insert(o, l); },
+	  [&](uint64_t o, uint64_t l) { fast_set.insert(o, l); });
+  }
+  if (!slow_set.empty()) {
+    slow->release(slow_set);
+  }
+  if (!fast_set.empty()) {
+    fast->release(fast_set);
+  }
+}
+
+void TieredAllocator::dump()
+{
+  slow->dump();
+  fast->dump();
+}
+
+void TieredAllocator::dump(
+  std::function<void(uint64_t offset, uint64_t length)> notify)
+{
+  slow->dump(notify);
+  fast->dump([&](uint64_t offset, uint64_t length) {
+    notify(offset + fast_offset, length);
+  });
+}
+
+void TieredAllocator::init_add_free(uint64_t offset, uint64_t length)
+{
+  split(offset, length,
+	[&](uint64_t o, uint64_t l) { slow->init_add_free(o, l); },
+	[&](uint64_t o, uint64_t l) { fast->init_add_free(o, l); });
+}
+
+void TieredAllocator::init_rm_free(uint64_t offset, uint64_t length)
+{
+  split(offset, length,
+	[&](uint64_t o, uint64_t l) { slow->init_rm_free(o, l); },
+	[&](uint64_t o, uint64_t l) { fast->init_rm_free(o, l); });
+}
+
+uint64_t TieredAllocator::get_free()
+{
+  return slow->get_free() + fast->get_free();
+}
+
+double TieredAllocator::get_fragmentation()
+{
+  // weighted by capacity
+  return (slow->get_fragmentation() * slow_size +
+	  fast->get_fragmentation() * fast_size) /
+    (double)(slow_size + fast_size);
+}
+
+void TieredAllocator::shutdown()
+{
+  slow->shutdown();
+  fast->shutdown();
+}
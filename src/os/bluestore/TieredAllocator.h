@@ -0,0 +1,75 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#pragma once
+
+#include "Allocator.h"
+
+/*
+ * Allocator for the address space of a TieredDevice: [0, slow_size) is
+ * served by one allocator, [fast_offset, fast_offset + fast_size) by
+ * another, which sees it as [0, fast_size).  Anything in between is
+ * dropped when it is added or released.
+ *
+ * Allocations are placed by hint: a hint in the fast range allocates from
+ * the fast device and tops up from the slow one if that runs short; any
+ * other hint only allocates from the slow device.
+ */
+class TieredAllocator : public Allocator {
+  CephContext* cct;
+  Allocator *slow;
+  Allocator *fast;
+  uint64_t slow_size;
+  uint64_t fast_offset;
+  uint64_t fast_size;
+
+  template <typename F1, typename F2>
+  void split(uint64_t offset, uint64_t length, F1&& on_slow, F2&& on_fast);
+
+public:
+  /// takes ownership of both allocators
+  TieredAllocator(CephContext* cct,
+		  Allocator *slow, uint64_t slow_size,
+		  Allocator *fast, uint64_t fast_offset, uint64_t fast_size,
+		  const std::string& name);
+  ~TieredAllocator() override;
+
+  /// the allocator for the slow range, which BlueFS shares
+  Allocator *get_slow() {
+    return slow;
+  }
+  uint64_t get_slow_size() const {
+    return slow_size;
+  }
+  uint64_t get_fast_offset() const {
+    return fast_offset;
+  }
+  uint64_t get_fast_size() const {
+    return fast_size;
+  }
+  uint64_t get_fast_free() {
+    return fast->get_free();
+  }
+  bool is_fast(uint64_t offset) const {
+    return offset >= fast_offset;
+  }
+
+  int64_t allocate(
+    uint64_t want,
+    uint64_t unit,
+    uint64_t max_alloc_size,
+    int64_t hint,
+    PExtentVector *extents) override;
+  void release(const interval_set<uint64_t>& release_set) override;
+  using Allocator::release;
+
+  void dump() override;
+  void dump(std::function<void(uint64_t offset, uint64_t length)> notify) override;
+
+  void init_add_free(uint64_t offset, uint64_t length) override;
+  void init_rm_free(uint64_t offset, uint64_t length) override;
+
+  uint64_t get_free() override;
+  double get_fragmentation() override;
+  void shutdown() override;
+};
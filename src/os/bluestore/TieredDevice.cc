@@ -0,0 +1,334 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "TieredDevice.h"
+#include "include/intarith.h"
+#include "include/stringify.h"
+#include "common/debug.h"
+#include "common/errno.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_bdev
+#undef dout_prefix
+#define dout_prefix *_dout << "tiered_bdev(" << this << " " << path << ") "
+
+TieredDevice::TieredDevice(CephContext* cct, uint64_t fast_offset,
+			   aio_callback_t cb, void *cbpriv,
+			   aio_callback_t d_cb, void *d_cbpriv)
+  : BlockDevice(cct, cb, cbpriv),
+    fast_offset(fast_offset),
+    discard_callback(d_cb),
+    discard_callback_priv(d_cbpriv)
+{
+}
+
+TieredDevice::~TieredDevice()
+{
+  delete fast;
+  delete slow;
+}
+
+void TieredDevice::fast_discard_cb(void *priv, void *priv2)
+{
+  TieredDevice *d = static_cast<TieredDevice*>(priv);
+  interval_set<uint64_t> *s = static_cast<interval_set<uint64_t>*>(priv2);
+  interval_set<uint64_t> released;
+  for (auto p = s->begin(); p != s->end(); ++p) {
+    released.insert(p.get_start() - d->fast_reserved + d->fast_offset,
+		    p.get_len());
+  }
+  d->discard_callback(d->discard_callback_priv, &released);
+}
+
+BlockDevice *TieredDevice::route(uint64_t *off, uint64_t len) const
+{
+  if (in_slow(*off, len)) {
+    return slow;
+  }
+  ceph_assert(in_fast(*off, len));
+  *off = to_fast(*off);
+  return fast;
+}
+
+void TieredDevice::split(const interval_set<uint64_t>& s,
+			 interval_set<uint64_t> *slow_part,
+			 interval_set<uint64_t> *fast_part) const
+{
+  uint64_t slow_end = slow->get_size();
+  for (auto p = s.begin(); p != s.end(); ++p) {
+    uint64_t start = p.get_start();
+    uint64_t end = p.get_end();
+    if (start < slow_end) {
+      slow_part->insert(start, std::min(end, slow_end) - start);
+    }
+    uint64_t fs = std::max(start, fast_offset);
+    uint64_t fe = std::min(end, size);
+    if (fe > fs) {
+      fast_part->insert(to_fast(fs), fe - fs);
+    }
+  }
+}
+
+int TieredDevice::open(const std::string& p)
+{
+  path = p;
+  std::string fast_path = p + FAST_SUFFIX;
+  slow = BlockDevice::create(cct, p, aio_callback, aio_callback_priv,
+			     discard_callback, discard_callback_priv);
+  int r = slow->open(p);
+  if (r < 0) {
+    goto out_slow;
+  }
+  fast = BlockDevice::create(cct, fast_path, aio_callback, aio_callback_priv,
+			     fast_discard_cb, static_cast<void*>(this));
+  r = fast->open(fast_path);
+  if (r < 0) {
+    goto out_fast;
+  }
+
+  if (fast->get_block_size() != slow->get_block_size()) {
+    derr << __func__ << " block size of " << fast_path << " 0x" << std::hex
+	 << fast->get_block_size() << " does not match 0x"
+	 << slow->get_block_size() << std::dec << dendl;
+    r = -EINVAL;
+    goto out_close_fast;
+  }
+  block_size = slow->get_block_size();
+  fast_reserved = p2roundup(FAST_LABEL_SIZE, block_size);
+  if (fast->get_size() <= fast_reserved) {
+    derr << __func__ << " " << fast_path << " is too small" << dendl;
+    r = -EINVAL;
+    goto out_close_fast;
+  }
+  if (!fast_offset) {
+    fast_offset = p2roundup(slow->get_size() + 1, FAST_OFFSET_ALIGN);
+  } else if (slow->get_size() >= fast_offset) {
+    derr << __func__ << " main device size 0x" << std::hex
+	 << slow->get_size() << " overlaps the fast device at 0x"
+	 << fast_offset << std::dec << dendl;
+    r = -EINVAL;
+    goto out_close_fast;
+  }
+  size = fast_offset + p2align(fast->get_size() - fast_reserved, block_size);
+  rotational = slow->is_rotational();
+  support_discard = true;
+
+  dout(1) << __func__ << " size 0x" << std::hex << size
+	  << " main 0x" << slow->get_size()
+	  << " fast 0x" << fast_offset << "~" << get_fast_size() << std::dec
+	  << dendl;
+  return 0;
+
+ out_close_fast:
+  fast->close();
+ out_fast:
+  delete fast;
+  fast = nullptr;
+  slow->close();
+ out_slow:
+  delete slow;
+  slow = nullptr;
+  return r;
+}
+
+void TieredDevice::close()
+{
+  dout(1) << __func__ << dendl;
+  fast->close();
+  delete fast;
+  fast = nullptr;
+  slow->close();
+  delete slow;
+  slow = nullptr;
+}
+
+int TieredDevice::collect_metadata(const std::string& prefix,
+				   std::map<std::string,std::string> *pm) const
+{
+  int r = slow->collect_metadata(prefix, pm);
+  if (r < 0) {
+    return r;
+  }
+  (*pm)[prefix + "fast_offset"] = stringify(fast_offset);
+  return fast->collect_metadata(prefix + "fast_", pm);
+}
+
+int TieredDevice::get_devices(std::set<std::string> *ls) const
+{
+  slow->get_devices(ls);
+  fast->get_devices(ls);
+  return 0;
+}
+
+int TieredDevice::get_numa_node(int *node) const
+{
+  int slow_node, fast_node;
+  int r = slow->get_numa_node(&slow_node);
+  if (r < 0) {
+    return r;
+  }
+  r = fast->get_numa_node(&fast_node);
+  if (r < 0) {
+    return r;
+  }
+  if (slow_node != fast_node) {
+    return -EXDEV;
+  }
+  *node = slow_node;
+  return 0;
+}
+
+void TieredDevice::aio_submit(IOContext *ioc)
+{
+  int fast_pending = ioc->fast_pending_aios.size();
+  if (!fast_pending) {
+    slow->aio_submit(ioc);
+    return;
+  }
+  // hold the ioc open until both halves are submitted, or the slow aios
+  // could complete it while the fast ones are still to go
+  ++ioc->num_running;
+  ioc->num_pending -= fast_pending;
+  slow->aio_submit(ioc);
+  ioc->pending_aios.splice(ioc->pending_aios.end(), ioc->fast_pending_aios);
+  ioc->num_pending += fast_pending;
+  fast->aio_submit(ioc);
+  // same as an aio completion, see KernelDevice::_aio_thread
+  if (ioc->priv) {
+    if (--ioc->num_running == 0) {
+      aio_callback(aio_callback_priv, ioc->priv);
+    }
+  } else {
+    ioc->try_aio_wake();
+  }
+}
+
+void TieredDevice::discard_drain()
+{
+  slow->discard_drain();
+  fast->discard_drain();
+}
+
+int TieredDevice::read(uint64_t off, uint64_t len, bufferlist *pbl,
+		       IOContext *ioc,
+		       bool buffered)
+{
+  BlockDevice *d = route(&off, len);
+  return d->read(off, len, pbl, ioc, buffered);
+}
+
+int TieredDevice::aio_read(uint64_t off, uint64_t len, bufferlist *pbl,
+			   IOContext *ioc)
+{
+  BlockDevice *d = route(&off, len);
+  if (d == slow) {
+    return slow->aio_read(off, len, pbl, ioc);
+  }
+  bool was_empty = ioc->pending_aios.empty();
+  auto last = was_empty ?
+    ioc->pending_aios.end() : std::prev(ioc->pending_aios.end());
+  int r = fast->aio_read(off, len, pbl, ioc);
+  ioc->fast_pending_aios.splice(
+    ioc->fast_pending_aios.end(), ioc->pending_aios,
+    was_empty ? ioc->pending_aios.begin() : std::next(last),
+    ioc->pending_aios.end());
+  return r;
+}
+
+int TieredDevice::read_random(uint64_t off, uint64_t len, char *buf,
+			      bool buffered)
+{
+  BlockDevice *d = route(&off, len);
+  return d->read_random(off, len, buf, buffered);
+}
+
+int TieredDevice::write(uint64_t off, bufferlist& bl, bool buffered,
+			int write_hint)
+{
+  BlockDevice *d = route(&off, bl.length());
+  return d->write(off, bl, buffered, write_hint);
+}
+
+int TieredDevice::aio_write(uint64_t off, bufferlist& bl,
+			    IOContext *ioc,
+			    bool buffered,
+			    int write_hint)
+{
+  BlockDevice *d = route(&off, bl.length());
+  if (d == slow) {
+    return slow->aio_write(off, bl, ioc, buffered, write_hint);
+  }
+  bool was_empty = ioc->pending_aios.empty();
+  auto last = was_empty ?
+    ioc->pending_aios.end() : std::prev(ioc->pending_aios.end());
+  int r = fast->aio_write(off, bl, ioc, buffered, write_hint);
+  ioc->fast_pending_aios.splice(
+    ioc->fast_pending_aios.end(), ioc->pending_aios,
+    was_empty ? ioc->pending_aios.begin() : std::next(last),
+    ioc->pending_aios.end());
+  return r;
+}
+
+int TieredDevice::flush()
+{
+  int r = slow->flush();
+  int r2 = fast->flush();
+  return r < 0 ? r : r2;
+}
+
+int TieredDevice::discard(uint64_t offset, uint64_t len)
+{
+  interval_set<uint64_t> s, slow_part, fast_part;
+  s.insert(offset, len);
+  split(s, &slow_part, &fast_part);
+  int r = 0;
+  for (auto p = slow_part.begin(); p != slow_part.end(); ++p) {
+    int r2 = slow->discard(p.get_start(), p.get_len());
+    if (r == 0) {
+      r = r2;
+    }
+  }
+  for (auto p = fast_part.begin(); p != fast_part.end(); ++p) {
+    int r2 = fast->discard(p.get_start(), p.get_len());
+    if (r == 0) {
+      r = r2;
+    }
+  }
+  return r;
+}
+
+int TieredDevice::queue_discard(interval_set<uint64_t> &to_release)
+{
+  interval_set<uint64_t> slow_part, fast_part;
+  split(to_release, &slow_part, &fast_part);
+  // the caller releases everything itself if we fail, so only fail while
+  // nothing has been queued yet
+  if (!fast_part.empty() && fast->queue_discard(fast_part) < 0) {
+    return -1;
+  }
+  if (!slow_part.empty() && slow->queue_discard(slow_part) < 0) {
+    if (fast_part.empty()) {
+      return -1;
+    }
+    for (auto p = slow_part.begin(); p != slow_part.end(); ++p) {
+      slow->discard(p.get_start(), p.get_len());
+    }
+    discard_callback(discard_callback_priv, &slow_part);
+  }
+  return 0;
+}
+
+int TieredDevice::invalidate_cache(uint64_t off, uint64_t len)
+{
+  BlockDevice *d = route(&off, len);
+  return d->invalidate_cache(off, len);
+}
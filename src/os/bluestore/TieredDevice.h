@@ -0,0 +1,124 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_BLUESTORE_TIEREDDEVICE_H
+#define CEPH_OS_BLUESTORE_TIEREDDEVICE_H
+
+#include "include/interval_set.h"
+
+#include "BlockDevice.h"
+
+/**
+ * A slow (main) and a fast data device presented as one address space
+ *
+ * The slow device is mapped 1:1 at [0, slow size), so that BlueFS can keep
+ * sharing it by path.  The fast device, minus the block holding its label,
+ * starts at fast_offset, which is past the end of the slow device and fixed
+ * when the store is created; the hole in between is never handed out by
+ * the allocator (see TieredAllocator).  No single IO may span both.
+ *
+ * aios for the fast device are kept aside in IOContext::fast_pending_aios
+ * and submitted to it separately, so that each device only ever sees its
+ * own aios.
+ */
+class TieredDevice : public BlockDevice {
+  BlockDevice *slow = nullptr;
+  BlockDevice *fast = nullptr;
+  uint64_t fast_offset;          ///< start of the fast device, 0 = choose
+  uint64_t fast_reserved = 0;    ///< label area at the start of fast
+  std::string path;
+
+  aio_callback_t discard_callback;
+  void *discard_callback_priv;
+
+  static void fast_discard_cb(void *priv, void *priv2);
+
+  bool in_slow(uint64_t off, uint64_t len) const {
+    return off + len <= slow->get_size();
+  }
+  bool in_fast(uint64_t off, uint64_t len) const {
+    return off >= fast_offset && off + len <= size;
+  }
+  uint64_t to_fast(uint64_t off) const {
+    return off - fast_offset + fast_reserved;
+  }
+  /// pick the device for an IO and translate its offset
+  BlockDevice *route(uint64_t *off, uint64_t len) const;
+  /// split @s into the parts for either device, in device offsets
+  void split(const interval_set<uint64_t>& s,
+	     interval_set<uint64_t> *slow_part,
+	     interval_set<uint64_t> *fast_part) const;
+
+public:
+  /// fast devices are expected at the main device's path plus this
+  static constexpr const char *FAST_SUFFIX = ".fast";
+  /// fast_offset is aligned to this
+  static constexpr uint64_t FAST_OFFSET_ALIGN = 1ull << 30;
+  /// BlueStore's label at the start of the fast device
+  static constexpr uint64_t FAST_LABEL_SIZE = 4096;
+
+  TieredDevice(CephContext* cct, uint64_t fast_offset,
+	       aio_callback_t cb, void *cbpriv,
+	       aio_callback_t d_cb, void *d_cbpriv);
+  ~TieredDevice() override;
+
+  uint64_t get_fast_offset() const {
+    return fast_offset;
+  }
+  uint64_t get_slow_size() const {
+    return slow->get_size();
+  }
+  uint64_t get_fast_size() const {
+    return size - fast_offset;
+  }
+  bool is_fast(uint64_t off) const {
+    return off >= fast_offset;
+  }
+
+  bool supported_bdev_label() override {
+    return slow->supported_bdev_label();
+  }
+  void aio_submit(IOContext *ioc) override;
+  void discard_drain() override;
+
+  int collect_metadata(const std::string& prefix,
+		       std::map<std::string,std::string> *pm) const override;
+  int get_devname(std::string *s) const override {
+    return slow->get_devname(s);
+  }
+  int get_devices(std::set<std::string> *ls) const override;
+  int get_numa_node(int *node) const override;
+
+  int read(uint64_t off, uint64_t len, bufferlist *pbl,
+	   IOContext *ioc,
+	   bool buffered) override;
+  int aio_read(uint64_t off, uint64_t len, bufferlist *pbl,
+	       IOContext *ioc) override;
+  int read_random(uint64_t off, uint64_t len, char *buf,
+		  bool buffered) override;
+
+  int write(uint64_t off, bufferlist& bl, bool buffered,
+	    int write_hint = WRITE_LIFE_NOT_SET) override;
+  int aio_write(uint64_t off, bufferlist& bl,
+		IOContext *ioc,
+		bool buffered,
+		int write_hint = WRITE_LIFE_NOT_SET) override;
+  int flush() override;
+  int discard(uint64_t offset, uint64_t len) override;
+  int queue_discard(interval_set<uint64_t> &to_release) override;
+
+  int invalidate_cache(uint64_t off, uint64_t len) override;
+  int open(const std::string& path) override;
+  void close() override;
+};
+
+#endif
@@ -145,6 +145,13 @@ void add_devices(
 {
   map<string, int> got;
   parse_devices(cct, devs, &got, nullptr, nullptr);
+  // the main device is always the slowest one; BlueFS space there is
+  // managed by BlueStore's allocator, which we don't open here.
+  int main_id = -1;
+  for (auto& e : got) {
+    main_id = std::max(main_id, e.second);
+  }
+  static bluefs_shared_alloc_context_t shared_alloc;
   for(auto e : got) {
     char target_path[PATH_MAX] = "";
     if(!e.first.empty()) {
@@ -160,7 +167,8 @@ void add_devices(
       cout << " -> " << target_path;
     }
     cout << std::endl;
-    int r = fs->add_block_device(e.second, e.first, false);
+    int r = fs->add_block_device(e.second, e.first, false,
+				 e.second == main_id ? &shared_alloc : nullptr);
     if (r < 0) {
       cerr << "unable to open " << e.first << ": " << cpp_strerror(r) << std::endl;
       exit(EXIT_FAILURE);
@@ -226,6 +234,7 @@ int main(int argc, char **argv)
   string log_file;
   string key, value;
   vector<string> allocs_name;
+  string sharding;
   int log_level = 30;
   bool fsck_deep = false;
   po::options_description po_options("Options");
@@ -242,6 +251,7 @@ int main(int argc, char **argv)
     ("key,k", po::value<string>(&key), "label metadata key name")
     ("value,v", po::value<string>(&value), "label metadata value")
     ("allocator", po::value<vector<string>>(&allocs_name), "allocator to inspect: 'block'/'bluefs-wal'/'bluefs-db'/'bluefs-slow'")
+    ("sharding", po::value<string>(&sharding), "new rocksdb column family sharding for reshard, e.g. 'M(3,0-8) P O(3,0-13) L'")
     ;
   po::options_description po_positional("Positional options");
   po_positional.add_options()
@@ -261,7 +271,8 @@ int main(int argc, char **argv)
         "prime-osd-dir, "
         "bluefs-log-dump, "
         "free-dump, "
-        "free-score")
+        "free-score, "
+        "reshard")
     ;
   po::options_description po_all("All options");
   po_all.add(po_options).add(po_positional);
@@ -376,6 +387,16 @@ int main(int argc, char **argv)
       exit(EXIT_FAILURE);
     }
   }
+  if (action == "reshard") {
+    if (path.empty()) {
+      cerr << "must specify bluestore path" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (!vm.count("sharding")) {
+      cerr << "must specify --sharding" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
   if (action == "free-score" || action == "free-dump") {
     if (path.empty()) {
       cerr << "must specify bluestore path" << std::endl;
@@ -858,6 +879,15 @@ int main(int argc, char **argv)
     }
 
     bluestore.cold_close();
+  } else if (action == "reshard") {
+    validate_path(cct.get(), path, false);
+    BlueStore bluestore(cct.get(), path);
+    int r = bluestore.reshard(sharding, cout);
+    if (r < 0) {
+      cerr << "failed to reshard: " << cpp_strerror(r) << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    cout << "reshard success" << std::endl;
   } else {
     cerr << "unrecognized action " << action << std::endl;
     return 1;
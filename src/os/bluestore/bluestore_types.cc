@@ -857,6 +857,20 @@ void bluestore_blob_t::allocated(uint32_t b_off, uint32_t length, const PExtentV
       start_it->length = tail;
     } 
   }
+
+  // merge with physically adjacent neighbours, e.g. when a sequential
+  // write was allocated right behind the previous one
+  if (extents.size() > 1) {
+    auto p = extents.begin();
+    for (auto q = std::next(p); q != extents.end(); ++q) {
+      if (p->is_valid() && q->is_valid() && p->end() == q->offset) {
+	p->length += q->length;
+      } else {
+	*(++p) = *q;
+      }
+    }
+    extents.erase(++p, extents.end());
+  }
 }
 
 // cut it out of extents
@@ -7,16 +7,22 @@
 
 #include "liburing.h"
 #include <sys/epoll.h>
+#include <atomic>
+#include <time.h>
 
-/* Options */
-
-static bool hipri = false;      /* use IO polling */
-static bool sq_thread = false;  /* use kernel submission/poller thread */
+#include "common/ceph_time.h"
 
 struct ioring_data {
   struct io_uring io_uring;
   pthread_mutex_t cq_mutex;
   pthread_mutex_t sq_mutex;
+  /* IOPOLL only: signalled under sq_mutex when ios are submitted, so
+   * that an idle reaper can sleep instead of polling an empty ring */
+  pthread_cond_t submit_cond;
+  std::atomic<int> inflight = {0};
+  /* the kernel drops completions that do not fit the CQ ring (or fails
+   * submissions with -EBUSY), so never have more ios in flight */
+  int max_inflight = 0;
   int epoll_fd = -1;
   std::map<int, int> fixed_fds_map;
 };
@@ -39,6 +45,7 @@ static int ioring_get_cqe(struct ioring_data *d, unsigned int max,
       break;
   }
   io_uring_cq_advance(ring, nr);
+  d->inflight -= nr;
 
   return nr;
 }
@@ -73,30 +80,59 @@ static void init_sqe(struct ioring_data *d, struct io_uring_sqe *sqe,
 }
 
 static int ioring_queue(struct ioring_data *d, void *priv,
-			list<aio_t>::iterator beg, list<aio_t>::iterator end)
+			list<aio_t>::iterator beg, list<aio_t>::iterator end,
+			bool hipri, int *retries)
 {
   struct io_uring *ring = &d->io_uring;
-  struct aio_t *io = nullptr;
+  int queued = 0;
+  /* same backoff as aio_queue_t: ~16 seconds at most */
+  int attempts = 16;
+  int delay = 125;
+  int r;
 
   ceph_assert(beg != end);
 
-  do {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
-    if (!sqe)
+  pthread_mutex_lock(&d->sq_mutex);
+  while (true) {
+    while (beg != end && d->inflight < d->max_inflight) {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+      if (!sqe)
+	break;
+
+      struct aio_t *io = &*beg;
+      io->priv = priv;
+
+      init_sqe(d, sqe, io);
+      /* counted before the submit, which may complete it right away */
+      ++d->inflight;
+      ++queued;
+      ++beg;
+    }
+
+    r = io_uring_submit(ring);
+    if (hipri)
+      pthread_cond_signal(&d->submit_cond);
+    if (r < 0 && r != -EAGAIN && r != -EBUSY)
+      break;
+    if (r >= 0 && beg == end)
       break;
 
-    io = &*beg;
-    io->priv = priv;
-
-    init_sqe(d, sqe, io);
-
-  } while (++beg != end);
-
-  if (!io)
-    /* Queue is full, go and reap something first */
-    return 0;
+    /* SQ or CQ ring full, or the kernel is short of resources: give the
+     * reaper (and the SQ poller) a chance to catch up.  Whatever is
+     * already in the SQ ring goes with the next submit. */
+    if (attempts-- <= 0) {
+      r = -EAGAIN;
+      break;
+    }
+    pthread_mutex_unlock(&d->sq_mutex);
+    usleep(delay);
+    delay *= 2;
+    (*retries)++;
+    pthread_mutex_lock(&d->sq_mutex);
+  }
+  pthread_mutex_unlock(&d->sq_mutex);
 
-  return io_uring_submit(ring);
+  return r < 0 ? r : queued;
 }
 
 static void build_fixed_fds_map(struct ioring_data *d,
@@ -108,9 +144,12 @@ static void build_fixed_fds_map(struct ioring_data *d,
   }
 }
 
-ioring_queue_t::ioring_queue_t(unsigned iodepth_) :
+ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_,
+			       bool sq_thread_) :
   d(make_unique<ioring_data>()),
-  iodepth(iodepth_)
+  iodepth(iodepth_),
+  hipri(hipri_),
+  sq_thread(sq_thread_)
 {
 }
 
@@ -124,6 +163,11 @@ int ioring_queue_t::init(std::vector<int> &fds)
 
   pthread_mutex_init(&d->cq_mutex, NULL);
   pthread_mutex_init(&d->sq_mutex, NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&d->submit_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
 
   if (hipri)
     flags |= IORING_SETUP_IOPOLL;
@@ -143,6 +187,12 @@ int ioring_queue_t::init(std::vector<int> &fds)
 
   build_fixed_fds_map(d.get(), fds);
 
+  d->max_inflight = *d->io_uring.cq.kring_entries;
+
+  if (hipri)
+    /* polled completions never wake up epoll, see get_next_completed() */
+    return 0;
+
   d->epoll_fd = epoll_create1(0);
   if (d->epoll_fd < 0) {
     ret = -errno;
@@ -170,7 +220,8 @@ close_ring_fd:
 void ioring_queue_t::shutdown()
 {
   d->fixed_fds_map.clear();
-  close(d->epoll_fd);
+  if (d->epoll_fd >= 0)
+    close(d->epoll_fd);
   d->epoll_fd = -1;
   io_uring_queue_exit(&d->io_uring);
 }
@@ -180,17 +231,51 @@ int ioring_queue_t::submit_batch(aio_iter beg, aio_iter end,
                                  int *retries)
 {
   (void)aios_size;
-  (void)retries;
 
-  pthread_mutex_lock(&d->sq_mutex);
-  int rc = ioring_queue(d.get(), priv, beg, end);
-  pthread_mutex_unlock(&d->sq_mutex);
-
-  return rc;
+  return ioring_queue(d.get(), priv, beg, end, hipri, retries);
 }
 
 int ioring_queue_t::get_next_completed(int timeout_ms, aio_t **paio, int max)
 {
+  if (hipri) {
+    /* IOPOLL rings only post completions when we poll for them, but
+     * there is nothing to poll for until something is submitted */
+    if (d->inflight <= 0) {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      ts.tv_sec += timeout_ms / 1000;
+      ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+	++ts.tv_sec;
+	ts.tv_nsec -= 1000000000;
+      }
+      pthread_mutex_lock(&d->sq_mutex);
+      while (d->inflight <= 0 &&
+	     pthread_cond_timedwait(&d->submit_cond, &d->sq_mutex, &ts) == 0)
+	;
+      pthread_mutex_unlock(&d->sq_mutex);
+      if (d->inflight <= 0)
+	return 0;
+    }
+
+    auto deadline = ceph::mono_clock::now() +
+      std::chrono::milliseconds(timeout_ms);
+    int events;
+    do {
+      if (io_uring_enter(d->io_uring.ring_fd, 0, 0,
+			 IORING_ENTER_GETEVENTS, NULL) < 0 &&
+	  errno != EINTR && errno != EAGAIN)
+	return -errno;
+
+      pthread_mutex_lock(&d->cq_mutex);
+      events = ioring_get_cqe(d.get(), max, paio);
+      pthread_mutex_unlock(&d->cq_mutex);
+    } while (events == 0 && d->inflight > 0 &&
+	     ceph::mono_clock::now() < deadline);
+
+    return events;
+  }
+
 get_cqe:
   pthread_mutex_lock(&d->cq_mutex);
   int events = ioring_get_cqe(d.get(), max, paio);
@@ -227,7 +312,8 @@ bool ioring_queue_t::supported()
 
 struct ioring_data {};
 
-ioring_queue_t::ioring_queue_t(unsigned iodepth_)
+ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_,
+			       bool sq_thread_)
 {
   ceph_assert(0);
 }
@@ -2209,6 +2209,7 @@ OSD::OSD(CephContext *cct_, ObjectStore *store_,
                                            cct->_conf->osd_op_history_duration);
   op_tracker.set_history_slow_op_size_and_threshold(cct->_conf->osd_op_history_slow_op_size,
                                                     cct->_conf->osd_op_history_slow_op_threshold);
+  op_tracker.set_history_sample_rate(cct->_conf->osd_op_history_sample_rate);
   ObjectCleanRegions::set_max_num_intervals(cct->_conf->osd_object_clean_region_max_num_intervals);
 #ifdef WITH_BLKIN
   std::stringstream ss;
@@ -2349,6 +2350,25 @@ int OSD::set_numa_affinity()
   } else {
     dout(1) << __func__ << " not setting numa affinity" << dendl;
   }
+  if (numa_node < 0 && store_node >= 0 && !shard_numa_affinity &&
+      g_conf().get_val<bool>("osd_numa_shard_affinity")) {
+    // keep at least the op path next to the storage; the op shard threads
+    // pick this up on their next pass through _process
+    int r = get_numa_node_cpu_set(store_node, &shard_numa_cpu_set_size,
+				  &shard_numa_cpu_set);
+    if (r < 0) {
+      dout(1) << __func__ << " unable to determine numa node " << store_node
+	      << " CPUs" << dendl;
+    } else {
+      dout(1) << __func__ << " setting op shard numa affinity to node "
+	      << store_node << " cpus "
+	      << cpu_set_to_str_list(shard_numa_cpu_set_size,
+				     &shard_numa_cpu_set)
+	      << dendl;
+      shard_numa_node = store_node;
+      shard_numa_affinity = true;
+    }
+  }
   return 0;
 }
 
@@ -2462,6 +2482,16 @@ void OSD::asok_command(
     f->dump_unsigned("oldest_map", superblock.oldest_map);
     f->dump_unsigned("newest_map", superblock.newest_map);
     f->dump_unsigned("num_pgs", num_pgs);
+    map<coll_t,uint64_t> removals;
+    store->get_collection_removals(&removals);
+    f->open_array_section("collection_removals");
+    for (auto& p : removals) {
+      f->open_object_section("removal");
+      f->dump_stream("cid") << p.first;
+      f->dump_unsigned("objects_removed", p.second);
+      f->close_section();
+    }
+    f->close_section();
     f->close_section();
   } else if (prefix == "flush_journal") {
     store->flush_journal();
@@ -5236,6 +5266,17 @@ void OSD::handle_osd_ping(MOSDPing *m)
 
   int from = m->get_source().num();
 
+  // stamp the message before we wait for heartbeat_lock, so that the ping
+  // times we record are those of the network and not of our own lock
+  utime_t now = ceph_clock_now();
+  auto mnow = service.get_mnow();
+
+  if (m->op == MOSDPing::PING) {
+    handle_osd_ping_request(m, from, mnow);
+    m->put();
+    return;
+  }
+
   heartbeat_lock.lock();
   if (is_stopping()) {
     heartbeat_lock.unlock();
@@ -5243,8 +5284,6 @@ void OSD::handle_osd_ping(MOSDPing *m)
     return;
   }
 
-  utime_t now = ceph_clock_now();
-  auto mnow = service.get_mnow();
   ConnectionRef con(m->get_connection());
   OSDMapRef curmap = service.get_osdmap();
   if (!curmap) {
@@ -5267,82 +5306,6 @@ void OSD::handle_osd_ping(MOSDPing *m)
 
   switch (m->op) {
 
-  case MOSDPing::PING:
-    {
-      if (cct->_conf->osd_debug_drop_ping_probability > 0) {
-	auto heartbeat_drop = debug_heartbeat_drops_remaining.find(from);
-	if (heartbeat_drop != debug_heartbeat_drops_remaining.end()) {
-	  if (heartbeat_drop->second == 0) {
-	    debug_heartbeat_drops_remaining.erase(heartbeat_drop);
-	  } else {
-	    --heartbeat_drop->second;
-	    dout(5) << "Dropping heartbeat from " << from
-		    << ", " << heartbeat_drop->second
-		    << " remaining to drop" << dendl;
-	    break;
-	  }
-	} else if (cct->_conf->osd_debug_drop_ping_probability >
-	           ((((double)(rand()%100))/100.0))) {
-	  heartbeat_drop =
-	    debug_heartbeat_drops_remaining.insert(std::make_pair(from,
-	                     cct->_conf->osd_debug_drop_ping_duration)).first;
-	  dout(5) << "Dropping heartbeat from " << from
-		  << ", " << heartbeat_drop->second
-		  << " remaining to drop" << dendl;
-	  break;
-	}
-      }
-
-      ceph::signedspan sender_delta_ub{};
-      s->stamps->got_ping(
-	m->up_from,
-	mnow,
-	m->mono_send_stamp,
-	m->delta_ub,
-	&sender_delta_ub);
-      dout(20) << __func__ << " new stamps " << *s->stamps << dendl;
-
-      if (!cct->get_heartbeat_map()->is_healthy()) {
-	dout(10) << "internal heartbeat not healthy, dropping ping request"
-		 << dendl;
-	break;
-      }
-
-      Message *r = new MOSDPing(monc->get_fsid(),
-				curmap->get_epoch(),
-				MOSDPing::PING_REPLY,
-				m->ping_stamp,
-				m->mono_ping_stamp,
-				mnow,
-				service.get_up_epoch(),
-				cct->_conf->osd_heartbeat_min_size,
-				sender_delta_ub);
-      con->send_message(r);
-
-      if (curmap->is_up(from)) {
-	if (is_active()) {
-	  ConnectionRef cluster_con = service.get_con_osd_cluster(
-	    from, curmap->get_epoch());
-	  if (cluster_con) {
-	    service.maybe_share_map(cluster_con.get(), curmap, m->map_epoch);
-	  }
-	}
-      } else if (!curmap->exists(from) ||
-		 curmap->get_down_at(from) > m->map_epoch) {
-	// tell them they have died
-	Message *r = new MOSDPing(monc->get_fsid(),
-				  curmap->get_epoch(),
-				  MOSDPing::YOU_DIED,
-				  m->ping_stamp,
-				  m->mono_ping_stamp,
-				  mnow,
-				  service.get_up_epoch(),
-				  cct->_conf->osd_heartbeat_min_size);
-	con->send_message(r);
-      }
-    }
-    break;
-
   case MOSDPing::PING_REPLY:
     {
       map<int,HeartbeatInfo>::iterator i = heartbeat_peers.find(from);
@@ -5390,12 +5353,18 @@ void OSD::handle_osd_ping(MOSDPing *m)
 #define ROUND_S_TO_USEC(sec) (uint32_t)((sec) * 1000 * 1000 + 0.5)
 	    ++i->second.hb_average_count;
 	    uint32_t back_pingtime = ROUND_S_TO_USEC(i->second.last_rx_back - m->ping_stamp);
+	    logger->tinc(l_osd_hb_ping_back_lat,
+			 i->second.last_rx_back - m->ping_stamp);
 	    i->second.hb_total_back += back_pingtime;
 	    if (back_pingtime < i->second.hb_min_back)
 	      i->second.hb_min_back = back_pingtime;
 	    if (back_pingtime > i->second.hb_max_back)
 	      i->second.hb_max_back = back_pingtime;
 	    uint32_t front_pingtime = ROUND_S_TO_USEC(i->second.last_rx_front - m->ping_stamp);
+	    if (i->second.con_front) {
+	      logger->tinc(l_osd_hb_ping_front_lat,
+			   i->second.last_rx_front - m->ping_stamp);
+	    }
 	    i->second.hb_total_front += front_pingtime;
 	    if (front_pingtime < i->second.hb_min_front)
 	      i->second.hb_min_front = front_pingtime;
@@ -5572,6 +5541,106 @@ void OSD::handle_osd_ping(MOSDPing *m)
   m->put();
 }
 
+/*
+ * Pings are answered without heartbeat_lock, which heartbeat() and
+ * heartbeat_check() hold while they walk all peers: the sender times our
+ * reply, and it should not include that wait.
+ */
+void OSD::handle_osd_ping_request(MOSDPing *m, int from,
+				  ceph::signedspan mnow)
+{
+  if (is_stopping()) {
+    return;
+  }
+  ConnectionRef con(m->get_connection());
+  OSDMapRef curmap = service.get_osdmap();
+  if (!curmap) {
+    return;
+  }
+  auto sref = con->get_priv();
+  Session *s = static_cast<Session*>(sref.get());
+  if (!s) {
+    return;
+  }
+  if (!s->stamps) {
+    s->peer = from;
+    s->stamps = service.get_hb_stamps(from);
+  }
+
+  if (cct->_conf->osd_debug_drop_ping_probability > 0) {
+    std::lock_guard l(heartbeat_lock);
+    auto heartbeat_drop = debug_heartbeat_drops_remaining.find(from);
+    if (heartbeat_drop != debug_heartbeat_drops_remaining.end()) {
+      if (heartbeat_drop->second == 0) {
+	debug_heartbeat_drops_remaining.erase(heartbeat_drop);
+      } else {
+	--heartbeat_drop->second;
+	dout(5) << "Dropping heartbeat from " << from
+		<< ", " << heartbeat_drop->second
+		<< " remaining to drop" << dendl;
+	return;
+      }
+    } else if (cct->_conf->osd_debug_drop_ping_probability >
+	       ((((double)(rand()%100))/100.0))) {
+      heartbeat_drop =
+	debug_heartbeat_drops_remaining.insert(std::make_pair(from,
+			 cct->_conf->osd_debug_drop_ping_duration)).first;
+      dout(5) << "Dropping heartbeat from " << from
+	      << ", " << heartbeat_drop->second
+	      << " remaining to drop" << dendl;
+      return;
+    }
+  }
+
+  ceph::signedspan sender_delta_ub{};
+  s->stamps->got_ping(
+    m->up_from,
+    mnow,
+    m->mono_send_stamp,
+    m->delta_ub,
+    &sender_delta_ub);
+  dout(20) << __func__ << " new stamps " << *s->stamps << dendl;
+
+  if (!cct->get_heartbeat_map()->is_healthy()) {
+    dout(10) << "internal heartbeat not healthy, dropping ping request"
+	     << dendl;
+    return;
+  }
+
+  Message *r = new MOSDPing(monc->get_fsid(),
+			    curmap->get_epoch(),
+			    MOSDPing::PING_REPLY,
+			    m->ping_stamp,
+			    m->mono_ping_stamp,
+			    mnow,
+			    service.get_up_epoch(),
+			    cct->_conf->osd_heartbeat_min_size,
+			    sender_delta_ub);
+  con->send_message(r);
+
+  if (curmap->is_up(from)) {
+    if (is_active()) {
+      ConnectionRef cluster_con = service.get_con_osd_cluster(
+	from, curmap->get_epoch());
+      if (cluster_con) {
+	service.maybe_share_map(cluster_con.get(), curmap, m->map_epoch);
+      }
+    }
+  } else if (!curmap->exists(from) ||
+	     curmap->get_down_at(from) > m->map_epoch) {
+    // tell them they have died
+    Message *r = new MOSDPing(monc->get_fsid(),
+			      curmap->get_epoch(),
+			      MOSDPing::YOU_DIED,
+			      m->ping_stamp,
+			      m->mono_ping_stamp,
+			      mnow,
+			      service.get_up_epoch(),
+			      cct->_conf->osd_heartbeat_min_size);
+    con->send_message(r);
+  }
+}
+
 void OSD::heartbeat_entry()
 {
   std::unique_lock l(heartbeat_lock);
@@ -5580,6 +5649,15 @@ void OSD::heartbeat_entry()
   while (!heartbeat_stop) {
     heartbeat();
 
+    // statfs may queue behind client io in the store; refresh the stats
+    // without heartbeat_lock so that neither our next pings nor the
+    // replies to these wait for it
+    l.unlock();
+    heartbeat_update_stats();
+    l.lock();
+    if (heartbeat_stop)
+      break;
+
     double wait;
     if (cct->_conf.get_val<bool>("debug_disable_randomized_ping")) {
       wait = (float)cct->_conf->osd_heartbeat_interval;
@@ -5644,35 +5722,19 @@ void OSD::heartbeat_check()
   }
 }
 
-void OSD::heartbeat()
+void OSD::heartbeat_update_stats()
 {
-  ceph_assert(ceph_mutex_is_locked_by_me(heartbeat_lock));
-  dout(30) << "heartbeat" << dendl;
-
-  // get CPU load avg
-  double loadavgs[1];
-  int hb_interval = cct->_conf->osd_heartbeat_interval;
-  int n_samples = 86400;
-  if (hb_interval > 1) {
-    n_samples /= hb_interval;
-    if (n_samples < 1)
-      n_samples = 1;
-  }
-
-  if (getloadavg(loadavgs, 1) == 1) {
-    logger->set(l_osd_loadavg, 100 * loadavgs[0]);
-    daily_loadavg = (daily_loadavg * (n_samples - 1) + loadavgs[0]) / n_samples;
-    dout(30) << "heartbeat: daily_loadavg " << daily_loadavg << dendl;
-  }
-
   dout(30) << "heartbeat checking stats" << dendl;
 
   // refresh peer list and osd stats
   vector<int> hb_peers;
-  for (map<int,HeartbeatInfo>::iterator p = heartbeat_peers.begin();
-       p != heartbeat_peers.end();
-       ++p)
-    hb_peers.push_back(p->first);
+  {
+    std::lock_guard l(heartbeat_lock);
+    for (map<int,HeartbeatInfo>::iterator p = heartbeat_peers.begin();
+	 p != heartbeat_peers.end();
+	 ++p)
+      hb_peers.push_back(p->first);
+  }
 
   auto new_stat = service.set_osd_stat(hb_peers, get_num_pgs());
   dout(5) << __func__ << " " << new_stat << dendl;
@@ -5682,6 +5744,12 @@ void OSD::heartbeat()
   float ratio = service.compute_adjusted_ratio(new_stat, &pratio);
 
   service.check_full_status(ratio, pratio);
+}
+
+void OSD::heartbeat()
+{
+  ceph_assert(ceph_mutex_is_locked_by_me(heartbeat_lock));
+  dout(30) << "heartbeat" << dendl;
 
   utime_t now = ceph_clock_now();
   auto mnow = service.get_mnow();
@@ -5733,6 +5801,22 @@ void OSD::heartbeat()
 
   logger->set(l_osd_hb_to, heartbeat_peers.size());
 
+  // get CPU load avg
+  double loadavgs[1];
+  int hb_interval = cct->_conf->osd_heartbeat_interval;
+  int n_samples = 86400;
+  if (hb_interval > 1) {
+    n_samples /= hb_interval;
+    if (n_samples < 1)
+      n_samples = 1;
+  }
+
+  if (getloadavg(loadavgs, 1) == 1) {
+    logger->set(l_osd_loadavg, 100 * loadavgs[0]);
+    daily_loadavg = (daily_loadavg * (n_samples - 1) + loadavgs[0]) / n_samples;
+    dout(30) << "heartbeat: daily_loadavg " << daily_loadavg << dendl;
+  }
+
   // hmm.. am i all alone?
   dout(30) << "heartbeat lonely?" << dendl;
   if (heartbeat_peers.empty()) {
@@ -6271,10 +6355,7 @@ void OSD::_preboot(epoch_t oldest, epoch_t newest)
 	   << oldest << ".." << newest << dendl;
 
   // ensure our local fullness awareness is accurate
-  {
-    std::lock_guard l(heartbeat_lock);
-    heartbeat();
-  }
+  heartbeat_update_stats();
 
   const auto& monmap = monc->monmap;
 
@@ -6569,6 +6650,10 @@ void OSD::_collect_metadata(map<string,string> *pm)
     (*pm)["numa_node"] = stringify(numa_node);
     (*pm)["numa_node_cpus"] = cpu_set_to_str_list(numa_cpu_set_size,
 						  &numa_cpu_set);
+  } else if (shard_numa_affinity) {
+    (*pm)["shard_numa_node"] = stringify(shard_numa_node);
+    (*pm)["shard_numa_node_cpus"] = cpu_set_to_str_list(
+      shard_numa_cpu_set_size, &shard_numa_cpu_set);
   }
 
   set<string> devnames;
@@ -7080,7 +7165,8 @@ void OSD::ms_fast_dispatch(Message *m)
     enqueue_op(
       static_cast<MOSDFastDispatchOp*>(m)->get_spg(),
       std::move(op),
-      static_cast<MOSDFastDispatchOp*>(m)->get_map_epoch());
+      static_cast<MOSDFastDispatchOp*>(m)->get_map_epoch(),
+      true);
   } else {
     // legacy client, and this is an MOSDOp (the *only* fast dispatch
     // message that didn't have an explicit spg_t); we need to map
@@ -9548,7 +9634,8 @@ bool OSD::op_is_discardable(const MOSDOp *op)
   return false;
 }
 
-void OSD::enqueue_op(spg_t pg, OpRequestRef&& op, epoch_t epoch)
+void OSD::enqueue_op(spg_t pg, OpRequestRef&& op, epoch_t epoch,
+		     bool may_run_inline)
 {
   const utime_t stamp = op->get_req()->get_recv_stamp();
   const utime_t latency = ceph_clock_now() - stamp;
@@ -9566,12 +9653,69 @@ void OSD::enqueue_op(spg_t pg, OpRequestRef&& op, epoch_t epoch)
   op->osd_trace.keyval("cost", cost);
   op->mark_queued_for_pg();
   logger->tinc(l_osd_op_before_queue_op_lat, latency);
+  if (may_run_inline &&
+      cct->_conf->osd_op_run_inline &&
+      op->get_req()->get_type() == CEPH_MSG_OSD_OP &&
+      (uint64_t)cost <= cct->_conf->osd_op_inline_max_cost) {
+    if (try_run_op_inline(pg, op, epoch)) {
+      logger->inc(l_osd_op_inline);
+      return;
+    }
+    logger->inc(l_osd_op_inline_missed);
+  }
   op_shardedwq.queue(
     OpSchedulerItem(
       unique_ptr<OpSchedulerItem::OpQueueable>(new PGOpItem(pg, std::move(op))),
       cost, priority, stamp, owner, epoch));
 }
 
+/*
+ * Run a client op on the calling (messenger) thread instead of queueing
+ * it, if that can't reorder it: nothing may be queued on its shard or be
+ * waiting in its pg slot, and no worker may be about to take, or be
+ * holding, the pg lock.  Ops for the pg that were dequeued earlier have
+ * either finished or still hold the pg lock, so a successful try_lock
+ * puts us after all of them.
+ */
+bool OSD::try_run_op_inline(spg_t pgid, OpRequestRef& op, epoch_t epoch)
+{
+  OSDShard *sdata = shards[pgid.hash_to_shard(shards.size())];
+  PGRef pg;
+  {
+    std::lock_guard l{sdata->shard_lock};
+    if (is_stopping() ||
+	!sdata->scheduler->empty() ||
+	epoch > sdata->shard_osdmap->get_epoch()) {
+      return false;
+    }
+    auto p = sdata->pg_slots.find(pgid);
+    if (p == sdata->pg_slots.end()) {
+      return false;
+    }
+    OSDShardPGSlot *slot = p->second.get();
+    if (!slot->pg ||
+	slot->num_running ||
+	!slot->to_process.empty() ||
+	!slot->waiting.empty() ||
+	!slot->waiting_peering.empty() ||
+	!slot->waiting_for_split.empty() ||
+	slot->waiting_for_merge_epoch) {
+      return false;
+    }
+    // lock order is pg lock, then shard lock; only try
+    if (!slot->pg->try_lock()) {
+      return false;
+    }
+    pg = slot->pg;
+  }
+  dout(20) << __func__ << " " << pgid << " " << op << dendl;
+  // messenger threads have no heartbeat handle to reset
+  ThreadPool::TPHandle handle(cct, nullptr, 0, 0);
+  dequeue_op(pg, op, handle);
+  pg->unlock();
+  return true;
+}
+
 void OSD::enqueue_peering_evt(spg_t pgid, PGPeeringEventRef evt)
 {
   dout(15) << __func__ << " " << pgid << " " << evt->get_desc() << dendl;
@@ -9695,6 +9839,7 @@ const char** OSD::get_tracked_conf_keys() const
     "osd_op_history_duration",
     "osd_op_history_slow_op_size",
     "osd_op_history_slow_op_threshold",
+    "osd_op_history_sample_rate",
     "osd_enable_op_tracker",
     "osd_map_cache_size",
     "osd_pg_epoch_max_lag_factor",
@@ -9753,6 +9898,9 @@ void OSD::handle_conf_change(const ConfigProxy& conf,
     op_tracker.set_history_slow_op_size_and_threshold(cct->_conf->osd_op_history_slow_op_size,
                                                       cct->_conf->osd_op_history_slow_op_threshold);
   }
+  if (changed.count("osd_op_history_sample_rate")) {
+    op_tracker.set_history_sample_rate(cct->_conf->osd_op_history_sample_rate);
+  }
   if (changed.count("osd_enable_op_tracker")) {
       op_tracker.set_tracking(cct->_conf->osd_enable_op_tracker);
   }
@@ -10373,6 +10521,19 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
   auto& sdata = osd->shards[shard_index];
   ceph_assert(sdata);
 
+  if (osd->shard_numa_affinity) {
+    static thread_local bool numa_bound = false;
+    if (!numa_bound) {
+      numa_bound = true;
+      int r = set_cpu_affinity_this_thread(osd->shard_numa_cpu_set_size,
+					   &osd->shard_numa_cpu_set);
+      if (r < 0) {
+	derr << __func__ << " failed to set numa affinity: "
+	     << cpp_strerror(r) << dendl;
+      }
+    }
+  }
+
   // If all threads of shards do oncommits, there is a out-of-order
   // problem.  So we choose the thread which has the smallest
   // thread_index(thread_index < num_shards) of shard to do oncommit
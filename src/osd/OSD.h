@@ -1125,6 +1125,12 @@ protected:
   size_t numa_cpu_set_size = 0;
   cpu_set_t numa_cpu_set;
 
+  // op shard threads bind themselves to this set (osd_numa_shard_affinity)
+  std::atomic<bool> shard_numa_affinity = {false};
+  int shard_numa_node = -1;
+  size_t shard_numa_cpu_set_size = 0;
+  cpu_set_t shard_numa_cpu_set;
+
   bool store_is_rotational = true;
   bool journal_is_rotational = true;
 
@@ -1484,6 +1490,7 @@ private:
     heartbeat_need_update.store(false);
   }
   void heartbeat();
+  void heartbeat_update_stats();
   void heartbeat_check();
   void heartbeat_entry();
   void need_heartbeat_peer_update();
@@ -1664,7 +1671,9 @@ protected:
   } op_shardedwq;
 
 
-  void enqueue_op(spg_t pg, OpRequestRef&& op, epoch_t epoch);
+  void enqueue_op(spg_t pg, OpRequestRef&& op, epoch_t epoch,
+		  bool may_run_inline = false);
+  bool try_run_op_inline(spg_t pgid, OpRequestRef& op, epoch_t epoch);
   void dequeue_op(
     PGRef pg, OpRequestRef op,
     ThreadPool::TPHandle &handle);
@@ -2038,6 +2047,8 @@ private:
   void handle_scrub(struct MOSDScrub *m);
   void handle_fast_scrub(struct MOSDScrub2 *m);
   void handle_osd_ping(class MOSDPing *m);
+  void handle_osd_ping_request(class MOSDPing *m, int from,
+			       ceph::signedspan mnow);
 
   size_t get_num_cache_shards();
   int get_num_op_shards();
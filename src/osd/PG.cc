@@ -241,6 +241,19 @@ void PG::lock(bool no_lockdep) const
   dout(30) << "lock" << dendl;
 }
 
+bool PG::try_lock() const
+{
+  if (!_lock.try_lock()) {
+    return false;
+  }
+#ifndef CEPH_DEBUG_MUTEX
+  locked_by = std::this_thread::get_id();
+#endif
+  ceph_assert(!recovery_state.debug_has_dirty_state());
+  dout(30) << "try_lock" << dendl;
+  return true;
+}
+
 bool PG::is_locked() const
 {
   return ceph_mutex_is_locked(_lock);
@@ -1866,21 +1879,51 @@ void PG::do_replica_scrub_map(OpRequestRef op)
 
   op->mark_started();
 
+  // a map names the chunk it answers, so one for a chunk we gave up on
+  // (dropped ahead, or an aborted scrub in this interval) matches nothing.
+  // Untagged maps come from peers that only get one chunk at a time (see
+  // scrub_request_ahead), so the chunk waiting on them is the one.
+  auto answers = [m](const hobject_t& start, const hobject_t& end,
+		     const eversion_t& scrub_to) {
+    return !m->has_range ||
+      (m->start == start && m->end == end && m->scrub_to == scrub_to);
+  };
+  set<pg_shard_t> *waiting_on_whom = &scrubber.waiting_on_whom;
+  ScrubMap *map = nullptr;
+  if (waiting_on_whom->count(m->from) &&
+      answers(scrubber.start, scrubber.end, scrubber.subset_last_update)) {
+    map = &scrubber.received_maps[m->from];
+  } else {
+    for (auto& c : scrubber.ahead) {
+      if (c.waiting_on_whom.count(m->from) &&
+	  answers(c.start, c.end, c.subset_last_update)) {
+	dout(10) << __func__ << " map for chunk ahead [" << c.start << ","
+		 << c.end << ")" << dendl;
+	waiting_on_whom = &c.waiting_on_whom;
+	map = &c.received_maps[m->from];
+	break;
+      }
+    }
+  }
+  if (!map) {
+    dout(10) << __func__ << " discarding map for a chunk we aren't waiting on"
+	     << dendl;
+    return;
+  }
+
   auto p = const_cast<bufferlist&>(m->get_data()).cbegin();
-  scrubber.received_maps[m->from].decode(p, info.pgid.pool());
-  dout(10) << "map version is "
-	   << scrubber.received_maps[m->from].valid_through
-	   << dendl;
+  map->decode(p, info.pgid.pool());
+  dout(10) << "map version is " << map->valid_through << dendl;
 
-  dout(10) << __func__ << " waiting_on_whom was " << scrubber.waiting_on_whom
+  dout(10) << __func__ << " waiting_on_whom was " << *waiting_on_whom
 	   << dendl;
-  ceph_assert(scrubber.waiting_on_whom.count(m->from));
-  scrubber.waiting_on_whom.erase(m->from);
+  waiting_on_whom->erase(m->from);
   if (m->preempted) {
     dout(10) << __func__ << " replica was preempted, setting flag" << dendl;
     scrub_preempted = true;
   }
-  if (scrubber.waiting_on_whom.empty()) {
+  if (waiting_on_whom == &scrubber.waiting_on_whom &&
+      scrubber.waiting_on_whom.empty()) {
     requeue_scrub(ops_blocked_by_scrub());
   }
 }
@@ -1909,6 +1952,156 @@ void PG::_request_scrub_map(
     replica.osd, repscrubop, get_osdmap_epoch());
 }
 
+bool PG::scrub_chunk_range(
+  const hobject_t& start,
+  hobject_t *end,
+  eversion_t *subset_last_update)
+{
+  /* get the end of our scrub chunk
+   *
+   * Our scrub chunk has an important restriction we're going to need to
+   * respect. We can't let head be start or end.
+   * Using a half-open interval means that if end == head,
+   * we'd scrub/lock head and the clone right next to head in different
+   * chunks which would allow us to miss clones created between
+   * scrubbing that chunk and scrubbing the chunk including head.
+   * This isn't true for any of the other clones since clones can
+   * only be created "just to the left of" head.  There is one exception
+   * to this: promotion of clones which always happens to the left of the
+   * left-most clone, but promote_object checks the scrubber in that
+   * case, so it should be ok.  Also, it's ok to "miss" clones at the
+   * left end of the range if we are a tier because they may legitimately
+   * not exist (see _scrub).
+   */
+  int min = std::max<int64_t>(3, cct->_conf->osd_scrub_chunk_min /
+			      scrubber.preempt_divisor);
+  int max = std::max<int64_t>(min, cct->_conf->osd_scrub_chunk_max /
+			      scrubber.preempt_divisor);
+  hobject_t candidate_end;
+  vector<hobject_t> objects;
+  int ret = get_pgbackend()->objects_list_partial(
+    start,
+    min,
+    max,
+    &objects,
+    &candidate_end);
+  ceph_assert(ret >= 0);
+
+  if (!objects.empty()) {
+    hobject_t back = objects.back();
+    while (candidate_end.is_head() &&
+	   candidate_end == back.get_head()) {
+      candidate_end = back;
+      objects.pop_back();
+      if (objects.empty()) {
+	ceph_assert(0 ==
+	       "Somehow we got more than 2 objects which"
+	       "have the same head but are not clones");
+      }
+      back = objects.back();
+    }
+    if (candidate_end.is_head()) {
+      ceph_assert(candidate_end != back.get_head());
+      candidate_end = candidate_end.get_object_boundary();
+    }
+  } else {
+    ceph_assert(candidate_end.is_max());
+  }
+
+  if (!_range_available_for_scrub(start, candidate_end)) {
+    // we'll be requeued by whatever made us unavailable for scrub
+    dout(10) << __func__ << ": scrub blocked somewhere in range "
+	     << "[" << start << ", " << candidate_end << ")"
+	     << dendl;
+    return false;
+  }
+  *end = candidate_end;
+
+  // walk the log to find the latest update that affects our chunk
+  *subset_last_update = eversion_t();
+  for (auto p = projected_log.log.rbegin();
+       p != projected_log.log.rend();
+       ++p) {
+    if (p->soid >= start &&
+	p->soid < candidate_end) {
+      *subset_last_update = p->version;
+      break;
+    }
+  }
+  if (*subset_last_update == eversion_t()) {
+    for (list<pg_log_entry_t>::const_reverse_iterator p =
+	   recovery_state.get_pg_log().get_log().log.rbegin();
+	 p != recovery_state.get_pg_log().get_log().log.rend();
+	 ++p) {
+      if (p->soid >= start &&
+	  p->soid < candidate_end) {
+	*subset_last_update = p->version;
+	break;
+      }
+    }
+  }
+  return true;
+}
+
+/*
+ * Ask the replicas for the maps of the chunks after the current one, up
+ * to osd_scrub_chunk_window chunks in flight, so that they are built
+ * while we build and compare ours.  Writes to these chunks are blocked
+ * from now on, like those to the current chunk.  A chunk that isn't
+ * ready (busy objects, pushes or writes in flight) ends the lookahead;
+ * it is picked up again when it becomes the current chunk.
+ */
+void PG::scrub_request_ahead()
+{
+  uint64_t window = cct->_conf.get_val<uint64_t>("osd_scrub_chunk_window");
+  if (get_acting_recovery_backfill().size() < 2) {
+    return;
+  }
+  if (get_osdmap()->require_osd_release < ceph_release_t::octopus) {
+    // older replicas neither queue chunk requests nor name the chunk
+    // their map answers
+    window = 1;
+  }
+  while (scrubber.ahead.size() + 1 < window &&
+	 !scrubber.blocked_end().is_max() &&
+	 active_pushes == 0 &&
+	 !scrub_preempted) {
+    Scrubber::ChunkAhead c;
+    c.start = scrubber.blocked_end();
+    if (!scrub_chunk_range(c.start, &c.end, &c.subset_last_update)) {
+      break;
+    }
+    if (recovery_state.get_last_update_applied() < c.subset_last_update) {
+      dout(15) << __func__ << " writes to [" << c.start << "," << c.end
+	       << ") in flight" << dendl;
+      break;
+    }
+    for (auto& i : get_acting_recovery_backfill()) {
+      if (i == pg_whoami) continue;
+      _request_scrub_map(i, c.subset_last_update, c.start, c.end,
+			 scrubber.deep, scrubber.preempt_left > 0);
+      c.waiting_on_whom.insert(i);
+    }
+    if (c.end > scrubber.max_end) {
+      scrubber.max_end = c.end;
+    }
+    dout(10) << __func__ << " requested [" << c.start << "," << c.end
+	     << ") ahead" << dendl;
+    scrubber.ahead.push_back(std::move(c));
+    osd->logger->inc(l_osd_scrub_chunks_ahead);
+  }
+}
+
+void PG::scrub_drop_ahead()
+{
+  for (auto& c : scrubber.ahead) {
+    dout(10) << __func__ << " [" << c.start << "," << c.end << ")"
+	     << " waiting on " << c.waiting_on_whom << dendl;
+  }
+  // their maps still arrive and are discarded as they match no chunk
+  scrubber.ahead.clear();
+}
+
 void PG::handle_scrub_reserve_request(OpRequestRef op)
 {
   dout(7) << __func__ << " " << *op->get_req() << dendl;
@@ -2417,13 +2610,15 @@ void PG::repair_object(
  * Wait for last_update_applied to match msg->scrub_to as above. Wait
  * for pushes to complete in case of recent recovery. Build a single
  * scrubmap of objects that are in the range [msg->start, msg->end).
+ *
+ * A primary with osd_scrub_chunk_window > 1 asks for the following
+ * chunks before we are done with this one; they are built in order.
  */
 void PG::replica_scrub(
   OpRequestRef op,
   ThreadPool::TPHandle &handle)
 {
   auto msg = op->get_req<MOSDRepScrub>();
-  ceph_assert(!scrubber.active_rep_scrub);
   dout(7) << "replica_scrub" << dendl;
 
   if (msg->map_epoch < info.history.same_interval_since) {
@@ -2434,17 +2629,35 @@ void PG::replica_scrub(
   }
 
   ceph_assert(msg->chunky);
+  scrubber.pending_rep_scrubs.push_back(op);
+  replica_scrub_next();
+}
+
+void PG::replica_scrub_next()
+{
+  if (scrubber.state == Scrubber::BUILD_MAP_REPLICA ||
+      scrubber.pending_rep_scrubs.empty()) {
+    return;
+  }
+  OpRequestRef op = scrubber.pending_rep_scrubs.front();
   if (active_pushes > 0) {
     dout(10) << "waiting for active pushes to finish" << dendl;
     scrubber.active_rep_scrub = op;
     return;
   }
+  scrubber.active_rep_scrub.reset();
+  scrubber.pending_rep_scrubs.pop_front();
+  auto msg = op->get_req<MOSDRepScrub>();
+  dout(10) << __func__ << " [" << msg->start << "," << msg->end << ")"
+	   << ", " << scrubber.pending_rep_scrubs.size() << " more queued"
+	   << dendl;
 
   scrubber.state = Scrubber::BUILD_MAP_REPLICA;
   scrubber.replica_scrub_start = msg->min_epoch;
   scrubber.start = msg->start;
   scrubber.end = msg->end;
   scrubber.max_end = msg->end;
+  scrubber.subset_last_update = msg->scrub_to;
   scrubber.deep = msg->deep;
   scrubber.epoch_start = info.history.same_interval_since;
   if (msg->priority) {
@@ -2686,97 +2899,31 @@ void PG::chunky_scrub(ThreadPool::TPHandle &handle)
 	  dout(10) << __func__ << " preempted, " << scrubber.preempt_left
 		   << " left" << dendl;
 	  scrub_preempted = false;
+	  // their maps may predate the write that preempted us
+	  scrub_drop_ahead();
 	}
 	scrub_can_preempt = scrubber.preempt_left > 0;
 
-        {
-          /* get the start and end of our scrub chunk
-	   *
-	   * Our scrub chunk has an important restriction we're going to need to
-	   * respect. We can't let head be start or end.
-	   * Using a half-open interval means that if end == head,
-	   * we'd scrub/lock head and the clone right next to head in different
-	   * chunks which would allow us to miss clones created between
-	   * scrubbing that chunk and scrubbing the chunk including head.
-	   * This isn't true for any of the other clones since clones can
-	   * only be created "just to the left of" head.  There is one exception
-	   * to this: promotion of clones which always happens to the left of the
-	   * left-most clone, but promote_object checks the scrubber in that
-	   * case, so it should be ok.  Also, it's ok to "miss" clones at the
-	   * left end of the range if we are a tier because they may legitimately
-	   * not exist (see _scrub).
-	   */
-	  int min = std::max<int64_t>(3, cct->_conf->osd_scrub_chunk_min /
-				      scrubber.preempt_divisor);
-	  int max = std::max<int64_t>(min, cct->_conf->osd_scrub_chunk_max /
-                                      scrubber.preempt_divisor);
-          hobject_t start = scrubber.start;
+	if (!scrubber.ahead.empty()) {
+	  auto& c = scrubber.ahead.front();
+	  ceph_assert(c.start == scrubber.start);
+	  scrubber.end = c.end;
+	  scrubber.subset_last_update = c.subset_last_update;
+	  scrubber.waiting_on_whom.swap(c.waiting_on_whom);
+	  scrubber.received_maps.swap(c.received_maps);
+	  scrubber.ahead.pop_front();
+	  scrubber.chunk_requested = true;
+	} else {
 	  hobject_t candidate_end;
-	  vector<hobject_t> objects;
-	  ret = get_pgbackend()->objects_list_partial(
-	    start,
-	    min,
-	    max,
-	    &objects,
-	    &candidate_end);
-	  ceph_assert(ret >= 0);
-
-	  if (!objects.empty()) {
-	    hobject_t back = objects.back();
-	    while (candidate_end.is_head() &&
-		   candidate_end == back.get_head()) {
-	      candidate_end = back;
-	      objects.pop_back();
-	      if (objects.empty()) {
-		ceph_assert(0 ==
-		       "Somehow we got more than 2 objects which"
-		       "have the same head but are not clones");
-	      }
-	      back = objects.back();
-	    }
-	    if (candidate_end.is_head()) {
-	      ceph_assert(candidate_end != back.get_head());
-	      candidate_end = candidate_end.get_object_boundary();
-	    }
-	  } else {
-	    ceph_assert(candidate_end.is_max());
-	  }
-
-	  if (!_range_available_for_scrub(scrubber.start, candidate_end)) {
-	    // we'll be requeued by whatever made us unavailable for scrub
-	    dout(10) << __func__ << ": scrub blocked somewhere in range "
-		     << "[" << scrubber.start << ", " << candidate_end << ")"
-		     << dendl;
+	  if (!scrub_chunk_range(scrubber.start, &candidate_end,
+				 &scrubber.subset_last_update)) {
 	    done = true;
 	    break;
 	  }
 	  scrubber.end = candidate_end;
 	  if (scrubber.end > scrubber.max_end)
 	    scrubber.max_end = scrubber.end;
-        }
-
-        // walk the log to find the latest update that affects our chunk
-        scrubber.subset_last_update = eversion_t();
-	for (auto p = projected_log.log.rbegin();
-	     p != projected_log.log.rend();
-	     ++p) {
-          if (p->soid >= scrubber.start &&
-	      p->soid < scrubber.end) {
-            scrubber.subset_last_update = p->version;
-            break;
-	  }
-	}
-	if (scrubber.subset_last_update == eversion_t()) {
-	  for (list<pg_log_entry_t>::const_reverse_iterator p =
-		 recovery_state.get_pg_log().get_log().log.rbegin();
-	       p != recovery_state.get_pg_log().get_log().log.rend();
-	       ++p) {
-	    if (p->soid >= scrubber.start &&
-		p->soid < scrubber.end) {
-	      scrubber.subset_last_update = p->version;
-	      break;
-	    }
-	  }
+	  scrubber.chunk_requested = false;
 	}
 
         scrubber.state = PG::Scrubber::WAIT_PUSHES;
@@ -2803,9 +2950,10 @@ void PG::chunky_scrub(ThreadPool::TPHandle &handle)
         // ask replicas to scan
         scrubber.waiting_on_whom.insert(pg_whoami);
 
-        // request maps from replicas
+        // request maps from replicas, unless that was done ahead
 	for (set<pg_shard_t>::iterator i = get_acting_recovery_backfill().begin();
-	     i != get_acting_recovery_backfill().end();
+	     !scrubber.chunk_requested &&
+	       i != get_acting_recovery_backfill().end();
 	     ++i) {
 	  if (*i == pg_whoami) continue;
           _request_scrub_map(*i, scrubber.subset_last_update,
@@ -2815,6 +2963,7 @@ void PG::chunky_scrub(ThreadPool::TPHandle &handle)
         }
 	dout(10) << __func__ << " waiting_on_whom " << scrubber.waiting_on_whom
 		 << dendl;
+	scrub_request_ahead();
 
 	scrubber.state = PG::Scrubber::BUILD_MAP;
 	scrubber.primary_scrubmap_pos.reset();
@@ -2953,6 +3102,10 @@ void PG::chunky_scrub(ThreadPool::TPHandle &handle)
 	    scrubber.replica_scrub_start,
 	    pg_whoami);
 	  reply->preempted = scrub_preempted;
+	  reply->start = scrubber.start;
+	  reply->end = scrubber.end;
+	  reply->scrub_to = scrubber.subset_last_update;
+	  reply->has_range = true;
 	  ::encode(scrubber.replica_scrubmap, reply->get_data());
 	  osd->send_message_osd_cluster(
 	    get_primary().osd, reply,
@@ -2966,7 +3119,9 @@ void PG::chunky_scrub(ThreadPool::TPHandle &handle)
 	scrubber.start = hobject_t();
 	scrubber.end = hobject_t();
 	scrubber.max_end = hobject_t();
+	scrubber.subset_last_update = eversion_t();
 	done = true;
+	replica_scrub_next();
 	break;
 
       default:
@@ -2980,7 +3135,7 @@ void PG::chunky_scrub(ThreadPool::TPHandle &handle)
 
 bool PG::write_blocked_by_scrub(const hobject_t& soid)
 {
-  if (soid < scrubber.start || soid >= scrubber.end) {
+  if (soid < scrubber.start || soid >= scrubber.blocked_end()) {
     return false;
   }
   if (scrub_can_preempt) {
@@ -3030,6 +3185,15 @@ void PG::scrub_compare_maps()
 {
   dout(10) << __func__ << " has maps, analyzing" << dendl;
 
+  uint64_t bytes = 0;
+  for (auto& [hoid, o] : scrubber.primary_scrubmap.objects) {
+    bytes += o.size;
+  }
+  osd->logger->inc(l_osd_scrub_chunks);
+  osd->logger->inc(l_osd_scrub_objects,
+		   scrubber.primary_scrubmap.objects.size());
+  osd->logger->inc(l_osd_scrub_bytes, bytes);
+
   // construct authoritative scrub map for type specific scrubbing
   scrubber.cleaned_meta_map.insert(scrubber.primary_scrubmap);
   map<hobject_t,
@@ -3741,6 +3905,22 @@ void PG::handle_query_state(Formatter *f)
       }
       f->close_section();
     }
+    {
+      f->open_array_section("scrubber.ahead");
+      for (auto& c : scrubber.ahead) {
+	f->open_object_section("chunk");
+	f->dump_stream("start") << c.start;
+	f->dump_stream("end") << c.end;
+	f->dump_stream("subset_last_update") << c.subset_last_update;
+	f->open_array_section("waiting_on_whom");
+	for (auto& i : c.waiting_on_whom) {
+	  f->dump_stream("shard") << i;
+	}
+	f->close_section();
+	f->close_section();
+      }
+      f->close_section();
+    }
     f->close_section();
   }
 }
@@ -3773,7 +3953,10 @@ void PG::do_delete_work(ObjectStore::Transaction &t)
 {
   dout(10) << __func__ << dendl;
 
-  {
+  // if the store can remove a non-empty collection itself we only need to
+  // clean up the snap mapper here; that is cheap enough to skip the sleep
+  bool bulk = osd->store->can_remove_nonempty_collection();
+  if (!bulk) {
     float osd_delete_sleep = osd->osd->get_osd_delete_sleep();
     if (osd_delete_sleep > 0 && delete_needs_sleep) {
       epoch_t e = get_osdmap()->get_epoch();
@@ -3807,12 +3990,15 @@ void PG::do_delete_work(ObjectStore::Transaction &t)
   ghobject_t next;
   osd->store->collection_list(
     ch,
-    next,
+    bulk ? delete_cursor : next,
     ghobject_t::get_max(),
     max,
     &olist,
     &next);
   dout(20) << __func__ << " " << olist << dendl;
+  if (bulk) {
+    delete_cursor = next;
+  }
 
   OSDriver::OSTransaction _t(osdriver.get_transaction(&t));
   int64_t num = 0;
@@ -3828,11 +4014,14 @@ void PG::do_delete_work(ObjectStore::Transaction &t)
     if (r != 0 && r != -ENOENT) {
       ceph_abort();
     }
-    t.remove(coll, oid);
+    if (!bulk) {
+      t.remove(coll, oid);
+    }
     ++num;
   }
-  if (num) {
-    dout(20) << __func__ << " deleting " << num << " objects" << dendl;
+  if (num || (bulk && !next.is_max())) {
+    dout(20) << __func__ << " deleting " << num << " objects"
+	     << (bulk ? " (snap mapper only)" : "") << dendl;
     Context *fin = new C_DeleteMore(this, get_osdmap_epoch());
     t.register_on_commit(fin);
   } else {
@@ -3856,6 +4045,7 @@ void PG::do_delete_work(ObjectStore::Transaction &t)
     if (!osd->try_finish_pg_delete(this, pool.info.get_pg_num())) {
       dout(1) << __func__ << " raced with merge, reinstantiating" << dendl;
       ch = osd->store->create_new_collection(coll);
+      delete_cursor = ghobject_t();
       create_pg_collection(t,
 	      info.pgid,
 	      info.pgid.get_split_bits(pool.info.get_pg_num()));
@@ -217,6 +217,7 @@ public:
     handle.reset_tp_timeout();
   }
   void lock(bool no_lockdep = false) const;
+  bool try_lock() const;
   void unlock() const;
   bool is_locked() const;
 
@@ -1119,6 +1120,20 @@ public:
     OpRequestRef active_rep_scrub;
     utime_t scrub_reg_stamp;  // stamp we registered for
 
+    // a chunk past the current one whose replica maps were requested early
+    // (osd_scrub_chunk_window); replies name the chunk they answer
+    struct ChunkAhead {
+      hobject_t start, end;
+      eversion_t subset_last_update;
+      set<pg_shard_t> waiting_on_whom;
+      map<pg_shard_t, ScrubMap> received_maps;
+    };
+    deque<ChunkAhead> ahead;
+    // current chunk's maps were requested while it was ahead
+    bool chunk_requested = false;
+    // replica: chunk requests waiting for the one being built
+    deque<OpRequestRef> pending_rep_scrubs;
+
     static utime_t scrub_must_stamp() { return utime_t(0,1); }
 
     omap_stat_t omap_stats  = (const struct omap_stat_t){ 0 };
@@ -1185,6 +1200,11 @@ public:
     hobject_t max_end;       // Largest end that may have been sent to replicas
     eversion_t subset_last_update;
 
+    /// end of the range writes are blocked on: current chunk and ahead
+    const hobject_t& blocked_end() const {
+      return ahead.empty() ? end : ahead.back().end;
+    }
+
     // chunky scrub state
     enum State {
       INACTIVE,
@@ -1249,6 +1269,9 @@ public:
         active_rep_scrub = OpRequestRef();
       }
       received_maps.clear();
+      ahead.clear();
+      chunk_requested = false;
+      pending_rep_scrubs.clear();
 
       must_scrub = false;
       must_deep_scrub = false;
@@ -1324,6 +1347,12 @@ protected:
   void _request_scrub_map(pg_shard_t replica, eversion_t version,
                           hobject_t start, hobject_t end, bool deep,
 			  bool allow_preemption);
+  /// pick the chunk starting at @start; false if it is busy right now
+  bool scrub_chunk_range(const hobject_t& start,
+			 hobject_t *end,
+			 eversion_t *subset_last_update);
+  void scrub_request_ahead();
+  void scrub_drop_ahead();
   int build_scrub_map_chunk(
     ScrubMap &map,
     ScrubMapBuilder &pos,
@@ -1351,6 +1380,7 @@ protected:
   void replica_scrub(
     OpRequestRef op,
     ThreadPool::TPHandle &handle);
+  void replica_scrub_next();
   void do_replica_scrub_map(OpRequestRef op);
 
   void handle_scrub_reserve_request(OpRequestRef op);
@@ -1383,6 +1413,7 @@ public:
   int pg_stat_adjust(osd_stat_t *new_stat);
 protected:
   bool delete_needs_sleep = false;
+  ghobject_t delete_cursor;  ///< listing position when the store empties colls
 
 protected:
   bool state_test(uint64_t m) const { return recovery_state.state_test(m); }
@@ -71,12 +71,19 @@ public:
   /**
    * IndexLog - adds in-memory index of the log, by oid.
    * plus some methods to manipulate it all.
+   *
+   * The indexes are only built on first use (see the lookup methods
+   * below), so that a log loaded from disk or received from a peer does
+   * not pay for them until peering, recovery or dup detection asks.  In
+   * practice replicas rarely build any, and primaries only those for
+   * reqids.  They are accounted to the osd_pglog mempool along with the
+   * entries.
    */
   struct IndexedLog : public pg_log_t {
-    mutable ceph::unordered_map<hobject_t,pg_log_entry_t*> objects;  // ptrs into log.  be careful!
-    mutable ceph::unordered_map<osd_reqid_t,pg_log_entry_t*> caller_ops;
-    mutable ceph::unordered_multimap<osd_reqid_t,pg_log_entry_t*> extra_caller_ops;
-    mutable ceph::unordered_map<osd_reqid_t,pg_log_dup_t*> dup_index;
+    mutable mempool::osd_pglog::unordered_map<hobject_t,pg_log_entry_t*> objects;  // ptrs into log.  be careful!
+    mutable mempool::osd_pglog::unordered_map<osd_reqid_t,pg_log_entry_t*> caller_ops;
+    mutable mempool::osd_pglog::unordered_multimap<osd_reqid_t,pg_log_entry_t*> extra_caller_ops;
+    mutable mempool::osd_pglog::unordered_map<osd_reqid_t,pg_log_dup_t*> dup_index;
 
     // recovery pointers
     list<pg_log_entry_t>::iterator complete_to; // not inclusive of referenced item
@@ -146,7 +153,6 @@ public:
       rollback_info_trimmed_to_riter(log.rbegin())
     {
       reset_rollback_info_trimmed_to_riter();
-      index();
     }
 
     IndexedLog(const IndexedLog &rhs) :
@@ -187,7 +193,7 @@ public:
 
     mempool::osd_pglog::list<pg_log_entry_t> rewind_from_head(eversion_t newhead) {
       auto divergent = pg_log_t::rewind_from_head(newhead);
-      index();
+      reindex();
       reset_rollback_info_trimmed_to_riter();
       return divergent;
     }
@@ -216,7 +222,6 @@ public:
       *this = IndexedLog(o);
 
       skip_can_rollback_to_to_head();
-      index();
     }
 
     void split_out_child(
@@ -250,6 +255,15 @@ public:
       return objects.count(oid);
     }
 
+    /// latest entry for @oid, or nullptr if it is not in the log
+    const pg_log_entry_t *get_latest_entry(const hobject_t& oid) const {
+      if (!(indexed_data & PGLOG_INDEXED_OBJECTS)) {
+         index_objects();
+      }
+      auto p = objects.find(oid);
+      return p == objects.end() ? nullptr : p->second;
+    }
+
     bool logged_req(const osd_reqid_t &r) const {
       if (!(indexed_data & PGLOG_INDEXED_CALLER_OPS)) {
         index_caller_ops();
@@ -273,11 +287,10 @@ public:
       ceph_assert(version);
       ceph_assert(user_version);
       ceph_assert(return_code);
-      ceph::unordered_map<osd_reqid_t,pg_log_entry_t*>::const_iterator p;
       if (!(indexed_data & PGLOG_INDEXED_CALLER_OPS)) {
         index_caller_ops();
       }
-      p = caller_ops.find(r);
+      auto p = caller_ops.find(r);
       if (p != caller_ops.end()) {
 	*version = p->second->version;
 	*user_version = p->second->user_version;
@@ -291,20 +304,20 @@ public:
       if (!(indexed_data & PGLOG_INDEXED_EXTRA_CALLER_OPS)) {
         index_extra_caller_ops();
       }
-      p = extra_caller_ops.find(r);
-      if (p != extra_caller_ops.end()) {
+      auto e = extra_caller_ops.find(r);
+      if (e != extra_caller_ops.end()) {
 	uint32_t idx = 0;
-	for (auto i = p->second->extra_reqids.begin();
-	     i != p->second->extra_reqids.end();
+	for (auto i = e->second->extra_reqids.begin();
+	     i != e->second->extra_reqids.end();
 	     ++idx, ++i) {
 	  if (i->first == r) {
-	    *version = p->second->version;
+	    *version = e->second->version;
 	    *user_version = i->second;
-	    *return_code = p->second->return_code;
-	    *op_returns = p->second->op_returns;
+	    *return_code = e->second->return_code;
+	    *op_returns = e->second->op_returns;
 	    if (*return_code >= 0) {
-	      auto it = p->second->extra_reqid_return_codes.find(idx);
-	      if (it != p->second->extra_reqid_return_codes.end()) {
+	      auto it = e->second->extra_reqid_return_codes.find(idx);
+	      if (it != e->second->extra_reqid_return_codes.end()) {
 		*return_code = it->second;
 	      }
 	    }
@@ -444,6 +457,11 @@ public:
       index(PGLOG_INDEXED_DUPS);
     }
 
+    /// rebuild the indexes built so far, e.g. after entries were removed
+    void reindex() const {
+      index(indexed_data);
+    }
+
     void index(pg_log_entry_t& e) {
       if ((indexed_data & PGLOG_INDEXED_OBJECTS) && e.object_is_indexed()) {
         if (objects.count(e.soid) == 0 ||
@@ -492,8 +510,7 @@ public:
         for (auto j = e.extra_reqids.begin();
              j != e.extra_reqids.end();
              ++j) {
-          for (ceph::unordered_multimap<osd_reqid_t,pg_log_entry_t*>::iterator k =
-		 extra_caller_ops.find(j->first);
+          for (auto k = extra_caller_ops.find(j->first);
                k != extra_caller_ops.end() && k->first == j->first;
                ++k) {
             if (k->second == &e) {
@@ -807,8 +824,6 @@ public:
     }
     log.merge_from(slogs, last_update);
 
-    index();
-
     mark_log_for_rewrite();
   }
 
@@ -984,21 +999,20 @@ protected:
 		       << " last_divergent_update: " << last_divergent_update
 		       << dendl;
 
-    ceph::unordered_map<hobject_t, pg_log_entry_t*>::const_iterator objiter =
-      log.objects.find(hoid);
-    if (objiter != log.objects.end() &&
-	objiter->second->version >= first_divergent_update) {
+    const pg_log_entry_t *latest = log.get_latest_entry(hoid);
+    if (latest &&
+	latest->version >= first_divergent_update) {
       /// Case 1)
       ldpp_dout(dpp, 10) << __func__ << ": more recent entry found: "
-			 << *objiter->second << ", already merged" << dendl;
+			 << *latest << ", already merged" << dendl;
 
-      ceph_assert(objiter->second->version > last_divergent_update);
+      ceph_assert(latest->version > last_divergent_update);
 
       // ensure missing has been updated appropriately
-      if (objiter->second->is_update() ||
-	  (missing.may_include_deletes && objiter->second->is_delete())) {
+      if (latest->is_update() ||
+	  (missing.may_include_deletes && latest->is_delete())) {
 	ceph_assert(missing.is_missing(hoid) &&
-	       missing.get_items().at(hoid).need == objiter->second->version);
+	       missing.get_items().at(hoid).need == latest->version);
       } else {
 	ceph_assert(!missing.is_missing(hoid));
       }
@@ -380,7 +380,7 @@ void PrimaryLogPG::on_local_recover(
   if (!is_delete && recovery_state.get_pg_log().get_missing().is_missing(recovery_info.soid) &&
       recovery_state.get_pg_log().get_missing().get_items().find(recovery_info.soid)->second.need > recovery_info.version) {
     ceph_assert(is_primary());
-    const pg_log_entry_t *latest = recovery_state.get_pg_log().get_log().objects.find(recovery_info.soid)->second;
+    const pg_log_entry_t *latest = recovery_state.get_pg_log().get_log().get_latest_entry(recovery_info.soid);
     if (latest->op == pg_log_entry_t::LOST_REVERT &&
 	latest->reverting_to == recovery_info.version) {
       dout(10) << " got old revert version " << recovery_info.version
@@ -7390,28 +7390,20 @@ int PrimaryLogPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
 	bool truncated = false;
 	bufferlist bl;
 	if (oi.is_omap()) {
-	  ObjectMap::ObjectMapIterator iter = osd->store->get_omap_iterator(
-	    ch, ghobject_t(soid)
-	    );
-          if (!iter) {
-            result = -ENOENT;
-            goto fail;
-          }
-	  iter->upper_bound(start_after);
-	  if (filter_prefix > start_after) iter->lower_bound(filter_prefix);
-	  for (num = 0;
-	       iter->valid() &&
-		 iter->key().substr(0, filter_prefix.size()) == filter_prefix;
-	       ++num, iter->next()) {
-	    dout(20) << "Found key " << iter->key() << dendl;
-	    if (num >= max_return ||
-		bl.length() >= cct->_conf->osd_max_omap_bytes_per_request) {
-	      truncated = true;
-	      break;
-	    }
-	    encode(iter->key(), bl);
-	    encode(iter->value(), bl);
+	  map<string, bufferlist> out;
+	  int r = osd->store->omap_get_batch(
+	    ch, ghobject_t(soid), start_after, filter_prefix, max_return,
+	    cct->_conf->osd_max_omap_bytes_per_request, &out, &truncated);
+	  if (r < 0) {
+	    result = r;
+	    goto fail;
+	  }
+	  for (auto& [key, value] : out) {
+	    dout(20) << "Found key " << key << dendl;
+	    encode(key, bl);
+	    encode(value, bl);
 	  }
+	  num = out.size();
 	} // else return empty out_set
 	encode(num, osd_op.outdata);
 	osd_op.outdata.claim_append(bl);
@@ -10877,13 +10869,14 @@ void PrimaryLogPG::check_blacklisted_obc_watchers(ObjectContextRef obc)
 void PrimaryLogPG::populate_obc_watchers(ObjectContextRef obc)
 {
   ceph_assert(is_active());
-  auto it_objects = recovery_state.get_pg_log().get_log().objects.find(obc->obs.oi.soid);
+  const pg_log_entry_t *latest;
   ceph_assert((recovering.count(obc->obs.oi.soid) ||
 	  !is_missing_object(obc->obs.oi.soid)) ||
-	 (it_objects != recovery_state.get_pg_log().get_log().objects.end() && // or this is a revert... see recover_primary()
-	  it_objects->second->op ==
+	 ((latest = recovery_state.get_pg_log().get_log().get_latest_entry(
+	     obc->obs.oi.soid)) && // or this is a revert... see recover_primary()
+	  latest->op ==
 	    pg_log_entry_t::LOST_REVERT &&
-	  it_objects->second->reverting_to ==
+	  latest->reverting_to ==
 	    obc->obs.oi.version));
 
   dout(10) << "populate_obc_watchers " << obc->obs.oi.soid << dendl;
@@ -11001,12 +10994,12 @@ ObjectContextRef PrimaryLogPG::get_object_context(
   bool can_create,
   const map<string, bufferlist> *attrs)
 {
-  auto it_objects = recovery_state.get_pg_log().get_log().objects.find(soid);
+  const pg_log_entry_t *latest;
   ceph_assert(
     attrs || !recovery_state.get_pg_log().get_missing().is_missing(soid) ||
     // or this is a revert... see recover_primary()
-    (it_objects != recovery_state.get_pg_log().get_log().objects.end() &&
-      it_objects->second->op ==
+    ((latest = recovery_state.get_pg_log().get_log().get_latest_entry(soid)) &&
+      latest->op ==
       pg_log_entry_t::LOST_REVERT));
   ObjectContextRef obc = object_contexts.lookup(soid);
   osd->logger->inc(l_osd_object_ctx_cache_total);
@@ -11646,20 +11639,10 @@ void PrimaryLogPG::_applied_recovered_object_replica()
   ceph_assert(active_pushes >= 1);
   --active_pushes;
 
-  // requeue an active chunky scrub waiting on recovery ops
+  // start a chunky scrub waiting on recovery ops
   if (!recovery_state.is_deleting() && active_pushes == 0 &&
-      scrubber.active_rep_scrub && static_cast<const MOSDRepScrub*>(
-	scrubber.active_rep_scrub->get_req())->chunky) {
-    auto& op = scrubber.active_rep_scrub;
-    osd->enqueue_back(
-      OpSchedulerItem(
-        unique_ptr<OpSchedulerItem::OpQueueable>(new PGOpItem(info.pgid, op)),
-	op->get_req()->get_cost(),
-	op->get_req()->get_priority(),
-	op->get_req()->get_recv_stamp(),
-	op->get_req()->get_source().num(),
-	get_osdmap_epoch()));
-    scrubber.active_rep_scrub.reset();
+      scrubber.active_rep_scrub) {
+    replica_scrub_next();
   }
 }
 
@@ -12039,6 +12022,7 @@ void PrimaryLogPG::on_removal(ObjectStore::Transaction &t)
 
   on_shutdown();
 
+  delete_cursor = ghobject_t();
   t.register_on_commit(new C_DeleteMore(this, get_osdmap_epoch()));
 }
 
@@ -12545,7 +12529,7 @@ uint64_t PrimaryLogPG::recover_primary(uint64_t max, ThreadPool::TPHandle &handl
   dout(25) << __func__ << " " << missing.get_items() << dendl;
 
   // look at log!
-  pg_log_entry_t *latest = 0;
+  const pg_log_entry_t *latest = 0;
   unsigned started = 0;
   int skipped = 0;
 
@@ -12557,9 +12541,8 @@ uint64_t PrimaryLogPG::recover_primary(uint64_t max, ThreadPool::TPHandle &handl
     hobject_t soid;
     version_t v = p->first;
 
-    auto it_objects = recovery_state.get_pg_log().get_log().objects.find(p->second);
-    if (it_objects != recovery_state.get_pg_log().get_log().objects.end()) {
-      latest = it_objects->second;
+    latest = recovery_state.get_pg_log().get_log().get_latest_entry(p->second);
+    if (latest) {
       ceph_assert(latest->is_update() || latest->is_delete());
       soid = latest->soid;
     } else {
@@ -1380,12 +1380,11 @@ void ReplicatedBackend::prepare_pull(
 	     << " at version " << pmissing.get_items().find(soid)->second.have
 	     << " rather than at version " << v << dendl;
     v = pmissing.get_items().find(soid)->second.have;
-    ceph_assert(get_parent()->get_log().get_log().objects.count(soid) &&
-	   (get_parent()->get_log().get_log().objects.find(soid)->second->op ==
-	    pg_log_entry_t::LOST_REVERT) &&
-	   (get_parent()->get_log().get_log().objects.find(
-	     soid)->second->reverting_to ==
-	    v));
+    const pg_log_entry_t *latest =
+      get_parent()->get_log().get_log().get_latest_entry(soid);
+    ceph_assert(latest &&
+	   (latest->op == pg_log_entry_t::LOST_REVERT) &&
+	   (latest->reverting_to == v));
   }
 
   ObjectRecoveryInfo recovery_info;
@@ -123,6 +123,10 @@ PerfCounters *build_osd_logger(CephContext *cct) {
     "Latency of IO before calling queue(before really queue into ShardedOpWq)"); // client io before queue op_wq latency
   osd_plb.add_time_avg(l_osd_op_before_dequeue_op_lat, "op_before_dequeue_op_lat",
     "Latency of IO before calling dequeue_op(already dequeued and get PG lock)"); // client io before dequeue_op latency
+  osd_plb.add_u64_counter(l_osd_op_inline, "op_inline",
+    "Client operations run on the messenger thread (osd_op_run_inline)");
+  osd_plb.add_u64_counter(l_osd_op_inline_missed, "op_inline_missed",
+    "Client operations queued because their shard or PG was busy");
 
   osd_plb.add_u64_counter(
     l_osd_sop, "subop", "Suboperations");
@@ -186,6 +190,12 @@ PerfCounters *build_osd_logger(CephContext *cct) {
     PerfCountersBuilder::PRIO_USEFUL);
   osd_plb.add_u64(
     l_osd_hb_to, "heartbeat_to_peers", "Heartbeat (ping) peers we send to");
+  osd_plb.add_time_avg(
+    l_osd_hb_ping_back_lat, "heartbeat_ping_back_lat",
+    "Heartbeat round trip time on the back (cluster) network");
+  osd_plb.add_time_avg(
+    l_osd_hb_ping_front_lat, "heartbeat_ping_front_lat",
+    "Heartbeat round trip time on the front (public) network");
   osd_plb.add_u64_counter(l_osd_map, "map_messages", "OSD map messages");
   osd_plb.add_u64_counter(l_osd_mape, "map_message_epochs", "OSD map epochs");
   osd_plb.add_u64_counter(
@@ -276,6 +286,17 @@ PerfCounters *build_osd_logger(CephContext *cct) {
   osd_plb.add_u64_counter(
     l_osd_pg_biginfo, "osd_pg_biginfo", "PG updated its biginfo attr");
 
+  osd_plb.add_u64_counter(
+    l_osd_scrub_chunks, "scrub_chunks", "Scrub chunks compared");
+  osd_plb.add_u64_counter(
+    l_osd_scrub_chunks_ahead, "scrub_chunks_ahead",
+    "Scrub chunks requested from replicas ahead of time");
+  osd_plb.add_u64_counter(
+    l_osd_scrub_objects, "scrub_objects", "Objects scrubbed as primary");
+  osd_plb.add_u64_counter(
+    l_osd_scrub_bytes, "scrub_bytes", "Object data scrubbed as primary",
+    NULL, 0, unit_t(UNIT_BYTES));
+
   return osd_plb.create_perf_counters();
 }
  
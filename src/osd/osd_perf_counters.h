@@ -37,6 +37,8 @@ enum {
 
   l_osd_op_before_queue_op_lat,
   l_osd_op_before_dequeue_op_lat,
+  l_osd_op_inline,
+  l_osd_op_inline_missed,
 
   l_osd_sop,
   l_osd_sop_inb,
@@ -68,6 +70,8 @@ enum {
   l_osd_pg_stray,
   l_osd_pg_removing,
   l_osd_hb_to,
+  l_osd_hb_ping_back_lat,
+  l_osd_hb_ping_front_lat,
   l_osd_map,
   l_osd_mape,
   l_osd_mape_dup,
@@ -117,6 +121,11 @@ enum {
   l_osd_pg_fastinfo,
   l_osd_pg_biginfo,
 
+  l_osd_scrub_chunks,
+  l_osd_scrub_chunks_ahead,
+  l_osd_scrub_objects,
+  l_osd_scrub_bytes,
+
   l_osd_last,
 };
 
@@ -4,6 +4,8 @@
 #include "gtest/gtest.h"
 #include "common/numa.h"
 
+#include <thread>
+
 TEST(cpu_set, parse_list) {
   cpu_set_t cpu_set;
   size_t size;
@@ -70,3 +72,33 @@ TEST(cpu_set, round_trip_list)
   }
 }
 
+
+#if defined(__linux__)
+TEST(cpu_set, this_thread)
+{
+  // bind a helper thread to one of our CPUs; the caller must be unaffected
+  cpu_set_t mine;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(mine), &mine));
+  int cpu = -1;
+  for (int i = 0; i < CPU_SETSIZE && cpu < 0; ++i) {
+    if (CPU_ISSET(i, &mine)) {
+      cpu = i;
+    }
+  }
+  ASSERT_GE(cpu, 0);
+  std::thread t([&] {
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    ASSERT_EQ(0, set_cpu_affinity_this_thread(sizeof(one), &one));
+    cpu_set_t now;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(now), &now));
+    ASSERT_EQ(1, CPU_COUNT(&now));
+    ASSERT_TRUE(CPU_ISSET(cpu, &now));
+  });
+  t.join();
+  cpu_set_t after;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(after), &after));
+  ASSERT_TRUE(CPU_EQUAL(&mine, &after));
+}
+#endif
@@ -1937,6 +1937,74 @@ TEST_P(MessengerTest, SyntheticStressTest1) {
   test_msg.wait_for_done();
 }
 
+TEST_P(MessengerTest, SyntheticZeroCopyTest) {
+  g_ceph_context->_conf.set_val("ms_tcp_zerocopy", "true");
+  g_ceph_context->_conf.set_val("ms_tcp_zerocopy_min_bytes", "4096");
+  SyntheticWorkload test_msg(8, 16, GetParam(), 100,
+                             Messenger::Policy::stateful_server(0),
+                             Messenger::Policy::lossless_client(0));
+  for (int i = 0; i < 20; ++i) {
+    test_msg.generate_connection();
+  }
+  gen_type rng(time(NULL));
+  for (int i = 0; i < 2000; ++i) {
+    if (!(i % 100)) {
+      lderr(g_ceph_context) << "Op " << i << ": " << dendl;
+      test_msg.print_internal_state();
+    }
+    boost::uniform_int<> true_false(0, 99);
+    int val = true_false(rng);
+    if (val > 95) {
+      test_msg.generate_connection();
+    } else if (val > 90) {
+      test_msg.drop_connection();
+    } else {
+      test_msg.send_message();
+    }
+  }
+  test_msg.wait_for_done();
+  g_ceph_context->_conf.set_val("ms_tcp_zerocopy", "false");
+  g_ceph_context->_conf.set_val("ms_tcp_zerocopy_min_bytes", "65536");
+}
+
+// Over loopback the kernel copies and the first completion turns
+// zerocopy off; keep it on, and fault sockets while sends are still
+// pending, so that buffers held for the kernel and closing with them
+// outstanding are exercised.  The dispatcher checks every payload.
+TEST_P(MessengerTest, SyntheticZeroCopyInjectTest) {
+  g_ceph_context->_conf.set_val("ms_tcp_zerocopy", "true");
+  g_ceph_context->_conf.set_val("ms_tcp_zerocopy_min_bytes", "4096");
+  g_ceph_context->_conf.set_val("ms_inject_zerocopy_ignore_copied", "true");
+  g_ceph_context->_conf.set_val("ms_inject_socket_failures", "30");
+  SyntheticWorkload test_msg(8, 16, GetParam(), 100,
+                             Messenger::Policy::stateful_server(0),
+                             Messenger::Policy::lossless_client(0));
+  for (int i = 0; i < 20; ++i) {
+    test_msg.generate_connection();
+  }
+  gen_type rng(time(NULL));
+  for (int i = 0; i < 2000; ++i) {
+    if (!(i % 100)) {
+      lderr(g_ceph_context) << "Op " << i << ": " << dendl;
+      test_msg.print_internal_state();
+    }
+    boost::uniform_int<> true_false(0, 99);
+    int val = true_false(rng);
+    if (val > 95) {
+      test_msg.generate_connection();
+    } else if (val > 90) {
+      test_msg.drop_connection();
+    } else {
+      test_msg.send_message();
+    }
+  }
+  test_msg.wait_for_done();
+  g_ceph_context->_conf.set_val("ms_inject_socket_failures", "0");
+  g_ceph_context->_conf.set_val("ms_inject_zerocopy_ignore_copied", "false");
+  g_ceph_context->_conf.set_val("ms_tcp_zerocopy", "false");
+  g_ceph_context->_conf.set_val("ms_tcp_zerocopy_min_bytes", "65536");
+}
+
 
 TEST_P(MessengerTest, SyntheticInjectTest) {
   uint64_t dispatch_throttle_bytes = g_ceph_context->_conf->ms_dispatch_throttle_bytes;
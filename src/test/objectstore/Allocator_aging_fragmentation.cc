@@ -105,6 +105,7 @@ struct test_result {
   double fragments_count = 0;
   double time = 0;
   double frag_score = 0;
+  size_t max_mem = 0;
 };
 
 std::map<std::string, test_result> results_per_allocator;
@@ -270,6 +271,7 @@ void AllocTest::doAgingTest(
         " time=" << (ceph_clock_now() - start) * 1000 << "ms" << std::endl;
   }
   double frag_score = alloc->get_fragmentation_score();
+  size_t mem = mempool::bluestore_alloc::allocated_bytes();
   do_free(0);
   double free_frag_score = alloc->get_fragmentation_score();
   ASSERT_EQ(alloc->get_free(), capacity);
@@ -277,7 +279,8 @@ void AllocTest::doAgingTest(
   std::cout << "    fragmented allocs=" << 100.0 * fragmented / allocs << "%" <<
         " #frags=" << ( fragmented != 0 ? double(fragments) / fragmented : 0 ) <<
         " time=" << (ceph_clock_now() - start) * 1000 << "ms" <<
-        " frag.score=" << frag_score << " after free frag.score=" << free_frag_score << std::endl;
+        " frag.score=" << frag_score << " after free frag.score=" << free_frag_score <<
+        " mem=" << mem / 1024 << "KB" << std::endl;
 
   uint64_t sum = 0;
   uint64_t cnt = 0;
@@ -297,6 +300,7 @@ void AllocTest::doAgingTest(
   r.fragments_count += ( fragmented != 0 ? double(fragments) / fragmented : 2 );
   r.time += ceph_clock_now() - start;
   r.frag_score += frag_score;
+  r.max_mem = std::max(r.max_mem, mem);
 }
 
 void AllocTest::TearDownTestCase() {
@@ -306,7 +310,8 @@ void AllocTest::TearDownTestCase() {
         "    fragmented allocs=" << r.second.fragmented_percent / r.second.tests_cnt << "%" <<
         " #frags=" << r.second.fragments_count / r.second.tests_cnt <<
         " free_score=" << r.second.frag_score / r.second.tests_cnt <<
-        " time=" << r.second.time * 1000 << "ms" << std::endl;
+        " time=" << r.second.time * 1000 << "ms" <<
+        " max_mem=" << r.second.max_mem / 1024 << "KB" << std::endl;
   }
 }
 
@@ -434,5 +439,5 @@ TEST_P(AllocTest, test_bonus_empty_fragmented)
 INSTANTIATE_TEST_CASE_P(
   Allocator,
   AllocTest,
-  ::testing::Values("stupid", "bitmap", "avl"));
+  ::testing::Values("stupid", "bitmap", "avl", "hybrid"));
 
@@ -37,8 +37,33 @@ public:
   }
   void doOverwriteTest(uint64_t capacity, uint64_t prefill,
     uint64_t overwrite);
+
+  static void TearDownTestCase();
+};
+
+struct mem_latency_result {
+  size_t mem_bytes = 0;
+  double alloc_4k_usec = 0;
+  double alloc_64k_usec = 0;
 };
 
+std::map<std::string, mem_latency_result> mem_latency_per_allocator;
+
+void AllocTest::TearDownTestCase()
+{
+  if (mem_latency_per_allocator.empty()) {
+    return;
+  }
+  std::cout << "Fragmented memory/latency summary: " << std::endl;
+  for (auto& r : mem_latency_per_allocator) {
+    std::cout << r.first
+	      << "    mem=" << r.second.mem_bytes / 1024 << " KB"
+	      << " alloc_4k=" << r.second.alloc_4k_usec << "us"
+	      << " alloc_64k=" << r.second.alloc_64k_usec << "us"
+	      << std::endl;
+  }
+}
+
 const uint64_t _1m = 1024 * 1024;
 
 void dump_mempools()
@@ -326,7 +351,48 @@ TEST_P(AllocTest, test_alloc_bench_10_300)
   doOverwriteTest(capacity, prefill, overwrite);
 }
 
+/*
+ * Compares allocator RAM usage and allocation latency for the worst case
+ * fragmentation pattern: every other allocation unit is free.
+ */
+TEST_P(AllocTest, test_alloc_bench_fragmented_mem_latency)
+{
+  uint64_t capacity = uint64_t(64) * 1024 * 1024 * 1024;
+  uint64_t alloc_unit = 4096;
+  const uint64_t iterations = 100000;
+  PExtentVector tmp;
+
+  init_alloc(capacity, alloc_unit);
+  size_t mem_before = mempool::bluestore_alloc::allocated_bytes();
+  for (uint64_t o = 0; o < capacity; o += 2 * alloc_unit) {
+    alloc->init_add_free(o, alloc_unit);
+  }
+  auto& r = mem_latency_per_allocator[GetParam()];
+  r.mem_bytes = mempool::bluestore_alloc::allocated_bytes() - mem_before;
+  std::cout << "Free " << alloc->get_free() / _1m << " MB in "
+	    << capacity / alloc_unit / 2 << " chunks, allocator mem "
+	    << r.mem_bytes / 1024 << " KB" << std::endl;
+
+  auto measure = [&](uint64_t want) {
+    utime_t start = ceph_clock_now();
+    uint64_t i = 0;
+    for (; i < iterations; ++i) {
+      tmp.clear();
+      auto got = alloc->allocate(want, alloc_unit, 0, 0, &tmp);
+      if (got < (int64_t)want) {
+	break;
+      }
+    }
+    return i ? double(ceph_clock_now() - start) * 1000000 / i : 0;
+  };
+  r.alloc_4k_usec = measure(alloc_unit);
+  r.alloc_64k_usec = measure(16 * alloc_unit);
+  std::cout << "alloc 4K " << r.alloc_4k_usec << "us, alloc 64K "
+	    << r.alloc_64k_usec << "us" << std::endl;
+  dump_mempools();
+}
+
 INSTANTIATE_TEST_SUITE_P(
   Allocator,
   AllocTest,
-  ::testing::Values("stupid", "bitmap", "avl"));
+  ::testing::Values("stupid", "bitmap", "avl", "hybrid"));
@@ -13,6 +13,7 @@
 #include "include/stringify.h"
 #include "include/Context.h"
 #include "os/bluestore/Allocator.h"
+#include "os/bluestore/TieredAllocator.h"
 
 #include <boost/random/uniform_int.hpp>
 typedef boost::mt11213b gen_type;
@@ -446,7 +447,129 @@ TEST_P(AllocTest, test_alloc_big3)
   EXPECT_TRUE(extents[0].length > 0);
 }
 
+TEST_P(AllocTest, test_alloc_mem_cap)
+{
+  int64_t block_size = 4096;
+  int64_t blocks = 1024;
+  int64_t capacity = blocks * block_size;
+
+  // hybrid allocator is to spill over most of the free ranges
+  // into its bitmap backing store, others ignore the setting
+  g_ceph_context->_conf.set_val("bluestore_hybrid_alloc_mem_cap", "4096");
+  init_alloc(capacity, block_size);
+  g_ceph_context->_conf.rm_val("bluestore_hybrid_alloc_mem_cap");
+
+  alloc->init_add_free(0, capacity);
+  PExtentVector extents;
+  for (int64_t i = 0; i < blocks; i++) {
+    EXPECT_EQ(block_size, alloc->allocate(block_size, block_size,
+					  0, (int64_t) 0, &extents));
+  }
+  EXPECT_EQ(0u, alloc->get_free());
+
+  interval_set<uint64_t> release_set;
+  for (int64_t i = 0; i < blocks; i += 2) {
+    release_set.insert(i * block_size, block_size);
+  }
+  alloc->release(release_set);
+  EXPECT_EQ(uint64_t(capacity / 2), alloc->get_free());
+
+  uint64_t sum = 0;
+  alloc->dump([&](uint64_t offset, uint64_t length) {
+    EXPECT_EQ(0u, (offset / block_size) % 2);
+    sum += length;
+  });
+  EXPECT_EQ(uint64_t(capacity / 2), sum);
+
+  alloc->init_rm_free(0, block_size);
+  alloc->init_rm_free(capacity - 2 * block_size, block_size);
+  EXPECT_EQ(uint64_t(capacity / 2 - 2 * block_size), alloc->get_free());
+
+  extents.clear();
+  EXPECT_EQ(capacity / 2 - 2 * block_size,
+	    alloc->allocate(capacity / 2 - 2 * block_size, block_size,
+			    0, (int64_t) 0, &extents));
+  EXPECT_EQ(0u, alloc->get_free());
+  EXPECT_EQ(-ENOSPC, alloc->allocate(block_size, block_size,
+				     0, (int64_t) 0, &extents));
+}
+
+TEST_P(AllocTest, test_alloc_tiered)
+{
+  uint64_t block_size = 4096;
+  uint64_t slow_size = 256 * block_size;
+  uint64_t fast_offset = 1024 * block_size;
+  uint64_t fast_size = 64 * block_size;
+  TieredAllocator tiered(
+    g_ceph_context,
+    Allocator::create(g_ceph_context, GetParam(), slow_size, block_size,
+		      "test_tiered_slow"),
+    slow_size,
+    Allocator::create(g_ceph_context, GetParam(), fast_size, block_size,
+		      "test_tiered_fast"),
+    fast_offset, fast_size, "test_tiered");
+
+  // the hole between the devices is never free
+  tiered.init_add_free(0, fast_offset + fast_size);
+  EXPECT_EQ(slow_size + fast_size, tiered.get_free());
+  EXPECT_EQ(fast_size, tiered.get_fast_free());
+
+  // a hint on the fast device allocates from it...
+  PExtentVector extents, all;
+  EXPECT_EQ(int64_t(32 * block_size),
+	    tiered.allocate(32 * block_size, block_size, 0, fast_offset,
+			    &extents));
+  for (auto& e : extents) {
+    EXPECT_TRUE(tiered.is_fast(e.offset));
+    EXPECT_LE(e.end(), fast_offset + fast_size);
+  }
+  all.insert(all.end(), extents.begin(), extents.end());
+
+  // ...and from the main device once it is full
+  extents.clear();
+  EXPECT_EQ(int64_t(64 * block_size),
+	    tiered.allocate(64 * block_size, block_size, 0, fast_offset,
+			    &extents));
+  uint64_t on_fast = 0;
+  for (auto& e : extents) {
+    if (tiered.is_fast(e.offset)) {
+      on_fast += e.length;
+    } else {
+      EXPECT_LE(e.end(), slow_size);
+    }
+  }
+  EXPECT_EQ(32 * block_size, on_fast);
+  EXPECT_EQ(0u, tiered.get_fast_free());
+  all.insert(all.end(), extents.begin(), extents.end());
+
+  // anything else only allocates from the main device
+  extents.clear();
+  EXPECT_EQ(int64_t(16 * block_size),
+	    tiered.allocate(16 * block_size, block_size, 0, 0, &extents));
+  for (auto& e : extents) {
+    EXPECT_LE(e.end(), slow_size);
+  }
+  all.insert(all.end(), extents.begin(), extents.end());
+  EXPECT_EQ(slow_size - 48 * block_size, tiered.get_free());
+
+  interval_set<uint64_t> release_set;
+  for (auto& e : all) {
+    release_set.insert(e.offset, e.length);
+  }
+  tiered.release(release_set);
+  EXPECT_EQ(slow_size + fast_size, tiered.get_free());
+  uint64_t sum = 0;
+  tiered.dump([&](uint64_t offset, uint64_t length) {
+    EXPECT_TRUE(offset + length <= slow_size ||
+		(offset >= fast_offset &&
+		 offset + length <= fast_offset + fast_size));
+    sum += length;
+  });
+  EXPECT_EQ(slow_size + fast_size, sum);
+  tiered.shutdown();
+}
+
 INSTANTIATE_TEST_SUITE_P(
   Allocator,
   AllocTest,
-  ::testing::Values("stupid", "bitmap", "avl"));
+  ::testing::Values("stupid", "bitmap", "avl", "hybrid"));
@@ -0,0 +1,193 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * fio-like closed loop benchmark for BlockDevice implementations, to
+ * compare e.g. libaio and the io_uring modes of KernelDevice:
+ *
+ *   ceph_perf_bdev --bluestore_ioring=true <path> randwrite 4096 32 10
+ *
+ * An optional numa node binds the submitting thread; together with
+ * --bluestore_numa_affinity=true (aio thread on the device's node) this
+ * shows the cost of completing I/O across nodes:
+ *
+ *   ceph_perf_bdev --bluestore_numa_affinity=true <path> randread 4096 1 10 1
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include <iostream>
+#include <random>
+
+using namespace std;
+
+#include "common/ceph_argparse.h"
+#include "common/ceph_mutex.h"
+#include "common/ceph_time.h"
+#include "common/debug.h"
+#include "common/errno.h"
+#include "common/numa.h"
+#include "global/global_init.h"
+#include "os/bluestore/BlockDevice.h"
+
+struct Job {
+  IOContext ioc;
+  bufferlist bl;
+  ceph::mono_time start;
+
+  explicit Job(CephContext *cct) : ioc(cct, this) {}
+};
+
+struct Completions {
+  ceph::mutex lock = ceph::make_mutex("Completions::lock");
+  ceph::condition_variable cond;
+  std::vector<Job*> done;
+};
+
+static void aio_cb(void *priv, void *priv2)
+{
+  Completions *c = static_cast<Completions*>(priv);
+  std::lock_guard l(c->lock);
+  c->done.push_back(static_cast<Job*>(priv2));
+  c->cond.notify_one();
+}
+
+void usage(const string &name) {
+  cerr << "Usage: " << name
+       << " <path> <randread|randwrite> <block size> <iodepth> <seconds>"
+       << " [numa node]" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, (const char **)argv, args);
+
+  auto cct = global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT,
+			 CODE_ENVIRONMENT_UTILITY,
+			 CINIT_FLAG_NO_DEFAULT_CONFIG_FILE);
+  common_init_finish(g_ceph_context);
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  if (args.size() < 5) {
+    usage(argv[0]);
+    return 1;
+  }
+  string path = args[0];
+  bool write = string(args[1]) == "randwrite";
+  if (!write && string(args[1]) != "randread") {
+    usage(argv[0]);
+    return 1;
+  }
+  uint64_t bs = strtoull(args[2], nullptr, 10);
+  unsigned iodepth = atoi(args[3]);
+  auto runtime = make_timespan(atoi(args[4]));
+  if (args.size() > 5) {
+    int node = atoi(args[5]);
+    size_t cpu_set_size;
+    cpu_set_t cpu_set;
+    int r = get_numa_node_cpu_set(node, &cpu_set_size, &cpu_set);
+    if (r >= 0) {
+      r = set_cpu_affinity_this_thread(cpu_set_size, &cpu_set);
+    }
+    if (r < 0) {
+      cerr << "unable to bind to numa node " << node << ": "
+	   << cpp_strerror(r) << std::endl;
+      return 1;
+    }
+  }
+
+  Completions c;
+  std::unique_ptr<BlockDevice> bdev(BlockDevice::create(
+    g_ceph_context, path, aio_cb, &c, nullptr, nullptr));
+  int r = bdev->open(path);
+  if (r < 0) {
+    cerr << "unable to open " << path << ": " << cpp_strerror(r) << std::endl;
+    return 1;
+  }
+  if (bs == 0 || bs % bdev->get_block_size() || iodepth == 0) {
+    cerr << "block size must be a multiple of " << bdev->get_block_size()
+	 << " and iodepth must be positive" << std::endl;
+    bdev->close();
+    return 1;
+  }
+
+  std::mt19937_64 rng(0);
+  std::uniform_int_distribution<uint64_t> block(0, bdev->get_size() / bs - 1);
+  bufferptr payload = buffer::create_small_page_aligned(bs);
+  memset(payload.c_str(), 0xaa, bs);
+
+  auto issue = [&](Job *j) {
+    uint64_t off = block(rng) * bs;
+    j->ioc.release_running_aios();
+    j->bl.clear();
+    j->start = ceph::mono_clock::now();
+    if (write) {
+      j->bl.append(payload);
+      bdev->aio_write(off, j->bl, &j->ioc, false);
+    } else {
+      bdev->aio_read(off, bs, &j->bl, &j->ioc);
+    }
+    bdev->aio_submit(&j->ioc);
+  };
+
+  std::vector<std::unique_ptr<Job>> jobs;
+  for (unsigned i = 0; i < iodepth; ++i) {
+    jobs.emplace_back(std::make_unique<Job>(g_ceph_context));
+  }
+
+  uint64_t ios = 0;
+  ceph::timespan total_lat = ceph::timespan::zero();
+  ceph::timespan max_lat = ceph::timespan::zero();
+  auto start = ceph::mono_clock::now();
+  auto end = start + runtime;
+  for (auto& j : jobs) {
+    issue(j.get());
+  }
+  unsigned inflight = iodepth;
+  std::vector<Job*> done;
+  while (inflight > 0) {
+    {
+      std::unique_lock l(c.lock);
+      c.cond.wait(l, [&] { return !c.done.empty(); });
+      done.swap(c.done);
+    }
+    auto now = ceph::mono_clock::now();
+    for (auto j : done) {
+      ceph::timespan lat = now - j->start;
+      total_lat += lat;
+      max_lat = std::max(max_lat, lat);
+      ++ios;
+      if (now < end) {
+	issue(j);
+      } else {
+	--inflight;
+      }
+    }
+    done.clear();
+  }
+  double secs = std::chrono::duration<double>(
+    ceph::mono_clock::now() - start).count();
+  for (auto& j : jobs) {
+    j->ioc.release_running_aios();
+  }
+  bdev->close();
+
+  cout << args[1] << " bs " << bs << " iodepth " << iodepth
+       << ": " << ios << " ios in " << secs << "s, "
+       << (uint64_t)(ios / secs) << " iops, "
+       << byte_u_t(ios * bs / secs) << "/s, avg lat "
+       << std::chrono::duration<double, std::micro>(total_lat).count() / ios
+       << "us, max lat "
+       << std::chrono::duration<double, std::micro>(max_lat).count() << "us"
+       << std::endl;
+  return 0;
+}
@@ -0,0 +1,211 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Pages through a large omap the way CEPH_OSD_OP_OMAPGETVALS does, once
+ * stepping an omap iterator and once with omap_get_batch, e.g.
+ *
+ *   ceph_perf_omap <path> 10000000 64 512
+ *
+ * <path> must be an existing directory.  The store in it is created and
+ * filled on the first run and reused afterwards, so that repeated runs
+ * only measure the reads.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include <iostream>
+
+using namespace std;
+
+#include "common/ceph_argparse.h"
+#include "common/ceph_time.h"
+#include "common/debug.h"
+#include "common/errno.h"
+#include "global/global_init.h"
+#include "os/ObjectStore.h"
+
+static const coll_t cid(spg_t(pg_t(0, 1), shard_id_t::NO_SHARD));
+static const ghobject_t oid(hobject_t("omap_bench", "", CEPH_NOSNAP, 0, 1, ""));
+
+void usage(const string &name) {
+  cerr << "Usage: " << name
+       << " <path> [keys (10000000)] [value size (64)] [batch (512)]"
+       << std::endl;
+}
+
+static string make_key(uint64_t i)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "key-%012llu", (unsigned long long)i);
+  return buf;
+}
+
+static int fill(ObjectStore *store, ObjectStore::CollectionHandle& ch,
+		uint64_t keys, unsigned value_size)
+{
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.touch(cid, oid);
+    store->queue_transaction(ch, std::move(t));
+  }
+  bufferlist value;
+  value.append(string(value_size, 'v'));
+  const uint64_t per_txn = 10000;
+  auto start = ceph::mono_clock::now();
+  for (uint64_t i = 0; i < keys; ) {
+    map<string, bufferlist> kv;
+    for (uint64_t j = 0; j < per_txn && i < keys; ++j, ++i) {
+      kv.emplace_hint(kv.end(), make_key(i), value);
+    }
+    ObjectStore::Transaction t;
+    t.omap_setkeys(cid, oid, kv);
+    store->queue_transaction(ch, std::move(t));
+    if (i % (per_txn * 100) == 0) {
+      cout << "  " << i << " keys" << std::endl;
+    }
+  }
+  ch->flush();
+  double secs = std::chrono::duration<double>(
+    ceph::mono_clock::now() - start).count();
+  cout << "filled " << keys << " keys in " << secs << "s" << std::endl;
+  return 0;
+}
+
+/// one page per loop, as the OSD did before omap_get_batch
+static uint64_t scan_iterator(ObjectStore *store,
+			      ObjectStore::CollectionHandle& ch,
+			      uint64_t batch, uint64_t max_bytes)
+{
+  uint64_t total = 0;
+  string after;
+  bool more = true;
+  while (more) {
+    ObjectMap::ObjectMapIterator iter = store->get_omap_iterator(ch, oid);
+    ceph_assert(iter);
+    more = false;
+    uint64_t num = 0, bytes = 0;
+    map<string, bufferlist> out;
+    for (iter->upper_bound(after); iter->valid(); iter->next()) {
+      if (num >= batch || bytes >= max_bytes) {
+	more = true;
+	break;
+      }
+      string key = iter->key();
+      bufferlist value = iter->value();
+      ++num;
+      bytes += key.size() + value.length();
+      out.emplace_hint(out.end(), std::move(key), std::move(value));
+    }
+    if (!out.empty()) {
+      after = out.rbegin()->first;
+    }
+    total += out.size();
+  }
+  return total;
+}
+
+static uint64_t scan_batch(ObjectStore *store,
+			   ObjectStore::CollectionHandle& ch,
+			   uint64_t batch, uint64_t max_bytes)
+{
+  uint64_t total = 0;
+  string after;
+  bool more = true;
+  while (more) {
+    map<string, bufferlist> out;
+    int r = store->omap_get_batch(ch, oid, after, string(), batch, max_bytes,
+				  &out, &more);
+    ceph_assert(r == 0);
+    if (!out.empty()) {
+      after = out.rbegin()->first;
+    }
+    total += out.size();
+  }
+  return total;
+}
+
+int main(int argc, char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, (const char **)argv, args);
+
+  auto cct = global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT,
+			 CODE_ENVIRONMENT_UTILITY,
+			 CINIT_FLAG_NO_DEFAULT_CONFIG_FILE);
+  common_init_finish(g_ceph_context);
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  if (args.size() < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  string path = args[0];
+  uint64_t keys = args.size() > 1 ? strtoull(args[1], nullptr, 10) : 10000000;
+  unsigned value_size = args.size() > 2 ? atoi(args[2]) : 64;
+  uint64_t batch = args.size() > 3 ? strtoull(args[3], nullptr, 10) : 512;
+  uint64_t max_bytes =
+    g_ceph_context->_conf.get_val<Option::size_t>("osd_max_omap_bytes_per_request");
+  if (batch == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::unique_ptr<ObjectStore> store(
+    ObjectStore::create(g_ceph_context, "bluestore", path, string()));
+  ceph_assert(store);
+  bool created = false;
+  if (store->mount() < 0) {
+    int r = store->mkfs();
+    if (r < 0) {
+      cerr << "mkfs " << path << " failed: " << cpp_strerror(r) << std::endl;
+      return 1;
+    }
+    r = store->mount();
+    if (r < 0) {
+      cerr << "mount " << path << " failed: " << cpp_strerror(r) << std::endl;
+      return 1;
+    }
+    created = true;
+  }
+  ObjectStore::CollectionHandle ch;
+  if (created) {
+    ch = store->create_new_collection(cid);
+    fill(store.get(), ch, keys, value_size);
+  } else {
+    ch = store->open_collection(cid);
+    if (!ch) {
+      cerr << path << " was not created by " << argv[0] << std::endl;
+      store->umount();
+      return 1;
+    }
+  }
+
+  auto run = [&](const char *name, auto scan) {
+    auto start = ceph::mono_clock::now();
+    uint64_t n = scan(store.get(), ch, batch, max_bytes);
+    double secs = std::chrono::duration<double>(
+      ceph::mono_clock::now() - start).count();
+    cout << name << " batch " << batch << ": " << n << " keys in "
+	 << secs << "s, " << (uint64_t)(n / secs) << " keys/s, "
+	 << (uint64_t)((n + batch - 1) / batch / secs) << " batches/s"
+	 << std::endl;
+  };
+  // warm up the caches, so that neither run pays for a cold read
+  scan_batch(store.get(), ch, batch, max_bytes);
+  run("iterator", scan_iterator);
+  run("omap_get_batch", scan_batch);
+
+  ch.reset();
+  store->umount();
+  return 0;
+}
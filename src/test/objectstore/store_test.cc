@@ -17,6 +17,7 @@
 #include <string.h>
 #include <iostream>
 #include <time.h>
+#include <thread>
 #include <sys/mount.h>
 #include <boost/scoped_ptr.hpp>
 #include <boost/random/mersenne_twister.hpp>
@@ -3202,6 +3203,9 @@ TEST_P(StoreTest, SimpleCloneTest) {
     ASSERT_EQ(r, 0);
     ch = store->open_collection(cid);
 
+    // bluestore would empty the collection in the background
+    SetVal(g_conf(), "bluestore_bulk_remove_collection", "false");
+    g_conf().apply_changes(nullptr);
     ObjectStore::Transaction t;
     t.remove_collection(cid);
     cerr << "Invalid rm coll" << std::endl;
@@ -4586,18 +4590,12 @@ TEST_P(StoreTest, Synthetic) {
 }
 
 #if defined(WITH_BLUESTORE)
-TEST_P(StoreTestSpecificAUSize, BlueFSExtenderTest) {
+TEST_P(StoreTestSpecificAUSize, BlueFSSharedAllocTest) {
   if(string(GetParam()) != "bluestore")
     return;
 
   SetVal(g_conf(), "bluestore_block_db_size", "0");
   SetVal(g_conf(), "bluestore_block_wal_size", "0");
-  SetVal(g_conf(), "bluestore_bluefs_min", "12582912");
-  SetVal(g_conf(), "bluestore_bluefs_min_free", "4194304");
-  SetVal(g_conf(), "bluestore_bluefs_gift_ratio", "0");
-  SetVal(g_conf(), "bluestore_bluefs_min_ratio", "0");
-  SetVal(g_conf(), "bluestore_bluefs_balance_interval", "100000");
-  SetVal(g_conf(), "bluestore_bluefs_db_compatibility", "false");
 
   g_conf().apply_changes(nullptr);
 
@@ -4608,15 +4606,14 @@ TEST_P(StoreTestSpecificAUSize, BlueFSExtenderTest) {
   BlueStore* bstore = NULL;
   EXPECT_NO_THROW(bstore = dynamic_cast<BlueStore*> (store.get()));
 
-  // verify downgrades are broken and repair that
-  bstore->umount();
-  ASSERT_EQ(bstore->fsck(false), 0);
-
-  SetVal(g_conf(), "bluestore_bluefs_db_compatibility", "true");
-  g_conf().apply_changes(nullptr);
+  // bluefs takes its space straight from our allocator, nothing is
+  // reserved for it upfront
+  struct store_statfs_t statfs;
+  ASSERT_EQ(store->statfs(&statfs), 0);
+  ASSERT_EQ(statfs.internally_reserved, 0u);
 
-  ASSERT_EQ(bstore->fsck(false), 1);
-  ASSERT_EQ(bstore->repair(false), 0);
+  // neither bluefs nor bluestore should have leaked or double allocated
+  bstore->umount();
   ASSERT_EQ(bstore->fsck(false), 0);
   bstore->mount();
 }
@@ -4792,6 +4789,883 @@ TEST_P(StoreTestSpecificAUSize, SyntheticMatrixPreferDeferred) {
   };
   do_matrix(m, std::bind(&StoreTest::doSyntheticTest, this, _1, _2, _3, _4));
 }
+
+TEST_P(StoreTestSpecificAUSize, DeferredAdaptive) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_prefer_deferred_adaptive", "true");
+  g_conf().apply_changes(nullptr);
+
+  StartDeferred(4096);
+  doSyntheticTest(10000, 400*1024, 16*1024, 4096);
+
+  // every small write that could go either way had the model decide
+  const PerfCounters* logger = store->get_perf_counters();
+  uint64_t decided =
+    logger->get(l_bluestore_write_adaptive_deferred) +
+    logger->get(l_bluestore_write_adaptive_direct) +
+    logger->get(l_bluestore_write_adaptive_direct_backlog) +
+    logger->get(l_bluestore_write_adaptive_direct_probe);
+  ASSERT_GT(decided, 0u);
+  ASSERT_GT(logger->get(l_bluestore_kv_commit_lat_avg), 0u);
+
+  BlueStore* bstore = NULL;
+  EXPECT_NO_THROW(bstore = dynamic_cast<BlueStore*> (store.get()));
+  bstore->umount();
+  ASSERT_EQ(bstore->fsck(false), 0);
+  bstore->mount();
+}
+
+TEST_P(StoreTestSpecificAUSize, SyntheticMatrixCacheType) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  // cache shards are created along with the store, so restart it for
+  // each policy; keep the cache small so that every one of them trims.
+  // TearDown() drops our settings, so set them again each time
+  bool first = true;
+  for (auto type : { "lru", "2q", "clock" }) {
+    cerr << "bluestore_cache_type = " << type << std::endl;
+    if (!first) {
+      TearDown();
+    }
+    first = false;
+    SetVal(g_conf(), "bluestore_cache_autotune", "false");
+    SetVal(g_conf(), "bluestore_cache_size", "4000000");
+    SetVal(g_conf(), "bluestore_default_buffered_read", "true");
+    SetVal(g_conf(), "bluestore_default_buffered_write", "true");
+    SetVal(g_conf(), "bluestore_cache_type", type);
+    g_conf().apply_changes(nullptr);
+    StartDeferred(4096);
+    doSyntheticTest(10000, 1048576, 65536, 4096);
+  }
+}
+
+// cached read throughput of each cache type: several threads stat and
+// read small objects that all fit in the cache, so that every read is a
+// hit and the cost is mostly the shard lookup and touch
+TEST_P(StoreTestSpecificAUSize, CacheTypeReadBench) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  const unsigned num_objects = 2000;
+  const unsigned num_threads = 8;
+  const unsigned reads_per_thread = 100000;
+  const uint64_t len = 4096;
+  bool first = true;
+  for (auto type : { "lru", "2q", "clock" }) {
+    if (!first) {
+      TearDown();
+    }
+    first = false;
+    SetVal(g_conf(), "bluestore_cache_autotune", "false");
+    SetVal(g_conf(), "bluestore_cache_size", "268435456");
+    SetVal(g_conf(), "bluestore_default_buffered_read", "true");
+    SetVal(g_conf(), "bluestore_default_buffered_write", "true");
+    SetVal(g_conf(), "bluestore_cache_type", type);
+    g_conf().apply_changes(nullptr);
+    StartDeferred(4096);
+
+    coll_t cid;
+    auto ch = store->create_new_collection(cid);
+    {
+      ObjectStore::Transaction t;
+      t.create_collection(cid, 0);
+      int r = queue_transaction(store, ch, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+    bufferlist data;
+    data.append(string(len, 'x'));
+    vector<ghobject_t> oids;
+    for (unsigned i = 0; i < num_objects; ++i) {
+      oids.emplace_back(hobject_t(sobject_t("Object " + stringify(i),
+					    CEPH_NOSNAP)));
+    }
+    for (unsigned i = 0; i < num_objects; i += 100) {
+      ObjectStore::Transaction t;
+      for (unsigned j = i; j < i + 100 && j < num_objects; ++j) {
+	t.write(cid, oids[j], 0, len, data);
+      }
+      int r = queue_transaction(store, ch, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+    // warm up, so that all threads only hit
+    for (auto& oid : oids) {
+      bufferlist bl;
+      ASSERT_EQ((int)len, store->read(ch, oid, 0, len, bl));
+    }
+
+    // with a small working set all threads keep hitting the same onodes
+    // of one shard, and every hit pins and unpins its onode, so the shard
+    // lock is what limits the rate there
+    for (unsigned working_set : { num_objects, 16u }) {
+      std::atomic<unsigned> errors = {0};
+      auto start = ceph::mono_clock::now();
+      vector<std::thread> threads;
+      for (unsigned n = 0; n < num_threads; ++n) {
+	threads.emplace_back([&, n] {
+	  gen_type rng(n);
+	  boost::uniform_int<> pick(0, working_set - 1);
+	  for (unsigned i = 0; i < reads_per_thread; ++i) {
+	    auto& oid = oids[pick(rng)];
+	    struct stat st;
+	    bufferlist bl;
+	    if (store->stat(ch, oid, &st) < 0 ||
+		store->read(ch, oid, 0, len, bl) != (int)len) {
+	      ++errors;
+	    }
+	  }
+	});
+      }
+      for (auto& t : threads) {
+	t.join();
+      }
+      double secs = std::chrono::duration<double>(
+	ceph::mono_clock::now() - start).count();
+      ASSERT_EQ(0u, errors.load());
+      cout << "bluestore_cache_type " << type << ": "
+	   << num_threads << " threads, " << working_set << " objects, "
+	   << (uint64_t)(num_threads * reads_per_thread / secs)
+	   << " cached reads/s" << std::endl;
+    }
+  }
+}
+
+TEST_P(StoreTestSpecificAUSize, CachePartitions) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  // partitions are set up along with the cache shards
+  SetVal(g_conf(), "bluestore_cache_partitions", "1:2:1M:1");
+  g_conf().apply_changes(nullptr);
+  StartDeferred(4096);
+
+  auto get_counter = [](const string& path) {
+    int64_t v = -1;
+    g_ceph_context->get_perfcounters_collection()->with_counters(
+      [&](const PerfCountersCollectionImpl::CounterMap& by_path) {
+	auto p = by_path.find(path);
+	if (p != by_path.end()) {
+	  v = p->second.data->u64;
+	}
+      });
+    return v;
+  };
+  ASSERT_EQ(0, get_counter("bluestore-pool-1.bluestore_onode_hits"));
+  ASSERT_EQ(-1, get_counter("bluestore-pool-2.bluestore_onode_hits"));
+
+  for (int64_t pool : { 1, 2 }) {
+    coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+    ghobject_t hoid(hobject_t("Object 1", "", CEPH_NOSNAP, 0, pool, ""));
+    auto ch = store->create_new_collection(cid);
+    {
+      ObjectStore::Transaction t;
+      t.create_collection(cid, 0);
+      bufferlist bl;
+      bl.append("abcde");
+      t.write(cid, hoid, 0, bl.length(), bl);
+      ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+    }
+    for (int i = 0; i < 3; ++i) {
+      bufferlist in;
+      ASSERT_EQ(5, store->read(ch, hoid, 0, 5, in));
+    }
+    {
+      ObjectStore::Transaction t;
+      t.remove(cid, hoid);
+      t.remove_collection(cid);
+      ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+    }
+  }
+  ASSERT_GT(get_counter("bluestore-pool-1.bluestore_onode_hits"), 0);
+  ASSERT_GT(get_counter("bluestore-pool-1.bluestore_buffer_hit_bytes") +
+	    get_counter("bluestore-pool-1.bluestore_buffer_miss_bytes"), 0);
+  ASSERT_EQ(-1, get_counter("bluestore-pool-2.bluestore_onode_hits"));
+}
+
+TEST_P(StoreTestSpecificAUSize, SequentialReadahead) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  StartDeferred(65536);
+
+  auto get_counter = [](const string& path) {
+    int64_t v = -1;
+    g_ceph_context->get_perfcounters_collection()->with_counters(
+      [&](const PerfCountersCollectionImpl::CounterMap& by_path) {
+	auto p = by_path.find(path);
+	if (p != by_path.end()) {
+	  v = p->second.data->u64;
+	}
+      });
+    return v;
+  };
+
+  const uint64_t obj_size = 16 << 20;
+  const uint64_t chunk = 64 << 10;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  auto ch = store->create_new_collection(cid);
+  bufferlist data;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  for (uint64_t off = 0; off < obj_size; off += 1 << 20) {
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(std::string(1 << 20, 'a' + (off >> 20) % 26));
+    t.write(cid, hoid, off, bl.length(), bl);
+    data.append(bl);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+
+  for (auto max_bytes : { "0", "1048576" }) {
+    SetVal(g_conf(), "bluestore_readahead_max_bytes", max_bytes);
+    g_conf().apply_changes(nullptr);
+    // start with a cold cache
+    ch.reset();
+    store->umount();
+    ASSERT_EQ(store->mount(), 0);
+    ch = store->open_collection(cid);
+
+    int64_t hits = get_counter("bluestore.bluestore_readahead_hits");
+    auto start = ceph::mono_clock::now();
+    for (uint64_t off = 0; off < obj_size; off += chunk) {
+      bufferlist in, exp;
+      ASSERT_EQ((int)chunk, store->read(ch, hoid, off, chunk, in));
+      exp.substr_of(data, off, chunk);
+      ASSERT_TRUE(bl_eq(exp, in));
+    }
+    double secs = std::chrono::duration<double>(
+      ceph::mono_clock::now() - start).count();
+    hits = get_counter("bluestore.bluestore_readahead_hits") - hits;
+    cerr << "readahead max " << max_bytes << ": sequential read of "
+	 << byte_u_t(obj_size) << " in " << chunk << " byte chunks took "
+	 << secs << "s (" << byte_u_t(obj_size / secs) << "/s), "
+	 << hits << " readahead hits" << std::endl;
+    if (string(max_bytes) == "0") {
+      ASSERT_EQ(0, hits);
+    } else {
+      ASSERT_GT(hits, 0);
+    }
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+}
+
+TEST_P(StoreTestSpecificAUSize, FsckMultithreaded) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  // small shards to get plenty of extent shard keys to check
+  SetVal(g_conf(), "bluestore_extent_map_shard_max_size", "200");
+  SetVal(g_conf(), "bluestore_extent_map_shard_target_size", "100");
+  g_conf().apply_changes(nullptr);
+  StartDeferred(4096);
+  doSyntheticTest(5000, 400*1024, 40*1024, 0);
+
+  BlueStore* bstore = NULL;
+  EXPECT_NO_THROW(bstore = dynamic_cast<BlueStore*> (store.get()));
+  bstore->umount();
+  for (auto threads : { "0", "1", "4" }) {
+    cerr << "bluestore_fsck_threads = " << threads << std::endl;
+    SetVal(g_conf(), "bluestore_fsck_threads", threads);
+    g_conf().apply_changes(nullptr);
+    ASSERT_EQ(bstore->fsck(false), 0);
+    ASSERT_EQ(bstore->fsck(true), 0);
+  }
+  bstore->mount();
+  bstore->inject_leaked(0x30000);
+  bstore->umount();
+  ASSERT_EQ(bstore->fsck(false), 1);
+  ASSERT_EQ(bstore->repair(false), 0);
+  ASSERT_EQ(bstore->fsck(true), 0);
+  bstore->mount();
+}
+
+TEST_P(StoreTestSpecificAUSize, AllocationMapInMemory) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_allocation_map_in_memory", "true");
+  SetVal(g_conf(), "bluestore_extent_map_shard_max_size", "200");
+  SetVal(g_conf(), "bluestore_extent_map_shard_target_size", "100");
+  g_conf().apply_changes(nullptr);
+  StartDeferred(4096);
+  doSyntheticTest(2000, 400*1024, 40*1024, 0);
+
+  // leave some sharded objects behind for the rebuild to find
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  bufferlist bl;
+  bl.append(std::string(0x3000, 'a'));
+  for (unsigned i = 0; i < 100; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i), CEPH_NOSNAP)));
+    ObjectStore::Transaction t;
+    for (unsigned j = 0; j < 16; ++j) {
+      t.write(cid, hoid, j * 0x10000, bl.length(), bl);
+    }
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  ch.reset();
+
+  BlueStore* bstore = NULL;
+  EXPECT_NO_THROW(bstore = dynamic_cast<BlueStore*> (store.get()));
+  const PerfCounters* logger = store->get_perf_counters();
+  uint64_t rebuilds = logger->get(l_bluestore_alloc_map_rebuilds);
+
+  // clean shutdown saves the map, both fsck and mount load it back
+  bstore->umount();
+  ASSERT_EQ(bstore->fsck(false), 0);
+  bstore->mount();
+  ASSERT_EQ(logger->get(l_bluestore_alloc_map_rebuilds), rebuilds);
+
+  // a read/write open without a clean umount (as repair does) drops
+  // the saved map, so it has to be rebuilt from the onodes
+  bstore->umount();
+  ASSERT_EQ(bstore->repair(false), 0);
+  for (auto threads : { "0", "1", "4" }) {
+    cerr << "bluestore_fsck_threads = " << threads << std::endl;
+    SetVal(g_conf(), "bluestore_fsck_threads", threads);
+    g_conf().apply_changes(nullptr);
+    ASSERT_EQ(bstore->fsck(false), 0);
+  }
+  bstore->mount();
+  ASSERT_GT(logger->get(l_bluestore_alloc_map_rebuilds), rebuilds);
+
+  // leaks in the in-memory map are found against the saved snapshot
+  bstore->inject_leaked(0x30000);
+  bstore->umount();
+  ASSERT_EQ(bstore->fsck(false), 1);
+  ASSERT_EQ(bstore->repair(false), 0);
+  ASSERT_EQ(bstore->fsck(true), 0);
+  bstore->mount();
+}
+
+TEST_P(StoreTest, BulkRemoveCollection) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  const unsigned num_objects = 2000;
+  const PerfCounters* logger = store->get_perf_counters();
+  auto populate = [&](const coll_t& cid, ObjectStore::CollectionHandle& ch) {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+    bufferlist bl, omap_bl;
+    bl.append(std::string(0x2000, 'a'));
+    omap_bl.append("value");
+    map<string, bufferlist> omap;
+    omap["key"] = omap_bl;
+    for (unsigned i = 0; i < num_objects; i += 100) {
+      ObjectStore::Transaction t;
+      for (unsigned j = i; j < i + 100; ++j) {
+	ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(j),
+					    CEPH_NOSNAP)));
+	t.write(cid, hoid, 0, bl.length(), bl);
+	t.omap_setkeys(cid, hoid, omap);
+      }
+      ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+    }
+  };
+  auto wait_removed = [&]() {
+    map<coll_t,uint64_t> removals;
+    do {
+      removals.clear();
+      usleep(10000);
+      store->get_collection_removals(&removals);
+    } while (!removals.empty());
+  };
+
+  store_statfs_t before;
+  ASSERT_EQ(store->statfs(&before), 0);
+
+  // per-object removal as done without the background path
+  coll_t cid(spg_t(pg_t(0, 1), shard_id_t::NO_SHARD));
+  auto ch = store->create_new_collection(cid);
+  populate(cid, ch);
+  auto start = ceph::mono_clock::now();
+  {
+    vector<ghobject_t> ls;
+    ghobject_t next;
+    do {
+      ls.clear();
+      ASSERT_EQ(store->collection_list(ch, next, ghobject_t::get_max(), 100,
+				       &ls, &next), 0);
+      ObjectStore::Transaction t;
+      for (auto& oid : ls) {
+	t.remove(cid, oid);
+      }
+      if (next.is_max()) {
+	t.remove_collection(cid);
+      }
+      ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+    } while (!next.is_max());
+  }
+  auto per_object = ceph::mono_clock::now() - start;
+  ch.reset();
+
+  // background removal, the collection is gone once the txc commits
+  SetVal(g_conf(), "bluestore_bulk_remove_sleep", "0");
+  g_conf().apply_changes(nullptr);
+  ASSERT_TRUE(store->can_remove_nonempty_collection());
+  ch = store->create_new_collection(cid);
+  populate(cid, ch);
+  uint64_t removed = logger->get(l_bluestore_bulk_remove_objects);
+  start = ceph::mono_clock::now();
+  {
+    ObjectStore::Transaction t;
+    t.remove_collection(cid);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  auto queued = ceph::mono_clock::now() - start;
+  ASSERT_FALSE(store->collection_exists(cid));
+  wait_removed();
+  auto bulk = ceph::mono_clock::now() - start;
+  ch.reset();
+  cout << num_objects << " objects: per-object removal " << per_object
+       << ", background removal " << bulk << " (" << queued
+       << " until the collection was gone)" << std::endl;
+  ASSERT_EQ(logger->get(l_bluestore_bulk_remove_objects),
+	    removed + num_objects);
+
+  store_statfs_t after;
+  ASSERT_EQ(store->statfs(&after), 0);
+  ASSERT_EQ(before.allocated, after.allocated);
+
+  // a pending removal survives remount; recreating the collection does
+  // not wait for it, but none of the old objects show up again
+  SetVal(g_conf(), "bluestore_bulk_remove_sleep", "10");
+  g_conf().apply_changes(nullptr);
+  ch = store->create_new_collection(cid);
+  populate(cid, ch);
+  {
+    ObjectStore::Transaction t;
+    t.remove_collection(cid);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  ch.reset();
+  ASSERT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->fsck(false), 0);
+  ASSERT_EQ(store->mount(), 0);
+  {
+    map<coll_t,uint64_t> removals;
+    store->get_collection_removals(&removals);
+    ASSERT_EQ(removals.count(cid), 1u);
+  }
+  ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  {
+    vector<ghobject_t> ls;
+    ASSERT_EQ(store->collection_list(ch, ghobject_t(), ghobject_t::get_max(),
+				     10, &ls, nullptr), 0);
+    ASSERT_TRUE(ls.empty());
+    struct stat st;
+    ghobject_t hoid(hobject_t(sobject_t("Object 0", CEPH_NOSNAP)));
+    ASSERT_EQ(store->stat(ch, hoid, &st), -ENOENT);
+    ObjectStore::Transaction t;
+    t.remove_collection(cid);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  wait_removed();
+  ch.reset();
+  ASSERT_EQ(store->statfs(&after), 0);
+  ASSERT_EQ(before.allocated, after.allocated);
+  ASSERT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->fsck(true), 0);
+  ASSERT_EQ(store->mount(), 0);
+}
+
+TEST_P(StoreTest, BulkRemoveFencedThrottle) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  // writes to a collection recreated over a pending removal wait for it
+  // while holding throttle budget; the removal must still get through
+  const unsigned num_objects = 500;
+  SetVal(g_conf(), "bluestore_bulk_remove_sleep", "0");
+  SetVal(g_conf(), "bluestore_bulk_remove_batch", "1");
+  g_conf().apply_changes(nullptr);
+  coll_t cid(spg_t(pg_t(0, 1), shard_id_t::NO_SHARD));
+  auto ch = store->create_new_collection(cid);
+  bufferlist bl;
+  bl.append(std::string(0x1000, 'a'));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  for (unsigned i = 0; i < num_objects; i += 100) {
+    ObjectStore::Transaction t;
+    for (unsigned j = i; j < i + 100; ++j) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(j),
+					  CEPH_NOSNAP)));
+      t.write(cid, hoid, 0, bl.length(), bl);
+    }
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove_collection(cid);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  ch.reset();
+
+  // a single txc fills the throttle from here on
+  SetVal(g_conf(), "bluestore_throttle_bytes", "1");
+  g_conf().apply_changes(nullptr);
+  ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  const unsigned num_writes = 10;
+  C_SaferCond committed;
+  for (unsigned i = 0; i < num_writes; ++i) {
+    ObjectStore::Transaction t;
+    ghobject_t hoid(hobject_t(sobject_t("New " + stringify(i), CEPH_NOSNAP)));
+    t.write(cid, hoid, 0, bl.length(), bl);
+    if (i == num_writes - 1) {
+      t.register_on_commit(&committed);
+    }
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  committed.wait();
+  {
+    map<coll_t,uint64_t> removals;
+    do {
+      removals.clear();
+      usleep(10000);
+      store->get_collection_removals(&removals);
+    } while (!removals.empty());
+  }
+  {
+    vector<ghobject_t> ls;
+    ASSERT_EQ(store->collection_list(ch, ghobject_t(), ghobject_t::get_max(),
+				     num_writes + 1, &ls, nullptr), 0);
+    ASSERT_EQ(ls.size(), num_writes);
+    ObjectStore::Transaction t;
+    for (auto& oid : ls) {
+      t.remove(cid, oid);
+    }
+    t.remove_collection(cid);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  ch.reset();
+}
+
+// number of physical extents backing an object, from its onode dump
+static unsigned count_pextents(ObjectStore *store,
+			       ObjectStore::CollectionHandle& ch,
+			       const ghobject_t& oid)
+{
+  JSONFormatter f(false);
+  int r = store->dump_onode(ch, oid, "onode", &f);
+  ceph_assert(r == 0);
+  std::stringstream ss;
+  f.flush(ss);
+  string s = ss.str();
+  unsigned n = 0;
+  for (auto p = s.find("\"offset\":"); p != string::npos;
+       p = s.find("\"offset\":", p + 1)) {
+    ++n;
+  }
+  return n;
+}
+
+TEST_P(StoreTestSpecificAUSize, WriteCoalescing) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_allocator", "avl");
+  SetVal(g_conf(), "bluestore_write_coalesce_window", "0");
+  g_conf().apply_changes(nullptr);
+  StartDeferred(4096);
+
+  const unsigned num_writes = 128;
+  const PerfCounters* logger = store->get_perf_counters();
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+
+  // two interleaved sequential 4k writers; returns the number of physical
+  // extents backing the first object
+  auto run = [&](const string& name, unsigned *pextents) {
+    ghobject_t a(hobject_t(sobject_t(name + "_a", CEPH_NOSNAP)));
+    ghobject_t b(hobject_t(sobject_t(name + "_b", CEPH_NOSNAP)));
+    bufferlist bl;
+    bl.append(std::string(4096, 'x'));
+    auto start = ceph::mono_clock::now();
+    for (unsigned i = 0; i < num_writes; ++i) {
+      for (auto& oid : { a, b }) {
+	ObjectStore::Transaction t;
+	t.write(cid, oid, i * bl.length(), bl.length(), bl);
+	ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+      }
+    }
+    double secs = std::chrono::duration<double>(
+      ceph::mono_clock::now() - start).count();
+
+    bufferlist r;
+    ASSERT_EQ(store->read(ch, b, 0, num_writes * bl.length(), r),
+	      (int)(num_writes * bl.length()));
+    ASSERT_EQ(r.length(), num_writes * bl.length());
+    ASSERT_TRUE(std::all_of(r.c_str(), r.c_str() + r.length(),
+			    [](char c) { return c == 'x'; }));
+
+    *pextents = count_pextents(store.get(), ch, a);
+    cout << name << ": " << 2 * num_writes << " writes, "
+	 << (uint64_t)(2 * num_writes / secs) << " iops, "
+	 << *pextents << " physical extents" << std::endl;
+  };
+
+  unsigned without = 0, with = 0;
+  run("plain", &without);
+  uint64_t coalesced = logger->get(l_bluestore_write_coalesced);
+  ASSERT_EQ(logger->get(l_bluestore_write_coalesce_reserved), 0u);
+
+  SetVal(g_conf(), "bluestore_write_coalesce_window", "10");
+  g_conf().apply_changes(nullptr);
+  run("coalesced", &with);
+  ASSERT_GT(logger->get(l_bluestore_write_coalesced),
+	    coalesced + num_writes);
+  ASSERT_LT(with, without);
+
+  // unused reservations go back to the allocator
+  SetVal(g_conf(), "bluestore_write_coalesce_window", "0");
+  g_conf().apply_changes(nullptr);
+  for (unsigned i = 0; i < 50; ++i) {
+    if (logger->get(l_bluestore_write_coalesce_reserved) == 0)
+      break;
+    usleep(100000);
+  }
+  ASSERT_EQ(logger->get(l_bluestore_write_coalesce_reserved), 0u);
+  ch.reset();
+  ASSERT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->fsck(false), 0);
+  ASSERT_EQ(store->mount(), 0);
+}
+
+TEST_P(StoreTestSpecificAUSize, Defrag) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_defrag_min_extents", "8");
+  SetVal(g_conf(), "bluestore_defrag_min_extents_per_mb", "16");
+  SetVal(g_conf(), "bluestore_defrag_bytes_per_sec", "0");
+  g_conf().apply_changes(nullptr);
+  StartDeferred(4096);
+
+  BlueStore* bstore = dynamic_cast<BlueStore*>(store.get());
+  ASSERT_TRUE(bstore);
+  const PerfCounters* logger = store->get_perf_counters();
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+
+  // interleaved appends leave both objects with one extent per write;
+  // c is small and d is a clone, neither is worth/allowed a rewrite
+  const unsigned num_writes = 64;
+  ghobject_t a(hobject_t(sobject_t("defrag_a", CEPH_NOSNAP)));
+  ghobject_t b(hobject_t(sobject_t("defrag_b", CEPH_NOSNAP)));
+  ghobject_t c(hobject_t(sobject_t("defrag_c", CEPH_NOSNAP)));
+  ghobject_t d(hobject_t(sobject_t("defrag_d", CEPH_NOSNAP)));
+  bufferlist expected_a, expected_b;
+  for (unsigned i = 0; i < num_writes; ++i) {
+    bufferlist bla, blb;
+    bla.append(std::string(4096, 'a' + i % 26));
+    blb.append(std::string(4096, 'A' + i % 26));
+    expected_a.append(bla);
+    // leave a hole in the middle of b
+    bool hole = i >= num_writes / 2 - 8 && i < num_writes / 2;
+    if (hole) {
+      expected_b.append_zero(blb.length());
+    } else {
+      expected_b.append(blb);
+    }
+    {
+      ObjectStore::Transaction t;
+      t.write(cid, a, i * bla.length(), bla.length(), bla);
+      ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+    }
+    if (!hole) {
+      ObjectStore::Transaction t;
+      t.write(cid, b, i * blb.length(), blb.length(), blb);
+      ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+    }
+  }
+  {
+    bufferlist bl;
+    bl.append(std::string(4096, 'c'));
+    ObjectStore::Transaction t;
+    t.write(cid, c, 0, bl.length(), bl);
+    t.clone(cid, a, d);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  unsigned before_b = count_pextents(store.get(), ch, b);
+  ASSERT_GE(before_b, 8u);
+
+  uint64_t objects = logger->get(l_bluestore_defrag_objects);
+  uint64_t scanned = logger->get(l_bluestore_defrag_scanned);
+  bstore->defrag_request(true);
+  for (unsigned i = 0; i < 300; ++i) {
+    if (logger->get(l_bluestore_defrag_scanned) >= scanned + 4)
+      break;
+    usleep(100000);
+  }
+  ASSERT_GE(logger->get(l_bluestore_defrag_scanned), scanned + 4);
+  // a and d share blobs after the clone; only b is rewritten
+  ASSERT_EQ(logger->get(l_bluestore_defrag_objects), objects + 1);
+  unsigned after_b = count_pextents(store.get(), ch, b);
+  cout << "defrag: " << before_b << " -> " << after_b << " extents, "
+       << logger->get(l_bluestore_defrag_bytes) << " bytes rewritten"
+       << std::endl;
+  ASSERT_LT(after_b, before_b);
+  ASSERT_GT(logger->get(l_bluestore_defrag_extents_saved), 0u);
+
+  bufferlist r;
+  ASSERT_EQ(store->read(ch, b, 0, num_writes * 4096, r),
+	    (int)(num_writes * 4096));
+  ASSERT_TRUE(bl_eq(expected_b, r));
+  r.clear();
+  ASSERT_EQ(store->read(ch, a, 0, num_writes * 4096, r),
+	    (int)(num_writes * 4096));
+  ASSERT_TRUE(bl_eq(expected_a, r));
+  // the hole in b is still a hole
+  map<uint64_t, uint64_t> m;
+  ASSERT_EQ(store->fiemap(ch, b, 0, num_writes * 4096, m), 0);
+  ASSERT_GT(m.size(), 1u);
+
+  ch.reset();
+  ASSERT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->fsck(false), 0);
+  ASSERT_EQ(store->mount(), 0);
+}
+
+TEST_P(StoreTestSpecificAUSize, Tiering) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  // file backed fast device next to the main one
+  SetVal(g_conf(), "bluestore_block_fast_create", "true");
+  SetVal(g_conf(), "bluestore_block_fast_size", "1073741824");
+  SetVal(g_conf(), "bluestore_tier_promote_hits", "4");
+  SetVal(g_conf(), "bluestore_tier_migrate_bytes_per_sec", "0");
+  g_conf().apply_changes(nullptr);
+  StartDeferred(4096);
+
+  const PerfCounters* logger = store->get_perf_counters();
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+
+  auto wait_for = [&](int idx, uint64_t v) {
+    for (unsigned i = 0; i < 300; ++i) {
+      if (logger->get(idx) >= v)
+	break;
+      usleep(100000);
+    }
+    return logger->get(idx) >= v;
+  };
+
+  // new objects are cold and land on the main device
+  const unsigned len = 256 * 1024;
+  ghobject_t hot(hobject_t(sobject_t("tier_hot", CEPH_NOSNAP)));
+  ghobject_t cold(hobject_t(sobject_t("tier_cold", CEPH_NOSNAP)));
+  bufferlist expected_hot, expected_cold;
+  expected_hot.append(std::string(len, 'h'));
+  expected_cold.append(std::string(len, 'c'));
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hot, 0, len, expected_hot);
+    t.write(cid, cold, 0, len, expected_cold);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+  }
+  ASSERT_EQ(logger->get(l_bluestore_tier_placed_fast), 0u);
+  ASSERT_GE(logger->get(l_bluestore_tier_placed_slow), 2u * len);
+
+  // reads heat up an object until it is moved to the fast device
+  for (unsigned i = 0; i < 4; ++i) {
+    bufferlist r;
+    ASSERT_EQ(store->read(ch, hot, 0, len, r), (int)len);
+  }
+  ASSERT_TRUE(wait_for(l_bluestore_tier_promoted, 1));
+  ASSERT_EQ(logger->get(l_bluestore_tier_promoted), 1u);
+  ASSERT_GE(logger->get(l_bluestore_tier_promoted_bytes), len);
+  ASSERT_GE(logger->get(l_bluestore_tier_fast_used), len);
+
+  // and new writes to it go there directly
+  uint64_t placed_fast = logger->get(l_bluestore_tier_placed_fast);
+  {
+    bufferlist bl;
+    bl.append(std::string(len, 'H'));
+    ObjectStore::Transaction t;
+    t.write(cid, hot, len, len, bl);
+    ASSERT_EQ(queue_transaction(store, ch, std::move(t)), 0);
+    expected_hot.append(bl);
+  }
+  ASSERT_GE(logger->get(l_bluestore_tier_placed_fast), placed_fast + len);
+  {
+    bufferlist r;
+    ASSERT_EQ(store->read(ch, hot, 0, 2 * len, r), (int)(2 * len));
+    ASSERT_TRUE(bl_eq(expected_hot, r));
+  }
+
+  // nothing is hot enough to stay once the fast device is over target
+  SetVal(g_conf(), "bluestore_tier_demote_hits", "1000");
+  SetVal(g_conf(), "bluestore_tier_fast_target_ratio", "0");
+  g_conf().apply_changes(nullptr);
+  ASSERT_TRUE(wait_for(l_bluestore_tier_demoted, 1));
+  for (unsigned i = 0; i < 300; ++i) {
+    if (logger->get(l_bluestore_tier_fast_used) == 0)
+      break;
+    usleep(100000);
+  }
+  ASSERT_EQ(logger->get(l_bluestore_tier_fast_used), 0u);
+  ASSERT_EQ(logger->get(l_bluestore_tier_demoted), 1u);
+  {
+    bufferlist r;
+    ASSERT_EQ(store->read(ch, hot, 0, 2 * len, r), (int)(2 * len));
+    ASSERT_TRUE(bl_eq(expected_hot, r));
+    r.clear();
+    ASSERT_EQ(store->read(ch, cold, 0, len, r), (int)len);
+    ASSERT_TRUE(bl_eq(expected_cold, r));
+  }
+
+  ch.reset();
+  ASSERT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->fsck(false), 0);
+  ASSERT_EQ(store->mount(), 0);
+}
 #endif // WITH_BLUESTORE
 
 TEST_P(StoreTest, AttrSynthetic) {
@@ -5294,6 +6168,155 @@ TEST_P(StoreTest, OMapIterator) {
   }
 }
 
+TEST_P(StoreTest, OMapGetBatch) {
+  coll_t cid;
+  ghobject_t hoid(hobject_t("tesomap", "", CEPH_NOSNAP, 0, 0, ""));
+  ghobject_t hoid2(hobject_t("tesomap2", "", CEPH_NOSNAP, 0, 0, ""));
+  auto ch = store->create_new_collection(cid);
+  int r;
+  map<string, bufferlist> attrs;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    bufferlist header;
+    header.append("header");
+    for (int i = 0; i < 100; i++) {
+      char buf[20];
+      snprintf(buf, sizeof(buf), "a-%03d", i);
+      attrs[buf].append(string(i + 1, 'a'));
+      if (i < 50) {
+	buf[0] = 'b';
+	attrs[buf].append(string(i + 1, 'b'));
+      }
+    }
+    attrs["b\xff\xff"].append("ff");
+    attrs["c"].append("c");
+    t.touch(cid, hoid);
+    t.omap_setheader(cid, hoid, header);
+    t.omap_setkeys(cid, hoid, attrs);
+    // keys of the next object must not leak into the batches
+    t.touch(cid, hoid2);
+    t.omap_setkeys(cid, hoid2, attrs);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  auto check = [&](const string& after, const string& prefix,
+		   const map<string, bufferlist>& out) {
+    auto p = attrs.upper_bound(after);
+    if (prefix > after) {
+      p = attrs.lower_bound(prefix);
+    }
+    for (auto& [key, value] : out) {
+      ASSERT_TRUE(p != attrs.end());
+      ASSERT_EQ(p->first, key);
+      ASSERT_TRUE(p->second.contents_equal(value));
+      ++p;
+    }
+  };
+
+  {
+    map<string, bufferlist> out;
+    bool more = true;
+    r = store->omap_get_batch(ch, hoid, "", "", 1000, 1 << 20, &out, &more);
+    ASSERT_EQ(r, 0);
+    ASSERT_FALSE(more);
+    ASSERT_EQ(attrs.size(), out.size());
+    check("", "", out);
+  }
+  {
+    // page through in batches of 7
+    string after;
+    size_t total = 0;
+    bool more = true;
+    while (more) {
+      map<string, bufferlist> out;
+      r = store->omap_get_batch(ch, hoid, after, "", 7, 1 << 20, &out, &more);
+      ASSERT_EQ(r, 0);
+      ASSERT_FALSE(out.empty());
+      ASSERT_TRUE(out.size() == 7 || !more);
+      check(after, "", out);
+      total += out.size();
+      after = out.rbegin()->first;
+    }
+    ASSERT_EQ(attrs.size(), total);
+  }
+  {
+    map<string, bufferlist> out;
+    bool more = true;
+    r = store->omap_get_batch(ch, hoid, "", "b-", 1000, 1 << 20, &out, &more);
+    ASSERT_EQ(r, 0);
+    ASSERT_FALSE(more);
+    ASSERT_EQ(50u, out.size());
+    check("", "b-", out);
+  }
+  {
+    map<string, bufferlist> out;
+    bool more = true;
+    r = store->omap_get_batch(ch, hoid, "b-010", "b-", 1000, 1 << 20,
+			      &out, &more);
+    ASSERT_EQ(r, 0);
+    ASSERT_FALSE(more);
+    ASSERT_EQ(39u, out.size());
+    check("b-010", "b-", out);
+  }
+  {
+    // start_after sorts before the prefix
+    map<string, bufferlist> out;
+    bool more = true;
+    r = store->omap_get_batch(ch, hoid, "a-050", "b-", 10, 1 << 20,
+			      &out, &more);
+    ASSERT_EQ(r, 0);
+    ASSERT_TRUE(more);
+    ASSERT_EQ(10u, out.size());
+    check("a-050", "b-", out);
+  }
+  {
+    map<string, bufferlist> out;
+    bool more = true;
+    r = store->omap_get_batch(ch, hoid, "", "b\xff", 1000, 1 << 20,
+			      &out, &more);
+    ASSERT_EQ(r, 0);
+    ASSERT_FALSE(more);
+    ASSERT_EQ(1u, out.size());
+    check("", "b\xff", out);
+  }
+  {
+    map<string, bufferlist> out;
+    bool more = true;
+    r = store->omap_get_batch(ch, hoid, "", "z", 1000, 1 << 20, &out, &more);
+    ASSERT_EQ(r, 0);
+    ASSERT_FALSE(more);
+    ASSERT_TRUE(out.empty());
+  }
+  {
+    // the byte limit stops the batch after the entry that reaches it
+    map<string, bufferlist> out;
+    bool more = false;
+    r = store->omap_get_batch(ch, hoid, "", "", 1000, 1, &out, &more);
+    ASSERT_EQ(r, 0);
+    ASSERT_TRUE(more);
+    ASSERT_EQ(1u, out.size());
+    check("", "", out);
+  }
+  {
+    map<string, bufferlist> out;
+    bool more;
+    ghobject_t missing(hobject_t("missing", "", CEPH_NOSNAP, 0, 0, ""));
+    r = store->omap_get_batch(ch, missing, "", "", 1000, 1 << 20,
+			      &out, &more);
+    ASSERT_EQ(r, -ENOENT);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove(cid, hoid2);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTest, XattrTest) {
   coll_t cid;
   ghobject_t hoid(hobject_t("tesomap", "", CEPH_NOSNAP, 0, 0, ""));
@@ -6996,21 +8019,16 @@ TEST_P(StoreTestSpecificAUSize, ExcessiveFragmentation) {
   }
   {
     // remove one of the object producing much free space
-    // and hence triggering bluefs rebalance.
-    // Which should fail as there is no long enough pextents.
+    // while leaving it fragmented; bluefs has to keep allocating
+    // from there as there is no long enough pextents.
     ObjectStore::Transaction t;
     t.remove(cid, hoid2);
     r = queue_transaction(store, ch, std::move(t));
     ASSERT_EQ(r, 0);
   }
 
-  auto to_sleep = 5 *
-    (int)g_conf().get_val<double>("bluestore_bluefs_balance_interval");
-  std::cout<<"sleeping... " << std::endl;
-  sleep(to_sleep);
-
   {
-    // touch another object to triggerrebalance
+    // touch another object to have more metadata written
     ObjectStore::Transaction t;
     t.touch(cid, hoid1);
     r = queue_transaction(store, ch, std::move(t));
@@ -7651,8 +8669,6 @@ TEST_P(StoreTestSpecificAUSize, BluestoreTinyDevFailure) {
     stringify(1024 * 1024 * 1024).c_str()); //1 Gb
   SetVal(g_conf(), "bluestore_block_db_size", "0");
   SetVal(g_conf(), "bluestore_block_db_create", "false");
-  SetVal(g_conf(), "bluestore_bluefs_min",
-    stringify(1024 * 1024 * 1024).c_str());
   StartDeferred(0x1000);
   store->umount();
   ASSERT_EQ(store->fsck(false), 0); // do fsck explicitly
@@ -7671,8 +8687,6 @@ TEST_P(StoreTestSpecificAUSize, BluestoreTinyDevFailure2) {
   SetVal(g_conf(), "bluestore_block_db_size",
     stringify(1024 * 1024 * 1024).c_str()); //1 Gb
   SetVal(g_conf(), "bluestore_block_db_create", "true");
-  SetVal(g_conf(), "bluestore_bluefs_min",
-    stringify(1024 * 1024 * 1024).c_str());
   StartDeferred(0x1000);
   store->umount();
   ASSERT_EQ(store->fsck(false), 0); // do fsck explicitly
@@ -7741,30 +8755,6 @@ TEST_P(StoreTest, SpuriousReadErrorTest) {
   }
 }
 
-TEST_P(StoreTest, allocateBlueFSTest) {
-  if (string(GetParam()) != "bluestore")
-    return;
-
-  BlueStore* bstore = NULL;
-  EXPECT_NO_THROW(bstore = dynamic_cast<BlueStore*> (store.get()));
-
-  struct store_statfs_t statfs;
-  store->statfs(&statfs);
-
-  uint64_t to_alloc = g_conf().get_val<Option::size_t>("bluefs_alloc_size");
-
-  int r = bstore->allocate_bluefs_freespace(to_alloc, to_alloc, nullptr);
-  ASSERT_EQ(r, 0);
-  r = bstore->allocate_bluefs_freespace(statfs.total, statfs.total, nullptr);
-  ASSERT_EQ(r, -ENOSPC);
-  r = bstore->allocate_bluefs_freespace(to_alloc * 16, to_alloc * 16, nullptr);
-  ASSERT_EQ(r, 0);
-  store->umount();
-  ASSERT_EQ(store->fsck(false), 0); // do fsck explicitly
-  r = store->mount();
-  ASSERT_EQ(r, 0);
-}
-
 TEST_P(StoreTest, mergeRegionTest) {
   if (string(GetParam()) != "bluestore")
     return;
@@ -17,6 +17,7 @@
 #include <gtest/gtest.h>
 
 #include "os/bluestore/BlueFS.h"
+#include "os/bluestore/Allocator.h"
 
 std::unique_ptr<char[]> gen_buffer(uint64_t size)
 {
@@ -79,6 +80,63 @@ TEST(BlueFS, mkfs_mount) {
   fs.umount();
 }
 
+TEST(BlueFS, mkfs_mount_shared_alloc) {
+  uint64_t size = 1048576 * 128;
+  TempBdev bdev{size};
+  uint64_t alloc_unit = g_ceph_context->_conf->bluefs_shared_alloc_size;
+  Allocator* alloc = Allocator::create(g_ceph_context, "bitmap", size,
+				       alloc_unit, "test_shared");
+  ASSERT_TRUE(alloc);
+  alloc->init_add_free(1048576, size - 1048576);
+  uint64_t free_before = alloc->get_free();
+
+  bluefs_shared_alloc_context_t shared_alloc;
+  shared_alloc.set(alloc);
+  {
+    BlueFS fs(g_ceph_context);
+    ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false,
+				     &shared_alloc));
+    uuid_d fsid;
+    ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+    ASSERT_EQ(0, fs.mount());
+    {
+      BlueFS::FileWriter *h;
+      ASSERT_EQ(0, fs.mkdir("dir"));
+      ASSERT_EQ(0, fs.open_for_write("dir", "file", &h, false));
+      auto buf = gen_buffer(1048576);
+      h->append(buf.get(), 1048576);
+      fs.fsync(h);
+      fs.close_writer(h);
+    }
+    // all the space comes from and is reported by the shared allocator
+    ASSERT_GE(shared_alloc.bluefs_used.load(), 1048576u);
+    ASSERT_EQ(fs.get_used(BlueFS::BDEV_DB), shared_alloc.bluefs_used.load());
+    ASSERT_EQ(fs.get_free(BlueFS::BDEV_DB), alloc->get_free());
+    fs.umount();
+  }
+  ASSERT_EQ(free_before - alloc->get_free(), shared_alloc.bluefs_used.load());
+  {
+    BlueFS fs(g_ceph_context);
+    ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false,
+				     &shared_alloc));
+    ASSERT_EQ(0, fs.mount());
+    // usage is recovered from the files, not from the log
+    ASSERT_EQ(free_before - alloc->get_free(),
+	      shared_alloc.bluefs_used.load());
+    interval_set<uint64_t> extents;
+    ASSERT_EQ(0, fs.get_block_extents(BlueFS::BDEV_DB, &extents));
+    ASSERT_EQ(extents.size(), shared_alloc.bluefs_used.load());
+    uint64_t file_size;
+    utime_t mtime;
+    ASSERT_EQ(0, fs.stat("dir", "file", &file_size, &mtime));
+    ASSERT_EQ(1048576u, file_size);
+    fs.umount();
+  }
+  shared_alloc.reset();
+  alloc->shutdown();
+  delete alloc;
+}
+
 TEST(BlueFS, mkfs_mount_duplicate_gift) {
   uint64_t size = 1048576 * 128;
   TempBdev bdev{ size };
@@ -683,6 +741,99 @@ TEST(BlueFS, test_replay) {
   fs.umount();
 }
 
+TEST(BlueFS, test_wal_ring_fsync) {
+  uint64_t size = 1048576 * 128;
+  TempBdev bdev{size};
+  const unsigned num_syncs = 1024;
+  const uint64_t ring = 8 * 1048576;
+  auto buf = gen_buffer(4096);
+  {
+    // stale data the ring must not expose after a crash
+    int fd = ::open(bdev.path.c_str(), O_WRONLY);
+    ASSERT_GE(fd, 0);
+    std::string junk(1048576, '\xaa');
+    for (uint64_t off = 0; off < size; off += junk.size()) {
+      ASSERT_EQ((ssize_t)junk.size(), ::pwrite(fd, junk.data(), junk.size(), off));
+    }
+    ::close(fd);
+  }
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false));
+  fs.add_block_extent(BlueFS::BDEV_DB, 1048576, size - 1048576);
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("db.wal"));
+  const PerfCounters* logger = fs.get_perf_counters();
+
+  // append + fsync like rocksdb does for each WAL commit, return the
+  // number of fsyncs that needed a BlueFS log update
+  auto run = [&](const char *name, const char *ring_size) {
+    g_ceph_context->_conf.set_val("bluefs_wal_ring_size", ring_size);
+    uint64_t meta0 = logger->get(l_bluefs_wal_fsync_meta);
+    BlueFS::FileWriter *h;
+    EXPECT_EQ(0, fs.open_for_write("db.wal", name, &h, false));
+    auto start = ceph::mono_clock::now();
+    for (unsigned i = 0; i < num_syncs; ++i) {
+      h->append(buf.get(), 4096);
+      EXPECT_EQ(0, fs.fsync(h));
+    }
+    auto lat = std::chrono::duration<double, std::micro>(
+      ceph::mono_clock::now() - start).count() / num_syncs;
+    fs.close_writer(h);
+    uint64_t meta = logger->get(l_bluefs_wal_fsync_meta) - meta0;
+    std::cout << name << " bluefs_wal_ring_size " << ring_size
+	      << ": avg fsync latency " << lat << "us, "
+	      << meta << " of " << num_syncs << " fsyncs updated the log"
+	      << std::endl;
+    return meta;
+  };
+
+  ASSERT_GT(run("000001.log", "0"), 1u);
+  ASSERT_EQ(run("000002.log", stringify(ring).c_str()), 1u);
+  // recycled in place: no metadata at all
+  ASSERT_EQ(0, fs.rename("db.wal", "000002.log", "db.wal", "000003.log"));
+  {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("db.wal", "000003.log", &h, true));
+    uint64_t nometa0 = logger->get(l_bluefs_wal_fsync_nometa);
+    uint64_t meta0 = logger->get(l_bluefs_wal_fsync_meta);
+    for (unsigned i = 0; i < num_syncs; ++i) {
+      h->append(buf.get(), 4096);
+      ASSERT_EQ(0, fs.fsync(h));
+    }
+    fs.close_writer(h);
+    ASSERT_EQ(logger->get(l_bluefs_wal_fsync_meta), meta0);
+    ASSERT_EQ(logger->get(l_bluefs_wal_fsync_nometa), nometa0 + num_syncs);
+  }
+  fs.umount();
+
+  // the ring and what was synced into it survive replay
+  ASSERT_EQ(0, fs.mount());
+  {
+    uint64_t fsize;
+    utime_t mtime;
+    ASSERT_EQ(0, fs.stat("db.wal", "000003.log", &fsize, &mtime));
+    ASSERT_EQ(fsize, ring);
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("db.wal", "000003.log", &h));
+    bufferlist bl;
+    BlueFS::FileReaderBuffer rbuf(4096);
+    ASSERT_EQ(4096, fs.read(h, &rbuf, (num_syncs - 1) * 4096, 4096, &bl, NULL));
+    ASSERT_EQ(0, memcmp(buf.get(), bl.c_str(), 4096));
+    // the rest of the ring was zeroed when it was laid out
+    bl.clear();
+    ASSERT_EQ((int)(ring - num_syncs * 4096),
+	      fs.read(h, &rbuf, num_syncs * 4096, ring - num_syncs * 4096,
+		      &bl, NULL));
+    ASSERT_TRUE(bl.is_zero());
+    delete h;
+  }
+  fs.umount();
+  g_ceph_context->_conf.set_val("bluefs_wal_ring_size", "0");
+}
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
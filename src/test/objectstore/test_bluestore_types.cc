@@ -332,6 +332,168 @@ TEST(bluestore_blob_t, csum_bench)
   }
 }
 
+TEST(bluestore_blob_t, allocated_merge)
+{
+  bluestore_blob_t b;
+  PExtentVector av;
+  av.emplace_back(0x10000, 0x1000);
+  b.allocated(0, 0x1000, av);
+  b.add_tail(0x4000);
+  ASSERT_EQ(2u, b.get_extents().size());
+
+  // physically adjacent allocation extends the previous extent
+  av.clear();
+  av.emplace_back(0x11000, 0x1000);
+  b.allocated(0x1000, 0x1000, av);
+  ASSERT_EQ(2u, b.get_extents().size());
+  ASSERT_EQ(bluestore_pextent_t(0x10000, 0x2000), b.get_extents()[0]);
+  ASSERT_FALSE(b.get_extents()[1].is_valid());
+  ASSERT_EQ(0x2000u, b.get_extents()[1].length);
+
+  // a discontiguous one does not
+  av.clear();
+  av.emplace_back(0x20000, 0x1000);
+  b.allocated(0x2000, 0x1000, av);
+  ASSERT_EQ(3u, b.get_extents().size());
+  ASSERT_EQ(bluestore_pextent_t(0x20000, 0x1000), b.get_extents()[1]);
+  ASSERT_TRUE(b.is_allocated(0, 0x3000));
+  ASSERT_FALSE(b.is_allocated(0x3000, 0x1000));
+}
+
+// per-block reference for the batched Checksummer paths
+template<class Alg>
+static void csum_one_by_one(size_t csum_block_size, const bufferlist& bl,
+			    vector<uint64_t> *out)
+{
+  typename Alg::state_t state;
+  Alg::init(&state);
+  auto p = bl.begin();
+  for (size_t i = 0; i < bl.length() / csum_block_size; ++i) {
+    out->push_back(Alg::calc(state, -1, csum_block_size, p));
+  }
+  Alg::fini(&state);
+}
+
+static void csum_one_by_one(unsigned csum_type, size_t csum_block_size,
+			    const bufferlist& bl, vector<uint64_t> *out)
+{
+  switch (csum_type) {
+  case Checksummer::CSUM_XXHASH32:
+    csum_one_by_one<Checksummer::xxhash32>(csum_block_size, bl, out);
+    break;
+  case Checksummer::CSUM_XXHASH64:
+    csum_one_by_one<Checksummer::xxhash64>(csum_block_size, bl, out);
+    break;
+  case Checksummer::CSUM_CRC32C:
+    csum_one_by_one<Checksummer::crc32c>(csum_block_size, bl, out);
+    break;
+  case Checksummer::CSUM_CRC32C_16:
+    csum_one_by_one<Checksummer::crc32c_16>(csum_block_size, bl, out);
+    break;
+  case Checksummer::CSUM_CRC32C_8:
+    csum_one_by_one<Checksummer::crc32c_8>(csum_block_size, bl, out);
+    break;
+  }
+}
+
+TEST(bluestore_blob_t, calc_csum_blocks)
+{
+  cout << "multi-buffer csum: " << Checksummer::get_blocks_impl()
+       << std::endl;
+  const size_t nblocks = 77;  // not a multiple of any batch size
+  for (unsigned order : { 3, 9, 12, 16 }) {
+    size_t bs = 1ull << order;
+    // fragments that do not line up with the csum blocks
+    bufferlist bl;
+    size_t frags[] = { bs * 20 + 17, 5, bs * 2 + 3, bs * 40, 1 };
+    for (unsigned i = 0; bl.length() < nblocks * bs; ++i) {
+      size_t len = std::min(frags[i % 5], nblocks * bs - bl.length());
+      bufferptr bp(len);
+      for (size_t j = 0; j < len; ++j) {
+	bp[j] = (char)(j * 7 + i * 13 + order);
+      }
+      bl.append(bp);
+    }
+    bufferlist flat;
+    flat.append(bl.c_str(), bl.length());
+
+    for (unsigned csum_type = Checksummer::CSUM_NONE + 1;
+	 csum_type < Checksummer::CSUM_MAX;
+	 ++csum_type) {
+      SCOPED_TRACE(string(Checksummer::get_csum_type_string(csum_type)) +
+		   " " + stringify(bs));
+      vector<uint64_t> expected;
+      csum_one_by_one(csum_type, bs, flat, &expected);
+      ASSERT_EQ(nblocks, expected.size());
+      for (auto* data : { &bl, &flat }) {
+	bluestore_blob_t b;
+	b.init_csum(csum_type, order, data->length());
+	b.calc_csum(0, *data);
+	for (size_t i = 0; i < nblocks; ++i) {
+	  ASSERT_EQ(expected[i], b.get_csum_item(i));
+	}
+	int bad_off;
+	uint64_t bad_csum;
+	ASSERT_EQ(0, b.verify_csum(0, *data, &bad_off, &bad_csum));
+	ASSERT_EQ(-1, bad_off);
+      }
+
+      if (csum_type == Checksummer::CSUM_CRC32C_16 ||
+	  csum_type == Checksummer::CSUM_CRC32C_8) {
+	continue;  // a single bit flip may go unnoticed
+      }
+      bluestore_blob_t b;
+      b.init_csum(csum_type, order, bl.length());
+      b.calc_csum(0, bl);
+      bufferlist bad;
+      bad.append(flat.c_str(), flat.length());
+      bad.c_str()[bs * 70 + 1] ^= 1;
+      int bad_off;
+      uint64_t bad_csum;
+      ASSERT_EQ(-1, b.verify_csum(0, bad, &bad_off, &bad_csum));
+      ASSERT_EQ((int)(bs * 70), bad_off);
+    }
+  }
+}
+
+TEST(bluestore_blob_t, calc_csum_blocks_bench)
+{
+  bufferlist bl;
+  bufferptr bp(8 << 20);
+  for (char *a = bp.c_str(); a < bp.c_str() + bp.length(); ++a)
+    *a = (unsigned long)a & 0xff;
+  bl.append(bp);
+  int count = 16;
+  for (unsigned order : { 9, 12, 14, 16 }) {
+    for (unsigned csum_type = Checksummer::CSUM_NONE + 1;
+	 csum_type < Checksummer::CSUM_MAX;
+	 ++csum_type) {
+      bluestore_blob_t b;
+      b.init_csum(csum_type, order, bl.length());
+      vector<uint64_t> v;
+      v.reserve(bl.length() >> order);
+      auto start = ceph::mono_clock::now();
+      for (int i = 0; i < count; ++i) {
+	v.clear();
+	csum_one_by_one(csum_type, 1ull << order, bl, &v);
+      }
+      auto mid = ceph::mono_clock::now();
+      for (int i = 0; i < count; ++i) {
+	b.calc_csum(0, bl);
+      }
+      auto end = ceph::mono_clock::now();
+      auto mbsec = [&](ceph::timespan dur) {
+	return (double)count * bl.length() / 1000000.0 /
+	  std::chrono::duration<double>(dur).count();
+      };
+      cout << "csum_type " << Checksummer::get_csum_type_string(csum_type)
+	   << ", chunk " << (1u << order)
+	   << ": one by one " << mbsec(mid - start) << " MB/sec"
+	   << ", batched " << mbsec(end - mid) << " MB/sec" << std::endl;
+    }
+  }
+}
+
 TEST(Blob, put_ref)
 {
   {
@@ -1202,6 +1364,206 @@ TEST(ExtentMap, compress_extent_map)
   ASSERT_EQ(6u, em.extent_map.size());
 }
 
+TEST(ExtentMap, encode_bench)
+{
+  BlueStore store(g_ceph_context, "", 4096);
+  // not mounted, install what mount would
+  auto cp = Compressor::create(g_ceph_context, "lz4");
+  ASSERT_TRUE(cp);
+  store.set_spanning_blob_compressor(cp);
+  BlueStore::OnodeCacheShard *oc = BlueStore::OnodeCacheShard::create(
+    g_ceph_context, "lru", NULL);
+  BlueStore::BufferCacheShard *bc = BlueStore::BufferCacheShard::create(
+    g_ceph_context, "lru", NULL);
+
+  auto coll = ceph::make_ref<BlueStore::Collection>(&store, oc, bc, coll_t());
+  BlueStore::Onode onode(coll.get(), ghobject_t(), "");
+  BlueStore::ExtentMap em(&onode);
+
+  auto new_blob = [&](uint64_t poff, uint32_t len) {
+    BlueStore::BlobRef b(new BlueStore::Blob);
+    b->shared_blob = new BlueStore::SharedBlob(coll.get());
+    b->dirty_blob().allocated_test(bluestore_pextent_t(poff, len));
+    b->dirty_blob().init_csum(Checksummer::CSUM_CRC32C, 12, len);
+    return b;
+  };
+
+  // an rbd-like 4M object written as 64K blobs, then hit by
+  // random 4K overwrites each landing in a blob of its own
+  const uint32_t blob_len = 0x10000, chunk = 0x1000;
+  std::mt19937 rng(0);
+  uint64_t poff = 0x100000000ull;
+  for (uint32_t o = 0; o < 0x400000; o += blob_len) {
+    auto base = new_blob(poff, blob_len);
+    poff += blob_len;
+    for (uint32_t c = 0; c < blob_len; c += chunk) {
+      if (rng() % 4 == 0) {
+	auto b = new_blob(poff, chunk);
+	poff += chunk;
+	em.extent_map.insert(*new BlueStore::Extent(o + c, 0, chunk, b));
+      } else {
+	em.extent_map.insert(*new BlueStore::Extent(o + c, c, chunk, base));
+      }
+    }
+  }
+  em.compress_extent_map(0, 0x400000);
+  // plenty of spanning blobs to exercise compression of the set
+  for (int id = 0; id < 256; ++id) {
+    auto b = new_blob(poff, blob_len);
+    poff += blob_len;
+    b->id = id;
+    b->get_ref(coll.get(), 0, blob_len);
+    em.spanning_blob_map[id] = b;
+  }
+
+  const int count = 200;
+  for (auto legacy : { "true", "false" }) {
+    g_ceph_context->_conf.set_val_or_die(
+      "bluestore_extent_map_encode_legacy", legacy);
+    g_ceph_context->_conf.apply_changes(nullptr);
+
+    bufferlist bl;
+    unsigned n = 0;
+    auto start = ceph::mono_clock::now();
+    for (int i = 0; i < count; ++i) {
+      bl.clear();
+      ASSERT_FALSE(em.encode_some(0, 0x400000, bl, &n));
+    }
+    auto encode_dur = ceph::mono_clock::now() - start;
+    ASSERT_EQ(em.extent_map.size(), n);
+
+    size_t bound = 0;
+    em.bound_encode_spanning_blobs(bound);
+    bufferlist sbl;
+    {
+      auto app = sbl.get_contiguous_appender(bound);
+      em.encode_spanning_blobs(app);
+    }
+    ASSERT_LE(sbl.length(), bound);
+    if (string(legacy) == "false") {
+      ASSERT_EQ(3u, (__u8)sbl[0]);
+      ASSERT_EQ(1u, (__u8)sbl[1]);  // lz4
+    }
+
+    BlueStore::Onode onode2(coll.get(), ghobject_t(), "");
+    start = ceph::mono_clock::now();
+    for (int i = 0; i < count; ++i) {
+      onode2.extent_map.clear();
+      ASSERT_EQ(n, onode2.extent_map.decode_some(bl));
+    }
+    auto decode_dur = ceph::mono_clock::now() - start;
+    auto p = sbl.front().begin_deep();
+    onode2.extent_map.decode_spanning_blobs(p);
+    ASSERT_TRUE(p.end());
+
+    auto a = em.extent_map.begin();
+    auto b = onode2.extent_map.extent_map.begin();
+    for (; a != em.extent_map.end(); ++a, ++b) {
+      ASSERT_NE(b, onode2.extent_map.extent_map.end());
+      ASSERT_EQ(a->logical_offset, b->logical_offset);
+      ASSERT_EQ(a->blob_offset, b->blob_offset);
+      ASSERT_EQ(a->length, b->length);
+      ASSERT_EQ(a->blob->get_blob().get_extents(),
+		b->blob->get_blob().get_extents());
+    }
+    ASSERT_EQ(b, onode2.extent_map.extent_map.end());
+    ASSERT_EQ(em.spanning_blob_map.size(),
+	      onode2.extent_map.spanning_blob_map.size());
+    for (auto& i : em.spanning_blob_map) {
+      auto j = onode2.extent_map.spanning_blob_map.find(i.first);
+      ASSERT_NE(j, onode2.extent_map.spanning_blob_map.end());
+      ASSERT_EQ(i.second->get_blob().get_extents(),
+		j->second->get_blob().get_extents());
+    }
+
+    cout << "legacy " << legacy << ": " << n << " extents in "
+	 << bl.length() << " bytes, encode "
+	 << encode_dur / count << ", decode " << decode_dur / count
+	 << "; " << em.spanning_blob_map.size() << " spanning blobs in "
+	 << sbl.length() << " bytes" << std::endl;
+  }
+  g_ceph_context->_conf.set_val_or_die(
+    "bluestore_extent_map_encode_legacy", "false");
+  g_ceph_context->_conf.apply_changes(nullptr);
+}
+
+TEST(ExtentMap, spanning_blobs_lz4)
+{
+  BlueStore store(g_ceph_context, "", 4096);
+  auto cp = Compressor::create(g_ceph_context, "lz4");
+  ASSERT_TRUE(cp);
+  store.set_spanning_blob_compressor(cp);
+  BlueStore::OnodeCacheShard *oc = BlueStore::OnodeCacheShard::create(
+    g_ceph_context, "lru", NULL);
+  BlueStore::BufferCacheShard *bc = BlueStore::BufferCacheShard::create(
+    g_ceph_context, "lru", NULL);
+
+  auto coll = ceph::make_ref<BlueStore::Collection>(&store, oc, bc, coll_t());
+  BlueStore::Onode onode(coll.get(), ghobject_t(), "");
+  BlueStore::ExtentMap em(&onode);
+
+  g_ceph_context->_conf.set_val_or_die(
+    "bluestore_spanning_blobs_compress_min_size", "1");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  // sparse ids for the delta encoding, every other blob shared so the
+  // set carries sbid back-references, partial refs for the ref maps
+  for (int i = 0; i < 64; ++i) {
+    BlueStore::BlobRef b(new BlueStore::Blob);
+    b->id = i * 3;
+    b->dirty_blob().allocated_test(
+      bluestore_pextent_t(0x100000 + i * 0x10000, 0x10000));
+    b->dirty_blob().init_csum(Checksummer::CSUM_CRC32C, 12, 0x10000);
+    if (i % 2) {
+      b->dirty_blob().set_flag(bluestore_blob_t::FLAG_SHARED);
+      coll->open_shared_blob(i + 1, b);
+    } else {
+      b->shared_blob = new BlueStore::SharedBlob(coll.get());
+    }
+    b->get_ref(coll.get(), 0x1000 * (i % 8), 0x2000);
+    em.spanning_blob_map[b->id] = b;
+  }
+
+  size_t bound = 0;
+  em.bound_encode_spanning_blobs(bound);
+  bufferlist bl;
+  {
+    auto app = bl.get_contiguous_appender(bound);
+    em.encode_spanning_blobs(app);
+  }
+  ASSERT_LE(bl.length(), bound);
+  ASSERT_EQ(3u, (__u8)bl[0]);
+  ASSERT_EQ(1u, (__u8)bl[1]);  // lz4
+
+  BlueStore::Onode onode2(coll.get(), ghobject_t(), "");
+  bl.rebuild();
+  auto p = bl.front().begin_deep();
+  onode2.extent_map.decode_spanning_blobs(p);
+  ASSERT_TRUE(p.end());
+
+  ASSERT_EQ(em.spanning_blob_map.size(),
+	    onode2.extent_map.spanning_blob_map.size());
+  for (auto& i : em.spanning_blob_map) {
+    auto j = onode2.extent_map.spanning_blob_map.find(i.first);
+    ASSERT_NE(j, onode2.extent_map.spanning_blob_map.end());
+    auto& a = i.second;
+    auto& b = j->second;
+    ASSERT_EQ(a->id, b->id);
+    ASSERT_EQ(a->get_blob().get_extents(), b->get_blob().get_extents());
+    ASSERT_EQ(a->get_blob().is_shared(), b->get_blob().is_shared());
+    ASSERT_EQ(a->get_referenced_bytes(), b->get_referenced_bytes());
+    ASSERT_EQ(a->shared_blob->get_sbid(), b->shared_blob->get_sbid());
+    if (a->get_blob().is_shared()) {
+      // resolved through the collection's shared blob set
+      ASSERT_EQ(a->shared_blob, b->shared_blob);
+    }
+  }
+
+  g_ceph_context->_conf.set_val_or_die(
+    "bluestore_spanning_blobs_compress_min_size", "8192");
+  g_ceph_context->_conf.apply_changes(nullptr);
+}
+
 TEST(GarbageCollector, BasicTest)
 {
   BlueStore::OnodeCacheShard *oc = BlueStore::OnodeCacheShard::create(
@@ -530,6 +530,164 @@ TEST_P(KVTest, RocksDB_estimate_size_column_family) {
   fini();
 }
 
+TEST_P(KVTest, RocksDBShardingTest) {
+  if(string(GetParam()) != "rocksdb")
+    GTEST_SKIP();
+
+  std::vector<KeyValueDB::ColumnFamily> cfs;
+  ASSERT_EQ(0, KeyValueDB::parse_sharding("A(3,2-4) B", &cfs, cout));
+  ASSERT_EQ(0, db->init(g_conf()->bluestore_rocksdb_options));
+  ASSERT_EQ(0, db->create_and_open(cout, cfs));
+  bufferlist v;
+  v.append("value");
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (int i = 0; i < 100; i++) {
+      t->set("A", stringify(1000 + i), v);
+    }
+    t->set("B", "key", v);
+    t->set("C", "key", v);
+    ASSERT_EQ(0, db->submit_transaction_sync(t));
+  }
+  fini();
+
+  init();
+  ASSERT_EQ(0, db->open(cout, cfs));
+  {
+    cout << "keys of a sharded prefix iterate in order" << std::endl;
+    KeyValueDB::Iterator it = db->get_iterator("A");
+    int i = 0;
+    for (it->seek_to_first(); it->valid(); it->next(), i++) {
+      ASSERT_EQ(stringify(1000 + i), it->key());
+      ASSERT_EQ("value", _bl_to_str(it->value()));
+    }
+    ASSERT_EQ(100, i);
+    for (it->seek_to_last(); it->valid(); it->prev()) {
+      ASSERT_EQ(stringify(1000 + --i), it->key());
+    }
+    ASSERT_EQ(0, i);
+    ASSERT_EQ(0, it->upper_bound("1049"));
+    ASSERT_EQ("1050", it->key());
+    ASSERT_EQ(0, it->prev());
+    ASSERT_EQ("1049", it->key());
+    ASSERT_EQ(0, it->next());
+    ASSERT_EQ("1050", it->key());
+  }
+  {
+    cout << "the whole space covers the sharded prefixes, too" << std::endl;
+    KeyValueDB::WholeSpaceIterator it = db->get_wholespace_iterator();
+    int i = 0;
+    std::pair<string,string> last;
+    for (it->seek_to_first(); it->valid(); it->next(), i++) {
+      auto k = it->raw_key();
+      if (i) {
+	ASSERT_LT(last, k);
+      }
+      last = k;
+    }
+    ASSERT_EQ(102, i);
+    for (it->seek_to_last(); it->valid(); it->prev()) {
+      --i;
+    }
+    ASSERT_EQ(0, i);
+    ASSERT_EQ(0, it->seek_to_first("B"));
+    ASSERT_EQ(make_pair(string("B"), string("key")), it->raw_key());
+    ASSERT_EQ(0, it->prev());
+    ASSERT_EQ(make_pair(string("A"), string("1099")), it->raw_key());
+    ASSERT_EQ(0, it->next());
+    ASSERT_EQ(0, it->next());
+    ASSERT_EQ(make_pair(string("C"), string("key")), it->raw_key());
+  }
+  {
+    cout << "point lookups and removal find the right shard" << std::endl;
+    bufferlist v1, v2, v3;
+    ASSERT_EQ(0, db->get("A", "1042", &v1));
+    ASSERT_EQ(0, db->get("B", "key", &v2));
+    ASSERT_EQ(0, db->get("C", "key", &v3));
+    KeyValueDB::Transaction t = db->get_transaction();
+    t->rmkeys_by_prefix("A");
+    ASSERT_EQ(0, db->submit_transaction_sync(t));
+    KeyValueDB::Iterator it = db->get_iterator("A");
+    it->seek_to_first();
+    ASSERT_FALSE(it->valid());
+  }
+  fini();
+}
+
+TEST_P(KVTest, RocksDBReshardTest) {
+  if(string(GetParam()) != "rocksdb")
+    GTEST_SKIP();
+
+  ASSERT_EQ(0, db->init(g_conf()->bluestore_rocksdb_options));
+  ASSERT_EQ(0, db->create_and_open(cout));
+  bufferlist v;
+  v.append("value");
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (int i = 0; i < 100; i++) {
+      t->set("A", stringify(1000 + i), v);
+      t->set("B", stringify(1000 + i), v);
+      t->set("C", stringify(1000 + i), v);
+    }
+    ASSERT_EQ(0, db->submit_transaction_sync(t));
+  }
+  fini();
+
+  auto verify = [&](const std::vector<KeyValueDB::ColumnFamily>& cfs) {
+    init();
+    ASSERT_EQ(0, db->init(g_conf()->bluestore_rocksdb_options));
+    ASSERT_EQ(0, db->open(cout, cfs));
+    for (auto prefix : { "A", "B", "C" }) {
+      KeyValueDB::Iterator it = db->get_iterator(prefix);
+      int i = 0;
+      for (it->seek_to_first(); it->valid(); it->next(), i++) {
+	ASSERT_EQ(stringify(1000 + i), it->key());
+      }
+      ASSERT_EQ(100, i);
+      bufferlist bl;
+      ASSERT_EQ(0, db->get(prefix, "1077", &bl));
+      ASSERT_EQ("value", _bl_to_str(bl));
+    }
+    fini();
+  };
+
+  for (auto def : { "A(3) B(2,0-4)", "B(4,1-) C", "" }) {
+    cout << "resharding to '" << def << "'" << std::endl;
+    std::vector<KeyValueDB::ColumnFamily> cfs;
+    ASSERT_EQ(0, KeyValueDB::parse_sharding(def, &cfs, cout));
+    init();
+    ASSERT_EQ(0, db->init(g_conf()->bluestore_rocksdb_options));
+    ASSERT_EQ(0, db->reshard(cfs, cout));
+    fini();
+    verify(cfs);
+  }
+}
+
+TEST(KVSharding, Parse) {
+  std::vector<KeyValueDB::ColumnFamily> cfs;
+  ASSERT_EQ(0, KeyValueDB::parse_sharding(
+    "M(3,0-8) m(3,0-16)=write_buffer_size=1M O(2,4-)  L=", &cfs, cout));
+  ASSERT_EQ(4u, cfs.size());
+  ASSERT_EQ("M", cfs[0].name);
+  ASSERT_EQ(3u, cfs[0].shard_cnt);
+  ASSERT_EQ(0u, cfs[0].hash_l);
+  ASSERT_EQ(8u, cfs[0].hash_h);
+  ASSERT_EQ("write_buffer_size=1M", cfs[1].option);
+  ASSERT_EQ(4u, cfs[2].hash_l);
+  ASSERT_EQ(UINT32_MAX, cfs[2].hash_h);
+  ASSERT_EQ(1u, cfs[3].shard_cnt);
+  ASSERT_EQ("M(3,0-8) m(3,0-16) O(2,4-) L",
+	    KeyValueDB::sharding_to_string(cfs));
+
+  ASSERT_EQ(0, KeyValueDB::parse_sharding("M= P= L=", &cfs, cout));
+  ASSERT_EQ("M P L", KeyValueDB::sharding_to_string(cfs));
+
+  ASSERT_EQ(-EINVAL, KeyValueDB::parse_sharding("M(0)", &cfs, cout));
+  ASSERT_EQ(-EINVAL, KeyValueDB::parse_sharding("M(3,8-8)", &cfs, cout));
+  ASSERT_EQ(-EINVAL, KeyValueDB::parse_sharding("M(3", &cfs, cout));
+  ASSERT_EQ(-EINVAL, KeyValueDB::parse_sharding("M M(2)", &cfs, cout));
+}
+
 INSTANTIATE_TEST_SUITE_P(
   KeyValueDB,
   KVTest,
@@ -3243,6 +3243,58 @@ TEST_F(PGLogTrimTest, TestCopyAfter2) {
   EXPECT_EQ(7u, copy.dups.size()) << copy;
 }
 
+// mempool use of the logs of 200 PGs with 3000 entries each, as loaded at
+// OSD start, before and after their indexes are built
+TEST(PGLogMemory, LazyIndex) {
+  constexpr unsigned num_pgs = 200;
+  constexpr unsigned num_entries = 3000;
+
+  size_t start_bytes = mempool::osd_pglog::allocated_bytes();
+  vector<PGLog::IndexedLog> logs(num_pgs);
+  for (unsigned pg = 0; pg < num_pgs; ++pg) {
+    PGLog::IndexedLog& log = logs[pg];
+    for (unsigned i = 1; i <= num_entries; ++i) {
+      char name[64];
+      snprintf(name, sizeof(name), "rbd_data.%08x.%016x", pg, i % 1000);
+      hobject_t hoid(object_t(name), "", CEPH_NOSNAP, i % 1000, 1, "");
+      pg_log_entry_t e = PGLogTestBase::mk_ple_mod(
+	hoid, eversion_t(1, i), eversion_t(1, i - 1),
+	osd_reqid_t(entity_name_t::CLIENT(pg), 0, i));
+      log.add(e);
+    }
+  }
+  size_t lazy_bytes = mempool::osd_pglog::allocated_bytes() - start_bytes;
+
+  // a replica is asked nothing; a primary looks up reqids
+  for (auto& log : logs) {
+    eversion_t version;
+    version_t user_version;
+    int return_code;
+    vector<pg_log_op_return_item_t> op_returns;
+    EXPECT_FALSE(log.get_request(osd_reqid_t(entity_name_t::CLIENT(0), 0, 0),
+				 &version, &user_version, &return_code,
+				 &op_returns));
+  }
+  size_t reqid_bytes = mempool::osd_pglog::allocated_bytes() - start_bytes;
+
+  for (auto& log : logs) {
+    log.index();
+  }
+  size_t indexed_bytes = mempool::osd_pglog::allocated_bytes() - start_bytes;
+
+  std::cout << num_pgs << " pgs x " << num_entries << " entries: "
+	    << byte_u_t(lazy_bytes) << " unindexed, "
+	    << byte_u_t(reqid_bytes) << " with reqid indexes, "
+	    << byte_u_t(indexed_bytes) << " fully indexed" << std::endl;
+  EXPECT_LT(lazy_bytes, reqid_bytes);
+  EXPECT_LT(reqid_bytes, indexed_bytes);
+
+  hobject_t hoid(object_t("rbd_data.00000000.0000000000000001"), "",
+		 CEPH_NOSNAP, 1, 1, "");
+  EXPECT_TRUE(logs[0].logged_object(hoid));
+  EXPECT_EQ(eversion_t(1, 2001), logs[0].get_latest_entry(hoid)->version);
+}
+
 // Local Variables:
 // compile-command: "cd ../.. ; make unittest_pglog ; ./unittest_pglog --log-to-stderr=true  --debug-osd=20 # --gtest_filter=*.* "
 // End: